@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 /*
  * open file cache caches
@@ -21,6 +25,22 @@
 #define NGX_MIN_READ_AHEAD  (128 * 1024)
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_str_t                name;
+    ngx_open_file_info_t     of;
+    ngx_int_t                rc;
+
+    ngx_fd_t                 fd;
+    ngx_file_uniq_t          uniq;
+    unsigned                 test_dir:1;
+    unsigned                 test:1;
+} ngx_open_file_thread_ctx_t;
+
+#endif
+
+
 static void ngx_open_file_cache_cleanup(void *data);
 #if (NGX_HAVE_OPENAT)
 static ngx_fd_t ngx_openat_file_owner(ngx_fd_t at_fd, const u_char *name,
@@ -37,6 +57,17 @@ static ngx_int_t ngx_file_info_wrapper(ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_file_info_t *fi, ngx_log_t *log);
 static ngx_int_t ngx_open_and_stat_file(ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_log_t *log);
+static ngx_int_t ngx_stat_file(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_log_t *log);
+static ngx_int_t ngx_open_file_offload(ngx_str_t *name,
+    ngx_open_file_info_t *of, ngx_uint_t test, ngx_pool_t *pool);
+#if (NGX_THREADS)
+static ngx_int_t ngx_open_file_thread(ngx_str_t *name,
+    ngx_open_file_info_t *of, ngx_uint_t test, ngx_pool_t *pool);
+static void ngx_open_file_thread_handler(void *data, ngx_log_t *log);
+static void ngx_open_file_thread_cleanup(void *data);
+static void ngx_open_file_thread_close(ngx_thread_task_t *task);
+#endif
 static void ngx_open_file_add_event(ngx_open_file_cache_t *cache,
     ngx_cached_open_file_t *file, ngx_open_file_info_t *of, ngx_log_t *log);
 static void ngx_open_file_cleanup(void *data);
@@ -147,7 +178,6 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     time_t                          now;
     uint32_t                        hash;
     ngx_int_t                       rc;
-    ngx_file_info_t                 fi;
     ngx_pool_cleanup_t             *cln;
     ngx_cached_open_file_t         *file;
     ngx_pool_cleanup_file_t        *clnf;
@@ -159,23 +189,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     if (cache == NULL) {
 
         if (of->test_only) {
-
-            if (ngx_file_info_wrapper(name, of, &fi, pool->log)
-                == NGX_FILE_ERROR)
-            {
-                return NGX_ERROR;
-            }
-
-            of->uniq = ngx_file_uniq(&fi);
-            of->mtime = ngx_file_mtime(&fi);
-            of->size = ngx_file_size(&fi);
-            of->fs_size = ngx_file_fs_size(&fi);
-            of->is_dir = ngx_is_dir(&fi);
-            of->is_file = ngx_is_file(&fi);
-            of->is_link = ngx_is_link(&fi);
-            of->is_exec = ngx_is_exec(&fi);
-
-            return NGX_OK;
+            return ngx_open_file_offload(name, of, 1, pool);
         }
 
         cln = ngx_pool_cleanup_add(pool, sizeof(ngx_pool_cleanup_file_t));
@@ -183,7 +197,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
             return NGX_ERROR;
         }
 
-        rc = ngx_open_and_stat_file(name, of, pool->log);
+        rc = ngx_open_file_offload(name, of, 0, pool);
 
         if (rc == NGX_OK && !of->is_dir) {
             cln->handler = ngx_pool_cleanup_file;
@@ -218,7 +232,11 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
             /* file was not used often enough to keep open */
 
-            rc = ngx_open_and_stat_file(name, of, pool->log);
+            rc = ngx_open_file_offload(name, of, 0, pool);
+
+            if (rc == NGX_AGAIN) {
+                goto again;
+            }
 
             if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
                 goto failed;
@@ -286,7 +304,11 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
         of->fd = file->fd;
         of->uniq = file->uniq;
 
-        rc = ngx_open_and_stat_file(name, of, pool->log);
+        rc = ngx_open_file_offload(name, of, 0, pool);
+
+        if (rc == NGX_AGAIN) {
+            goto again;
+        }
 
         if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
             goto failed;
@@ -351,7 +373,11 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
     /* not found */
 
-    rc = ngx_open_and_stat_file(name, of, pool->log);
+    rc = ngx_open_file_offload(name, of, 0, pool);
+
+    if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
 
     if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
         goto failed;
@@ -450,6 +476,18 @@ found:
 
     return NGX_ERROR;
 
+again:
+
+    /* the file is opened in a thread, the call is repeated on completion */
+
+    file->uses--;
+
+    ngx_queue_insert_head(&cache->expire_queue, &file->queue);
+
+    of->fd = NGX_INVALID_FILE;
+
+    return NGX_AGAIN;
+
 failed:
 
     if (file) {
@@ -945,6 +983,194 @@ done:
 }
 
 
+static ngx_int_t
+ngx_stat_file(ngx_str_t *name, ngx_open_file_info_t *of, ngx_log_t *log)
+{
+    ngx_file_info_t  fi;
+
+    if (ngx_file_info_wrapper(name, of, &fi, log) == NGX_FILE_ERROR) {
+        return NGX_ERROR;
+    }
+
+    of->uniq = ngx_file_uniq(&fi);
+    of->mtime = ngx_file_mtime(&fi);
+    of->size = ngx_file_size(&fi);
+    of->fs_size = ngx_file_fs_size(&fi);
+    of->is_dir = ngx_is_dir(&fi);
+    of->is_file = ngx_is_file(&fi);
+    of->is_link = ngx_is_link(&fi);
+    of->is_exec = ngx_is_exec(&fi);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_open_file_offload(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_uint_t test, ngx_pool_t *pool)
+{
+#if (NGX_THREADS)
+
+    if (of->thread_handler) {
+        return ngx_open_file_thread(name, of, test, pool);
+    }
+
+#endif
+
+    if (test) {
+        return ngx_stat_file(name, of, pool->log);
+    }
+
+    return ngx_open_and_stat_file(name, of, pool->log);
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_open_file_thread(ngx_str_t *name, ngx_open_file_info_t *of,
+    ngx_uint_t test, ngx_pool_t *pool)
+{
+    ngx_thread_task_t           *task;
+    ngx_pool_cleanup_t          *cln;
+    ngx_open_file_thread_ctx_t  *ctx;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, pool->log, 0,
+                   "thread open: \"%V\", t:%ui", name, test);
+
+    task = of->thread_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(pool,
+                                     sizeof(ngx_open_file_thread_ctx_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_open_file_thread_cleanup;
+        cln->data = task;
+
+        task->event.log = pool->log;
+
+        of->thread_task = task;
+    }
+
+    ctx = task->ctx;
+
+    if (task->event.complete) {
+        task->event.complete = 0;
+
+        if (ctx->test == test
+            && ctx->fd == of->fd
+            && ctx->uniq == of->uniq
+            && ctx->test_dir == of->test_dir
+            && ctx->name.len == name->len
+            && ngx_strncmp(ctx->name.data, name->data, name->len) == 0)
+        {
+            of->fd = ctx->of.fd;
+            of->uniq = ctx->of.uniq;
+            of->mtime = ctx->of.mtime;
+            of->size = ctx->of.size;
+            of->fs_size = ctx->of.fs_size;
+            of->err = ctx->of.err;
+            of->failed = ctx->of.failed;
+
+            of->is_dir = ctx->of.is_dir;
+            of->is_file = ctx->of.is_file;
+            of->is_link = ctx->of.is_link;
+            of->is_exec = ctx->of.is_exec;
+            of->is_directio = ctx->of.is_directio;
+
+            return ctx->rc;
+        }
+
+        /*
+         * the file cache state has changed while the file was opened,
+         * the result is dropped and the file is opened again
+         */
+
+        ngx_open_file_thread_close(task);
+    }
+
+    ctx->name.len = name->len;
+    ctx->name.data = ngx_pnalloc(pool, name->len + 1);
+    if (ctx->name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_cpystrn(ctx->name.data, name->data, name->len + 1);
+
+    ctx->of = *of;
+    ctx->fd = of->fd;
+    ctx->uniq = of->uniq;
+    ctx->test_dir = of->test_dir;
+    ctx->test = test;
+
+    task->handler = ngx_open_file_thread_handler;
+
+    if (of->thread_handler(task, of) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_open_file_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_open_file_thread_ctx_t *ctx = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "thread open handler: \"%V\"", &ctx->name);
+
+    if (ctx->test) {
+        ctx->rc = ngx_stat_file(&ctx->name, &ctx->of, log);
+
+    } else {
+        ctx->rc = ngx_open_and_stat_file(&ctx->name, &ctx->of, log);
+    }
+}
+
+
+static void
+ngx_open_file_thread_cleanup(void *data)
+{
+    ngx_thread_task_t  *task = data;
+
+    if (task->event.complete) {
+        ngx_open_file_thread_close(task);
+    }
+}
+
+
+static void
+ngx_open_file_thread_close(ngx_thread_task_t *task)
+{
+    ngx_open_file_thread_ctx_t  *ctx;
+
+    ctx = task->ctx;
+
+    if (ctx->of.fd == NGX_INVALID_FILE || ctx->of.fd == ctx->fd) {
+        return;
+    }
+
+    if (ngx_close_file(ctx->of.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, task->event.log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &ctx->name);
+    }
+
+    ctx->of.fd = NGX_INVALID_FILE;
+}
+
+#endif
+
+
 /*
  * we ignore any possible event setting error and
  * fallback to usual periodic file retests
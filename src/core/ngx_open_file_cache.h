@@ -16,7 +16,9 @@
 #define NGX_OPEN_FILE_DIRECTIO_OFF  NGX_MAX_OFF_T_VALUE
 
 
-typedef struct {
+typedef struct ngx_open_file_info_s  ngx_open_file_info_t;
+
+struct ngx_open_file_info_s {
     ngx_fd_t                 fd;
     ngx_file_uniq_t          uniq;
     time_t                   mtime;
@@ -37,6 +39,13 @@ typedef struct {
     unsigned                 disable_symlinks:2;
 #endif
 
+#if (NGX_THREADS || NGX_COMPAT)
+    ngx_int_t              (*thread_handler)(ngx_thread_task_t *task,
+                                             ngx_open_file_info_t *of);
+    void                    *thread_ctx;
+    ngx_thread_task_t       *thread_task;
+#endif
+
     unsigned                 test_dir:1;
     unsigned                 test_only:1;
     unsigned                 log:1;
@@ -48,7 +57,7 @@ typedef struct {
     unsigned                 is_link:1;
     unsigned                 is_exec:1;
     unsigned                 is_directio:1;
-} ngx_open_file_info_t;
+};
 
 
 typedef struct ngx_cached_open_file_s  ngx_cached_open_file_t;
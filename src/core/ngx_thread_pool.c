@@ -274,6 +274,13 @@ ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
 }
 
 
+ngx_uint_t
+ngx_thread_pool_threads(ngx_thread_pool_t *tp)
+{
+    return tp->threads;
+}
+
+
 static void *
 ngx_thread_pool_cycle(void *data)
 {
@@ -23,14 +23,12 @@ struct ngx_thread_task_s {
 };
 
 
-typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
-
-
 ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name);
 ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name);
 
 ngx_thread_task_t *ngx_thread_task_alloc(ngx_pool_t *pool, size_t size);
 ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task);
+ngx_uint_t ngx_thread_pool_threads(ngx_thread_pool_t *tp);
 
 
 #endif /* _NGX_THREAD_POOL_H_INCLUDED_ */
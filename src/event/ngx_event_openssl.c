@@ -13,15 +13,103 @@
 #include <zlib.h>
 #endif
 
+#if (NGX_SSL_KEY_OFFLOAD)
+#include <ngx_thread_pool.h>
+#include <openssl/async.h>
+#include <openssl/rsa.h>
+#ifndef OPENSSL_NO_EC
+#include <openssl/ec.h>
+#endif
+#endif
+
 
 #define NGX_SSL_PASSWORD_BUFFER_SIZE  4096
 
 
 typedef struct {
-    ngx_uint_t  engine;   /* unsigned  engine:1; */
+    ngx_uint_t       engine;   /* unsigned  engine:1; */
+#if (NGX_SSL_KEY_OFFLOAD)
+    ngx_shm_zone_t  *offload_zone;
+#endif
 } ngx_openssl_conf_t;
 
 
+/*
+ * OpenSSL accepts early data only if the ticket age reported by the client
+ * is within 10 seconds of the actual one, so a ClientHello cannot be
+ * replayed for longer; each filter generation covers a window above that
+ */
+
+#define NGX_SSL_EARLY_DATA_WINDOW    15
+#define NGX_SSL_EARLY_DATA_HASHES    4
+
+
+typedef struct {
+    time_t                    start;
+    ngx_uint_t                current;
+    size_t                    len;
+    u_char                   *filter[2];
+} ngx_ssl_early_data_replay_t;
+
+
+#if (NGX_SSL_KEY_OFFLOAD)
+
+#define NGX_SSL_OFFLOAD_RSA_ENC  0
+#define NGX_SSL_OFFLOAD_RSA_DEC  1
+#define NGX_SSL_OFFLOAD_ECDSA    2
+
+#define NGX_SSL_OFFLOAD_BUCKETS  8
+
+
+struct ngx_ssl_offload_ctx_s {
+    ngx_uint_t         op;
+    void              *key;
+
+    const u_char      *from;
+    int                flen;
+    int                type;       /* RSA padding or ECDSA digest type */
+
+    u_char            *to;
+    unsigned int       len;
+    int                rc;
+
+    ngx_connection_t  *connection;
+    ngx_msec_t         start;
+    ngx_msec_t         wait;
+
+    unsigned           done:1;
+    unsigned           orphaned:1;
+};
+
+
+typedef struct {
+    ngx_atomic_t              batch[NGX_SSL_OFFLOAD_BUCKETS];
+    ngx_atomic_t              wait[NGX_SSL_OFFLOAD_BUCKETS];
+} ngx_ssl_offload_stats_t;
+
+
+typedef struct {
+    ngx_ssl_offload_ctx_t   **elts;
+    ngx_uint_t                nelts;
+    ngx_uint_t                size;       /* operations in the batch */
+    ngx_ssl_offload_stats_t  *stats;
+} ngx_ssl_offload_batch_t;
+
+
+typedef struct {
+    ngx_thread_pool_t        *thread_pool;
+    ngx_uint_t                batch;
+    ngx_msec_t                delay;
+    ngx_shm_zone_t           *zone;
+
+    ngx_ssl_offload_ctx_t   **queue;
+    ngx_uint_t                nqueued;
+    ngx_event_t               flush;
+} ngx_ssl_offload_conf_t;
+
+#endif
+
+
 static ngx_inline ngx_int_t ngx_ssl_cert_already_in_hash(void);
 #if (NGX_ZLIB && defined TLSEXT_cert_compression_zlib)
 static int ngx_ssl_cert_compression_callback(ngx_ssl_conn_t *ssl_conn,
@@ -42,12 +130,51 @@ static int ngx_ssl_new_client_session(ngx_ssl_conn_t *ssl_conn,
 static ngx_int_t ngx_ssl_try_early_data(ngx_connection_t *c);
 #endif
 static void ngx_ssl_handshake_handler(ngx_event_t *ev);
+#if (NGX_SSL_KEY_OFFLOAD)
+static ngx_int_t ngx_ssl_key_offload_init(ngx_log_t *log);
+static ngx_shm_zone_t *ngx_ssl_key_offload_zone(ngx_conf_t *cf);
+static ngx_int_t ngx_ssl_key_offload_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+static ngx_uint_t ngx_ssl_offload_rsa_kx(ngx_ssl_t *ssl);
+#endif
+static EVP_PKEY *ngx_ssl_offload_rsa_key(ngx_ssl_t *ssl, EVP_PKEY *pkey,
+    ngx_ssl_offload_conf_t *oc);
+static int ngx_ssl_offload_rsa_priv_enc(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding);
+static int ngx_ssl_offload_rsa_priv_dec(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding);
+#ifndef OPENSSL_NO_EC
+static EVP_PKEY *ngx_ssl_offload_ec_key(ngx_ssl_t *ssl, EVP_PKEY *pkey,
+    ngx_ssl_offload_conf_t *oc);
+static int ngx_ssl_offload_ecdsa_sign(int type, const unsigned char *dgst,
+    int dlen, unsigned char *sig, unsigned int *siglen, const BIGNUM *kinv,
+    const BIGNUM *r, EC_KEY *eckey);
+#endif
+static void ngx_ssl_offload(ngx_ssl_offload_ctx_t *op);
+static void ngx_ssl_offload_queue(ngx_ssl_offload_conf_t *oc,
+    ngx_ssl_offload_ctx_t *ctx);
+static void ngx_ssl_offload_flush(ngx_event_t *ev);
+static void ngx_ssl_offload_post(ngx_ssl_offload_conf_t *oc);
+static void ngx_ssl_offload_process(ngx_ssl_offload_ctx_t *ctx);
+static void ngx_ssl_offload_thread(void *data, ngx_log_t *log);
+static void ngx_ssl_offload_event(ngx_event_t *ev);
+static void ngx_ssl_offload_complete(ngx_ssl_offload_batch_t *b);
+static ngx_uint_t ngx_ssl_offload_bucket(ngx_uint_t *bounds,
+    ngx_uint_t value);
+static void ngx_ssl_offload_free(ngx_ssl_offload_ctx_t *ctx);
+static void ngx_ssl_offload_cancel(ngx_connection_t *c);
+#endif
 #ifdef SSL_READ_EARLY_DATA_SUCCESS
 static ssize_t ngx_ssl_recv_early(ngx_connection_t *c, u_char *buf,
     size_t size);
+#ifndef LIBRESSL_VERSION_NUMBER
+static int ngx_ssl_allow_early_data(ngx_ssl_conn_t *ssl_conn, void *arg);
+#endif
 #endif
 static ngx_int_t ngx_ssl_handle_recv(ngx_connection_t *c, int n);
 static void ngx_ssl_write_handler(ngx_event_t *wev);
+static u_char *ngx_ssl_record_end(ngx_connection_t *c, ngx_buf_t *buf);
 #ifdef SSL_READ_EARLY_DATA_SUCCESS
 static ssize_t ngx_ssl_write_early(ngx_connection_t *c, u_char *data,
     size_t size);
@@ -68,8 +195,18 @@ static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 #endif
     u_char *id, int len, int *copy);
 static void ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
+static ngx_ssl_sess_id_t *ngx_ssl_session_lookup(ngx_ssl_session_part_t *part,
+    u_char *id, size_t len, uint32_t hash);
+static u_char *ngx_ssl_session_slot(ngx_ssl_session_cache_t *cache,
+    ngx_ssl_session_part_t *part, ngx_slab_pool_t *shpool);
+static void ngx_ssl_session_free_slots(ngx_ssl_session_cache_t *cache,
+    ngx_ssl_session_part_t *part, ngx_ssl_sess_id_t *sess_id);
+static void ngx_ssl_drop_session(ngx_ssl_session_cache_t *cache,
+    ngx_ssl_session_part_t *part, ngx_ssl_sess_id_t *sess_id);
 static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n);
+    ngx_ssl_session_part_t *part, ngx_uint_t n);
+static ngx_int_t ngx_ssl_get_session_cache_stat(ngx_connection_t *c,
+    ngx_pool_t *pool, ngx_str_t *s, size_t offset);
 static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
@@ -146,6 +283,33 @@ int  ngx_ssl_client_hello_arg_index;
 u_char  ngx_ssl_session_buffer[NGX_SSL_MAX_SESSION_SIZE];
 
 
+#if (NGX_SSL_KEY_OFFLOAD)
+
+static ngx_connection_t  *ngx_ssl_offload_connection;
+
+static RSA_METHOD        *ngx_ssl_offload_rsa_method;
+static int                ngx_ssl_offload_rsa_index;
+
+/* upper bounds of histogram buckets, the last bucket is unbounded */
+
+static ngx_uint_t  ngx_ssl_offload_batch_bounds[NGX_SSL_OFFLOAD_BUCKETS - 1]
+    = { 1, 2, 4, 8, 16, 32, 64 };
+
+static ngx_uint_t  ngx_ssl_offload_wait_bounds[NGX_SSL_OFFLOAD_BUCKETS - 1]
+    = { 1, 2, 5, 10, 20, 50, 100 };
+
+#ifndef OPENSSL_NO_EC
+static EC_KEY_METHOD     *ngx_ssl_offload_ec_method;
+static int                ngx_ssl_offload_ec_index;
+
+static int (*ngx_ssl_ecdsa_sign)(int type, const unsigned char *dgst,
+    int dlen, unsigned char *sig, unsigned int *siglen, const BIGNUM *kinv,
+    const BIGNUM *r, EC_KEY *eckey);
+#endif
+
+#endif
+
+
 ngx_int_t
 ngx_ssl_init(ngx_log_t *log)
 {
@@ -1871,211 +2035,1264 @@ ngx_ssl_early_data(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
 
 
 ngx_int_t
-ngx_ssl_conf_commands(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *commands)
+ngx_ssl_early_data_replay(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_shm_zone_t *shm_zone)
 {
-    if (commands == NULL) {
+    if (shm_zone == NULL) {
         return NGX_OK;
     }
 
-#ifdef SSL_CONF_FLAG_FILE
-    {
-    int            type;
-    u_char        *key, *value;
-    ngx_uint_t     i;
-    ngx_keyval_t  *cmd;
-    SSL_CONF_CTX  *cctx;
+#if (defined SSL_READ_EARLY_DATA_SUCCESS && !defined LIBRESSL_VERSION_NUMBER)
 
-    cctx = SSL_CONF_CTX_new();
-    if (cctx == NULL) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CONF_CTX_new() failed");
-        return NGX_ERROR;
-    }
+    SSL_CTX_set_allow_early_data_cb(ssl->ctx, ngx_ssl_allow_early_data,
+                                    shm_zone);
 
-    SSL_CONF_CTX_set_flags(cctx, SSL_CONF_FLAG_FILE);
-    SSL_CONF_CTX_set_flags(cctx, SSL_CONF_FLAG_SERVER);
-    SSL_CONF_CTX_set_flags(cctx, SSL_CONF_FLAG_CLIENT);
-    SSL_CONF_CTX_set_flags(cctx, SSL_CONF_FLAG_CERTIFICATE);
-    SSL_CONF_CTX_set_flags(cctx, SSL_CONF_FLAG_SHOW_ERRORS);
+#else
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "\"ssl_early_data_replay_cache\" is not supported "
+                  "on this platform, ignored");
+#endif
 
-    SSL_CONF_CTX_set_ssl_ctx(cctx, ssl->ctx);
+    return NGX_OK;
+}
 
-    cmd = commands->elts;
-    for (i = 0; i < commands->nelts; i++) {
 
-        key = cmd[i].key.data;
-        type = SSL_CONF_cmd_value_type(cctx, (char *) key);
+ngx_int_t
+ngx_ssl_early_data_replay_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                        len;
+    ngx_slab_pool_t              *shpool;
+    ngx_ssl_early_data_replay_t  *replay;
 
-        if (type == SSL_CONF_TYPE_FILE || type == SSL_CONF_TYPE_DIR) {
-            if (ngx_conf_full_name(cf->cycle, &cmd[i].value, 1) != NGX_OK) {
-                SSL_CONF_CTX_free(cctx);
-                return NGX_ERROR;
-            }
-        }
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
 
-        value = cmd[i].value.data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-        if (SSL_CONF_cmd(cctx, (char *) key, (char *) value) <= 0) {
-            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                          "SSL_CONF_cmd(\"%s\", \"%s\") failed", key, value);
-            SSL_CONF_CTX_free(cctx);
-            return NGX_ERROR;
-        }
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
     }
 
-    if (SSL_CONF_CTX_finish(cctx) != 1) {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CONF_finish() failed");
-        SSL_CONF_CTX_free(cctx);
+    replay = ngx_slab_calloc(shpool, sizeof(ngx_ssl_early_data_replay_t));
+    if (replay == NULL) {
         return NGX_ERROR;
     }
 
-    SSL_CONF_CTX_free(cctx);
+    shpool->data = replay;
+    shm_zone->data = replay;
 
-    return NGX_OK;
+    /* the rest of the zone is split between two filter generations */
+
+    replay->len = shpool->pfree / 2 * ngx_pagesize;
+
+    if (replay->len == 0) {
+        return NGX_ERROR;
     }
-#else
-    ngx_log_error(NGX_LOG_EMERG, ssl->log, 0,
-                  "SSL_CONF_cmd() is not available on this platform");
-    return NGX_ERROR;
-#endif
-}
 
+    replay->filter[0] = ngx_slab_calloc(shpool, replay->len);
+    if (replay->filter[0] == NULL) {
+        return NGX_ERROR;
+    }
 
-ngx_int_t
-ngx_ssl_client_session_cache(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
-{
-    if (!enable) {
-        return NGX_OK;
+    replay->filter[1] = ngx_slab_calloc(shpool, replay->len);
+    if (replay->filter[1] == NULL) {
+        return NGX_ERROR;
     }
 
-    SSL_CTX_set_session_cache_mode(ssl->ctx,
-                                   SSL_SESS_CACHE_CLIENT
-                                   |SSL_SESS_CACHE_NO_INTERNAL);
+    replay->start = ngx_time();
 
-    SSL_CTX_sess_set_new_cb(ssl->ctx, ngx_ssl_new_client_session);
+    len = sizeof(" in SSL early data replay cache \"\"")
+          + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in SSL early data replay cache \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    shpool->log_nomem = 0;
 
     return NGX_OK;
 }
 
 
+#if (defined SSL_READ_EARLY_DATA_SUCCESS && !defined LIBRESSL_VERSION_NUMBER)
+
 static int
-ngx_ssl_new_client_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
+ngx_ssl_allow_early_data(ngx_ssl_conn_t *ssl_conn, void *arg)
 {
-    ngx_connection_t  *c;
+    ngx_shm_zone_t *shm_zone = arg;
+
+    u_char                       *filter;
+    time_t                        now;
+    uint32_t                      h1, h2;
+    ngx_uint_t                    i, n, bit, nbits, seen;
+    unsigned int                  len;
+    const u_char                 *id;
+    ngx_slab_pool_t              *shpool;
+    ngx_connection_t             *c;
+    ngx_ssl_session_t            *sess;
+    ngx_ssl_early_data_replay_t  *replay;
 
     c = ngx_ssl_get_connection(ssl_conn);
 
-    if (c->ssl->save_session) {
-        c->ssl->session = sess;
+    sess = SSL_get_session(ssl_conn);
+    if (sess == NULL) {
+        return 0;
+    }
 
-        c->ssl->save_session(c);
+    /*
+     * a session id is generated for each TLS 1.3 ticket issued,
+     * so it identifies the ticket used for early data
+     */
 
-        c->ssl->session = NULL;
+    id = SSL_SESSION_get_id(sess, &len);
+
+    if (len == 0) {
+        return 0;
     }
 
-    return 0;
-}
+    h1 = ngx_crc32_long((u_char *) id, len);
+    h2 = ngx_murmur_hash2((u_char *) id, len) | 1;
 
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    replay = shm_zone->data;
 
-ngx_int_t
-ngx_ssl_set_client_hello_callback(ngx_ssl_t *ssl, ngx_ssl_client_hello_arg *cb)
-{
-#ifdef SSL_CLIENT_HELLO_SUCCESS
+    nbits = replay->len * 8;
 
-    SSL_CTX_set_client_hello_cb(ssl->ctx, ngx_ssl_client_hello_callback, NULL);
+    ngx_shmtx_lock(&shpool->mutex);
 
-    if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_client_hello_arg_index, cb) == 0)
-    {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CTX_set_ex_data() failed");
-        return NGX_ERROR;
-    }
+    now = ngx_time();
 
-#elif defined OPENSSL_IS_BORINGSSL
+    if (now - replay->start >= NGX_SSL_EARLY_DATA_WINDOW) {
 
-    SSL_CTX_set_select_certificate_cb(ssl->ctx, ngx_ssl_select_certificate);
+        /* the previous generation is reused for the new window */
 
-    if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_client_hello_arg_index, cb) == 0)
-    {
-        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
-                      "SSL_CTX_set_ex_data() failed");
-        return NGX_ERROR;
+        replay->current ^= 1;
+        ngx_memzero(replay->filter[replay->current], replay->len);
+        replay->start = now;
     }
 
-#endif
+    seen = 0;
 
-    return NGX_OK;
-}
+    for (n = 0; n < 2; n++) {
+        filter = replay->filter[n];
 
+        for (i = 0; i < NGX_SSL_EARLY_DATA_HASHES; i++) {
+            bit = ((ngx_uint_t) h1 + i * h2) % nbits;
 
-#ifdef SSL_CLIENT_HELLO_SUCCESS
+            if (!(filter[bit / 8] & (1 << (bit % 8)))) {
+                break;
+            }
+        }
 
-int
-ngx_ssl_client_hello_callback(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
-{
-    u_char                    *p;
-    size_t                     len;
-    ngx_int_t                  rc;
-    ngx_str_t                  host;
-    ngx_connection_t          *c;
-    ngx_ssl_client_hello_arg  *cb;
+        if (i == NGX_SSL_EARLY_DATA_HASHES) {
+            seen = 1;
+            break;
+        }
+    }
 
-    c = ngx_ssl_get_connection(ssl_conn);
-    cb = SSL_CTX_get_ex_data(c->ssl->session_ctx,
-                             ngx_ssl_client_hello_arg_index);
+    if (!seen) {
+        filter = replay->filter[replay->current];
 
-    if (SSL_client_hello_get0_ext(ssl_conn, TLSEXT_TYPE_server_name,
-                                  (const unsigned char **) &p, &len)
-        == 0)
-    {
-        ngx_str_null(&host);
-        goto done;
+        for (i = 0; i < NGX_SSL_EARLY_DATA_HASHES; i++) {
+            bit = ((ngx_uint_t) h1 + i * h2) % nbits;
+            filter[bit / 8] |= (1 << (bit % 8));
+        }
     }
 
-    /*
-     * RFC 6066 mandates non-zero HostName length, we follow OpenSSL.
-     * No more than one ServerName is expected.
-     */
+    ngx_shmtx_unlock(&shpool->mutex);
 
-    if (len < 5
-        || (size_t) (p[0] << 8) + p[1] + 2 != len
-        || p[2] != TLSEXT_NAMETYPE_host_name
-        || (size_t) (p[3] << 8) + p[4] + 2 + 3 != len)
-    {
-        *ad = SSL_AD_DECODE_ERROR;
-        return SSL_CLIENT_HELLO_ERROR;
+    if (seen) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "early data rejected, ticket already used");
+        return 0;
     }
 
-    len -= 5;
-    p += 5;
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL early data allowed");
 
-    if (len > TLSEXT_MAXLEN_host_name || ngx_strlchr(p, p + len, '\0')) {
-        *ad = SSL_AD_UNRECOGNIZED_NAME;
-        return SSL_CLIENT_HELLO_ERROR;
+    return 1;
+}
+
+#endif
+
+
+ngx_int_t
+ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
+{
+    if (!enable) {
+        return NGX_OK;
     }
 
-    host.len = len;
-    host.data = p;
+#if (defined SSL_OP_ENABLE_KTLS && defined BIO_get_ktls_send && !NGX_WIN32)
 
-done:
+    /*
+     * kernel TLS is used for sending and receiving as long as
+     * the kernel supports the negotiated cipher
+     */
 
-    rc = cb->servername(ssl_conn, ad, &host);
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
 
-    if (rc == SSL_TLSEXT_ERR_ALERT_FATAL) {
-        return SSL_CLIENT_HELLO_ERROR;
-    }
+#else
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "kernel TLS is not supported on this platform, ignored");
+#endif
 
-    return SSL_CLIENT_HELLO_SUCCESS;
+    return NGX_OK;
 }
 
-#elif defined OPENSSL_IS_BORINGSSL
 
-enum ssl_select_cert_result_t ngx_ssl_select_certificate(
-    const SSL_CLIENT_HELLO *client_hello)
+ngx_int_t
+ngx_ssl_key_offload(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_thread_pool_t *tp,
+    ngx_uint_t batch, ngx_msec_t delay)
 {
-    int                        ad;
-    ngx_int_t                  rc;
+#if (NGX_SSL_KEY_OFFLOAD)
+
+    int                      rc;
+    EVP_PKEY                *pkey, *key;
+    ngx_ssl_offload_conf_t  *oc;
+
+    if (tp == NULL) {
+        return NGX_OK;
+    }
+
+    if (!ASYNC_is_capable()) {
+        ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                      "\"ssl_key_offload\" is not supported by the SSL "
+                      "library, ignored");
+        return NGX_OK;
+    }
+
+    if (ngx_ssl_key_offload_init(ssl->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    oc = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_offload_conf_t));
+    if (oc == NULL) {
+        return NGX_ERROR;
+    }
+
+    oc->thread_pool = tp;
+    oc->batch = batch;
+    oc->delay = delay;
+
+    oc->queue = ngx_palloc(cf->pool, batch * sizeof(ngx_ssl_offload_ctx_t *));
+    if (oc->queue == NULL) {
+        return NGX_ERROR;
+    }
+
+    oc->zone = ngx_ssl_key_offload_zone(cf);
+    if (oc->zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    oc->flush.handler = ngx_ssl_offload_flush;
+    oc->flush.data = oc;
+
+    /*
+     * the keys are replaced with copies using key methods which
+     * pause the handshake async job while a thread does the operation
+     */
+
+    for (rc = SSL_CTX_set_current_cert(ssl->ctx, SSL_CERT_SET_FIRST);
+         rc;
+         rc = SSL_CTX_set_current_cert(ssl->ctx, SSL_CERT_SET_NEXT))
+    {
+        pkey = SSL_CTX_get0_privatekey(ssl->ctx);
+
+        if (pkey == NULL) {
+            continue;
+        }
+
+        switch (EVP_PKEY_base_id(pkey)) {
+
+        case EVP_PKEY_RSA:
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+
+            /*
+             * OpenSSL 3.0 does not support TLS padding
+             * for RSA key exchange with keys using custom methods
+             */
+
+            if (ngx_ssl_offload_rsa_kx(ssl)) {
+                ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                              "\"ssl_key_offload\" is not used for RSA key "
+                              "as RSA key exchange ciphers are enabled");
+                continue;
+            }
+#endif
+
+            key = ngx_ssl_offload_rsa_key(ssl, pkey, oc);
+            break;
+
+#ifndef OPENSSL_NO_EC
+        case EVP_PKEY_EC:
+            key = ngx_ssl_offload_ec_key(ssl, pkey, oc);
+            break;
+#endif
+
+        default:
+            continue;
+        }
+
+        if (key == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (SSL_CTX_use_PrivateKey(ssl->ctx, key) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "SSL_CTX_use_PrivateKey() failed");
+            EVP_PKEY_free(key);
+            return NGX_ERROR;
+        }
+
+        EVP_PKEY_free(key);
+    }
+
+    SSL_CTX_set_mode(ssl->ctx, SSL_MODE_ASYNC);
+
+#else
+
+    if (tp) {
+        ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                      "\"ssl_key_offload\" is not supported on this platform, "
+                      "ignored");
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+#if (NGX_SSL_KEY_OFFLOAD)
+
+static ngx_int_t
+ngx_ssl_key_offload_init(ngx_log_t *log)
+{
+    RSA_METHOD     *rsa;
+#ifndef OPENSSL_NO_EC
+    EC_KEY_METHOD  *ec;
+    int           (*sign_setup)(EC_KEY *eckey, BN_CTX *ctx_in,
+                                BIGNUM **kinvp, BIGNUM **rp);
+    ECDSA_SIG    *(*sign_sig)(const unsigned char *dgst, int dgst_len,
+                              const BIGNUM *in_kinv, const BIGNUM *in_r,
+                              EC_KEY *eckey);
+#endif
+
+    if (ngx_ssl_offload_rsa_method) {
+        return NGX_OK;
+    }
+
+#ifndef OPENSSL_NO_EC
+
+    ngx_ssl_offload_ec_index = EC_KEY_get_ex_new_index(0, NULL, NULL, NULL,
+                                                       NULL);
+    if (ngx_ssl_offload_ec_index == -1) {
+        ngx_ssl_error(NGX_LOG_EMERG, log, 0,
+                      "EC_KEY_get_ex_new_index() failed");
+        return NGX_ERROR;
+    }
+
+    ec = EC_KEY_METHOD_new(EC_KEY_OpenSSL());
+    if (ec == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, log, 0, "EC_KEY_METHOD_new() failed");
+        return NGX_ERROR;
+    }
+
+    EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), &ngx_ssl_ecdsa_sign,
+                           &sign_setup, &sign_sig);
+    EC_KEY_METHOD_set_sign(ec, ngx_ssl_offload_ecdsa_sign,
+                           sign_setup, sign_sig);
+
+    ngx_ssl_offload_ec_method = ec;
+
+#endif
+
+    ngx_ssl_offload_rsa_index = RSA_get_ex_new_index(0, NULL, NULL, NULL,
+                                                     NULL);
+    if (ngx_ssl_offload_rsa_index == -1) {
+        ngx_ssl_error(NGX_LOG_EMERG, log, 0, "RSA_get_ex_new_index() failed");
+        return NGX_ERROR;
+    }
+
+    rsa = RSA_meth_dup(RSA_PKCS1_OpenSSL());
+    if (rsa == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, log, 0, "RSA_meth_dup() failed");
+        return NGX_ERROR;
+    }
+
+    RSA_meth_set_priv_enc(rsa, ngx_ssl_offload_rsa_priv_enc);
+    RSA_meth_set_priv_dec(rsa, ngx_ssl_offload_rsa_priv_dec);
+
+    ngx_ssl_offload_rsa_method = rsa;
+
+    return NGX_OK;
+}
+
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+
+static ngx_shm_zone_t *
+ngx_ssl_key_offload_zone(ngx_conf_t *cf)
+{
+    ngx_str_t            name;
+    ngx_openssl_conf_t  *oscf;
+
+    /* statistics of all servers are kept in a single zone */
+
+    oscf = (ngx_openssl_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                               ngx_openssl_module);
+
+    if (oscf->offload_zone) {
+        return oscf->offload_zone;
+    }
+
+    ngx_str_set(&name, "ssl_key_offload");
+
+    oscf->offload_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize,
+                                               &ngx_openssl_module);
+    if (oscf->offload_zone == NULL) {
+        return NULL;
+    }
+
+    oscf->offload_zone->init = ngx_ssl_key_offload_init_zone;
+
+    return oscf->offload_zone;
+}
+
+
+static ngx_int_t
+ngx_ssl_key_offload_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_offload_stats_t  *stats;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    stats = ngx_slab_calloc(shpool, sizeof(ngx_ssl_offload_stats_t));
+    if (stats == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = stats;
+    shm_zone->data = stats;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_ssl_offload_rsa_kx(ngx_ssl_t *ssl)
+{
+    int                     i, n;
+    STACK_OF(SSL_CIPHER)  *ciphers;
+
+    ciphers = SSL_CTX_get_ciphers(ssl->ctx);
+    n = sk_SSL_CIPHER_num(ciphers);
+
+    for (i = 0; i < n; i++) {
+        if (SSL_CIPHER_get_kx_nid(sk_SSL_CIPHER_value(ciphers, i))
+            == NID_kx_rsa)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+
+static EVP_PKEY *
+ngx_ssl_offload_rsa_key(ngx_ssl_t *ssl, EVP_PKEY *pkey,
+    ngx_ssl_offload_conf_t *oc)
+{
+    RSA       *rsa;
+    EVP_PKEY  *key;
+
+    rsa = RSAPrivateKey_dup(EVP_PKEY_get0_RSA(pkey));
+    if (rsa == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "RSAPrivateKey_dup() failed");
+        return NULL;
+    }
+
+    if (RSA_set_method(rsa, ngx_ssl_offload_rsa_method) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "RSA_set_method() failed");
+        goto failed;
+    }
+
+    if (RSA_set_ex_data(rsa, ngx_ssl_offload_rsa_index, oc) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "RSA_set_ex_data() failed");
+        goto failed;
+    }
+
+    key = EVP_PKEY_new();
+    if (key == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "EVP_PKEY_new() failed");
+        goto failed;
+    }
+
+    if (EVP_PKEY_assign_RSA(key, rsa) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "EVP_PKEY_assign_RSA() failed");
+        EVP_PKEY_free(key);
+        goto failed;
+    }
+
+    return key;
+
+failed:
+
+    RSA_free(rsa);
+
+    return NULL;
+}
+
+
+static int
+ngx_ssl_offload_rsa_priv_enc(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+    ngx_ssl_offload_ctx_t  op;
+
+    ngx_memzero(&op, sizeof(ngx_ssl_offload_ctx_t));
+
+    op.op = NGX_SSL_OFFLOAD_RSA_ENC;
+    op.key = rsa;
+    op.from = from;
+    op.flen = flen;
+    op.type = padding;
+    op.to = to;
+
+    ngx_ssl_offload(&op);
+
+    return op.rc;
+}
+
+
+static int
+ngx_ssl_offload_rsa_priv_dec(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+    ngx_ssl_offload_ctx_t  op;
+
+    ngx_memzero(&op, sizeof(ngx_ssl_offload_ctx_t));
+
+    op.op = NGX_SSL_OFFLOAD_RSA_DEC;
+    op.key = rsa;
+    op.from = from;
+    op.flen = flen;
+    op.type = padding;
+    op.to = to;
+
+    ngx_ssl_offload(&op);
+
+    return op.rc;
+}
+
+
+#ifndef OPENSSL_NO_EC
+
+static EVP_PKEY *
+ngx_ssl_offload_ec_key(ngx_ssl_t *ssl, EVP_PKEY *pkey,
+    ngx_ssl_offload_conf_t *oc)
+{
+    EC_KEY    *ec;
+    EVP_PKEY  *key;
+
+    ec = EC_KEY_dup(EVP_PKEY_get0_EC_KEY(pkey));
+    if (ec == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "EC_KEY_dup() failed");
+        return NULL;
+    }
+
+    if (EC_KEY_set_method(ec, ngx_ssl_offload_ec_method) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "EC_KEY_set_method() failed");
+        goto failed;
+    }
+
+    if (EC_KEY_set_ex_data(ec, ngx_ssl_offload_ec_index, oc) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "EC_KEY_set_ex_data() failed");
+        goto failed;
+    }
+
+    key = EVP_PKEY_new();
+    if (key == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "EVP_PKEY_new() failed");
+        goto failed;
+    }
+
+    if (EVP_PKEY_assign_EC_KEY(key, ec) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "EVP_PKEY_assign_EC_KEY() failed");
+        EVP_PKEY_free(key);
+        goto failed;
+    }
+
+    return key;
+
+failed:
+
+    EC_KEY_free(ec);
+
+    return NULL;
+}
+
+
+static int
+ngx_ssl_offload_ecdsa_sign(int type, const unsigned char *dgst, int dlen,
+    unsigned char *sig, unsigned int *siglen, const BIGNUM *kinv,
+    const BIGNUM *r, EC_KEY *eckey)
+{
+    ngx_ssl_offload_ctx_t  op;
+
+    if (kinv || r) {
+        return ngx_ssl_ecdsa_sign(type, dgst, dlen, sig, siglen, kinv, r,
+                                  eckey);
+    }
+
+    ngx_memzero(&op, sizeof(ngx_ssl_offload_ctx_t));
+
+    op.op = NGX_SSL_OFFLOAD_ECDSA;
+    op.key = eckey;
+    op.from = dgst;
+    op.flen = dlen;
+    op.type = type;
+    op.to = sig;
+
+    ngx_ssl_offload(&op);
+
+    *siglen = op.len;
+
+    return op.rc;
+}
+
+#endif
+
+
+static void
+ngx_ssl_offload(ngx_ssl_offload_ctx_t *op)
+{
+    u_char                  *p;
+    size_t                   size;
+    ngx_connection_t        *c;
+    ngx_ssl_offload_ctx_t   *ctx;
+    ngx_ssl_offload_conf_t  *oc;
+
+    c = ngx_ssl_offload_connection;
+
+    if (c == NULL || ASYNC_get_current_job() == NULL) {
+        ngx_ssl_offload_process(op);
+        return;
+    }
+
+#ifndef OPENSSL_NO_EC
+    if (op->op == NGX_SSL_OFFLOAD_ECDSA) {
+        oc = EC_KEY_get_ex_data(op->key, ngx_ssl_offload_ec_index);
+        size = ECDSA_size(op->key);
+
+    } else
+#endif
+    {
+        oc = RSA_get_ex_data(op->key, ngx_ssl_offload_rsa_index);
+        size = RSA_size(op->key);
+    }
+
+    /*
+     * the operation is allocated from the heap, as the connection
+     * may be closed before the thread completes the operation
+     */
+
+    ctx = ngx_alloc(sizeof(ngx_ssl_offload_ctx_t) + size + op->flen, c->log);
+    if (ctx == NULL) {
+        ngx_ssl_offload_process(op);
+        return;
+    }
+
+    *ctx = *op;
+
+    ctx->to = (u_char *) (ctx + 1);
+
+    p = ctx->to + size;
+    ngx_memcpy(p, op->from, op->flen);
+    ctx->from = p;
+
+    ctx->connection = c;
+    ctx->start = ngx_current_msec;
+
+#ifndef OPENSSL_NO_EC
+    if (op->op == NGX_SSL_OFFLOAD_ECDSA) {
+        EC_KEY_up_ref(op->key);
+
+    } else
+#endif
+    {
+        RSA_up_ref(op->key);
+    }
+
+    c->ssl->offload = ctx;
+
+    ngx_ssl_offload_queue(oc, ctx);
+
+    while (!ctx->done) {
+
+        if (ctx->orphaned) {
+            /* connection is closed, the operation is freed on completion */
+            ngx_ssl_offload_process(op);
+            return;
+        }
+
+        if (ASYNC_pause_job() == 0) {
+            c->ssl->offload = NULL;
+            ctx->orphaned = 1;
+            ngx_ssl_offload_process(op);
+            return;
+        }
+    }
+
+    c->ssl->offload = NULL;
+
+    op->rc = ctx->rc;
+    op->len = ctx->len;
+
+    if (op->op == NGX_SSL_OFFLOAD_ECDSA) {
+        if (ctx->rc == 1) {
+            ngx_memcpy(op->to, ctx->to, ctx->len);
+        }
+
+    } else if (ctx->rc > 0) {
+        ngx_memcpy(op->to, ctx->to, ctx->rc);
+    }
+
+    ngx_ssl_offload_free(ctx);
+}
+
+
+static void
+ngx_ssl_offload_queue(ngx_ssl_offload_conf_t *oc, ngx_ssl_offload_ctx_t *ctx)
+{
+    oc->queue[oc->nqueued++] = ctx;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ctx->connection->log, 0,
+                   "ssl key offload: queued %ui of %ui",
+                   oc->nqueued, oc->batch);
+
+    if (oc->nqueued == oc->batch) {
+        ngx_ssl_offload_post(oc);
+        return;
+    }
+
+    if (oc->nqueued == 1) {
+        oc->flush.log = ngx_cycle->log;
+
+        if (oc->delay) {
+            ngx_add_timer(&oc->flush, oc->delay);
+
+        } else {
+            /* flush operations queued in this event loop iteration */
+            ngx_post_event(&oc->flush, &ngx_posted_events);
+        }
+    }
+}
+
+
+static void
+ngx_ssl_offload_flush(ngx_event_t *ev)
+{
+    ngx_ssl_offload_conf_t  *oc = ev->data;
+
+    ev->timedout = 0;
+
+    if (oc->nqueued) {
+        ngx_ssl_offload_post(oc);
+    }
+}
+
+
+static void
+ngx_ssl_offload_post(ngx_ssl_offload_conf_t *oc)
+{
+    ngx_uint_t                i, n, size, threads;
+    ngx_thread_task_t        *task;
+    ngx_ssl_offload_stats_t  *stats;
+    ngx_ssl_offload_batch_t  *b, local;
+
+    size = oc->nqueued;
+    oc->nqueued = 0;
+
+    stats = oc->zone->data;
+
+    n = ngx_ssl_offload_bucket(ngx_ssl_offload_batch_bounds, size);
+    (void) ngx_atomic_fetch_add(&stats->batch[n], 1);
+
+    if (oc->flush.timer_set) {
+        ngx_del_timer(&oc->flush);
+    }
+
+    if (oc->flush.posted) {
+        ngx_delete_posted_event(&oc->flush);
+    }
+
+    /*
+     * OpenSSL has no multi-buffer private key operations, so the batch
+     * is split between the threads of the pool to keep the operations
+     * parallel; batching reduces the number of tasks and thread wakeups
+     */
+
+    threads = ngx_thread_pool_threads(oc->thread_pool);
+    n = (size + threads - 1) / threads;
+
+    for (i = 0; i < size; i += n) {
+
+        if (n > size - i) {
+            n = size - i;
+        }
+
+        task = ngx_alloc(sizeof(ngx_thread_task_t)
+                         + sizeof(ngx_ssl_offload_batch_t)
+                         + n * sizeof(ngx_ssl_offload_ctx_t *),
+                         ngx_cycle->log);
+
+        if (task == NULL) {
+
+            /* run the operations inline */
+
+            local.elts = &oc->queue[i];
+            local.nelts = n;
+            local.size = size;
+            local.stats = stats;
+
+            ngx_ssl_offload_thread(&local, ngx_cycle->log);
+            ngx_ssl_offload_complete(&local);
+
+            continue;
+        }
+
+        ngx_memzero(task, sizeof(ngx_thread_task_t));
+
+        b = (ngx_ssl_offload_batch_t *) (task + 1);
+        b->elts = (ngx_ssl_offload_ctx_t **) (b + 1);
+        b->nelts = n;
+        b->size = size;
+        b->stats = stats;
+
+        ngx_memcpy(b->elts, &oc->queue[i],
+                   n * sizeof(ngx_ssl_offload_ctx_t *));
+
+        task->ctx = b;
+        task->handler = ngx_ssl_offload_thread;
+        task->event.handler = ngx_ssl_offload_event;
+        task->event.data = task;
+        task->event.log = ngx_cycle->log;
+
+        if (ngx_thread_task_post(oc->thread_pool, task) != NGX_OK) {
+
+            /* run the operations inline */
+
+            ngx_ssl_offload_thread(b, ngx_cycle->log);
+            ngx_ssl_offload_event(&task->event);
+        }
+    }
+}
+
+
+static void
+ngx_ssl_offload_process(ngx_ssl_offload_ctx_t *ctx)
+{
+    switch (ctx->op) {
+
+    case NGX_SSL_OFFLOAD_RSA_ENC:
+        ctx->rc = RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL())(ctx->flen,
+                                           ctx->from, ctx->to, ctx->key,
+                                           ctx->type);
+        break;
+
+    case NGX_SSL_OFFLOAD_RSA_DEC:
+        ctx->rc = RSA_meth_get_priv_dec(RSA_PKCS1_OpenSSL())(ctx->flen,
+                                           ctx->from, ctx->to, ctx->key,
+                                           ctx->type);
+        break;
+
+#ifndef OPENSSL_NO_EC
+    default: /* NGX_SSL_OFFLOAD_ECDSA */
+        ctx->rc = ngx_ssl_ecdsa_sign(ctx->type, ctx->from, ctx->flen,
+                                     ctx->to, &ctx->len, NULL, NULL,
+                                     ctx->key);
+#endif
+    }
+}
+
+
+static void
+ngx_ssl_offload_thread(void *data, ngx_log_t *log)
+{
+    ngx_ssl_offload_batch_t *b = data;
+
+    ngx_uint_t              i;
+    ngx_ssl_offload_ctx_t  *ctx;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "ssl key offload thread: %ui of %ui operations",
+                   b->nelts, b->size);
+
+    for (i = 0; i < b->nelts; i++) {
+        ctx = b->elts[i];
+
+        /* time the operation spent in the queue */
+        ctx->wait = ngx_current_msec - ctx->start;
+
+        ngx_ssl_offload_process(ctx);
+
+        if (ctx->rc <= 0) {
+            ngx_ssl_error(NGX_LOG_ERR, log, 0,
+                          "private key operation failed");
+        }
+    }
+
+    ERR_clear_error();
+}
+
+
+static void
+ngx_ssl_offload_event(ngx_event_t *ev)
+{
+    ngx_thread_task_t  *task;
+
+    task = ev->data;
+
+    ngx_ssl_offload_complete(task->ctx);
+
+    ngx_free(task);
+}
+
+
+static void
+ngx_ssl_offload_complete(ngx_ssl_offload_batch_t *b)
+{
+    ngx_uint_t              i, n;
+    ngx_connection_t       *c;
+    ngx_ssl_offload_ctx_t  *ctx;
+
+    for (i = 0; i < b->nelts; i++) {
+        ctx = b->elts[i];
+
+        n = ngx_ssl_offload_bucket(ngx_ssl_offload_wait_bounds, ctx->wait);
+        (void) ngx_atomic_fetch_add(&b->stats->wait[n], 1);
+
+        if (ctx->orphaned) {
+            ngx_ssl_offload_free(ctx);
+            continue;
+        }
+
+        c = ctx->connection;
+
+        c->ssl->offload_batch = b->size;
+        c->ssl->offload_time = ngx_current_msec - ctx->start;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "ssl key offload done: %d, batch:%ui, time:%M",
+                       ctx->rc, b->size, c->ssl->offload_time);
+
+        ctx->done = 1;
+
+        /* resume the handshake */
+
+        ngx_post_event(c->read, &ngx_posted_events);
+    }
+}
+
+
+static ngx_uint_t
+ngx_ssl_offload_bucket(ngx_uint_t *bounds, ngx_uint_t value)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < NGX_SSL_OFFLOAD_BUCKETS - 1; i++) {
+        if (value <= bounds[i]) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+static void
+ngx_ssl_offload_free(ngx_ssl_offload_ctx_t *ctx)
+{
+#ifndef OPENSSL_NO_EC
+    if (ctx->op == NGX_SSL_OFFLOAD_ECDSA) {
+        EC_KEY_free(ctx->key);
+
+    } else
+#endif
+    {
+        RSA_free(ctx->key);
+    }
+
+    ngx_free(ctx);
+}
+
+
+static void
+ngx_ssl_offload_cancel(ngx_connection_t *c)
+{
+    ngx_ssl_offload_ctx_t  *ctx;
+
+    ctx = c->ssl->offload;
+
+    if (ctx == NULL) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "ssl key offload cancel");
+
+    ctx->orphaned = 1;
+
+    c->ssl->offload = NULL;
+
+    /*
+     * resume the paused job, so it completes the operation inline
+     * and finishes, the thread result is discarded on completion
+     */
+
+    ngx_ssl_clear_error(c->log);
+
+    (void) SSL_do_handshake(c->ssl->connection);
+
+    ERR_clear_error();
+}
+
+#endif
+
+
+ngx_int_t
+ngx_ssl_conf_commands(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *commands)
+{
+    if (commands == NULL) {
+        return NGX_OK;
+    }
+
+#ifdef SSL_CONF_FLAG_FILE
+    {
+    int            type;
+    u_char        *key, *value;
+    ngx_uint_t     i;
+    ngx_keyval_t  *cmd;
+    SSL_CONF_CTX  *cctx;
+
+    cctx = SSL_CONF_CTX_new();
+    if (cctx == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CONF_CTX_new() failed");
+        return NGX_ERROR;
+    }
+
+    SSL_CONF_CTX_set_flags(cctx, SSL_CONF_FLAG_FILE);
+    SSL_CONF_CTX_set_flags(cctx, SSL_CONF_FLAG_SERVER);
+    SSL_CONF_CTX_set_flags(cctx, SSL_CONF_FLAG_CLIENT);
+    SSL_CONF_CTX_set_flags(cctx, SSL_CONF_FLAG_CERTIFICATE);
+    SSL_CONF_CTX_set_flags(cctx, SSL_CONF_FLAG_SHOW_ERRORS);
+
+    SSL_CONF_CTX_set_ssl_ctx(cctx, ssl->ctx);
+
+    cmd = commands->elts;
+    for (i = 0; i < commands->nelts; i++) {
+
+        key = cmd[i].key.data;
+        type = SSL_CONF_cmd_value_type(cctx, (char *) key);
+
+        if (type == SSL_CONF_TYPE_FILE || type == SSL_CONF_TYPE_DIR) {
+            if (ngx_conf_full_name(cf->cycle, &cmd[i].value, 1) != NGX_OK) {
+                SSL_CONF_CTX_free(cctx);
+                return NGX_ERROR;
+            }
+        }
+
+        value = cmd[i].value.data;
+
+        if (SSL_CONF_cmd(cctx, (char *) key, (char *) value) <= 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "SSL_CONF_cmd(\"%s\", \"%s\") failed", key, value);
+            SSL_CONF_CTX_free(cctx);
+            return NGX_ERROR;
+        }
+    }
+
+    if (SSL_CONF_CTX_finish(cctx) != 1) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CONF_finish() failed");
+        SSL_CONF_CTX_free(cctx);
+        return NGX_ERROR;
+    }
+
+    SSL_CONF_CTX_free(cctx);
+
+    return NGX_OK;
+    }
+#else
+    ngx_log_error(NGX_LOG_EMERG, ssl->log, 0,
+                  "SSL_CONF_cmd() is not available on this platform");
+    return NGX_ERROR;
+#endif
+}
+
+
+ngx_int_t
+ngx_ssl_client_session_cache(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
+{
+    if (!enable) {
+        return NGX_OK;
+    }
+
+    SSL_CTX_set_session_cache_mode(ssl->ctx,
+                                   SSL_SESS_CACHE_CLIENT
+                                   |SSL_SESS_CACHE_NO_INTERNAL);
+
+    SSL_CTX_sess_set_new_cb(ssl->ctx, ngx_ssl_new_client_session);
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_ssl_new_client_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
+{
+    ngx_connection_t  *c;
+
+    c = ngx_ssl_get_connection(ssl_conn);
+
+    if (c->ssl->save_session) {
+        c->ssl->session = sess;
+
+        c->ssl->save_session(c);
+
+        c->ssl->session = NULL;
+    }
+
+    return 0;
+}
+
+
+ngx_int_t
+ngx_ssl_set_client_hello_callback(ngx_ssl_t *ssl, ngx_ssl_client_hello_arg *cb)
+{
+#ifdef SSL_CLIENT_HELLO_SUCCESS
+
+    SSL_CTX_set_client_hello_cb(ssl->ctx, ngx_ssl_client_hello_callback, NULL);
+
+    if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_client_hello_arg_index, cb) == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_ex_data() failed");
+        return NGX_ERROR;
+    }
+
+#elif defined OPENSSL_IS_BORINGSSL
+
+    SSL_CTX_set_select_certificate_cb(ssl->ctx, ngx_ssl_select_certificate);
+
+    if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_client_hello_arg_index, cb) == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_ex_data() failed");
+        return NGX_ERROR;
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+#ifdef SSL_CLIENT_HELLO_SUCCESS
+
+int
+ngx_ssl_client_hello_callback(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
+{
+    u_char                    *p;
+    size_t                     len;
+    ngx_int_t                  rc;
+    ngx_str_t                  host;
+    ngx_connection_t          *c;
+    ngx_ssl_client_hello_arg  *cb;
+
+    c = ngx_ssl_get_connection(ssl_conn);
+    cb = SSL_CTX_get_ex_data(c->ssl->session_ctx,
+                             ngx_ssl_client_hello_arg_index);
+
+    if (SSL_client_hello_get0_ext(ssl_conn, TLSEXT_TYPE_server_name,
+                                  (const unsigned char **) &p, &len)
+        == 0)
+    {
+        ngx_str_null(&host);
+        goto done;
+    }
+
+    /*
+     * RFC 6066 mandates non-zero HostName length, we follow OpenSSL.
+     * No more than one ServerName is expected.
+     */
+
+    if (len < 5
+        || (size_t) (p[0] << 8) + p[1] + 2 != len
+        || p[2] != TLSEXT_NAMETYPE_host_name
+        || (size_t) (p[3] << 8) + p[4] + 2 + 3 != len)
+    {
+        *ad = SSL_AD_DECODE_ERROR;
+        return SSL_CLIENT_HELLO_ERROR;
+    }
+
+    len -= 5;
+    p += 5;
+
+    if (len > TLSEXT_MAXLEN_host_name || ngx_strlchr(p, p + len, '\0')) {
+        *ad = SSL_AD_UNRECOGNIZED_NAME;
+        return SSL_CLIENT_HELLO_ERROR;
+    }
+
+    host.len = len;
+    host.data = p;
+
+done:
+
+    rc = cb->servername(ssl_conn, ad, &host);
+
+    if (rc == SSL_TLSEXT_ERR_ALERT_FATAL) {
+        return SSL_CLIENT_HELLO_ERROR;
+    }
+
+    return SSL_CLIENT_HELLO_SUCCESS;
+}
+
+#elif defined OPENSSL_IS_BORINGSSL
+
+enum ssl_select_cert_result_t ngx_ssl_select_certificate(
+    const SSL_CLIENT_HELLO *client_hello)
+{
+    int                        ad;
+    ngx_int_t                  rc;
     ngx_ssl_conn_t            *ssl_conn;
     ngx_connection_t          *c;
     ngx_ssl_client_hello_arg  *cb;
@@ -2115,6 +3332,9 @@ ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c, ngx_uint_t flags)
 
     sc->buffer = ((flags & NGX_SSL_BUFFER) != 0);
     sc->buffer_size = ssl->buffer_size;
+    sc->record_size = ssl->record_size;
+    sc->record_threshold = ssl->record_threshold;
+    sc->record_idle = ssl->record_idle;
 
     sc->session_ctx = ssl->ctx;
 
@@ -2216,8 +3436,16 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
     ngx_ssl_clear_error(c->log);
 
+#if (NGX_SSL_KEY_OFFLOAD)
+    ngx_ssl_offload_connection = c;
+#endif
+
     n = SSL_do_handshake(c->ssl->connection);
 
+#if (NGX_SSL_KEY_OFFLOAD)
+    ngx_ssl_offload_connection = NULL;
+#endif
+
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_do_handshake: %d", n);
 
     if (n == 1) {
@@ -2242,6 +3470,10 @@ ngx_ssl_handshake(ngx_connection_t *c)
         c->read->ready = 1;
         c->write->ready = 1;
 
+#if (NGX_SSL_KEY_OFFLOAD)
+        SSL_clear_mode(c->ssl->connection, SSL_MODE_ASYNC);
+#endif
+
 #if (!defined SSL_OP_NO_RENEGOTIATION                                         \
      && !defined SSL_OP_NO_CLIENT_RENEGOTIATION                               \
      && defined SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS                             \
@@ -2262,6 +3494,12 @@ ngx_ssl_handshake(ngx_connection_t *c)
             c->ssl->sendfile = 1;
         }
 
+        if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection)) == 1) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "BIO_get_ktls_recv(): 1");
+            c->ssl->ktls_recv = 1;
+        }
+
 #endif
 
         rc = ngx_ssl_ocsp_validate(c);
@@ -2317,6 +3555,20 @@ ngx_ssl_handshake(ngx_connection_t *c)
         return NGX_AGAIN;
     }
 
+#if (NGX_SSL_KEY_OFFLOAD)
+
+    if (sslerr == SSL_ERROR_WANT_ASYNC) {
+
+        /* resumed by ngx_ssl_offload_event() */
+
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
     c->ssl->no_wait_shutdown = 1;
@@ -2360,8 +3612,16 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
 
     readbytes = 0;
 
+#if (NGX_SSL_KEY_OFFLOAD)
+    ngx_ssl_offload_connection = c;
+#endif
+
     n = SSL_read_early_data(c->ssl->connection, &buf, 1, &readbytes);
 
+#if (NGX_SSL_KEY_OFFLOAD)
+    ngx_ssl_offload_connection = NULL;
+#endif
+
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "SSL_read_early_data: %d, %uz", n, readbytes);
 
@@ -2399,6 +3659,10 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
         c->read->ready = 1;
         c->write->ready = 1;
 
+#if (NGX_SSL_KEY_OFFLOAD)
+        SSL_clear_mode(c->ssl->connection, SSL_MODE_ASYNC);
+#endif
+
 #if (defined BIO_get_ktls_send && !NGX_WIN32)
 
         if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
@@ -2407,6 +3671,12 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
             c->ssl->sendfile = 1;
         }
 
+        if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection)) == 1) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "BIO_get_ktls_recv(): 1");
+            c->ssl->ktls_recv = 1;
+        }
+
 #endif
 
         rc = ngx_ssl_ocsp_validate(c);
@@ -2464,6 +3734,20 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
         return NGX_AGAIN;
     }
 
+#if (NGX_SSL_KEY_OFFLOAD)
+
+    if (sslerr == SSL_ERROR_WANT_ASYNC) {
+
+        /* resumed by ngx_ssl_offload_event() */
+
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
     c->ssl->no_wait_shutdown = 1;
@@ -3019,6 +4303,7 @@ ngx_chain_t *
 ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
     int           n;
+    u_char       *end;
     ngx_uint_t    flush;
     ssize_t       send, size, file_size;
     ngx_buf_t    *buf;
@@ -3084,9 +4369,11 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
     send = buf->last - buf->pos;
     flush = (in == NULL) ? 1 : buf->flush;
 
+    end = ngx_ssl_record_end(c, buf);
+
     for ( ;; ) {
 
-        while (in && buf->last < buf->end && send < limit) {
+        while (in && buf->last < end && send < limit) {
             if (in->buf->last_buf || in->buf->flush) {
                 flush = 1;
             }
@@ -3103,8 +4390,8 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
             size = in->buf->last - in->buf->pos;
 
-            if (size > buf->end - buf->last) {
-                size = buf->end - buf->last;
+            if (size > end - buf->last) {
+                size = end - buf->last;
             }
 
             if (send + size > limit) {
@@ -3125,7 +4412,7 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             }
         }
 
-        if (!flush && send < limit && buf->last < buf->end) {
+        if (!flush && send < limit && buf->last < end) {
             break;
         }
 
@@ -3176,6 +4463,12 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
         buf->pos += n;
 
+        if (c->ssl->record_sent < c->ssl->record_threshold) {
+            c->ssl->record_sent += n;
+        }
+
+        c->ssl->record_last = ngx_current_msec;
+
         if (n < size) {
             break;
         }
@@ -3188,6 +4481,8 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
         if (in == NULL || send >= limit) {
             break;
         }
+
+        end = ngx_ssl_record_end(c, buf);
     }
 
     buf->flush = flush;
@@ -3203,6 +4498,44 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 }
 
 
+static u_char *
+ngx_ssl_record_end(ngx_connection_t *c, ngx_buf_t *buf)
+{
+    u_char  *end;
+
+    /*
+     * dynamic record sizing: small records fit into a single TCP segment
+     * and can be decrypted as soon as they arrive, this improves time
+     * to first byte on new or idle connections, while bulk transfers
+     * use full-sized records to reduce the overhead
+     */
+
+    if (c->ssl->record_size == 0) {
+        return buf->end;
+    }
+
+    if (ngx_current_msec - c->ssl->record_last > c->ssl->record_idle) {
+        c->ssl->record_sent = 0;
+    }
+
+    if (c->ssl->record_sent >= c->ssl->record_threshold) {
+        return buf->end;
+    }
+
+    end = buf->start + c->ssl->record_size;
+
+    if (end > buf->end) {
+        return buf->end;
+    }
+
+    if (end < buf->last) {
+        return buf->last;
+    }
+
+    return end;
+}
+
+
 ssize_t
 ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
 {
@@ -3651,6 +4984,10 @@ ngx_ssl_shutdown(ngx_connection_t *c)
 
     ngx_ssl_ocsp_cleanup(c);
 
+#if (NGX_SSL_KEY_OFFLOAD)
+    ngx_ssl_offload_cancel(c);
+#endif
+
     if (SSL_in_init(c->ssl->connection)) {
         /*
          * OpenSSL 1.0.2f complains if SSL_shutdown() is called during
@@ -4289,8 +5626,11 @@ failed:
 ngx_int_t
 ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
+    u_char                   *file;
     size_t                    len;
+    ngx_uint_t                i, n, npages;
     ngx_slab_pool_t          *shpool;
+    ngx_ssl_session_part_t   *part;
     ngx_ssl_session_cache_t  *cache;
 
     if (data) {
@@ -4313,10 +5653,74 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     shpool->data = cache;
     shm_zone->data = cache;
 
-    ngx_rbtree_init(&cache->session_rbtree, &cache->sentinel,
-                    ngx_ssl_session_rbtree_insert_value);
+    /*
+     * the cache is striped into up to NGX_SSL_SESSION_CACHE_PARTS
+     * partitions with separate locks, at least 8 pages per partition
+     */
+
+    npages = shm_zone->shm.size / ngx_pagesize;
+
+#if (NGX_HAVE_ATOMIC_OPS)
+    n = 1;
+
+    while (n < NGX_SSL_SESSION_CACHE_PARTS && npages / (n * 2) >= 8) {
+        n *= 2;
+    }
+#else
+    n = 1;
+#endif
+
+    cache->parts = ngx_slab_alloc(shpool, n * sizeof(ngx_ssl_session_part_t));
+    if (cache->parts == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->nparts = n;
+
+    for (i = 0; i < n; i++) {
+        part = &cache->parts[i];
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        file = NULL;
+
+#else
+
+        file = ngx_slab_alloc(shpool, ngx_cycle->lock_file.len
+                                      + shm_zone->shm.name.len
+                                      + sizeof(".ssl"));
+        if (file == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_sprintf(file, "%V%V.ssl%Z",
+                           &ngx_cycle->lock_file, &shm_zone->shm.name);
+
+#endif
+
+        if (ngx_shmtx_create(&part->mutex, &part->lock, file) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&part->session_rbtree, &part->sentinel,
+                        ngx_ssl_session_rbtree_insert_value);
+
+        ngx_queue_init(&part->expire_queue);
+        ngx_queue_init(&part->free);
+
+        part->hits = 0;
+        part->misses = 0;
+        part->evictions = 0;
+    }
+
+    /*
+     * sessions are stored in fixed-size slots carved from whole pages,
+     * the slack at the end of a page is spread among its slots
+     */
+
+    n = ngx_pagesize / NGX_SSL_SESSION_SLOT_SIZE;
 
-    ngx_queue_init(&cache->expire_queue);
+    cache->slot_size = (ngx_pagesize / n) & ~((size_t) NGX_ALIGNMENT - 1);
 
     cache->ticket_keys[0].expire = 0;
     cache->ticket_keys[1].expire = 0;
@@ -4346,22 +5750,24 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
  * Typical length of the external ASN1 representation of a session
  * is about 150 bytes plus SNI server name.
  *
- * On 32-bit platforms we allocate an rbtree node, a session id, and
- * an ASN1 representation in a single allocation, it typically takes
- * 256 bytes.
- *
- * On 64-bit platforms we allocate separately an rbtree node + session_id,
- * and an ASN1 representation, they take accordingly 128 and 256 bytes.
+ * The cache is split into partitions selected by the session id hash,
+ * each with its own lock, rbtree, and expiration queue.  Partitions
+ * take whole pages from the slab pool and carve them into fixed-size
+ * slots, which are never returned to the pool, so the pool does not
+ * fragment.  An rbtree node, a session id, and an ASN1 representation
+ * of a typical session fit in a single slot; the rest of a larger
+ * session is stored in a chain of continuation slots, each starting
+ * with a pointer to the next one.
  *
  * OpenSSL's i2d_SSL_SESSION() and d2i_SSL_SESSION are slow,
- * so they are outside the code locked by shared pool mutex
+ * so they are outside the code locked by partition mutex
  */
 
 static int
 ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 {
     int                       len;
-    u_char                   *p, *session_id;
+    u_char                   *p, *slot, *session_id, **next;
     size_t                    n;
     uint32_t                  hash;
     SSL_CTX                  *ssl_ctx;
@@ -4370,6 +5776,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     ngx_connection_t         *c;
     ngx_slab_pool_t          *shpool;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_part_t   *part;
     ngx_ssl_session_cache_t  *cache;
 
 #ifdef TLS1_3_VERSION
@@ -4416,81 +5823,74 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     cache = shm_zone->data;
     shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    ngx_shmtx_lock(&shpool->mutex);
-
-    /* drop one or two expired sessions */
-    ngx_ssl_expire_sessions(cache, shpool, 1);
-
-#if (NGX_PTR_SIZE == 8)
-    n = sizeof(ngx_ssl_sess_id_t);
-#else
-    n = offsetof(ngx_ssl_sess_id_t, session) + len;
-#endif
-
-    sess_id = ngx_slab_alloc_locked(shpool, n);
-
-    if (sess_id == NULL) {
-
-        /* drop the oldest non-expired session and try once more */
+    hash = ngx_crc32_short(session_id, session_id_length);
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+    part = &cache->parts[hash & (cache->nparts - 1)];
 
-        sess_id = ngx_slab_alloc_locked(shpool, n);
+    ngx_shmtx_lock(&part->mutex);
 
-        if (sess_id == NULL) {
-            goto failed;
-        }
-    }
+    /* drop one or two expired sessions */
+    ngx_ssl_expire_sessions(cache, part, 1);
 
-#if (NGX_PTR_SIZE == 8)
+    sess_id = (ngx_ssl_sess_id_t *) ngx_ssl_session_slot(cache, part, shpool);
 
-    sess_id->session = ngx_slab_alloc_locked(shpool, len);
+    if (sess_id == NULL) {
+        goto failed;
+    }
+
+    n = ngx_min((size_t) len,
+                cache->slot_size - offsetof(ngx_ssl_sess_id_t, data));
 
-    if (sess_id->session == NULL) {
+    ngx_memcpy(sess_id->data, ngx_ssl_session_buffer, n);
 
-        /* drop the oldest non-expired session and try once more */
+    sess_id->len = len;
+    sess_id->next = NULL;
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+    next = &sess_id->next;
 
-        sess_id->session = ngx_slab_alloc_locked(shpool, len);
+    for (p = ngx_ssl_session_buffer + n;
+         p < ngx_ssl_session_buffer + len;
+         p += n)
+    {
+        slot = ngx_ssl_session_slot(cache, part, shpool);
 
-        if (sess_id->session == NULL) {
+        if (slot == NULL) {
+            ngx_ssl_session_free_slots(cache, part, sess_id);
             goto failed;
         }
-    }
 
-#endif
+        *next = slot;
+        next = (u_char **) slot;
+        *next = NULL;
 
-    ngx_memcpy(sess_id->session, ngx_ssl_session_buffer, len);
-    ngx_memcpy(sess_id->id, session_id, session_id_length);
+        n = ngx_min((size_t) (ngx_ssl_session_buffer + len - p),
+                    cache->slot_size - sizeof(u_char *));
 
-    hash = ngx_crc32_short(session_id, session_id_length);
+        ngx_memcpy(slot + sizeof(u_char *), p, n);
+    }
+
+    ngx_memcpy(sess_id->id, session_id, session_id_length);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "ssl new session: %08XD:%ud:%d",
-                   hash, session_id_length, len);
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl new session: %08XD:%ud:%d:%ui",
+                   hash, session_id_length, len, part - cache->parts);
 
     sess_id->node.key = hash;
     sess_id->node.data = (u_char) session_id_length;
-    sess_id->len = len;
 
     sess_id->expire = ngx_time() + SSL_CTX_get_timeout(ssl_ctx);
 
-    ngx_queue_insert_head(&cache->expire_queue, &sess_id->queue);
+    ngx_queue_insert_head(&part->expire_queue, &sess_id->queue);
 
-    ngx_rbtree_insert(&cache->session_rbtree, &sess_id->node);
+    ngx_rbtree_insert(&part->session_rbtree, &sess_id->node);
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_shmtx_unlock(&part->mutex);
 
     return 0;
 
 failed:
 
-    if (sess_id) {
-        ngx_slab_free_locked(shpool, sess_id);
-    }
-
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_shmtx_unlock(&part->mutex);
 
     if (cache->fail_time != ngx_time()) {
         cache->fail_time = ngx_time();
@@ -4509,16 +5909,15 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 #endif
     u_char *id, int len, int *copy)
 {
-    size_t                    slen;
+    u_char                   *slot;
+    size_t                    n, size, slen;
     uint32_t                  hash;
-    ngx_int_t                 rc;
     const u_char             *p;
     ngx_shm_zone_t           *shm_zone;
-    ngx_slab_pool_t          *shpool;
     ngx_connection_t         *c;
-    ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_session_t        *sess;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_part_t   *part;
     ngx_ssl_session_cache_t  *cache;
 
     hash = ngx_crc32_short((u_char *) (uintptr_t) id, (size_t) len);
@@ -4534,71 +5933,44 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 
     cache = shm_zone->data;
 
-    sess = NULL;
-
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
-
-    ngx_shmtx_lock(&shpool->mutex);
-
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
-
-    while (node != sentinel) {
-
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
-
-        if (hash > node->key) {
-            node = node->right;
-            continue;
-        }
-
-        /* hash == node->key */
-
-        sess_id = (ngx_ssl_sess_id_t *) node;
-
-        rc = ngx_memn2cmp((u_char *) (uintptr_t) id, sess_id->id,
-                          (size_t) len, (size_t) node->data);
-
-        if (rc == 0) {
+    part = &cache->parts[hash & (cache->nparts - 1)];
 
-            if (sess_id->expire > ngx_time()) {
-                slen = sess_id->len;
+    ngx_shmtx_lock(&part->mutex);
 
-                ngx_memcpy(ngx_ssl_session_buffer, sess_id->session, slen);
-
-                ngx_shmtx_unlock(&shpool->mutex);
-
-                p = ngx_ssl_session_buffer;
-                sess = d2i_SSL_SESSION(NULL, &p, slen);
-
-                return sess;
-            }
+    sess_id = ngx_ssl_session_lookup(part, (u_char *) (uintptr_t) id,
+                                     (size_t) len, hash);
 
-            ngx_queue_remove(&sess_id->queue);
+    if (sess_id == NULL) {
+        part->misses++;
+        ngx_shmtx_unlock(&part->mutex);
+        return NULL;
+    }
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+    if (sess_id->expire <= ngx_time()) {
+        ngx_ssl_drop_session(cache, part, sess_id);
+        part->misses++;
+        ngx_shmtx_unlock(&part->mutex);
+        return NULL;
+    }
 
-            ngx_explicit_memzero(sess_id->session, sess_id->len);
+    part->hits++;
 
-#if (NGX_PTR_SIZE == 8)
-            ngx_slab_free_locked(shpool, sess_id->session);
-#endif
-            ngx_slab_free_locked(shpool, sess_id);
+    slen = sess_id->len;
 
-            sess = NULL;
+    n = ngx_min(slen, cache->slot_size - offsetof(ngx_ssl_sess_id_t, data));
 
-            goto done;
-        }
+    ngx_memcpy(ngx_ssl_session_buffer, sess_id->data, n);
 
-        node = (rc < 0) ? node->left : node->right;
+    for (slot = sess_id->next; slot; slot = *(u_char **) slot) {
+        size = ngx_min(slen - n, cache->slot_size - sizeof(u_char *));
+        ngx_memcpy(ngx_ssl_session_buffer + n, slot + sizeof(u_char *), size);
+        n += size;
     }
 
-done:
+    ngx_shmtx_unlock(&part->mutex);
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    p = ngx_ssl_session_buffer;
+    sess = d2i_SSL_SESSION(NULL, &p, slen);
 
     return sess;
 }
@@ -4618,12 +5990,10 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 {
     u_char                   *id;
     uint32_t                  hash;
-    ngx_int_t                 rc;
     unsigned int              len;
     ngx_shm_zone_t           *shm_zone;
-    ngx_slab_pool_t          *shpool;
-    ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_part_t   *part;
     ngx_ssl_session_cache_t  *cache;
 
     shm_zone = SSL_CTX_get_ex_data(ssl, ngx_ssl_session_cache_index);
@@ -4641,12 +6011,30 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                    "ssl remove session: %08XD:%ud", hash, len);
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    part = &cache->parts[hash & (cache->nparts - 1)];
 
-    ngx_shmtx_lock(&shpool->mutex);
+    ngx_shmtx_lock(&part->mutex);
+
+    sess_id = ngx_ssl_session_lookup(part, id, len, hash);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    if (sess_id) {
+        ngx_ssl_drop_session(cache, part, sess_id);
+    }
+
+    ngx_shmtx_unlock(&part->mutex);
+}
+
+
+static ngx_ssl_sess_id_t *
+ngx_ssl_session_lookup(ngx_ssl_session_part_t *part, u_char *id, size_t len,
+    uint32_t hash)
+{
+    ngx_int_t           rc;
+    ngx_rbtree_node_t  *node, *sentinel;
+    ngx_ssl_sess_id_t  *sess_id;
+
+    node = part->session_rbtree.root;
+    sentinel = part->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -4667,33 +6055,86 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
         rc = ngx_memn2cmp(id, sess_id->id, len, (size_t) node->data);
 
         if (rc == 0) {
+            return sess_id;
+        }
 
-            ngx_queue_remove(&sess_id->queue);
+        node = (rc < 0) ? node->left : node->right;
+    }
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+    return NULL;
+}
 
-            ngx_explicit_memzero(sess_id->session, sess_id->len);
 
-#if (NGX_PTR_SIZE == 8)
-            ngx_slab_free_locked(shpool, sess_id->session);
-#endif
-            ngx_slab_free_locked(shpool, sess_id);
+static u_char *
+ngx_ssl_session_slot(ngx_ssl_session_cache_t *cache,
+    ngx_ssl_session_part_t *part, ngx_slab_pool_t *shpool)
+{
+    u_char       *p, *last;
+    ngx_queue_t  *q;
 
-            goto done;
+    if (ngx_queue_empty(&part->free)) {
+
+        p = ngx_slab_alloc(shpool, ngx_pagesize);
+
+        if (p != NULL) {
+            last = p + ngx_pagesize - cache->slot_size;
+
+            for ( /* void */ ; p <= last; p += cache->slot_size) {
+                ngx_queue_insert_tail(&part->free, (ngx_queue_t *) p);
+            }
+
+        } else {
+
+            /* reuse the slots of the oldest non-expired session */
+
+            ngx_ssl_expire_sessions(cache, part, 0);
+
+            if (ngx_queue_empty(&part->free)) {
+                return NULL;
+            }
         }
+    }
 
-        node = (rc < 0) ? node->left : node->right;
+    q = ngx_queue_head(&part->free);
+    ngx_queue_remove(q);
+
+    return (u_char *) q;
+}
+
+
+static void
+ngx_ssl_session_free_slots(ngx_ssl_session_cache_t *cache,
+    ngx_ssl_session_part_t *part, ngx_ssl_sess_id_t *sess_id)
+{
+    u_char  *slot, *next;
+
+    for (slot = sess_id->next; slot; slot = next) {
+        next = *(u_char **) slot;
+
+        ngx_explicit_memzero(slot, cache->slot_size);
+        ngx_queue_insert_head(&part->free, (ngx_queue_t *) slot);
     }
 
-done:
+    ngx_explicit_memzero(sess_id, cache->slot_size);
+    ngx_queue_insert_head(&part->free, (ngx_queue_t *) sess_id);
+}
 
-    ngx_shmtx_unlock(&shpool->mutex);
+
+static void
+ngx_ssl_drop_session(ngx_ssl_session_cache_t *cache,
+    ngx_ssl_session_part_t *part, ngx_ssl_sess_id_t *sess_id)
+{
+    ngx_queue_remove(&sess_id->queue);
+
+    ngx_rbtree_delete(&part->session_rbtree, &sess_id->node);
+
+    ngx_ssl_session_free_slots(cache, part, sess_id);
 }
 
 
 static void
 ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n)
+    ngx_ssl_session_part_t *part, ngx_uint_t n)
 {
     time_t              now;
     ngx_queue_t        *q;
@@ -4703,31 +6144,30 @@ ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&cache->expire_queue)) {
+        if (ngx_queue_empty(&part->expire_queue)) {
             return;
         }
 
-        q = ngx_queue_last(&cache->expire_queue);
+        q = ngx_queue_last(&part->expire_queue);
 
         sess_id = ngx_queue_data(q, ngx_ssl_sess_id_t, queue);
 
-        if (n++ != 0 && sess_id->expire > now) {
-            return;
-        }
+        if (sess_id->expire > now) {
 
-        ngx_queue_remove(q);
+            if (n++ != 0) {
+                return;
+            }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
-                       "expire session: %08Xi", sess_id->node.key);
+            part->evictions++;
 
-        ngx_rbtree_delete(&cache->session_rbtree, &sess_id->node);
+        } else {
+            n++;
+        }
 
-        ngx_explicit_memzero(sess_id->session, sess_id->len);
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                       "expire session: %08Xi", sess_id->node.key);
 
-#if (NGX_PTR_SIZE == 8)
-        ngx_slab_free_locked(shpool, sess_id->session);
-#endif
-        ngx_slab_free_locked(shpool, sess_id);
+        ngx_ssl_drop_session(cache, part, sess_id);
     }
 }
 
@@ -5808,6 +7248,26 @@ ngx_ssl_get_session_reused(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 }
 
 
+ngx_int_t
+ngx_ssl_get_ktls(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
+{
+    if (c->ssl->sendfile && c->ssl->ktls_recv) {
+        ngx_str_set(s, "tx:rx");
+
+    } else if (c->ssl->sendfile) {
+        ngx_str_set(s, "tx");
+
+    } else if (c->ssl->ktls_recv) {
+        ngx_str_set(s, "rx");
+
+    } else {
+        s->len = 0;
+    }
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_get_early_data(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 {
@@ -5835,6 +7295,200 @@ ngx_ssl_get_early_data(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 }
 
 
+ngx_int_t
+ngx_ssl_get_key_offload_batch(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+#if (NGX_SSL_KEY_OFFLOAD)
+
+    if (c->ssl->offload_batch) {
+        s->data = ngx_pnalloc(pool, NGX_INT_T_LEN);
+        if (s->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        s->len = ngx_sprintf(s->data, "%ui", c->ssl->offload_batch) - s->data;
+
+        return NGX_OK;
+    }
+
+#endif
+
+    s->len = 0;
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_get_key_offload_time(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+#if (NGX_SSL_KEY_OFFLOAD)
+
+    ngx_msec_t  ms;
+
+    if (c->ssl->offload_batch) {
+        s->data = ngx_pnalloc(pool, NGX_TIME_T_LEN + 4);
+        if (s->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ms = c->ssl->offload_time;
+
+        s->len = ngx_sprintf(s->data, "%T.%03M",
+                             (time_t) ms / 1000, ms % 1000)
+                 - s->data;
+
+        return NGX_OK;
+    }
+
+#endif
+
+    s->len = 0;
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_key_offload_status(ngx_cycle_t *cycle, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+#if (NGX_SSL_KEY_OFFLOAD)
+
+    u_char                   *p;
+    size_t                    len;
+    ngx_uint_t                i;
+    ngx_openssl_conf_t       *oscf;
+    ngx_ssl_offload_stats_t  *stats;
+
+    oscf = (ngx_openssl_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                               ngx_openssl_module);
+
+    if (oscf->offload_zone && oscf->offload_zone->data) {
+
+        stats = oscf->offload_zone->data;
+
+        len = 2 * (sizeof("SSL key offload wait ms:") + sizeof(" inf\n")
+                   + NGX_SSL_OFFLOAD_BUCKETS * (1 + NGX_INT_T_LEN)
+                   + NGX_SSL_OFFLOAD_BUCKETS * (1 + NGX_ATOMIC_T_LEN) + 2);
+
+        p = ngx_pnalloc(pool, len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        s->data = p;
+
+        /* bucket upper bounds, followed by operation counts */
+
+        p = ngx_cpymem(p, "SSL key offload batch:",
+                       sizeof("SSL key offload batch:") - 1);
+
+        for (i = 0; i < NGX_SSL_OFFLOAD_BUCKETS - 1; i++) {
+            p = ngx_sprintf(p, " %ui", ngx_ssl_offload_batch_bounds[i]);
+        }
+
+        p = ngx_cpymem(p, " inf\n", sizeof(" inf\n") - 1);
+
+        for (i = 0; i < NGX_SSL_OFFLOAD_BUCKETS; i++) {
+            p = ngx_sprintf(p, " %uA", stats->batch[i]);
+        }
+
+        p = ngx_cpymem(p, " \nSSL key offload wait ms:",
+                       sizeof(" \nSSL key offload wait ms:") - 1);
+
+        for (i = 0; i < NGX_SSL_OFFLOAD_BUCKETS - 1; i++) {
+            p = ngx_sprintf(p, " %ui", ngx_ssl_offload_wait_bounds[i]);
+        }
+
+        p = ngx_cpymem(p, " inf\n", sizeof(" inf\n") - 1);
+
+        for (i = 0; i < NGX_SSL_OFFLOAD_BUCKETS; i++) {
+            p = ngx_sprintf(p, " %uA", stats->wait[i]);
+        }
+
+        *p++ = ' ';
+        *p++ = LF;
+
+        s->len = p - s->data;
+
+        return NGX_OK;
+    }
+
+#endif
+
+    s->len = 0;
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_get_session_cache_hits(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+    return ngx_ssl_get_session_cache_stat(c, pool, s,
+                                       offsetof(ngx_ssl_session_part_t,
+                                                hits));
+}
+
+
+ngx_int_t
+ngx_ssl_get_session_cache_misses(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+    return ngx_ssl_get_session_cache_stat(c, pool, s,
+                                       offsetof(ngx_ssl_session_part_t,
+                                                misses));
+}
+
+
+ngx_int_t
+ngx_ssl_get_session_cache_evictions(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+    return ngx_ssl_get_session_cache_stat(c, pool, s,
+                                       offsetof(ngx_ssl_session_part_t,
+                                                evictions));
+}
+
+
+static ngx_int_t
+ngx_ssl_get_session_cache_stat(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s, size_t offset)
+{
+    ngx_uint_t                i, n;
+    ngx_shm_zone_t           *shm_zone;
+    ngx_ssl_session_cache_t  *cache;
+
+    shm_zone = SSL_CTX_get_ex_data(c->ssl->session_ctx,
+                                   ngx_ssl_session_cache_index);
+
+    if (shm_zone == NULL) {
+        s->len = 0;
+        return NGX_OK;
+    }
+
+    cache = shm_zone->data;
+
+    /* the counters are summed without locking */
+
+    n = 0;
+
+    for (i = 0; i < cache->nparts; i++) {
+        n += *(ngx_atomic_uint_t *) ((u_char *) &cache->parts[i] + offset);
+    }
+
+    s->data = ngx_pnalloc(pool, NGX_ATOMIC_T_LEN);
+    if (s->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->len = ngx_sprintf(s->data, "%ui", n) - s->data;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_get_server_name(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 {
@@ -99,7 +99,14 @@
 #endif
 
 
-typedef struct ngx_ssl_ocsp_s   ngx_ssl_ocsp_t;
+#if (NGX_THREADS && defined SSL_MODE_ASYNC                                    \
+     && !defined OPENSSL_NO_DEPRECATED_3_0)
+#define NGX_SSL_KEY_OFFLOAD  1
+#endif
+
+
+typedef struct ngx_ssl_ocsp_s          ngx_ssl_ocsp_t;
+typedef struct ngx_ssl_offload_ctx_s   ngx_ssl_offload_ctx_t;
 
 
 struct ngx_ssl_s {
@@ -107,6 +114,10 @@ struct ngx_ssl_s {
     ngx_log_t                  *log;
     size_t                      buffer_size;
 
+    size_t                      record_size;
+    size_t                      record_threshold;
+    ngx_msec_t                  record_idle;
+
     ngx_array_t                 certs;
 
     ngx_rbtree_t                staple_rbtree;
@@ -122,6 +133,12 @@ struct ngx_ssl_connection_s {
     ngx_buf_t                  *buf;
     size_t                      buffer_size;
 
+    size_t                      record_size;
+    size_t                      record_threshold;
+    ngx_msec_t                  record_idle;
+    size_t                      record_sent;
+    ngx_msec_t                  record_last;
+
     ngx_connection_handler_pt   handler;
 
     ngx_ssl_session_t          *session;
@@ -132,6 +149,12 @@ struct ngx_ssl_connection_s {
 
     ngx_ssl_ocsp_t             *ocsp;
 
+#if (NGX_SSL_KEY_OFFLOAD)
+    ngx_ssl_offload_ctx_t      *offload;
+    ngx_msec_t                  offload_time;
+    ngx_uint_t                  offload_batch;
+#endif
+
     u_char                      early_buf;
 
     unsigned                    handshaked:1;
@@ -139,6 +162,7 @@ struct ngx_ssl_connection_s {
     unsigned                    renegotiation:1;
     unsigned                    buffer:1;
     unsigned                    sendfile:1;
+    unsigned                    ktls_recv:1;
     unsigned                    no_wait_shutdown:1;
     unsigned                    no_send_shutdown:1;
     unsigned                    shutdown_without_free:1;
@@ -161,6 +185,9 @@ struct ngx_ssl_connection_s {
 
 #define NGX_SSL_MAX_SESSION_SIZE  8192
 
+#define NGX_SSL_SESSION_SLOT_SIZE    384
+#define NGX_SSL_SESSION_CACHE_PARTS  16
+
 typedef struct ngx_ssl_sess_id_s  ngx_ssl_sess_id_t;
 
 struct ngx_ssl_sess_id_s {
@@ -169,14 +196,24 @@ struct ngx_ssl_sess_id_s {
     ngx_queue_t                 queue;
     time_t                      expire;
     u_char                      id[32];
-#if (NGX_PTR_SIZE == 8)
-    u_char                     *session;
-#else
-    u_char                      session[1];
-#endif
+    u_char                     *next;
+    u_char                      data[1];
 };
 
 
+typedef struct {
+    ngx_shmtx_sh_t              lock;
+    ngx_shmtx_t                 mutex;
+    ngx_rbtree_t                session_rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 expire_queue;
+    ngx_queue_t                 free;
+    ngx_atomic_uint_t           hits;
+    ngx_atomic_uint_t           misses;
+    ngx_atomic_uint_t           evictions;
+} ngx_ssl_session_part_t;
+
+
 typedef struct {
     u_char                      name[16];
     u_char                      hmac_key[32];
@@ -188,9 +225,9 @@ typedef struct {
 
 
 typedef struct {
-    ngx_rbtree_t                session_rbtree;
-    ngx_rbtree_node_t           sentinel;
-    ngx_queue_t                 expire_queue;
+    ngx_ssl_session_part_t     *parts;
+    ngx_uint_t                  nparts;
+    size_t                      slot_size;
     ngx_ssl_ticket_key_t        ticket_keys[3];
     time_t                      fail_time;
 } ngx_ssl_session_cache_t;
@@ -256,6 +293,10 @@ ngx_int_t ngx_ssl_stapling(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_str_t *file, ngx_str_t *responder, ngx_uint_t verify);
 ngx_int_t ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_resolver_t *resolver, ngx_msec_t resolver_timeout);
+ngx_int_t ngx_ssl_stapling_cache(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_shm_zone_t *shm_zone);
+ngx_shm_zone_t *ngx_ssl_stapling_cache_zone(ngx_conf_t *cf, ngx_str_t *name,
+    size_t size, ngx_str_t *file, void *tag);
 ngx_int_t ngx_ssl_ocsp(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *responder,
     ngx_uint_t depth, ngx_shm_zone_t *shm_zone);
 ngx_int_t ngx_ssl_ocsp_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
@@ -282,6 +323,15 @@ ngx_int_t ngx_ssl_ech_files(ngx_conf_t *cf, ngx_ssl_t *ssl,
 ngx_int_t ngx_ssl_ecdh_curve(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *name);
 ngx_int_t ngx_ssl_early_data(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_uint_t enable);
+ngx_int_t ngx_ssl_early_data_replay(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_shm_zone_t *shm_zone);
+ngx_int_t ngx_ssl_early_data_replay_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+ngx_int_t ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable);
+ngx_int_t ngx_ssl_key_offload(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_thread_pool_t *tp, ngx_uint_t batch, ngx_msec_t delay);
+ngx_int_t ngx_ssl_key_offload_status(ngx_cycle_t *cycle, ngx_pool_t *pool,
+    ngx_str_t *s);
 ngx_int_t ngx_ssl_conf_commands(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_array_t *commands);
 
@@ -344,8 +394,20 @@ ngx_int_t ngx_ssl_get_session_id(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
 ngx_int_t ngx_ssl_get_session_reused(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
+ngx_int_t ngx_ssl_get_ktls(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
 ngx_int_t ngx_ssl_get_early_data(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
+ngx_int_t ngx_ssl_get_key_offload_batch(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
+ngx_int_t ngx_ssl_get_key_offload_time(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
+ngx_int_t ngx_ssl_get_session_cache_hits(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
+ngx_int_t ngx_ssl_get_session_cache_misses(ngx_connection_t *c,
+    ngx_pool_t *pool, ngx_str_t *s);
+ngx_int_t ngx_ssl_get_session_cache_evictions(ngx_connection_t *c,
+    ngx_pool_t *pool, ngx_str_t *s);
 ngx_int_t ngx_ssl_get_server_name(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
 ngx_int_t ngx_ssl_get_ech_status(ngx_connection_t *c, ngx_pool_t *pool,
@@ -40,11 +40,51 @@ typedef struct {
     time_t                       valid;
     time_t                       refresh;
 
+    ngx_shm_zone_t              *shm_zone;
+    u_char                       id[20];
+    time_t                       synced;
+
+    ngx_event_t                  event;
+
     unsigned                     verify:1;
     unsigned                     loading:1;
 } ngx_ssl_stapling_t;
 
 
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;
+} ngx_ssl_stapling_cache_sh_t;
+
+
+typedef struct {
+    ngx_ssl_stapling_cache_sh_t *sh;
+    ngx_slab_pool_t             *shpool;
+    ngx_str_t                    file;
+} ngx_ssl_stapling_cache_t;
+
+
+typedef struct {
+    ngx_str_node_t               node;
+    ngx_queue_t                  queue;
+    u_char                       id[20];
+    time_t                       valid;
+    time_t                       refresh;
+    time_t                       updating;
+    size_t                       len;
+    u_char                      *response;
+} ngx_ssl_stapling_cache_node_t;
+
+
+typedef struct {
+    u_char                       id[20];
+    uint32_t                     len;
+    int64_t                      valid;
+    int64_t                      refresh;
+} ngx_ssl_stapling_cache_record_t;
+
+
 typedef struct {
     ngx_addr_t                  *addrs;
     ngx_uint_t                   naddrs;
@@ -160,6 +200,25 @@ static int ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn,
 static ngx_ssl_stapling_t *ngx_ssl_stapling_lookup(ngx_ssl_t *ssl, X509 *cert);
 static void ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple);
 static void ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx);
+static void ngx_ssl_stapling_refresh_handler(ngx_event_t *ev);
+
+static void ngx_ssl_stapling_cache_sync(ngx_ssl_stapling_t *staple);
+static ngx_int_t ngx_ssl_stapling_cache_start(ngx_ssl_stapling_t *staple);
+static void ngx_ssl_stapling_cache_store(ngx_ssl_stapling_t *staple,
+    ngx_str_t *response);
+static void ngx_ssl_stapling_cache_fail(ngx_ssl_stapling_t *staple);
+static void ngx_ssl_stapling_cache_copy(ngx_ssl_stapling_t *staple,
+    ngx_ssl_stapling_cache_node_t *node);
+static ngx_ssl_stapling_cache_node_t *ngx_ssl_stapling_cache_node(
+    ngx_ssl_stapling_cache_t *cache, u_char *id, ngx_uint_t create);
+static void *ngx_ssl_stapling_cache_alloc(ngx_ssl_stapling_cache_t *cache,
+    size_t size, ngx_ssl_stapling_cache_node_t *keep);
+static ngx_int_t ngx_ssl_stapling_cache_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_ssl_stapling_cache_save(ngx_ssl_stapling_cache_t *cache,
+    ngx_log_t *log);
+static void ngx_ssl_stapling_cache_load(ngx_ssl_stapling_cache_t *cache,
+    ngx_log_t *log);
 
 static time_t ngx_ssl_stapling_time(ASN1_GENERALIZEDTIME *asn1time);
 
@@ -257,6 +316,10 @@ ngx_ssl_stapling_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl, X509 *cert,
 
     staple->ssl_ctx = ssl->ctx;
     staple->timeout = 60000;
+
+    staple->event.handler = ngx_ssl_stapling_refresh_handler;
+    staple->event.data = staple;
+    staple->event.cancelable = 1;
     staple->verify = verify;
     staple->cert = cert;
     staple->name = X509_get_ex_data(staple->cert,
@@ -571,6 +634,90 @@ ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
 }
 
 
+ngx_int_t
+ngx_ssl_stapling_cache(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_shm_zone_t *shm_zone)
+{
+    ngx_rbtree_t        *tree;
+    ngx_rbtree_node_t   *node;
+    ngx_ssl_stapling_t  *staple;
+
+    tree = &ssl->staple_rbtree;
+
+    if (tree->root == tree->sentinel) {
+        return NGX_OK;
+    }
+
+    for (node = ngx_rbtree_min(tree->root, tree->sentinel);
+         node;
+         node = ngx_rbtree_next(tree, node))
+    {
+        staple = ngx_rbtree_data(node, ngx_ssl_stapling_t, node);
+
+        if (staple->host.len == 0) {
+            continue;
+        }
+
+        if (X509_digest(staple->cert, EVP_sha1(), staple->id, NULL) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "X509_digest() failed");
+            return NGX_ERROR;
+        }
+
+        staple->shm_zone = shm_zone;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_shm_zone_t *
+ngx_ssl_stapling_cache_zone(ngx_conf_t *cf, ngx_str_t *name, size_t size,
+    ngx_str_t *file, void *tag)
+{
+    ngx_str_t                  path;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    path = *file;
+
+    if (path.len && ngx_conf_full_name(cf->cycle, &path, 0) != NGX_OK) {
+        return NULL;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    cache = shm_zone->data;
+
+    if (cache) {
+        if (cache->file.len != path.len
+            || ngx_strncmp(cache->file.data, path.data, path.len) != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "stapling cache \"%V\" is already used "
+                               "with a different file", name);
+            return NULL;
+        }
+
+        return shm_zone;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_stapling_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->file = path;
+
+    shm_zone->init = ngx_ssl_stapling_cache_init;
+    shm_zone->data = cache;
+
+    return shm_zone;
+}
+
+
 static int
 ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
 {
@@ -604,6 +751,10 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
         return rc;
     }
 
+    if (staple->shm_zone) {
+        ngx_ssl_stapling_cache_sync(staple);
+    }
+
     if (staple->staple.len
         && staple->valid >= ngx_time())
     {
@@ -663,6 +814,10 @@ ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple)
         return;
     }
 
+    if (staple->shm_zone && ngx_ssl_stapling_cache_start(staple) != NGX_OK) {
+        return;
+    }
+
     staple->loading = 1;
 
     ctx = ngx_ssl_ocsp_start(ngx_cycle->log);
@@ -740,21 +895,45 @@ ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx)
      * but not earlier than in 5 minutes, and at least in an hour
      */
 
-    staple->loading = 0;
     staple->refresh = ngx_max(ngx_min(ctx->valid - 300, now + 3600), now + 300);
 
-    ngx_ssl_ocsp_done(ctx);
-    return;
+    if (staple->shm_zone) {
+        ngx_ssl_stapling_cache_store(staple, &response);
+    }
+
+    goto done;
 
 error:
 
-    staple->loading = 0;
     staple->refresh = now + 300;
 
+    if (staple->shm_zone) {
+        ngx_ssl_stapling_cache_fail(staple);
+    }
+
+done:
+
+    staple->loading = 0;
+
+    /* refresh proactively, without waiting for a handshake */
+
+    staple->event.log = ngx_cycle->log;
+    ngx_add_timer(&staple->event,
+                  (ngx_msec_t) (staple->refresh - now + 1) * 1000);
+
     ngx_ssl_ocsp_done(ctx);
 }
 
 
+static void
+ngx_ssl_stapling_refresh_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0, "ssl stapling refresh");
+
+    ngx_ssl_stapling_update(ev->data);
+}
+
+
 static time_t
 ngx_ssl_stapling_time(ASN1_GENERALIZEDTIME *asn1time)
 {
@@ -794,6 +973,10 @@ ngx_ssl_stapling_cleanup(void *data)
 {
     ngx_ssl_stapling_t  *staple = data;
 
+    if (staple->event.timer_set) {
+        ngx_del_timer(&staple->event);
+    }
+
     if (staple->issuer) {
         X509_free(staple->issuer);
     }
@@ -804,6 +987,604 @@ ngx_ssl_stapling_cleanup(void *data)
 }
 
 
+static void
+ngx_ssl_stapling_cache_sync(ngx_ssl_stapling_t *staple)
+{
+    time_t                          now;
+    ngx_ssl_stapling_cache_t       *cache;
+    ngx_ssl_stapling_cache_node_t  *node;
+
+    /* look for a response fetched by other workers once per second */
+
+    now = ngx_time();
+
+    if (staple->synced == now) {
+        return;
+    }
+
+    staple->synced = now;
+
+    cache = staple->shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_ssl_stapling_cache_node(cache, staple->id, 0);
+
+    if (node && node->len && node->valid > staple->valid) {
+        ngx_ssl_stapling_cache_copy(staple, node);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_cache_start(ngx_ssl_stapling_t *staple)
+{
+    time_t                          now, next;
+    ngx_ssl_stapling_cache_t       *cache;
+    ngx_ssl_stapling_cache_node_t  *node;
+
+    now = ngx_time();
+    cache = staple->shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_ssl_stapling_cache_node(cache, staple->id, 1);
+
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_OK;
+    }
+
+    if (node->len && node->valid > staple->valid) {
+        ngx_ssl_stapling_cache_copy(staple, node);
+    }
+
+    if (staple->refresh >= now || node->updating > now) {
+        next = ngx_max(staple->refresh, node->updating);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                       "ssl stapling cache: updated by another worker");
+
+        /* check again once the response is expected to be refreshed */
+
+        staple->event.log = ngx_cycle->log;
+        ngx_add_timer(&staple->event, (ngx_msec_t) (next - now + 1) * 1000);
+
+        return NGX_DECLINED;
+    }
+
+    /* other workers wait while this one fetches the response */
+
+    node->updating = now + (staple->resolver_timeout + staple->timeout) / 1000
+                     + 1;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_ssl_stapling_cache_store(ngx_ssl_stapling_t *staple, ngx_str_t *response)
+{
+    u_char                         *p;
+    ngx_ssl_stapling_cache_t       *cache;
+    ngx_ssl_stapling_cache_node_t  *node;
+
+    cache = staple->shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_ssl_stapling_cache_node(cache, staple->id, 1);
+
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    node->updating = 0;
+
+    p = ngx_ssl_stapling_cache_alloc(cache, response->len, node);
+
+    if (p == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "could not allocate OCSP response%s",
+                      cache->shpool->log_ctx);
+        return;
+    }
+
+    if (node->response) {
+        ngx_slab_free_locked(cache->shpool, node->response);
+    }
+
+    ngx_memcpy(p, response->data, response->len);
+
+    node->response = p;
+    node->len = response->len;
+    node->valid = staple->valid;
+    node->refresh = staple->refresh;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (cache->file.len) {
+        ngx_ssl_stapling_cache_save(cache, ngx_cycle->log);
+    }
+}
+
+
+static void
+ngx_ssl_stapling_cache_fail(ngx_ssl_stapling_t *staple)
+{
+    ngx_ssl_stapling_cache_t       *cache;
+    ngx_ssl_stapling_cache_node_t  *node;
+
+    cache = staple->shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_ssl_stapling_cache_node(cache, staple->id, 0);
+
+    if (node) {
+        /* other workers do not retry before this one does */
+        node->updating = staple->refresh;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static void
+ngx_ssl_stapling_cache_copy(ngx_ssl_stapling_t *staple,
+    ngx_ssl_stapling_cache_node_t *node)
+{
+    time_t   now;
+    u_char  *p;
+
+    p = ngx_alloc(node->len, ngx_cycle->log);
+    if (p == NULL) {
+        return;
+    }
+
+    ngx_memcpy(p, node->response, node->len);
+
+    if (staple->staple.data) {
+        ngx_free(staple->staple.data);
+    }
+
+    staple->staple.data = p;
+    staple->staple.len = node->len;
+    staple->valid = node->valid;
+    staple->refresh = node->refresh;
+
+    now = ngx_time();
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                   "ssl stapling cache: response copied, valid:%T",
+                   node->valid - now);
+
+    /* refresh proactively, as if the response was fetched here */
+
+    staple->event.log = ngx_cycle->log;
+    ngx_add_timer(&staple->event,
+                  (ngx_msec_t) (ngx_max(staple->refresh - now, 0) + 1) * 1000);
+}
+
+
+static ngx_ssl_stapling_cache_node_t *
+ngx_ssl_stapling_cache_node(ngx_ssl_stapling_cache_t *cache, u_char *id,
+    ngx_uint_t create)
+{
+    uint32_t                        hash;
+    ngx_str_t                       key;
+    ngx_ssl_stapling_cache_node_t  *node;
+
+    key.len = 20;
+    key.data = id;
+
+    hash = ngx_crc32_short(id, 20);
+
+    node = (ngx_ssl_stapling_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, &key, hash);
+
+    if (node) {
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+        return node;
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    node = ngx_ssl_stapling_cache_alloc(cache,
+                                        sizeof(ngx_ssl_stapling_cache_node_t),
+                                        NULL);
+    if (node == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "could not allocate new entry%s",
+                      cache->shpool->log_ctx);
+        return NULL;
+    }
+
+    ngx_memzero(node, sizeof(ngx_ssl_stapling_cache_node_t));
+
+    ngx_memcpy(node->id, id, 20);
+
+    node->node.str.len = 20;
+    node->node.str.data = node->id;
+    node->node.node.key = hash;
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->node.node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    return node;
+}
+
+
+static void *
+ngx_ssl_stapling_cache_alloc(ngx_ssl_stapling_cache_t *cache, size_t size,
+    ngx_ssl_stapling_cache_node_t *keep)
+{
+    void                           *p;
+    ngx_queue_t                    *q;
+    ngx_ssl_stapling_cache_node_t  *node;
+
+    p = ngx_slab_alloc_locked(cache->shpool, size);
+
+    if (p) {
+        return p;
+    }
+
+    /* drop the least recently used entry and try once more */
+
+    if (ngx_queue_empty(&cache->sh->queue)) {
+        return NULL;
+    }
+
+    q = ngx_queue_last(&cache->sh->queue);
+    node = ngx_queue_data(q, ngx_ssl_stapling_cache_node_t, queue);
+
+    if (node == keep) {
+        return NULL;
+    }
+
+    ngx_queue_remove(q);
+    ngx_rbtree_delete(&cache->sh->rbtree, &node->node.node);
+
+    if (node->response) {
+        ngx_slab_free_locked(cache->shpool, node->response);
+    }
+
+    ngx_slab_free_locked(cache->shpool, node);
+
+    return ngx_slab_alloc_locked(cache->shpool, size);
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_cache_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_ssl_stapling_cache_t  *ocache = data;
+
+    size_t                     len;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_ssl_stapling_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in OCSP stapling cache \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in OCSP stapling cache \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    if (cache->file.len) {
+        ngx_ssl_stapling_cache_load(cache, shm_zone->shm.log);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * The stapling cache file is a sequence of records, each consisting of
+ * the ngx_ssl_stapling_cache_record_t header followed by a DER-encoded
+ * OCSP response.  It is written with a temporary file and rename(),
+ * and read once when the shared memory zone is created.
+ */
+
+static void
+ngx_ssl_stapling_cache_save(ngx_ssl_stapling_cache_t *cache, ngx_log_t *log)
+{
+    u_char                           *buf, *p, *name;
+    size_t                            size;
+    time_t                            now;
+    ssize_t                           n;
+    ngx_fd_t                          fd;
+    ngx_queue_t                      *q;
+    ngx_ssl_stapling_cache_node_t    *node;
+    ngx_ssl_stapling_cache_record_t   rec;
+
+    name = ngx_alloc(cache->file.len + 1 + NGX_INT64_LEN + 1, log);
+    if (name == NULL) {
+        return;
+    }
+
+    (void) ngx_sprintf(name, "%V.%P%Z", &cache->file, ngx_pid);
+
+    buf = NULL;
+    size = 0;
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (q = ngx_queue_head(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue);
+         q = ngx_queue_next(q))
+    {
+        node = ngx_queue_data(q, ngx_ssl_stapling_cache_node_t, queue);
+
+        if (node->len && node->valid > now) {
+            size += sizeof(ngx_ssl_stapling_cache_record_t) + node->len;
+        }
+    }
+
+    if (size) {
+        buf = ngx_alloc(size, log);
+        if (buf == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            ngx_free(name);
+            return;
+        }
+    }
+
+    p = buf;
+
+    for (q = ngx_queue_head(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue);
+         q = ngx_queue_next(q))
+    {
+        node = ngx_queue_data(q, ngx_ssl_stapling_cache_node_t, queue);
+
+        if (node->len == 0 || node->valid <= now) {
+            continue;
+        }
+
+        ngx_memcpy(rec.id, node->id, 20);
+        rec.len = (uint32_t) node->len;
+        rec.valid = node->valid;
+        rec.refresh = node->refresh;
+
+        p = ngx_cpymem(p, &rec, sizeof(ngx_ssl_stapling_cache_record_t));
+        p = ngx_cpymem(p, node->response, node->len);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    fd = ngx_open_file(name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+        goto failed;
+    }
+
+    n = size ? ngx_write_fd(fd, buf, size) : 0;
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_write_fd_n " \"%s\" failed", name);
+
+    } else if ((size_t) n != size) {
+        ngx_log_error(NGX_LOG_CRIT, log, 0,
+                      ngx_write_fd_n " has written only %z of %uz to \"%s\"",
+                      n, size, name);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    if ((size_t) n != size) {
+        goto failed;
+    }
+
+    if (ngx_rename_file(name, cache->file.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                      name, &cache->file);
+        goto failed;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "ssl stapling cache: saved %uz bytes to \"%V\"",
+                   size, &cache->file);
+
+    if (buf) {
+        ngx_free(buf);
+    }
+
+    ngx_free(name);
+
+    return;
+
+failed:
+
+    (void) ngx_delete_file(name);
+
+    if (buf) {
+        ngx_free(buf);
+    }
+
+    ngx_free(name);
+}
+
+
+static void
+ngx_ssl_stapling_cache_load(ngx_ssl_stapling_cache_t *cache, ngx_log_t *log)
+{
+    u_char                           *buf, *p, *last;
+    size_t                            size;
+    time_t                            now;
+    ssize_t                           n;
+    ngx_fd_t                          fd;
+    ngx_err_t                         err;
+    ngx_uint_t                        loaded;
+    ngx_file_info_t                   fi;
+    ngx_ssl_stapling_cache_node_t    *node;
+    ngx_ssl_stapling_cache_record_t   rec;
+
+    fd = ngx_open_file(cache->file.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, log, err,
+                          ngx_open_file_n " \"%V\" failed", &cache->file);
+        }
+
+        return;
+    }
+
+    buf = NULL;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &cache->file);
+        goto done;
+    }
+
+    size = ngx_file_size(&fi);
+
+    if (size == 0) {
+        goto done;
+    }
+
+    buf = ngx_alloc(size, log);
+    if (buf == NULL) {
+        goto done;
+    }
+
+    n = ngx_read_fd(fd, buf, size);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_read_fd_n " \"%V\" failed", &cache->file);
+        goto done;
+    }
+
+    if ((size_t) n != size) {
+        ngx_log_error(NGX_LOG_CRIT, log, 0,
+                      ngx_read_fd_n " has read only %z of %uz from \"%V\"",
+                      n, size, &cache->file);
+        goto done;
+    }
+
+    now = ngx_time();
+    loaded = 0;
+
+    p = buf;
+    last = buf + size;
+
+    while (p < last) {
+
+        if ((size_t) (last - p) < sizeof(ngx_ssl_stapling_cache_record_t)) {
+            goto invalid;
+        }
+
+        ngx_memcpy(&rec, p, sizeof(ngx_ssl_stapling_cache_record_t));
+        p += sizeof(ngx_ssl_stapling_cache_record_t);
+
+        if (rec.len == 0 || rec.len > (size_t) (last - p)) {
+            goto invalid;
+        }
+
+        if (rec.valid > now) {
+            node = ngx_ssl_stapling_cache_node(cache, rec.id, 1);
+            if (node == NULL) {
+                break;
+            }
+
+            node->response = ngx_slab_alloc_locked(cache->shpool, rec.len);
+            if (node->response == NULL) {
+                break;
+            }
+
+            ngx_memcpy(node->response, p, rec.len);
+
+            node->len = rec.len;
+            node->valid = (time_t) rec.valid;
+            node->refresh = (time_t) rec.refresh;
+
+            loaded++;
+        }
+
+        p += rec.len;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "ssl stapling cache: %ui responses loaded from \"%V\"",
+                   loaded, &cache->file);
+
+    goto done;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "stapling cache file \"%V\" is corrupted", &cache->file);
+
+done:
+
+    if (buf) {
+        ngx_free(buf);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &cache->file);
+    }
+}
+
+
 ngx_int_t
 ngx_ssl_ocsp(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *responder,
     ngx_uint_t depth, ngx_shm_zone_t *shm_zone)
@@ -2781,6 +3562,21 @@ ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
 }
 
 
+ngx_int_t
+ngx_ssl_stapling_cache(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_shm_zone_t *shm_zone)
+{
+    return NGX_OK;
+}
+
+
+ngx_shm_zone_t *
+ngx_ssl_stapling_cache_zone(ngx_conf_t *cf, ngx_str_t *name, size_t size,
+    ngx_str_t *file, void *tag)
+{
+    return ngx_shared_memory_add(cf, name, size, tag);
+}
+
+
 ngx_int_t
 ngx_ssl_ocsp(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *responder,
     ngx_uint_t depth, ngx_shm_zone_t *shm_zone)
@@ -29,6 +29,10 @@ typedef struct {
 
     size_t                          buffer_size;
 
+    size_t                          record_size;
+    size_t                          record_threshold;
+    ngx_msec_t                      record_idle;
+
     ssize_t                         builtin_session_cache;
 
     time_t                          session_timeout;
@@ -40,6 +44,7 @@ typedef struct {
     ngx_array_t                    *certificate_key_values;
 
     ngx_ssl_cache_t                *certificate_cache;
+    ngx_flag_t                      certificate_lazy;
 
     ngx_str_t                       dhparam;
     ngx_str_t                       ecdh_curve;
@@ -61,11 +66,17 @@ typedef struct {
     ngx_uint_t                      ocsp;
     ngx_str_t                       ocsp_responder;
     ngx_shm_zone_t                 *ocsp_cache_zone;
+    ngx_shm_zone_t                 *stapling_cache_zone;
+    ngx_shm_zone_t                 *early_data_replay_zone;
 
     ngx_flag_t                      stapling;
     ngx_flag_t                      stapling_verify;
     ngx_str_t                       stapling_file;
     ngx_str_t                       stapling_responder;
+
+    ngx_thread_pool_t              *key_offload;
+    ngx_uint_t                      key_offload_batch;
+    ngx_msec_t                      key_offload_delay;
 } ngx_http_ssl_srv_conf_t;
 
 
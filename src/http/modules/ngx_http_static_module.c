@@ -10,7 +10,21 @@
 #include <ngx_http.h>
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_thread_task_t         *task;
+} ngx_http_static_ctx_t;
+
+#endif
+
+
 static ngx_int_t ngx_http_static_handler(ngx_http_request_t *r);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_static_thread_handler(ngx_thread_task_t *task,
+    ngx_open_file_info_t *of);
+static void ngx_http_static_thread_event_handler(ngx_event_t *ev);
+#endif
 static ngx_int_t ngx_http_static_init(ngx_conf_t *cf);
 
 
@@ -59,6 +73,9 @@ ngx_http_static_handler(ngx_http_request_t *r)
     ngx_chain_t                out;
     ngx_open_file_info_t       of;
     ngx_http_core_loc_conf_t  *clcf;
+#if (NGX_THREADS)
+    ngx_http_static_ctx_t     *ctx;
+#endif
 
     if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
         return NGX_HTTP_NOT_ALLOWED;
@@ -100,9 +117,47 @@ ngx_http_static_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
-        != NGX_OK)
-    {
+#if (NGX_THREADS)
+
+    ctx = NULL;
+
+    if (clcf->aio == NGX_HTTP_AIO_THREADS && clcf->aio_open) {
+
+        ctx = ngx_http_get_module_ctx(r, ngx_http_static_module);
+
+        if (ctx == NULL) {
+            ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_static_ctx_t));
+            if (ctx == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            ngx_http_set_ctx(r, ctx, ngx_http_static_module);
+        }
+
+        of.thread_task = ctx->task;
+        of.thread_handler = ngx_http_static_thread_handler;
+        of.thread_ctx = r;
+    }
+
+#endif
+
+    rc = ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool);
+
+#if (NGX_THREADS)
+
+    if (ctx) {
+        ctx->task = of.thread_task;
+    }
+
+    if (rc == NGX_AGAIN) {
+        r->main->count++;
+        r->write_event_handler = ngx_http_request_empty_handler;
+        return NGX_DONE;
+    }
+
+#endif
+
+    if (rc != NGX_OK) {
         switch (of.err) {
 
         case 0:
@@ -278,6 +333,102 @@ ngx_http_static_handler(ngx_http_request_t *r)
 }
 
 
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_static_thread_handler(ngx_thread_task_t *task,
+    ngx_open_file_info_t *of)
+{
+    ngx_str_t                  name;
+    ngx_thread_pool_t         *tp;
+    ngx_http_request_t        *r;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    r = of->thread_ctx;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
+
+    task->event.data = r;
+    task->event.handler = ngx_http_static_thread_event_handler;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_add_timer(&task->event, 60000);
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_static_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http static thread: \"%V?%V\"", &r->uri, &r->args);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "thread operation took too long");
+        ev->timedout = 0;
+        return;
+    }
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    if (r->main->terminated) {
+        /*
+         * trigger connection event handler if the request was
+         * terminated
+         */
+
+        c->write->handler(c->write);
+
+    } else {
+        /* the static handler is called again to use the opened file */
+
+        r->write_event_handler = ngx_http_core_run_phases;
+        ngx_http_core_run_phases(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_static_init(ngx_conf_t *cf)
 {
@@ -88,6 +88,9 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
     ngx_buf_t         *b;
     ngx_chain_t        out;
     ngx_atomic_int_t   ap, hn, ac, rq, rd, wr, wa;
+#if (NGX_HTTP_SSL)
+    ngx_str_t          ssl;
+#endif
 
     if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
         return NGX_HTTP_NOT_ALLOWED;
@@ -108,6 +111,18 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
            + 6 + 3 * NGX_ATOMIC_T_LEN
            + sizeof("Reading:  Writing:  Waiting:  \n") + 3 * NGX_ATOMIC_T_LEN;
 
+#if (NGX_HTTP_SSL)
+
+    if (ngx_ssl_key_offload_status((ngx_cycle_t *) ngx_cycle, r->pool, &ssl)
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    size += ssl.len;
+
+#endif
+
     b = ngx_create_temp_buf(r->pool, size);
     if (b == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -134,6 +149,10 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
     b->last = ngx_sprintf(b->last, "Reading: %uA Writing: %uA Waiting: %uA \n",
                           rd, wr, wa);
 
+#if (NGX_HTTP_SSL)
+    b->last = ngx_cpymem(b->last, ssl.data, ssl.len);
+#endif
+
     r->headers_out.status = NGX_HTTP_OK;
     r->headers_out.content_length_n = b->last - b->pos;
 
@@ -0,0 +1,607 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_PEAK_EWMA_HEADER     0
+#define NGX_HTTP_UPSTREAM_PEAK_EWMA_LAST_BYTE  1
+
+
+typedef struct {
+    ngx_http_upstream_rr_peer_t              *peer;
+    ngx_uint_t                                range;
+} ngx_http_upstream_peak_ewma_range_t;
+
+
+typedef struct {
+    ngx_uint_t                                mode;
+    ngx_msec_t                                decay;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_uint_t                                config;
+#endif
+    ngx_http_upstream_peak_ewma_range_t      *ranges;
+} ngx_http_upstream_peak_ewma_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t          rrp;
+
+    ngx_http_upstream_peak_ewma_srv_conf_t   *conf;
+    ngx_http_upstream_t                      *upstream;
+    u_char                                    tries;
+} ngx_http_upstream_peak_ewma_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_peak_ewma(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_update_peak_ewma(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us);
+
+static ngx_int_t ngx_http_upstream_init_peak_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_peak_ewma_peer(
+    ngx_peer_connection_t *pc, void *data);
+static ngx_uint_t ngx_http_upstream_peek_peak_ewma_peer(
+    ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_peak_ewma_peer_data_t *pp);
+static uint64_t ngx_http_upstream_peak_ewma_load(
+    ngx_http_upstream_peak_ewma_peer_data_t *pp,
+    ngx_http_upstream_rr_peer_t *peer);
+static ngx_uint_t ngx_http_upstream_peak_ewma_decay(ngx_uint_t value,
+    ngx_msec_t elapsed, ngx_msec_t decay);
+static void ngx_http_upstream_free_peak_ewma_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static void *ngx_http_upstream_peak_ewma_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_peak_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_peak_ewma_commands[] = {
+
+    { ngx_string("peak_ewma"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_http_upstream_peak_ewma,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_peak_ewma_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_peak_ewma_create_conf,
+                                           /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_peak_ewma_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_peak_ewma_module_ctx, /* module context */
+    ngx_http_upstream_peak_ewma_commands,  /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_peak_ewma(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "init peak ewma");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_peak_ewma_peer;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (us->shm_zone) {
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_http_upstream_update_peak_ewma(cf->pool, us);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_update_peak_ewma(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    size_t                                   size;
+    ngx_uint_t                               i, total_weight;
+    ngx_http_upstream_rr_peer_t             *peer;
+    ngx_http_upstream_rr_peers_t            *peers;
+    ngx_http_upstream_peak_ewma_range_t     *ranges;
+    ngx_http_upstream_peak_ewma_srv_conf_t  *pcf;
+
+    pcf = ngx_http_conf_upstream_srv_conf(us,
+                                          ngx_http_upstream_peak_ewma_module);
+
+    if (pcf->ranges) {
+        ngx_free(pcf->ranges);
+        pcf->ranges = NULL;
+    }
+
+    peers = us->peer.data;
+
+    size = peers->number * sizeof(ngx_http_upstream_peak_ewma_range_t);
+
+    ranges = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
+    if (ranges == NULL) {
+        return NGX_ERROR;
+    }
+
+    total_weight = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        ranges[i].peer = peer;
+        ranges[i].range = total_weight;
+        total_weight += peer->weight;
+    }
+
+    pcf->ranges = ranges;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_peak_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_peak_ewma_srv_conf_t   *pcf;
+    ngx_http_upstream_peak_ewma_peer_data_t  *pp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init peak ewma peer");
+
+    pcf = ngx_http_conf_upstream_srv_conf(us,
+                                          ngx_http_upstream_peak_ewma_module);
+
+    pp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_peak_ewma_peer_data_t));
+    if (pp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &pp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_peak_ewma_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_peak_ewma_peer;
+
+    pp->conf = pcf;
+    pp->upstream = r->upstream;
+    pp->tries = 0;
+
+    ngx_http_upstream_rr_peers_rlock(pp->rrp.peers);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (pp->rrp.peers->config
+        && (pcf->ranges == NULL || pcf->config != *pp->rrp.peers->config))
+    {
+        if (ngx_http_upstream_update_peak_ewma(NULL, us) != NGX_OK) {
+            ngx_http_upstream_rr_peers_unlock(pp->rrp.peers);
+            return NGX_ERROR;
+        }
+
+        pcf->config = *pp->rrp.peers->config;
+    }
+#endif
+
+    ngx_http_upstream_rr_peers_unlock(pp->rrp.peers);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_peak_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_peak_ewma_peer_data_t  *pp = data;
+
+    time_t                             now;
+    uint64_t                           load, prev_load;
+    uintptr_t                          m;
+    ngx_uint_t                         i, n, p;
+    ngx_http_upstream_rr_peer_t       *peer, *prev;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get peak ewma peer, try: %ui", pc->tries);
+
+    rrp = &pp->rrp;
+    peers = rrp->peers;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    if (pp->tries > 20 || peers->number < 2) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (peers->config && rrp->config != *peers->config) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+#endif
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    prev = NULL;
+
+#if (NGX_SUPPRESS_WARN)
+    p = 0;
+#endif
+
+#if (NGX_HTTP_UPSTREAM_SID)
+    peer = ngx_http_upstream_get_rr_peer_by_sid(rrp, pc->hint, &i, 0);
+
+    if (peer) {
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        goto found;
+    }
+#endif
+
+    /*
+     * power of two choices: sample two peers according to their weights,
+     * and select the one with the lower peak ewma load
+     */
+
+    for ( ;; ) {
+
+        i = ngx_http_upstream_peek_peak_ewma_peer(peers, pp);
+
+        peer = pp->conf->ranges[i].peer;
+
+        if (peer == prev) {
+            goto next;
+        }
+
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            goto next;
+        }
+
+        if (peer->down) {
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            goto next;
+        }
+
+        if (prev) {
+            load = ngx_http_upstream_peak_ewma_load(pp, peer);
+            prev_load = ngx_http_upstream_peak_ewma_load(pp, prev);
+
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                           "get peak ewma peer, \"%V\" load:%uL "
+                           "\"%V\" load:%uL",
+                           &prev->name, prev_load, &peer->name, load);
+
+            if (load * prev->weight > prev_load * peer->weight) {
+                peer = prev;
+                n = p / (8 * sizeof(uintptr_t));
+                m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+            }
+
+            break;
+        }
+
+        prev = peer;
+        p = i;
+
+    next:
+
+        if (++pp->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(peers);
+            return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+        }
+    }
+
+#if (NGX_HTTP_UPSTREAM_SID)
+found:
+#endif
+
+    rrp->current = peer;
+    ngx_http_upstream_rr_peer_ref(peers, peer);
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+#if (NGX_HTTP_UPSTREAM_SID)
+    pc->sid = &peer->sid;
+#endif
+
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    rrp->tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_peek_peak_ewma_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_peak_ewma_peer_data_t *pp)
+{
+    ngx_uint_t  i, j, k, x;
+
+    x = ngx_random() % peers->total_weight;
+
+    i = 0;
+    j = peers->number;
+
+    while (j - i > 1) {
+        k = (i + j) / 2;
+
+        if (x < pp->conf->ranges[k].range) {
+            j = k;
+
+        } else {
+            i = k;
+        }
+    }
+
+    return i;
+}
+
+
+static uint64_t
+ngx_http_upstream_peak_ewma_load(ngx_http_upstream_peak_ewma_peer_data_t *pp,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_uint_t  cost;
+
+    /*
+     * the cost decays towards zero while no responses are seen,
+     * so that idle or previously slow peers are probed again
+     */
+
+    cost = ngx_http_upstream_peak_ewma_decay(peer->ewma,
+                                          ngx_current_msec - peer->ewma_stamp,
+                                          pp->conf->decay);
+
+    /* outstanding requests are penalized by the expected latency */
+
+    return (uint64_t) (cost + 1000) * (peer->conns + 1);
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_peak_ewma_decay(ngx_uint_t value, ngx_msec_t elapsed,
+    ngx_msec_t decay)
+{
+    ngx_msec_t  half;
+
+    /*
+     * value * exp(-elapsed / decay), approximated by halving the value
+     * once in a half-life and linear interpolation between
+     */
+
+    half = decay * 693 / 1000 + 1;
+
+    if (elapsed >= 32 * half) {
+        return 0;
+    }
+
+    value >>= elapsed / half;
+
+    return value - value * (elapsed % half) / (2 * half);
+}
+
+
+static void
+ngx_http_upstream_free_peak_ewma_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_peak_ewma_peer_data_t  *pp = data;
+
+    ngx_uint_t                         rtt;
+    ngx_msec_t                         now, time;
+    ngx_http_upstream_t               *u;
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "free peak ewma peer");
+
+    rrp = &pp->rrp;
+    peer = rrp->current;
+
+    u = pp->upstream;
+
+    ngx_http_upstream_rr_peers_rlock(rrp->peers);
+    ngx_http_upstream_rr_peer_lock(rrp->peers, peer);
+
+    if (pp->conf->mode == NGX_HTTP_UPSTREAM_PEAK_EWMA_HEADER
+        && u->state->header_time != (ngx_msec_t) -1)
+    {
+        time = u->state->header_time;
+
+    } else {
+        time = u->state->response_time;
+    }
+
+    now = ngx_current_msec;
+
+    if (time == (ngx_msec_t) -1) {
+        /* failed attempt, account time spent so far */
+        time = now - u->start_time;
+    }
+
+    rtt = time * 1000;
+
+    if (rtt > peer->ewma) {
+        /* peak sensitivity: latency spikes are accounted immediately */
+        peer->ewma = rtt;
+
+    } else if (!(state & (NGX_PEER_FAILED|NGX_PEER_NEXT))) {
+
+        /*
+         * only successful attempts lower the average to mitigate
+         * preferring of failing peers
+         */
+
+        peer->ewma = rtt + ngx_http_upstream_peak_ewma_decay(peer->ewma - rtt,
+                                                       now - peer->ewma_stamp,
+                                                       pp->conf->decay);
+
+    } else {
+        goto done;
+    }
+
+    peer->ewma_stamp = now;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "peak ewma peer \"%V\" cost:%uius", &peer->name, peer->ewma);
+
+done:
+
+    ngx_http_upstream_free_round_robin_peer_locked(pc, rrp, state);
+}
+
+
+static void *
+ngx_http_upstream_peak_ewma_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_peak_ewma_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_peak_ewma_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->mode = NGX_HTTP_UPSTREAM_PEAK_EWMA_HEADER;
+     *     conf->ranges = NULL;
+     */
+
+    conf->decay = 10000;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_peak_ewma(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_peak_ewma_srv_conf_t  *pcf = conf;
+
+    ngx_str_t                     *value, s;
+    ngx_uint_t                     i;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_peak_ewma;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_MODIFY
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "header") == 0) {
+            pcf->mode = NGX_HTTP_UPSTREAM_PEAK_EWMA_HEADER;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "last_byte") == 0) {
+            pcf->mode = NGX_HTTP_UPSTREAM_PEAK_EWMA_LAST_BYTE;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "decay=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = &value[i].data[6];
+
+            pcf->decay = ngx_parse_time(&s, 0);
+
+            if (pcf->decay == (ngx_msec_t) NGX_ERROR || pcf->decay == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
@@ -0,0 +1,549 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_STRIDE_SCALE  (1 << 20)
+
+
+typedef struct {
+    ngx_http_upstream_rr_peer_t          *peer;
+    ngx_uint_t                            index;
+    uint64_t                              pass;
+    uint64_t                              stride;
+    unsigned                              unavailable:1;
+} ngx_http_upstream_stride_node_t;
+
+
+typedef struct {
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_uint_t                            config;
+#endif
+    ngx_uint_t                            number;
+    ngx_http_upstream_stride_node_t      *nodes;
+    ngx_http_upstream_stride_node_t     **heap;
+    ngx_http_upstream_stride_node_t     **skipped;
+} ngx_http_upstream_stride_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t      rrp;
+
+    ngx_http_upstream_stride_srv_conf_t  *conf;
+    ngx_http_upstream_rr_peers_t         *peers;
+} ngx_http_upstream_stride_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_stride(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_update_stride(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us);
+
+static ngx_int_t ngx_http_upstream_init_stride_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_stride_peer(ngx_peer_connection_t *pc,
+    void *data);
+static ngx_http_upstream_stride_node_t *ngx_http_upstream_stride_pop(
+    ngx_http_upstream_stride_srv_conf_t *scf, ngx_uint_t *nelts);
+static void ngx_http_upstream_stride_push(
+    ngx_http_upstream_stride_srv_conf_t *scf, ngx_uint_t *nelts,
+    ngx_http_upstream_stride_node_t *node);
+static ngx_inline ngx_int_t ngx_http_upstream_stride_less(
+    ngx_http_upstream_stride_node_t *a, ngx_http_upstream_stride_node_t *b);
+
+static void *ngx_http_upstream_stride_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_stride(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_stride_commands[] = {
+
+    { ngx_string("stride"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_stride,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_stride_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_stride_create_conf,  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_stride_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_stride_module_ctx,  /* module context */
+    ngx_http_upstream_stride_commands,     /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_stride(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "init stride");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_stride_peer;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (us->shm_zone) {
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_http_upstream_update_stride(cf->pool, us);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_update_stride(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    u_char                               *p;
+    size_t                                size;
+    ngx_uint_t                            i, n;
+    ngx_http_upstream_rr_peer_t          *peer;
+    ngx_http_upstream_rr_peers_t         *peers;
+    ngx_http_upstream_stride_node_t      *node;
+    ngx_http_upstream_stride_srv_conf_t  *scf;
+
+    scf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_stride_module);
+
+    if (scf->nodes) {
+        ngx_free(scf->nodes);
+        scf->nodes = NULL;
+    }
+
+    peers = us->peer.data;
+
+    size = peers->number * (sizeof(ngx_http_upstream_stride_node_t)
+                            + 2 * sizeof(ngx_http_upstream_stride_node_t *));
+
+    p = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    scf->nodes = (ngx_http_upstream_stride_node_t *) p;
+    p += peers->number * sizeof(ngx_http_upstream_stride_node_t);
+
+    scf->heap = (ngx_http_upstream_stride_node_t **) p;
+    p += peers->number * sizeof(ngx_http_upstream_stride_node_t *);
+
+    scf->skipped = (ngx_http_upstream_stride_node_t **) p;
+
+    n = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        node = &scf->nodes[i];
+
+        node->peer = peer;
+        node->index = i;
+        node->stride = NGX_HTTP_UPSTREAM_STRIDE_SCALE / peer->weight;
+
+        if (node->stride == 0) {
+            node->stride = 1;
+        }
+
+        /*
+         * starting half a stride in spreads the peers with equal
+         * weights evenly, similar to smooth weighted round robin
+         */
+
+        node->pass = node->stride / 2;
+        node->unavailable = 0;
+
+        ngx_http_upstream_stride_push(scf, &n, node);
+    }
+
+    scf->number = n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_stride_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_stride_srv_conf_t   *scf;
+    ngx_http_upstream_stride_peer_data_t  *sp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init stride peer");
+
+    scf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_stride_module);
+
+    sp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_stride_peer_data_t));
+    if (sp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &sp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_stride_peer;
+
+    sp->conf = scf;
+    sp->peers = sp->rrp.peers;
+
+    ngx_http_upstream_rr_peers_rlock(sp->rrp.peers);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (sp->rrp.peers->config
+        && (scf->nodes == NULL || scf->config != *sp->rrp.peers->config))
+    {
+        if (ngx_http_upstream_update_stride(NULL, us) != NGX_OK) {
+            ngx_http_upstream_rr_peers_unlock(sp->rrp.peers);
+            return NGX_ERROR;
+        }
+
+        scf->config = *sp->rrp.peers->config;
+    }
+#endif
+
+    ngx_http_upstream_rr_peers_unlock(sp->rrp.peers);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_stride_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_stride_peer_data_t  *sp = data;
+
+    time_t                                now;
+    uint64_t                              pass;
+    uintptr_t                             m;
+    ngx_uint_t                            i, n, nelts, nskipped;
+    ngx_http_upstream_rr_peer_t          *peer;
+    ngx_http_upstream_rr_peers_t         *peers;
+    ngx_http_upstream_stride_node_t      *node, *best;
+    ngx_http_upstream_rr_peer_data_t     *rrp;
+    ngx_http_upstream_stride_srv_conf_t  *scf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get stride peer, try: %ui", pc->tries);
+
+    rrp = &sp->rrp;
+    peers = rrp->peers;
+    scf = sp->conf;
+
+    if (peers != sp->peers) {
+        /* the heap only contains primary peers, backup ones use round robin */
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    if (peers->number < 2) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (peers->config && rrp->config != *peers->config) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+#endif
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+#if (NGX_HTTP_UPSTREAM_SID)
+    peer = ngx_http_upstream_get_rr_peer_by_sid(rrp, pc->hint, &i, 0);
+
+    if (peer) {
+        goto found;
+    }
+#endif
+
+    /*
+     * the peer with the lowest pass value is selected, and its pass
+     * is advanced by the stride inversely proportional to its weight;
+     * peers which cannot be used for this request are taken out of
+     * the heap and put back once the selection is done
+     */
+
+    best = NULL;
+    nelts = scf->number;
+    nskipped = 0;
+
+    while (nelts) {
+
+        node = ngx_http_upstream_stride_pop(scf, &nelts);
+        scf->skipped[nskipped++] = node;
+
+        peer = node->peer;
+
+        n = node->index / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << node->index % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            continue;
+        }
+
+        if (peer->down) {
+            goto unavailable;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            goto unavailable;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            goto unavailable;
+        }
+
+        best = node;
+        nskipped--;
+
+        break;
+
+    unavailable:
+
+        /* peers not available at the moment lose their turn */
+
+        node->unavailable = 1;
+    }
+
+    if (best) {
+        pass = best->pass;
+        best->pass += best->stride;
+
+        ngx_http_upstream_stride_push(scf, &nelts, best);
+
+    } else {
+        pass = 0;
+    }
+
+    for (i = 0; i < nskipped; i++) {
+        node = scf->skipped[i];
+
+        if (node->unavailable) {
+            node->unavailable = 0;
+
+            if (best) {
+                node->pass = ngx_max(node->pass, pass) + node->stride;
+            }
+        }
+
+        ngx_http_upstream_stride_push(scf, &nelts, node);
+    }
+
+    if (best == NULL) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        /* backup servers and error handling */
+
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    peer = best->peer;
+    i = best->index;
+
+#if (NGX_HTTP_UPSTREAM_SID)
+found:
+#endif
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get stride peer, \"%V\" #%ui", &peer->name, i);
+
+    rrp->current = peer;
+    ngx_http_upstream_rr_peer_ref(peers, peer);
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+#if (NGX_HTTP_UPSTREAM_SID)
+    pc->sid = &peer->sid;
+#endif
+
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    rrp->tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+static ngx_http_upstream_stride_node_t *
+ngx_http_upstream_stride_pop(ngx_http_upstream_stride_srv_conf_t *scf,
+    ngx_uint_t *nelts)
+{
+    ngx_uint_t                         i, child, n;
+    ngx_http_upstream_stride_node_t   *top, *last, **heap;
+
+    heap = scf->heap;
+    top = heap[0];
+
+    n = --*nelts;
+
+    if (n == 0) {
+        return top;
+    }
+
+    last = heap[n];
+
+    for (i = 0; (child = 2 * i + 1) < n; i = child) {
+
+        if (child + 1 < n
+            && ngx_http_upstream_stride_less(heap[child + 1], heap[child]))
+        {
+            child++;
+        }
+
+        if (!ngx_http_upstream_stride_less(heap[child], last)) {
+            break;
+        }
+
+        heap[i] = heap[child];
+    }
+
+    heap[i] = last;
+
+    return top;
+}
+
+
+static void
+ngx_http_upstream_stride_push(ngx_http_upstream_stride_srv_conf_t *scf,
+    ngx_uint_t *nelts, ngx_http_upstream_stride_node_t *node)
+{
+    ngx_uint_t                         i, parent;
+    ngx_http_upstream_stride_node_t  **heap;
+
+    heap = scf->heap;
+
+    for (i = (*nelts)++; i; i = parent) {
+        parent = (i - 1) / 2;
+
+        if (!ngx_http_upstream_stride_less(node, heap[parent])) {
+            break;
+        }
+
+        heap[i] = heap[parent];
+    }
+
+    heap[i] = node;
+}
+
+
+static ngx_inline ngx_int_t
+ngx_http_upstream_stride_less(ngx_http_upstream_stride_node_t *a,
+    ngx_http_upstream_stride_node_t *b)
+{
+    if (a->pass != b->pass) {
+        return a->pass < b->pass;
+    }
+
+    /* on ties, heavier peers go first, then configuration order */
+
+    if (a->stride != b->stride) {
+        return a->stride < b->stride;
+    }
+
+    return a->index < b->index;
+}
+
+
+static void *
+ngx_http_upstream_stride_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_stride_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_stride_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->nodes = NULL;
+     *     conf->heap = NULL;
+     *     conf->skipped = NULL;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_stride(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_stride;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_MODIFY
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+}
@@ -10,6 +10,19 @@
 #include <ngx_http.h>
 
 
+/*
+ * peers marked unhealthy by health checks are still counted in tries,
+ * as health checks do not adjust peers->tries
+ */
+
+#if (NGX_HTTP_UPSTREAM_HC)
+#define ngx_http_upstream_zone_tries(peer)                                    \
+    (((peer)->down & ~NGX_HTTP_UPSTREAM_UNHEALTHY) == 0)
+#else
+#define ngx_http_upstream_zone_tries(peer)  ((peer)->down == 0)
+#endif
+
+
 static char *ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone,
@@ -390,6 +403,9 @@ ngx_http_upstream_zone_copy_peer(ngx_http_upstream_rr_peers_t *peers,
 #endif
         dst->server.data = NULL;
         dst->host = NULL;
+#if (NGX_HTTP_SSL)
+        dst->ssl_sessions = NULL;
+#endif
     }
 
     dst->sockaddr = ngx_slab_calloc_locked(pool, sizeof(ngx_sockaddr_t));
@@ -602,7 +618,7 @@ ngx_http_upstream_zone_preresolve(ngx_http_upstream_rr_peer_t *resolve,
                 peerp = &peer->next;
 
                 peers->number++;
-                peers->tries += (peer->down == 0);
+                peers->tries += ngx_http_upstream_zone_tries(peer);
                 peers->total_weight += peer->weight;
                 peers->weighted = (peers->total_weight != peers->number);
             }
@@ -640,7 +656,7 @@ ngx_http_upstream_zone_remove_peer_locked(ngx_http_upstream_rr_peers_t *peers,
 {
     peers->total_weight -= peer->weight;
     peers->number--;
-    peers->tries -= (peer->down == 0);
+    peers->tries -= ngx_http_upstream_zone_tries(peer);
     (*peers->config)++;
     peers->weighted = (peers->total_weight != peers->number);
 
@@ -997,7 +1013,7 @@ again:
         peerp = &peer->next;
 
         peers->number++;
-        peers->tries += (peer->down == 0);
+        peers->tries += ngx_http_upstream_zone_tries(peer);
         peers->total_weight += peer->weight;
         peers->weighted = (peers->total_weight != peers->number);
         (*peers->config)++;
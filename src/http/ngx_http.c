@@ -53,6 +53,11 @@ static ngx_int_t ngx_http_optimize_servers(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf, ngx_array_t *ports);
 static ngx_int_t ngx_http_server_names(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf, ngx_http_conf_addr_t *addr);
+#if (NGX_PCRE)
+static ngx_int_t ngx_http_server_regexes(ngx_conf_t *cf,
+    ngx_http_conf_addr_t *addr);
+static u_char *ngx_http_server_regex_copy(u_char *dst, ngx_str_t *name);
+#endif
 static ngx_int_t ngx_http_cmp_conf_addrs(const void *one, const void *two);
 static int ngx_libc_cdecl ngx_http_cmp_dns_wildcards(const void *one,
     const void *two);
@@ -1437,6 +1442,10 @@ ngx_http_add_address(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 #if (NGX_PCRE)
     addr->nregex = 0;
     addr->regex = NULL;
+    addr->nsets = 0;
+    addr->sets = NULL;
+    addr->captures = NULL;
+    addr->ncaptures = 0;
 #endif
     addr->default_server = cscf;
     addr->servers.elts = NULL;
@@ -1676,10 +1685,14 @@ ngx_http_server_names(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
         }
     }
 
-#endif
+    return ngx_http_server_regexes(cf, addr);
+
+#else
 
     return NGX_OK;
 
+#endif
+
 failed:
 
     ngx_destroy_pool(ha.temp_pool);
@@ -1688,6 +1701,268 @@ failed:
 }
 
 
+#if (NGX_PCRE)
+
+static ngx_int_t
+ngx_http_server_regexes(ngx_conf_t *cf, ngx_http_conf_addr_t *addr)
+{
+    u_char                   *p, *q;
+    size_t                    len;
+    ngx_uint_t                i, j, n, ngroups;
+    ngx_regex_compile_t       rc;
+    ngx_http_server_name_t   *sn;
+    ngx_http_server_regex_t  *set;
+    u_char                    errstr[NGX_MAX_CONF_ERRSTR];
+
+    /*
+     * runs of anchored regexes are matched as a single alternation,
+     * each regex in its own capture group: the first regex which matches
+     * still wins, and the number of captures tells which one it is
+     */
+
+    sn = addr->regex;
+
+    addr->sets = ngx_palloc(cf->pool,
+                            addr->nregex * sizeof(ngx_http_server_regex_t));
+    if (addr->sets == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngroups = 0;
+
+    for (i = 0; i < addr->nregex; i = n) {
+
+        set = &addr->sets[addr->nsets++];
+
+        set->regex = NULL;
+        set->first = i;
+        set->last = i + 1;
+
+        n = i + 1;
+
+        if (n == addr->nregex) {
+            break;
+        }
+
+        len = 0;
+
+        for (j = i; j < addr->nregex && j - i < NGX_HTTP_SERVER_REGEX_SET; j++)
+        {
+            len += sizeof("|((?i))") - 1 + 3 * sn[j].name.len;
+        }
+
+        p = ngx_pnalloc(cf->pool, len + 1);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+        rc.pattern.data = p;
+        rc.pool = cf->pool;
+        rc.err.len = NGX_MAX_CONF_ERRSTR;
+        rc.err.data = errstr;
+
+        for (j = i; j < addr->nregex && j - i < NGX_HTTP_SERVER_REGEX_SET; j++)
+        {
+            q = p;
+
+            if (j != i) {
+                *q++ = '|';
+            }
+
+            *q++ = '(';
+
+            q = ngx_http_server_regex_copy(q, &sn[j].name);
+            if (q == NULL) {
+                break;
+            }
+
+            *q++ = ')';
+            p = q;
+        }
+
+        if (j - i < 2) {
+            continue;
+        }
+
+        *p = '\0';
+        rc.pattern.len = p - rc.pattern.data;
+
+        /* regexes which cannot be combined are matched one by one */
+
+        if (ngx_regex_compile(&rc) != NGX_OK) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                           "server names regexes not combined: %V on %V",
+                           &rc.err, &addr->opt.addr_text);
+            continue;
+        }
+
+        if ((ngx_uint_t) rc.captures != j - i) {
+            continue;
+        }
+
+        set->regex = rc.regex;
+        set->last = j;
+
+        n = j;
+
+        if (j - i + 1 > ngroups) {
+            ngroups = j - i + 1;
+        }
+    }
+
+    if (ngroups) {
+        addr->ncaptures = ngroups * 3;
+        addr->captures = ngx_palloc(cf->pool, addr->ncaptures * sizeof(int));
+        if (addr->captures == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_server_regex_copy(u_char *dst, ngx_str_t *name)
+{
+    u_char      *p, *last;
+    ngx_int_t    depth;
+    ngx_uint_t   class;
+
+    /*
+     * a regex is combined with others only if each of its matches starts
+     * at the beginning of a name, and if it neither refers to groups
+     * nor changes the whole pattern; its groups are copied as
+     * non-capturing ones
+     */
+
+    p = name->data;
+    last = p + name->len;
+
+    if (*p != '^') {
+        return NULL;
+    }
+
+    for ( /* void */ ; p < last; p++) {
+        if (*p >= 'A' && *p <= 'Z') {
+            dst = ngx_cpymem(dst, "(?i)", sizeof("(?i)") - 1);
+            break;
+        }
+    }
+
+    p = name->data;
+
+    depth = 0;
+    class = 0;
+
+    while (p < last) {
+
+        if (*p == '\\') {
+            if (p + 1 == last) {
+                return NULL;
+            }
+
+            if ((p[1] >= '1' && p[1] <= '9')
+                || p[1] == 'g' || p[1] == 'k' || p[1] == 'Q' || p[1] == 'c')
+            {
+                return NULL;
+            }
+
+            *dst++ = *p++;
+            *dst++ = *p++;
+            continue;
+        }
+
+        if (class) {
+            if (*p == ']') {
+                class = 0;
+            }
+
+            *dst++ = *p++;
+            continue;
+        }
+
+        switch (*p) {
+
+        case '[':
+            class = 1;
+            *dst++ = *p++;
+
+            if (p < last && *p == '^') {
+                *dst++ = *p++;
+            }
+
+            if (p < last && *p == ']') {
+                *dst++ = *p++;
+            }
+
+            continue;
+
+        case '(':
+            depth++;
+
+            if (p + 1 == last || (p[1] != '?' && p[1] != '*')) {
+                dst = ngx_cpymem(dst, "(?:", sizeof("(?:") - 1);
+                p++;
+                continue;
+            }
+
+            if (p[1] == '*' || p + 2 == last) {
+                return NULL;
+            }
+
+            if (p[2] == '<' && p + 3 < last && p[3] != '=' && p[3] != '!') {
+
+                /* a named group */
+
+                p = ngx_strlchr(p + 3, last, '>');
+                if (p == NULL) {
+                    return NULL;
+                }
+
+                dst = ngx_cpymem(dst, "(?:", sizeof("(?:") - 1);
+                p++;
+                continue;
+            }
+
+            if (p[2] == 'i' && p + 3 < last && (p[3] == ')' || p[3] == ':')) {
+                dst = ngx_cpymem(dst, p, 3);
+                p += 3;
+                continue;
+            }
+
+            if (ngx_strchr(":=!<>|", p[2]) == NULL) {
+                return NULL;
+            }
+
+            dst = ngx_cpymem(dst, p, 3);
+            p += 3;
+            continue;
+
+        case ')':
+            depth--;
+            break;
+
+        case '|':
+
+            if (depth == 0) {
+                return NULL;
+            }
+
+            break;
+        }
+
+        *dst++ = *p++;
+    }
+
+    return dst;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_cmp_conf_addrs(const void *one, const void *two)
 {
@@ -1951,6 +2226,10 @@ ngx_http_add_addrs(ngx_conf_t *cf, ngx_http_port_t *hport,
 #if (NGX_PCRE)
         vn->nregex = addr[i].nregex;
         vn->regex = addr[i].regex;
+        vn->nsets = addr[i].nsets;
+        vn->sets = addr[i].sets;
+        vn->captures = addr[i].captures;
+        vn->ncaptures = addr[i].ncaptures;
 #endif
     }
 
@@ -2019,6 +2298,10 @@ ngx_http_add_addrs6(ngx_conf_t *cf, ngx_http_port_t *hport,
 #if (NGX_PCRE)
         vn->nregex = addr[i].nregex;
         vn->regex = addr[i].regex;
+        vn->nsets = addr[i].nsets;
+        vn->sets = addr[i].sets;
+        vn->captures = addr[i].captures;
+        vn->ncaptures = addr[i].ncaptures;
 #endif
     }
 
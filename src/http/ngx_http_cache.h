@@ -29,6 +29,14 @@
 
 #define NGX_HTTP_CACHE_VERSION       5
 
+#define NGX_HTTP_CACHE_LRU           0
+#define NGX_HTTP_CACHE_TINYLFU       1
+
+#define NGX_HTTP_CACHE_SKETCH_DEPTH  4
+
+#define NGX_HTTP_CACHE_RECORD_PENDING   0x50474573
+#define NGX_HTTP_CACHE_RECORD_COMPLETE  0x43474573
+
 
 typedef struct {
     ngx_uint_t                       status;
@@ -36,6 +44,15 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct ngx_http_file_cache_hot_s    ngx_http_file_cache_hot_t;
+typedef struct ngx_http_file_cache_batch_s  ngx_http_file_cache_batch_t;
+typedef struct ngx_http_file_cache_fill_s   ngx_http_file_cache_fill_t;
+typedef struct ngx_http_file_cache_sparse_s ngx_http_file_cache_sparse_t;
+typedef struct ngx_http_file_cache_purge_s  ngx_http_file_cache_purge_t;
+typedef struct ngx_http_file_cache_link_s   ngx_http_file_cache_link_t;
+typedef struct ngx_http_file_cache_segment_s ngx_http_file_cache_segment_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,7 +68,10 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         protected:1;
+    unsigned                         indexed:1;
+    unsigned                         waiting:1;
+                                     /* 7 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -59,9 +79,77 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+
+    ngx_http_file_cache_hot_t       *hot;
+    ngx_http_file_cache_fill_t      *fill;
+    ngx_http_file_cache_sparse_t    *sparse;
+    ngx_http_file_cache_purge_t     *purge;
+
+    ngx_http_file_cache_segment_t   *segment;
+    off_t                            offset;
+    off_t                            length;
 } ngx_http_file_cache_node_t;
 
 
+struct ngx_http_file_cache_hot_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    size_t                           len;
+    u_char                           data[1];
+};
+
+
+struct ngx_http_file_cache_fill_s {
+    off_t                            length;
+    off_t                            total;
+    ngx_file_uniq_t                  uniq;
+    size_t                           len;
+    u_char                           name[1];
+};
+
+
+struct ngx_http_file_cache_sparse_s {
+    ngx_file_uniq_t                  uniq;
+    off_t                            length;
+    u_char                           bits[1];
+};
+
+
+struct ngx_http_file_cache_purge_s {
+    ngx_str_node_t                   sn;
+    ngx_http_file_cache_node_t      *fcn;
+    ngx_http_file_cache_link_t      *links;
+    u_char                           data[1];
+};
+
+
+typedef struct {
+    ngx_str_node_t                   sn;
+    ngx_queue_t                      links;
+    u_char                           data[1];
+} ngx_http_file_cache_tag_t;
+
+
+struct ngx_http_file_cache_link_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_tag_t       *tag;
+    ngx_http_file_cache_purge_t     *purge;
+    ngx_http_file_cache_link_t      *next;
+};
+
+
+struct ngx_http_file_cache_segment_s {
+    ngx_queue_t                      queue;
+    uint32_t                         id;
+    off_t                            size;
+    off_t                            live;
+    off_t                            compact;
+    ngx_uint_t                       writing;
+    ngx_uint_t                       failed;
+                                     /* unsigned failed:1 */
+};
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -86,6 +174,9 @@ struct ngx_http_cache_s {
     off_t                            length;
     off_t                            fs_size;
 
+    uint32_t                         segment;
+    off_t                            offset;
+
     ngx_uint_t                       min_uses;
     ngx_uint_t                       error;
     ngx_uint_t                       valid_msec;
@@ -98,6 +189,7 @@ struct ngx_http_cache_s {
 
 #if (NGX_THREADS || NGX_COMPAT)
     ngx_thread_task_t               *thread_task;
+    ngx_thread_task_t               *open_task;
 #endif
 
     ngx_msec_t                       lock_timeout;
@@ -106,6 +198,19 @@ struct ngx_http_cache_s {
     ngx_msec_t                       wait_time;
 
     ngx_event_t                      wait_event;
+    ngx_queue_t                      wait_queue;
+
+    ngx_http_file_cache_fill_t      *fill;
+    ngx_buf_t                       *fill_buf;
+    off_t                            fill_sent;
+
+    ngx_str_t                        tags;
+
+    off_t                            range_start;
+    off_t                            range_end;
+    off_t                            sparse_start;
+    off_t                            sparse_end;
+    off_t                            sparse_length;
 
     unsigned                         lock:1;
     unsigned                         waiting:1;
@@ -122,6 +227,17 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+
+    unsigned                         hot:1;
+    unsigned                         filling:1;
+    unsigned                         fill_wait:1;
+
+    unsigned                         sparse:1;
+    unsigned                         sparse_range:1;
+    unsigned                         sparse_fill:1;
+    unsigned                         sparse_new:1;
+    unsigned                         sparse_commit:1;
+    unsigned                         sparse_send:1;
 };
 
 
@@ -144,6 +260,13 @@ typedef struct {
 } ngx_http_file_cache_header_t;
 
 
+typedef struct {
+    uint32_t                         magic;
+    off_t                            length;
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+} ngx_http_file_cache_record_t;
+
+
 typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
@@ -153,6 +276,29 @@ typedef struct {
     off_t                            size;
     ngx_uint_t                       count;
     ngx_uint_t                       watermark;
+    ngx_queue_t                      hot_queue;
+    size_t                           hot_size;
+
+    ngx_queue_t                      protected;
+    ngx_uint_t                       protected_count;
+
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_width;
+    ngx_uint_t                       sketch_additions;
+
+    ngx_uint_t                       rejected;
+    ngx_uint_t                       evicted_probation;
+    ngx_uint_t                       evicted_protected;
+
+    ngx_rbtree_t                     keys;
+    ngx_rbtree_node_t                keys_sentinel;
+    ngx_rbtree_t                     tags;
+    ngx_rbtree_node_t                tags_sentinel;
+
+    ngx_queue_t                      segments;
+    ngx_http_file_cache_segment_t   *segment;
+    uint32_t                         segment_id;
+    uint32_t                         segment_start;
 } ngx_http_file_cache_sh_t;
 
 
@@ -170,20 +316,46 @@ struct ngx_http_file_cache_s {
 
     time_t                           fail_time;
 
+    size_t                           hot_size;
+    size_t                           hot_max_object;
+    size_t                           sparse;
+    off_t                            segment_size;
+    ngx_uint_t                       hot_min_uses;
+
+    ngx_uint_t                       policy;
+
+    ngx_str_t                        tags;
+
+    ngx_str_t                        index;
+    ngx_str_t                        index_temp;
+    time_t                           index_interval;
+    time_t                           index_next;
+    time_t                           index_time;
+    u_char                          *index_dirs;
+
     ngx_uint_t                       files;
     ngx_uint_t                       loader_files;
     ngx_msec_t                       last;
     ngx_msec_t                       loader_sleep;
     ngx_msec_t                       loader_threshold;
+    ngx_uint_t                       loader_threads;
+    ngx_atomic_t                     loaded;
+    ngx_atomic_t                     reported;
 
     ngx_uint_t                       manager_files;
     ngx_msec_t                       manager_sleep;
     ngx_msec_t                       manager_threshold;
+    ngx_uint_t                       manager_threads;
+    ngx_http_file_cache_batch_t     *batch;
 
     ngx_shm_zone_t                  *shm_zone;
 
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
+    ngx_uint_t                       read_while_write;
+                                     /* unsigned read_while_write:1 */
+    ngx_uint_t                       purge;
+                                     /* unsigned purge:1 */
 };
 
 
@@ -193,7 +365,14 @@ void ngx_http_file_cache_create_key(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
+void ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf,
+    off_t length);
+ngx_int_t ngx_http_file_cache_sparse_open(ngx_http_request_t *r,
+    ngx_temp_file_t *tf, u_char *buf);
+ngx_int_t ngx_http_file_cache_sparse_update(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
+ngx_int_t ngx_http_file_cache_purge(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
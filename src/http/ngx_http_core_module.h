@@ -229,11 +229,34 @@ typedef struct {
 } ngx_http_server_name_t;
 
 
+#if (NGX_PCRE)
+
+#define NGX_HTTP_SERVER_REGEX_SET  64
+
+
+/* consecutive regex server names matched with a single regex */
+
+typedef struct {
+    ngx_regex_t               *regex;    /* NULL for a single name */
+    ngx_uint_t                 first;
+    ngx_uint_t                 last;
+} ngx_http_server_regex_t;
+
+#endif
+
+
 typedef struct {
     ngx_hash_combined_t        names;
 
     ngx_uint_t                 nregex;
     ngx_http_server_name_t    *regex;
+
+#if (NGX_PCRE)
+    ngx_uint_t                 nsets;
+    ngx_http_server_regex_t   *sets;
+    int                       *captures;
+    ngx_uint_t                 ncaptures;
+#endif
 } ngx_http_virtual_names_t;
 
 
@@ -295,6 +318,10 @@ typedef struct {
 #if (NGX_PCRE)
     ngx_uint_t                 nregex;
     ngx_http_server_name_t    *regex;
+    ngx_uint_t                 nsets;
+    ngx_http_server_regex_t   *sets;
+    int                       *captures;
+    ngx_uint_t                 ncaptures;
 #endif
 
     /* the default server configuration for this address:port */
@@ -400,6 +427,7 @@ struct ngx_http_core_loc_conf_s {
     ngx_flag_t    sendfile;                /* sendfile */
     ngx_flag_t    aio;                     /* aio */
     ngx_flag_t    aio_write;               /* aio_write */
+    ngx_flag_t    aio_open;                /* aio_open */
     ngx_flag_t    tcp_nopush;              /* tcp_nopush */
     ngx_flag_t    tcp_nodelay;             /* tcp_nodelay */
     ngx_flag_t    reset_timedout_connection; /* reset_timedout_connection */
@@ -11,13 +11,132 @@
 #include <ngx_md5.h>
 
 
+#define NGX_HTTP_CACHE_INDEX_MAGIC    0x78646e69  /* "indx" */
+#define NGX_HTTP_CACHE_INDEX_VERSION  1
+#define NGX_HTTP_CACHE_INDEX_BATCH    1024
+#define NGX_HTTP_CACHE_PURGE_BATCH    100
+
+#define NGX_HTTP_CACHE_FILL_TIMEOUT   60000
+
+#define NGX_HTTP_CACHE_SEGMENT_NAME_LEN  (sizeof("/segment.") - 1 + 8)
+#define NGX_HTTP_CACHE_SEGMENT_BUFFER    65536
+
+#define NGX_HTTP_CACHE_SPARSE         0x10000
+
+
+typedef struct {
+    uint32_t                         magic;
+    uint32_t                         version;
+    uint32_t                         entry_size;
+    uint32_t                         crc32;
+    uint64_t                         count;
+    uint64_t                         bsize;
+    time_t                           time;
+    u_char                           levels[NGX_MAX_PATH_LEVEL];
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    off_t                            fs_size;
+    size_t                           body_start;
+} ngx_http_file_cache_index_entry_t;
+
+
+typedef struct {
+    ngx_http_file_cache_t           *cache;
+    ngx_tree_ctx_t                   tree;
+    ngx_uint_t                       thread;
+    ngx_uint_t                       files;
+    ngx_msec_t                       last;
+    ngx_int_t                        rc;
+} ngx_http_file_cache_walk_t;
+
+
+struct ngx_http_file_cache_batch_s {
+    ngx_http_file_cache_node_t     **nodes;
+    u_char                          *names;
+    size_t                           len;
+    ngx_uint_t                       nelts;
+    ngx_uint_t                       nalloc;
+    ngx_atomic_t                     next;
+};
+
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_thread_mutex_t               mtx;
+    ngx_thread_cond_t                cond;
+    ngx_thread_cond_t                done;
+    ngx_uint_t                       threads;
+    ngx_log_t                       *log;
+
+    void                          *(*handler)(void *data);
+    u_char                          *data;
+    size_t                           size;
+    ngx_uint_t                       nelts;
+    ngx_uint_t                       next;
+    ngx_uint_t                       left;
+} ngx_http_file_cache_helpers_t;
+
+#endif
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static void ngx_http_file_cache_wait(ngx_http_cache_t *c, ngx_msec_t timer);
+static void ngx_http_file_cache_wait_notify(ngx_uint_t waiting);
+static void ngx_http_file_cache_wait_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_file_cache_fill_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static off_t ngx_http_file_cache_fill_length(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_fill_send(ngx_http_request_t *r);
+static void ngx_http_file_cache_fill_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_fill_write_handler(ngx_http_request_t *r);
+static void ngx_http_file_cache_fill_done(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_sparse_init(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_sparse_test(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_sparse_new(ngx_http_cache_t *c);
+static void ngx_http_file_cache_sparse_mark(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_file_uniq_t uniq);
+static void ngx_http_file_cache_sparse_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_purge_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_http_file_cache_purge_t *ngx_http_file_cache_purge_add(
+    ngx_http_file_cache_t *cache, ngx_http_cache_t *c,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_purge_tags(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_http_file_cache_purge_t *purge);
+static void ngx_http_file_cache_purge_unlink(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_purge_t *purge);
+static void ngx_http_file_cache_purge_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_int_t ngx_http_file_cache_purge_key(ngx_http_file_cache_t *cache,
+    ngx_str_t *key, ngx_uint_t prefix, ngx_str_t *from, ngx_pool_t *pool,
+    ngx_uint_t *n);
+static ngx_int_t ngx_http_file_cache_purge_tag(ngx_http_file_cache_t *cache,
+    ngx_str_t *name, ngx_uint_t *n);
+static ngx_uint_t ngx_http_file_cache_purge_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_purge_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_hot_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_hot_add(ngx_http_cache_t *c, size_t len);
+static void ngx_http_file_cache_hot_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_hot_t *hot);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
@@ -26,10 +145,24 @@ static void ngx_http_cache_aio_event_handler(ngx_event_t *ev);
 #if (NGX_THREADS)
 static ngx_int_t ngx_http_cache_thread_handler(ngx_thread_task_t *task,
     ngx_file_t *file);
+static ngx_int_t ngx_http_cache_open_thread_handler(ngx_thread_task_t *task,
+    ngx_open_file_info_t *of);
+static ngx_int_t ngx_http_cache_thread_post(ngx_http_request_t *r,
+    ngx_thread_task_t *task);
 static void ngx_http_cache_thread_event_handler(ngx_event_t *ev);
 #endif
 static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
+static void ngx_http_file_cache_enqueue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t hit);
+static ngx_queue_t *ngx_http_file_cache_last(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_sketch_init(ngx_shm_zone_t *shm_zone);
+static void ngx_http_file_cache_sketch_add(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_sketch_estimate(
+    ngx_http_file_cache_t *cache, u_char *key);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
@@ -49,7 +182,21 @@ static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
     ngx_queue_t *q, u_char *name);
-static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
+#if (NGX_THREADS)
+static ngx_http_file_cache_batch_t *ngx_http_file_cache_batch_create(
+    ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_delete_batch(ngx_http_file_cache_t *cache);
+static void *ngx_http_file_cache_delete_thread(void *data);
+static void ngx_http_file_cache_threads(void *(*handler)(void *data),
+    u_char *data, size_t size, ngx_uint_t n);
+static ngx_http_file_cache_helpers_t *ngx_http_file_cache_helpers_get(
+    ngx_uint_t threads);
+static void *ngx_http_file_cache_helper_cycle(void *data);
+#endif
+static void *ngx_http_file_cache_loader_walk(void *data);
+static ngx_uint_t ngx_http_file_cache_loader_owner(
+    ngx_http_file_cache_walk_t *walk, ngx_str_t *path);
+static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_walk_t *walk);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx,
@@ -58,11 +205,49 @@ static ngx_int_t ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
+static u_char *ngx_http_file_cache_loader_key(ngx_http_file_cache_t *cache,
+    ngx_file_t *file, ngx_http_cache_t *c, ngx_str_t *key);
+static void ngx_http_file_cache_loader_progress(
+    ngx_http_file_cache_walk_t *walk);
 static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
-    ngx_http_cache_t *c);
+    ngx_http_cache_t *c, ngx_http_file_cache_segment_t *seg);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_index_write(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_index_add(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_index_entry_t *e);
+static void ngx_http_file_cache_index_sweep(ngx_http_file_cache_t *cache);
+static ngx_rbtree_node_t *ngx_http_file_cache_index_next(
+    ngx_http_file_cache_t *cache, u_char *key);
+static ngx_int_t ngx_http_file_cache_index_dir(ngx_http_file_cache_t *cache,
+    u_char *p);
+static ngx_int_t ngx_http_file_cache_segment_init(ngx_http_file_cache_t *cache,
+    ngx_log_t *log);
+static u_char *ngx_http_file_cache_segment_name(ngx_http_file_cache_t *cache,
+    u_char *name, uint32_t id);
+static ngx_int_t ngx_http_file_cache_segment_file(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_http_file_cache_segment_t *ngx_http_file_cache_segment_reserve(
+    ngx_http_file_cache_t *cache, off_t size, off_t *offset);
+static void ngx_http_file_cache_segment_attach(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_http_file_cache_segment_t *seg,
+    off_t offset, off_t length);
+static void ngx_http_file_cache_segment_release(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_http_file_cache_segment_t *ngx_http_file_cache_segment_write(
+    ngx_http_request_t *r, ngx_temp_file_t *tf, off_t *offset, off_t *length);
+static ngx_int_t ngx_http_file_cache_segment_record(ngx_file_t *file,
+    off_t offset, u_char *key, ngx_file_t *src, off_t from, off_t length,
+    u_char *buf);
+static ngx_int_t ngx_http_file_cache_segment_load(
+    ngx_http_file_cache_walk_t *walk);
+static ngx_int_t ngx_http_file_cache_segment_manage(
+    ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_segment_compact(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_segment_t *seg,
+    u_char *name);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -79,6 +264,16 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+/* requests of this process waiting for cache locks */
+
+static ngx_queue_t  ngx_http_file_cache_waiters;
+static ngx_event_t  ngx_http_file_cache_wait_event;
+
+#if (NGX_THREADS)
+static ngx_http_file_cache_helpers_t  *ngx_http_file_cache_helpers;
+#endif
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
@@ -110,6 +305,13 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if ((cache->segment_size == 0) != (ocache->segment_size == 0)) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different segments",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
@@ -121,7 +323,7 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             cache->path->loader = NULL;
         }
 
-        return NGX_OK;
+        return ngx_http_file_cache_sketch_init(shm_zone);
     }
 
     cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
@@ -131,7 +333,7 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         cache->bsize = ngx_fs_bsize(cache->path->name.data);
         cache->max_size /= cache->bsize;
 
-        return NGX_OK;
+        return ngx_http_file_cache_sketch_init(shm_zone);
     }
 
     cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_file_cache_sh_t));
@@ -145,12 +347,34 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
                     ngx_http_file_cache_rbtree_insert_value);
 
     ngx_queue_init(&cache->sh->queue);
+    ngx_queue_init(&cache->sh->hot_queue);
+    ngx_queue_init(&cache->sh->protected);
+
+    ngx_rbtree_init(&cache->sh->keys, &cache->sh->keys_sentinel,
+                    ngx_http_file_cache_purge_insert_value);
+    ngx_rbtree_init(&cache->sh->tags, &cache->sh->tags_sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->segments);
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
     cache->sh->size = 0;
     cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
+    cache->sh->hot_size = 0;
+    cache->sh->protected_count = 0;
+    cache->sh->sketch = NULL;
+    cache->sh->sketch_width = 0;
+    cache->sh->sketch_additions = 0;
+    cache->sh->rejected = 0;
+    cache->sh->evicted_probation = 0;
+    cache->sh->evicted_protected = 0;
+    cache->sh->segment = NULL;
+
+    if (ngx_http_file_cache_segment_init(cache, shm_zone->shm.log) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
@@ -168,6 +392,39 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->log_nomem = 0;
 
+    return ngx_http_file_cache_sketch_init(shm_zone);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_sketch_init(ngx_shm_zone_t *shm_zone)
+{
+    ngx_uint_t              width;
+    ngx_http_file_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (cache->policy != NGX_HTTP_CACHE_TINYLFU || cache->sh->sketch) {
+        return NGX_OK;
+    }
+
+    /* about one counter per node the keys zone can hold */
+
+    width = 64;
+
+    while (width * 2 * 128 <= shm_zone->shm.size) {
+        width *= 2;
+    }
+
+    cache->sh->sketch = ngx_slab_calloc(cache->shpool,
+                                        NGX_HTTP_CACHE_SKETCH_DEPTH * width);
+    if (cache->sh->sketch == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->sh->sketch_width = width;
+    cache->sh->sketch_additions = 0;
+
     return NGX_OK;
 }
 
@@ -264,6 +521,7 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
+    size_t                     size;
     ngx_int_t                  rc, rv;
     ngx_uint_t                 test;
     ngx_http_cache_t          *c;
@@ -292,6 +550,10 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
         cln->handler = ngx_http_file_cache_cleanup;
         cln->data = c;
+
+        if (cache->sparse) {
+            ngx_http_file_cache_sparse_init(r, c);
+        }
     }
 
     c->buffer_size = c->body_start;
@@ -345,6 +607,38 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->node->sparse && !c->sparse) {
+
+        /* a partially cached response is replaced */
+
+        goto done;
+    }
+
+    c->hot = 0;
+
+    if (cache->hot_size && c->node->hot) {
+        rc = ngx_http_file_cache_hot_read(r, c);
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (cache->segment_size) {
+
+        if (c->segment == 0) {
+            goto done;
+        }
+
+        if (ngx_http_file_cache_segment_file(r, c) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -356,9 +650,28 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     of.directio = NGX_OPEN_FILE_DIRECTIO_OFF;
     of.read_ahead = clcf->read_ahead;
 
-    if (ngx_open_cached_file(clcf->open_file_cache, &c->file.name, &of, r->pool)
-        != NGX_OK)
-    {
+#if (NGX_THREADS)
+    if (clcf->aio == NGX_HTTP_AIO_THREADS && clcf->aio_open) {
+        of.thread_task = c->open_task;
+        of.thread_handler = ngx_http_cache_open_thread_handler;
+        of.thread_ctx = r;
+    }
+#endif
+
+    rc = ngx_open_cached_file(clcf->open_file_cache, &c->file.name, &of,
+                              r->pool);
+
+#if (NGX_THREADS)
+    if (of.thread_task) {
+        c->open_task = of.thread_task;
+    }
+#endif
+
+    if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+
+    if (rc != NGX_OK) {
         switch (of.err) {
 
         case 0:
@@ -380,11 +693,31 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
     c->file.fd = of.fd;
     c->file.log = r->connection->log;
-    c->uniq = of.uniq;
-    c->length = of.size;
-    c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
-    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    /* an object stored in a segment was located by the node */
+
+    if (c->segment == 0) {
+        c->uniq = of.uniq;
+        c->length = of.size;
+        c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
+    }
+
+    size = c->body_start;
+
+    /*
+     * small objects which may be placed into the memory tier
+     * are read completely
+     */
+
+    if (cache->hot_size
+        && c->length > (off_t) size
+        && c->length <= (off_t) cache->hot_max_object
+        && c->node->uses >= cache->hot_min_uses)
+    {
+        size = (size_t) c->length;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, size);
     if (c->buf == NULL) {
         return NGX_ERROR;
     }
@@ -394,6 +727,17 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 done:
 
     if (rv == NGX_DECLINED) {
+
+        if (c->sparse) {
+            ngx_http_file_cache_sparse_new(c);
+        }
+
+        if (cache->policy == NGX_HTTP_CACHE_TINYLFU
+            && ngx_http_file_cache_admit(cache, c) != NGX_OK)
+        {
+            return NGX_HTTP_CACHE_SCARCE;
+        }
+
         return ngx_http_file_cache_lock(r, c);
     }
 
@@ -404,6 +748,8 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    ngx_int_t                  rc;
+    ngx_uint_t                 fill;
     ngx_msec_t                 now, timer;
     ngx_http_file_cache_t     *cache;
 
@@ -415,27 +761,52 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
+    if (c->wait_time == 0) {
+        c->fill_wait = (cache->read_while_write
+                        && r == r->main
+                        && r->headers_in.range == NULL);
+    }
+
+    fill = 0;
+
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     timer = c->node->lock_time - now;
 
-    if (!c->node->updating || (ngx_msec_int_t) timer <= 0) {
+    if (c->fill_wait && c->node->updating && c->node->fill
+        && (ngx_msec_int_t) timer > 0)
+    {
+        fill = 1;
+
+    } else if (!c->node->updating || (ngx_msec_int_t) timer <= 0) {
         c->node->updating = 1;
         c->node->lock_time = now + c->lock_age;
         c->updating = 1;
         c->lock_time = c->node->lock_time;
     }
 
+    if (!c->updating) {
+        c->node->waiting = 1;
+    }
+
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache lock u:%d wt:%M",
-                   c->updating, c->wait_time);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache lock u:%d f:%ui wt:%M",
+                   c->updating, fill, c->wait_time);
 
     if (c->updating) {
         return NGX_DECLINED;
     }
 
+    if (fill) {
+        rc = ngx_http_file_cache_fill_open(r, c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     if (c->lock_timeout == 0) {
         return NGX_HTTP_CACHE_SCARCE;
     }
@@ -450,9 +821,7 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->wait_event.log = r->connection->log;
     }
 
-    timer = c->wait_time - now;
-
-    ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+    ngx_http_file_cache_wait(c, c->wait_time - now);
 
     r->main->blocked++;
 
@@ -475,6 +844,12 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http file cache wait: \"%V?%V\"", &r->uri, &r->args);
 
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    ngx_queue_remove(&r->cache->wait_queue);
+
     rc = ngx_http_file_cache_lock_wait(r, r->cache);
 
     if (rc == NGX_AGAIN) {
@@ -503,7 +878,7 @@ static ngx_int_t
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
     ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
+    ngx_msec_t              now, timer, lock;
     ngx_http_file_cache_t  *cache;
 
     now = ngx_current_msec;
@@ -522,16 +897,19 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    timer = c->node->lock_time - now;
+    lock = c->node->lock_time - now;
 
-    if (c->node->updating && (ngx_msec_int_t) timer > 0) {
+    if (c->node->updating && (ngx_msec_int_t) lock > 0
+        && !(c->fill_wait && c->node->fill))
+    {
+        c->node->waiting = 1;
         wait = 1;
     }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
     if (wait) {
-        ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+        ngx_http_file_cache_wait(c, ngx_min(timer, lock));
         return NGX_AGAIN;
     }
 
@@ -539,302 +917,363 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_wait(ngx_http_cache_t *c, ngx_msec_t timer)
 {
-    u_char                        *p;
-    time_t                         now;
-    ssize_t                        n;
-    ngx_str_t                     *key;
-    ngx_int_t                      rc;
-    ngx_uint_t                     i;
-    ngx_http_file_cache_t         *cache;
-    ngx_http_file_cache_header_t  *h;
+    ngx_event_t  *ev;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    /*
+     * a waiting request is woken up when the node it waits for
+     * changes in this process, or in another one which then sends
+     * a wakeup over the channels; the request timer is only needed
+     * for lock_timeout and lock_age
+     */
 
-    if (n < 0) {
-        return n;
-    }
+    ev = &ngx_http_file_cache_wait_event;
 
-    if ((size_t) n < c->header_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" is too small", c->file.name.data);
-        return NGX_DECLINED;
-    }
+    if (ngx_http_file_cache_waiters.next == NULL) {
+        ngx_queue_init(&ngx_http_file_cache_waiters);
 
-    h = (ngx_http_file_cache_header_t *) c->buf->pos;
+        ev->handler = ngx_http_file_cache_wait_handler;
+        ev->log = ngx_cycle->log;
 
-    if (h->version != NGX_HTTP_CACHE_VERSION) {
-        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
-                      "cache file \"%s\" version mismatch", c->file.name.data);
-        return NGX_DECLINED;
+#if !(NGX_WIN32)
+        ngx_wakeup_event = ev;
+#endif
     }
 
-    if (h->crc32 != c->crc32 || (size_t) h->header_start != c->header_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has md5 collision", c->file.name.data);
-        return NGX_DECLINED;
-    }
+    ngx_queue_insert_tail(&ngx_http_file_cache_waiters, &c->wait_queue);
 
-    p = c->buf->pos + sizeof(ngx_http_file_cache_header_t)
-        + sizeof(ngx_http_file_cache_key);
+    ngx_add_timer(&c->wait_event, timer);
+}
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        if (ngx_memcmp(p, key[i].data, key[i].len) != 0) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                          "cache file \"%s\" has md5 collision",
-                          c->file.name.data);
-            return NGX_DECLINED;
-        }
 
-        p += key[i].len;
-    }
+static void
+ngx_http_file_cache_wait_notify(ngx_uint_t waiting)
+{
+    /* other processes are only woken up if the node has waiters */
 
-    if ((size_t) h->body_start > c->body_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has too long header",
-                      c->file.name.data);
-        return NGX_DECLINED;
+#if !(NGX_WIN32)
+    if (waiting) {
+        ngx_wakeup_processes(ngx_cycle->log);
     }
+#endif
 
-    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary length",
-                      c->file.name.data);
-        return NGX_DECLINED;
+    if (ngx_http_file_cache_waiters.next == NULL
+        || ngx_queue_empty(&ngx_http_file_cache_waiters))
+    {
+        return;
     }
 
-    if (h->vary_len) {
-        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
-
-        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache vary mismatch");
-            return ngx_http_file_cache_reopen(r, c);
-        }
-    }
+    ngx_post_event(&ngx_http_file_cache_wait_event, &ngx_posted_events);
+}
 
-    c->buf->last += n;
 
-    c->valid_sec = h->valid_sec;
-    c->updating_sec = h->updating_sec;
-    c->error_sec = h->error_sec;
-    c->last_modified = h->last_modified;
-    c->date = h->date;
-    c->valid_msec = h->valid_msec;
-    c->body_start = h->body_start;
-    c->etag.len = h->etag_len;
-    c->etag.data = h->etag;
+static void
+ngx_http_file_cache_wait_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                   wake;
+    ngx_queue_t                 *q;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_fill_t  *fill;
 
-    r->cached = 1;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http file cache wait check");
 
-    cache = c->file_cache;
+    /*
+     * the node is checked without the zone lock, the state
+     * is tested again by the woken up request
+     */
 
-    if (cache->sh->cold) {
+    for (q = ngx_queue_head(&ngx_http_file_cache_waiters);
+         q != ngx_queue_sentinel(&ngx_http_file_cache_waiters);
+         q = ngx_queue_next(q))
+    {
+        c = ngx_queue_data(q, ngx_http_cache_t, wait_queue);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        if (c->filling) {
+            fill = c->node->fill;
+            wake = (fill != c->fill || fill->length > c->fill_sent);
 
-        if (!c->node->exists) {
-            c->node->uses = 1;
-            c->node->body_start = c->body_start;
-            c->node->exists = 1;
-            c->node->uniq = c->uniq;
-            c->node->fs_size = c->fs_size;
+        } else {
+            wake = (!c->node->updating || (c->fill_wait && c->node->fill));
+        }
 
-            cache->sh->size += c->fs_size;
+        if (wake && !c->wait_event.posted) {
+            ngx_post_event(&c->wait_event, &ngx_posted_events);
         }
+    }
+}
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+static ngx_int_t
+ngx_http_file_cache_fill_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                      *name;
+    off_t                        total;
+    ngx_fd_t                     fd;
+    ngx_err_t                    err;
+    ngx_int_t                    rc;
+    ngx_file_uniq_t              uniq;
+    ngx_file_info_t              fi;
+    ngx_pool_cleanup_t          *cln;
+    ngx_pool_cleanup_file_t     *clnf;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_fill_t  *fill;
+
+    /*
+     * the response is being written to a temporary file by the lock
+     * holder: the file is opened and sent as it grows
+     */
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
     }
 
-    now = ngx_time();
+    cache = c->file_cache;
 
-    if (c->valid_sec < now) {
-        c->stale_updating = c->valid_sec + c->updating_sec >= now;
-        c->stale_error = c->valid_sec + c->error_sec >= now;
+    name = NULL;
+    total = 0;
+    uniq = 0;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        if (c->node->updating) {
-            rc = NGX_HTTP_CACHE_UPDATING;
+    fill = c->node->fill;
 
-        } else {
-            c->node->updating = 1;
-            c->updating = 1;
-            c->lock_time = c->node->lock_time;
-            rc = NGX_HTTP_CACHE_STALE;
-        }
-
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (fill) {
+        name = ngx_pnalloc(r->pool, fill->len + 1);
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache expired: %i %T %T",
-                       rc, c->valid_sec, now);
-
-        return rc;
+        if (name) {
+            ngx_memcpy(name, fill->name, fill->len + 1);
+            total = fill->total;
+            uniq = fill->uniq;
+        }
     }
 
-    return NGX_OK;
-}
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
+    if (fill == NULL) {
+        return NGX_DECLINED;
+    }
 
-static ssize_t
-ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
-{
-#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
-    ssize_t                    n;
-    ngx_http_core_loc_conf_t  *clcf;
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-#endif
+    fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-#if (NGX_HAVE_FILE_AIO)
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
 
-    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        /* the file may have been already renamed or deleted */
 
-        if (n != NGX_AGAIN) {
-            c->reading = 0;
-            return n;
+        if (err == NGX_ENOENT) {
+            return NGX_DECLINED;
         }
 
-        c->reading = 1;
-
-        c->file.aio->data = r;
-        c->file.aio->handler = ngx_http_cache_aio_event_handler;
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", name);
+        return NGX_ERROR;
+    }
 
-        ngx_add_timer(&c->file.aio->event, 60000);
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
 
-        r->main->blocked++;
-        r->aio = 1;
+    clnf->fd = fd;
+    clnf->name = name;
+    clnf->log = r->pool->log;
 
-        return NGX_AGAIN;
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name);
+        return NGX_ERROR;
     }
 
-#endif
+    if (ngx_file_uniq(&fi) != uniq) {
+        ngx_pool_run_cleanup_file(r->pool, fd);
+        return NGX_DECLINED;
+    }
 
-#if (NGX_THREADS)
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill: \"%s\" %O", name, total);
 
-    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
-        c->file.thread_task = c->thread_task;
-        c->file.thread_handler = ngx_http_cache_thread_handler;
-        c->file.thread_ctx = r;
+    c->file.fd = fd;
+    c->file.log = r->connection->log;
+    c->uniq = uniq;
+    c->length = total;
+    c->segment = 0;
+    c->offset = 0;
+    c->fill = fill;
+    c->filling = 1;
+    c->hot = 0;
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
 
-        c->thread_task = c->file.thread_task;
-        c->reading = (n == NGX_AGAIN);
+    rc = ngx_http_file_cache_read(r, c);
 
-        return n;
+    if (rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_ERROR) {
+        return rc;
     }
 
-#endif
+    ngx_pool_run_cleanup_file(r->pool, fd);
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
-}
+    c->file.fd = NGX_INVALID_FILE;
+    c->fill = NULL;
+    c->filling = 0;
+    c->fill_wait = 0;
 
+    return NGX_DECLINED;
+}
 
-#if (NGX_HAVE_FILE_AIO)
 
-static void
-ngx_http_cache_aio_event_handler(ngx_event_t *ev)
+static off_t
+ngx_http_file_cache_fill_length(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_event_aio_t     *aio;
-    ngx_connection_t    *c;
-    ngx_http_request_t  *r;
+    off_t                   length;
+    ngx_file_info_t         fi;
+    ngx_http_file_cache_t  *cache;
 
-    aio = ev->data;
-    r = aio->data;
-    c = r->connection;
+    cache = c->file_cache;
+    length = -1;
 
-    ngx_http_set_log_request(c->log, r);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http file cache aio: \"%V?%V\"", &r->uri, &r->args);
+    if (c->node->fill == c->fill && c->fill->uniq == c->uniq) {
+        length = c->fill->length;
 
-    if (ev->timedout) {
-        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                      "aio operation took too long");
-        ev->timedout = 0;
-        return;
-    }
+        /* the request waits for the file to grow once this is sent */
 
-    if (ev->timer_set) {
-        ngx_del_timer(ev);
+        c->node->waiting = 1;
     }
 
-    r->main->blocked--;
-    r->aio = 0;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    if (r->main->terminated) {
-        /*
-         * trigger connection event handler if the request was
-         * terminated
-         */
+    if (length != -1) {
+        return ngx_min(length, c->length);
+    }
 
-        c->write->handler(c->write);
+    /* the fill is over, the file is either complete or abandoned */
 
-    } else {
-        r->write_event_handler(r);
-        ngx_http_run_posted_requests(c);
+    if (ngx_fd_info(c->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", c->file.name.data);
+        return NGX_ERROR;
     }
-}
 
-#endif
+    if (ngx_file_size(&fi) < c->length) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache file \"%s\" was not completely written",
+                      c->file.name.data);
+        return NGX_ERROR;
+    }
 
+    return c->length;
+}
 
-#if (NGX_THREADS)
 
 static ngx_int_t
-ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+ngx_http_file_cache_fill_send(ngx_http_request_t *r)
 {
-    ngx_str_t                  name;
-    ngx_thread_pool_t         *tp;
-    ngx_http_request_t        *r;
+    off_t                      length;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_chain_t                out;
+    ngx_event_t               *wev;
+    ngx_http_cache_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
-    r = file->thread_ctx;
+    c = r->cache;
+    b = c->fill_buf;
+    wev = r->connection->write;
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-    tp = clcf->thread_pool;
+    if (ngx_buf_size(b) || r->buffered || r->connection->buffered) {
+        rc = ngx_http_output_filter(r, NULL);
 
-    if (tp == NULL) {
-        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
-            != NGX_OK)
-        {
+        if (rc == NGX_ERROR) {
             return NGX_ERROR;
         }
 
-        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+        if (rc == NGX_AGAIN || ngx_buf_size(b)
+            || r->buffered || r->connection->buffered)
+        {
+            goto blocked;
+        }
+    }
 
-        if (tp == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "thread pool \"%V\" not found", &name);
-            return NGX_ERROR;
+    length = ngx_http_file_cache_fill_length(r, c);
+
+    if (length == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (length > c->fill_sent || length == c->length) {
+
+        b->file_pos = c->fill_sent;
+        b->file_last = length;
+
+        b->in_file = (length > c->fill_sent) ? 1 : 0;
+        b->last_buf = (length == c->length) ? 1 : 0;
+        b->last_in_chain = 1;
+        b->flush = 1;
+
+        c->fill_sent = length;
+
+        out.buf = b;
+        out.next = NULL;
+
+        rc = ngx_http_output_filter(r, &out);
+
+        if (rc == NGX_ERROR || b->last_buf) {
+            return rc;
+        }
+
+        if (rc == NGX_AGAIN || ngx_buf_size(b)
+            || r->buffered || r->connection->buffered)
+        {
+            goto blocked;
         }
     }
 
-    task->event.data = r;
-    task->event.handler = ngx_http_cache_thread_event_handler;
+    /* the output is flushed, wait for the cache file to grow */
 
-    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+    if (wev->timer_set && !wev->delayed) {
+        ngx_del_timer(wev);
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    ngx_add_timer(&task->event, 60000);
+    c->waiting = 1;
 
-    r->main->blocked++;
-    r->aio = 1;
+    ngx_http_file_cache_wait(c, NGX_HTTP_CACHE_FILL_TIMEOUT);
 
-    return NGX_OK;
+    return NGX_DONE;
+
+blocked:
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!wev->delayed) {
+        ngx_add_timer(wev, clcf->send_timeout);
+    }
+
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_DONE;
 }
 
 
 static void
-ngx_http_cache_thread_event_handler(ngx_event_t *ev)
+ngx_http_file_cache_fill_handler(ngx_event_t *ev)
 {
+    ngx_int_t            rc;
     ngx_connection_t    *c;
     ngx_http_request_t  *r;
 
@@ -844,1508 +1283,5749 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
     ngx_http_set_log_request(c->log, r);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http file cache thread: \"%V?%V\"", &r->uri, &r->args);
-
-    if (ev->timedout) {
-        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                      "thread operation took too long");
-        ev->timedout = 0;
-        return;
-    }
+                   "http file cache fill: \"%V?%V\"", &r->uri, &r->args);
 
-    if (ev->timer_set) {
-        ngx_del_timer(ev);
-    }
+    ngx_queue_remove(&r->cache->wait_queue);
+    r->cache->waiting = 0;
 
-    r->main->blocked--;
-    r->aio = 0;
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "cache file \"%s\" is not updated",
+                      r->cache->file.name.data);
+        rc = NGX_ERROR;
 
-    if (r->main->terminated) {
-        /*
-         * trigger connection event handler if the request was
-         * terminated
-         */
+    } else {
+        if (ev->timer_set) {
+            ngx_del_timer(ev);
+        }
 
-        c->write->handler(c->write);
+        rc = ngx_http_file_cache_fill_send(r);
+    }
 
-    } else {
-        r->write_event_handler(r);
-        ngx_http_run_posted_requests(c);
+    if (rc != NGX_DONE) {
+        ngx_http_finalize_request(r, rc);
     }
-}
 
-#endif
+    ngx_http_run_posted_requests(c);
+}
 
 
-static ngx_int_t
-ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_fill_write_handler(ngx_http_request_t *r)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                  rc;
+    ngx_event_t               *wev;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    c = r->connection;
+    wev = c->write;
 
-    fcn = c->node;
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
 
-    if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
     }
 
-    if (fcn) {
-        ngx_queue_remove(&fcn->queue);
-
-        if (c->node == NULL) {
-            fcn->uses++;
-            fcn->count++;
+    if (r->cache->waiting) {
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
         }
 
-        if (fcn->error) {
-
-            if (fcn->valid_sec < ngx_time()) {
-                goto renew;
-            }
+        return;
+    }
 
-            rc = NGX_OK;
+    if (wev->delayed || r->aio) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-            goto done;
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
         }
 
-        if (fcn->exists || fcn->uses >= c->min_uses) {
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
 
-            c->exists = fcn->exists;
-            if (fcn->body_start && !c->update_variant) {
-                c->body_start = fcn->body_start;
-            }
+        return;
+    }
 
-            rc = NGX_OK;
+    rc = ngx_http_file_cache_fill_send(r);
 
-            goto done;
-        }
+    if (rc != NGX_DONE) {
+        ngx_http_finalize_request(r, rc);
+    }
+}
 
-        rc = NGX_AGAIN;
 
-        goto done;
+static void
+ngx_http_file_cache_fill_done(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
+{
+    if (c->fill == NULL || c->filling) {
+        return;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
-    if (fcn == NULL) {
-        ngx_http_file_cache_set_watermark(cache);
+    if (c->node->fill == c->fill) {
+        c->node->fill = NULL;
+    }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_slab_free_locked(cache->shpool, c->fill);
+    c->fill = NULL;
+}
 
-        (void) ngx_http_file_cache_forced_expire(cache);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+static void
+ngx_http_file_cache_sparse_init(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                    *p, *last, *dash;
+    off_t                      start, end;
+    ngx_http_core_loc_conf_t  *clcf;
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "could not allocate node%s", cache->shpool->log_ctx);
-            rc = NGX_ERROR;
-            goto failed;
-        }
+    /*
+     * only a single range with a known start is cached sparsely,
+     * "bytes=0-" is the whole response
+     */
+
+    if (r != r->main
+        || r->headers_in.range == NULL
+        || r->headers_in.if_range)
+    {
+        return;
     }
 
-    cache->sh->count++;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    if (clcf->max_ranges == 0) {
+        return;
+    }
 
-    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    p = r->headers_in.range->value.data;
+    last = p + r->headers_in.range->value.len;
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    if (last - p < 7 || ngx_strncasecmp(p, (u_char *) "bytes=", 6) != 0) {
+        return;
+    }
 
-    fcn->uses = 1;
-    fcn->count = 1;
+    p += 6;
 
-renew:
+    dash = ngx_strlchr(p, last, '-');
 
-    rc = NGX_DECLINED;
+    if (dash == NULL || dash == p) {
+        return;
+    }
 
-    fcn->valid_msec = 0;
-    fcn->error = 0;
-    fcn->exists = 0;
-    fcn->valid_sec = 0;
-    fcn->uniq = 0;
-    fcn->body_start = 0;
-    fcn->fs_size = 0;
+    start = ngx_atoof(p, dash - p);
 
-done:
+    if (start == NGX_ERROR) {
+        return;
+    }
 
-    fcn->expire = ngx_time() + cache->inactive;
+    if (dash + 1 == last) {
+        if (start == 0) {
+            return;
+        }
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        end = -1;
 
-    c->uniq = fcn->uniq;
-    c->error = fcn->error;
-    c->node = fcn;
+    } else {
+        end = ngx_atoof(dash + 1, last - dash - 1);
 
-failed:
+        if (end == NGX_ERROR || end < start) {
+            return;
+        }
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    c->sparse = 1;
+    c->range_start = start;
+    c->range_end = end;
 
-    return rc;
+    ngx_http_file_cache_sparse_new(c);
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+ngx_http_file_cache_sparse_test(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    u_char            *p;
-    ngx_http_cache_t  *c;
+    off_t                          length, end, bsize;
+    ngx_uint_t                     i, first, last, miss;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_sparse_t  *sparse;
 
-    c = r->cache;
+    cache = c->file_cache;
+    bsize = cache->sparse;
+
+    length = -1;
+    miss = 0;
+    first = 0;
+    last = 0;
+
+    if (c->valid_sec >= ngx_time()) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        sparse = c->node->sparse;
+
+        if (sparse && sparse->uniq == c->uniq) {
+            length = sparse->length;
+
+            end = (c->range_end == -1 || c->range_end >= length)
+                  ? length - 1 : c->range_end;
+
+            if (c->range_start <= end) {
+                for (i = (ngx_uint_t) (c->range_start / bsize);
+                     i <= (ngx_uint_t) (end / bsize);
+                     i++)
+                {
+                    if (sparse->bits[i / 8] & (1 << (i % 8))) {
+                        continue;
+                    }
+
+                    if (miss++ == 0) {
+                        first = i;
+                    }
+
+                    last = i;
+                }
+            }
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+    if (length != -1 && miss == 0) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache sparse hit: %O", length);
+
+        c->sparse_send = 1;
+        c->sparse_length = length;
+        c->length = c->body_start + length;
+
+        r->cached = 1;
 
-    if (c->file.name.len) {
         return NGX_OK;
     }
 
-    c->file.name.len = path->name.len + 1 + path->len
-                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    if (length == -1) {
+        ngx_http_file_cache_sparse_new(c);
 
-    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
-    if (c->file.name.data == NULL) {
-        return NGX_ERROR;
+    } else {
+        c->sparse_new = 0;
+        c->sparse_start = (off_t) first * bsize;
+        c->sparse_end = ngx_min((off_t) (last + 1) * bsize, length) - 1;
+        c->sparse_length = length;
     }
 
-    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache sparse miss: %O-%O n:%d m:%ui",
+                   c->sparse_start, c->sparse_end, c->sparse_new, miss);
 
-    p = c->file.name.data + path->name.len + 1 + path->len;
-    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
-    *p = '\0';
+    return ngx_http_file_cache_lock(r, c);
+}
 
-    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "cache file: \"%s\"", c->file.name.data);
+static void
+ngx_http_file_cache_sparse_new(ngx_http_cache_t *c)
+{
+    off_t  bsize;
 
-    return NGX_OK;
+    /* a new file is created starting with the requested blocks */
+
+    bsize = c->file_cache->sparse;
+
+    c->sparse_new = 1;
+    c->sparse_start = c->range_start / bsize * bsize;
+    c->sparse_end = (c->range_end == -1)
+                    ? -1 : (c->range_end / bsize + 1) * bsize - 1;
 }
 
 
-static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+static void
+ngx_http_file_cache_sparse_mark(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_file_uniq_t uniq)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
+    off_t                          bsize;
+    ngx_uint_t                     i, n, last;
+    ngx_http_file_cache_sparse_t  *sparse;
 
-    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+    bsize = cache->sparse;
+    n = (ngx_uint_t) ((c->sparse_length + bsize - 1) / bsize);
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    sparse = c->node->sparse;
 
-    while (node != sentinel) {
+    if (sparse && (sparse->uniq != uniq || sparse->length != c->sparse_length))
+    {
+        ngx_http_file_cache_sparse_delete(cache, c->node);
+        sparse = NULL;
+    }
 
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
+    if (sparse == NULL) {
+        sparse = ngx_slab_calloc_locked(cache->shpool,
+                                        sizeof(ngx_http_file_cache_sparse_t)
+                                        + n / 8);
+        if (sparse == NULL) {
+            return;
         }
 
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
-        }
+        sparse->uniq = uniq;
+        sparse->length = c->sparse_length;
 
-        /* node_key == node->key */
+        c->node->sparse = sparse;
+    }
 
-        fcn = (ngx_http_file_cache_node_t *) node;
+    /* only the blocks received completely are marked */
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    if (c->sparse_end + 1 == c->sparse_length) {
+        last = n;
 
-        if (rc == 0) {
-            return fcn;
-        }
+    } else {
+        last = (ngx_uint_t) ((c->sparse_end + 1) / bsize);
+    }
 
-        node = (rc < 0) ? node->left : node->right;
+    for (i = (ngx_uint_t) (c->sparse_start / bsize); i < last; i++) {
+        sparse->bits[i / 8] |= 1 << (i % 8);
     }
+}
 
-    /* not found */
 
-    return NULL;
+static void
+ngx_http_file_cache_sparse_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    if (fcn->sparse) {
+        ngx_slab_free_locked(cache->shpool, fcn->sparse);
+        fcn->sparse = NULL;
+    }
 }
 
 
-static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+ngx_int_t
+ngx_http_file_cache_purge(ngx_http_request_t *r)
 {
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
+    u_char                      *p, *last, *start;
+    ngx_int_t                    rc;
+    ngx_str_t                    key, from, name, *k;
+    ngx_uint_t                   i, n, prefix;
+    ngx_list_part_t             *part;
+    ngx_table_elt_t             *h, *tags;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
 
-    for ( ;; ) {
+    c = r->cache;
+    cache = c->file_cache;
 
-        if (node->key < temp->key) {
+    /*
+     * entries are only marked here, files are deleted by the cache manager;
+     * many entries are marked in batches, and the lock is released between
+     * them to let other processes use the cache
+     */
 
-            p = &temp->left;
+    if (cache->sh->cold) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "cache \"%V\" is being loaded, entries not loaded "
+                      "yet are not purged", &cache->shm_zone->shm.name);
+    }
 
-        } else if (node->key > temp->key) {
+    tags = NULL;
 
-            p = &temp->right;
+    if (cache->tags.len) {
+        part = &r->headers_in.headers.part;
+        h = part->elts;
 
-        } else { /* node->key == temp->key */
+        for (i = 0; /* void */; i++) {
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
+                part = part->next;
+                h = part->elts;
+                i = 0;
+            }
+
+            if (h[i].key.len == cache->tags.len
+                && ngx_strncasecmp(h[i].key.data, cache->tags.data,
+                                   cache->tags.len)
+                   == 0)
+            {
+                tags = &h[i];
+                break;
+            }
         }
+    }
 
-        if (*p == sentinel) {
-            break;
+    if (tags) {
+        n = 0;
+
+        p = tags->value.data;
+        last = p + tags->value.len;
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+            start = p;
+
+            while (p < last && *p != ' ' && *p != ',') { p++; }
+
+            if (p == start) {
+                break;
+            }
+
+            name.len = p - start;
+            name.data = start;
+
+            while (ngx_http_file_cache_purge_tag(cache, &name, &n)
+                   == NGX_AGAIN)
+            {
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+                ngx_sched_yield();
+                ngx_shmtx_lock(&cache->shpool->mutex);
+            }
         }
 
-        temp = *p;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "purged %ui cache entries with tags \"%V\"",
+                      n, &tags->value);
+
+        return n ? NGX_OK : NGX_DECLINED;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
-}
+    key.len = 0;
 
+    k = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        key.len += k[i].len;
+    }
 
-static void
-ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
-    u_char *hash)
-{
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+    key.data = ngx_pnalloc(r->pool, key.len);
+    if (key.data == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache vary: \"%*s\"", len, vary);
+    p = key.data;
 
-    ngx_md5_init(&md5);
-    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_cpymem(p, k[i].data, k[i].len);
+    }
 
-    ngx_strlow(buf, vary, len);
+    prefix = (key.len && key.data[key.len - 1] == '*') ? 1 : 0;
 
-    p = buf;
-    last = buf + len;
+    if (prefix && !cache->purge) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "purge of \"%V\" requires the \"purge\" parameter "
+                      "of cache \"%V\"", &key, &cache->shm_zone->shm.name);
+        return NGX_HTTP_BAD_REQUEST;
+    }
 
-    while (p < last) {
+    n = 0;
+    rc = NGX_OK;
 
-        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        name.data = p;
+    if (prefix) {
+        key.len--;
 
-        while (p < last && *p != ',' && *p != ' ') { p++; }
+    } else {
+        fcn = ngx_http_file_cache_lookup(cache, c->key);
 
-        name.len = p - name.data;
+        if (fcn) {
+            n += ngx_http_file_cache_purge_node(cache, fcn);
+        }
+    }
 
-        if (name.len == 0) {
+    from = key;
+
+    /* variants are stored with the same key */
+
+    while (cache->purge) {
+        rc = ngx_http_file_cache_purge_key(cache, &key, prefix, &from,
+                                           r->pool, &n);
+        if (rc != NGX_AGAIN) {
             break;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache vary: %V", &name);
-
-        ngx_md5_update(&md5, name.data, name.len);
-        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_sched_yield();
+        ngx_shmtx_lock(&cache->shpool->mutex);
+    }
 
-        ngx_http_file_cache_vary_header(r, &md5, &name);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
     }
 
-    ngx_md5_final(hash, &md5);
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "purged %ui cache entries with key \"%V%s\"",
+                  n, &key, prefix ? "*" : "");
+
+    return n ? NGX_OK : NGX_DECLINED;
 }
 
 
 static void
-ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
-    ngx_str_t *name)
+ngx_http_file_cache_purge_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
 {
-    size_t            len;
-    u_char           *p, *start, *last;
-    ngx_uint_t        i, multiple, normalize;
-    ngx_list_part_t  *part;
-    ngx_table_elt_t  *header;
+    ngx_str_node_t      *n, *t;
+    ngx_rbtree_node_t  **p;
 
-    multiple = 0;
-    normalize = 0;
+    /* keys are kept in lexicographical order to look up prefixes */
 
-    if (name->len == sizeof("Accept-Charset") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
-                           sizeof("Accept-Charset") - 1) == 0)
-    {
-        normalize = 1;
+    n = (ngx_str_node_t *) node;
 
-    } else if (name->len == sizeof("Accept-Encoding") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
-                           sizeof("Accept-Encoding") - 1) == 0)
-    {
-        normalize = 1;
+    for ( ;; ) {
 
-    } else if (name->len == sizeof("Accept-Language") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
-                           sizeof("Accept-Language") - 1) == 0)
-    {
-        normalize = 1;
+        t = (ngx_str_node_t *) temp;
+
+        p = (ngx_memn2cmp(n->str.data, t->str.data, n->str.len, t->str.len)
+             < 0)
+            ? &temp->left : &temp->right;
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
     }
 
-    part = &r->headers_in.headers.part;
-    header = part->elts;
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
 
-    for (i = 0; /* void */ ; i++) {
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
-            }
+static ngx_http_file_cache_purge_t *
+ngx_http_file_cache_purge_add(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_http_file_cache_node_t *fcn)
+{
+    u_char                       *p;
+    size_t                        len;
+    ngx_str_t                    *key;
+    ngx_uint_t                    i;
+    ngx_http_file_cache_purge_t  *purge;
 
-            part = part->next;
-            header = part->elts;
-            i = 0;
-        }
+    if (fcn->purge) {
+        return fcn->purge;
+    }
 
-        if (header[i].hash == 0) {
-            continue;
-        }
+    len = 0;
 
-        if (header[i].key.len != name->len) {
-            continue;
-        }
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        len += key[i].len;
+    }
 
-        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
-            continue;
-        }
+    purge = ngx_slab_alloc_locked(cache->shpool,
+                                  offsetof(ngx_http_file_cache_purge_t, data)
+                                  + len);
+    if (purge == NULL) {
+        return NULL;
+    }
 
-        if (!normalize) {
+    p = purge->data;
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_cpymem(p, key[i].data, key[i].len);
+    }
 
-            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+    purge->sn.node.key = 0;
+    purge->sn.str.len = len;
+    purge->sn.str.data = purge->data;
+    purge->fcn = fcn;
+    purge->links = NULL;
 
-            multiple = 1;
+    ngx_rbtree_insert(&cache->sh->keys, &purge->sn.node);
 
-            continue;
-        }
+    fcn->purge = purge;
 
-        /* normalize spaces */
+    return purge;
+}
 
-        p = header[i].value.data;
-        last = p + header[i].value.len;
 
-        while (p < last) {
+static void
+ngx_http_file_cache_purge_tags(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_http_file_cache_purge_t *purge)
+{
+    u_char                      *p, *last, *start;
+    uint32_t                     hash;
+    ngx_str_t                    name;
+    ngx_http_file_cache_tag_t   *tag;
+    ngx_http_file_cache_link_t  *link;
 
-            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+    ngx_http_file_cache_purge_unlink(cache, purge);
 
-            start = p;
+    p = c->tags.data;
+    last = p + c->tags.len;
 
-            while (p < last && *p != ',' && *p != ' ') { p++; }
+    while (p < last) {
 
-            len = p - start;
+        /* tags are separated by spaces or commas */
 
-            if (len == 0) {
-                break;
-            }
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+        start = p;
+
+        while (p < last && *p != ' ' && *p != ',') { p++; }
+
+        if (p == start) {
+            break;
+        }
+
+        name.len = p - start;
+        name.data = start;
+
+        hash = ngx_crc32_short(name.data, name.len);
+
+        tag = (ngx_http_file_cache_tag_t *)
+                  ngx_str_rbtree_lookup(&cache->sh->tags, &name, hash);
+
+        if (tag == NULL) {
+            tag = ngx_slab_alloc_locked(cache->shpool,
+                                        offsetof(ngx_http_file_cache_tag_t,
+                                                 data)
+                                        + name.len);
+            if (tag == NULL) {
+                return;
             }
 
-            ngx_md5_update(md5, start, len);
+            ngx_memcpy(tag->data, name.data, name.len);
 
-            multiple = 1;
+            tag->sn.node.key = hash;
+            tag->sn.str.len = name.len;
+            tag->sn.str.data = tag->data;
+
+            ngx_queue_init(&tag->links);
+
+            ngx_rbtree_insert(&cache->sh->tags, &tag->sn.node);
         }
-    }
-}
 
+        link = ngx_slab_alloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_link_t));
+        if (link == NULL) {
 
-static ngx_int_t
-ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
-{
-    ngx_http_file_cache_t  *cache;
+            if (ngx_queue_empty(&tag->links)) {
+                ngx_rbtree_delete(&cache->sh->tags, &tag->sn.node);
+                ngx_slab_free_locked(cache->shpool, tag);
+            }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache reopen");
+            return;
+        }
 
-    if (c->secondary) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary hash",
-                      c->file.name.data);
-        return NGX_DECLINED;
-    }
+        link->tag = tag;
+        link->purge = purge;
+        link->next = purge->links;
+        purge->links = link;
 
-    cache = c->file_cache;
+        ngx_queue_insert_tail(&tag->links, &link->queue);
+    }
+}
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    c->node->count--;
-    c->node = NULL;
+static void
+ngx_http_file_cache_purge_unlink(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_purge_t *purge)
+{
+    ngx_http_file_cache_tag_t   *tag;
+    ngx_http_file_cache_link_t  *link, *next;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    for (link = purge->links; link; link = next) {
+        next = link->next;
+        tag = link->tag;
 
-    c->secondary = 1;
-    c->file.name.len = 0;
-    c->body_start = c->buffer_size;
+        ngx_queue_remove(&link->queue);
+        ngx_slab_free_locked(cache->shpool, link);
 
-    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+        if (ngx_queue_empty(&tag->links)) {
+            ngx_rbtree_delete(&cache->sh->tags, &tag->sn.node);
+            ngx_slab_free_locked(cache->shpool, tag);
+        }
+    }
 
-    return ngx_http_file_cache_open(r);
+    purge->links = NULL;
 }
 
 
-ngx_int_t
-ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+static void
+ngx_http_file_cache_purge_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+    if (fcn->purge) {
+        ngx_http_file_cache_purge_unlink(cache, fcn->purge);
+        ngx_rbtree_delete(&cache->sh->keys, &fcn->purge->sn.node);
+        ngx_slab_free_locked(cache->shpool, fcn->purge);
+        fcn->purge = NULL;
+    }
+}
 
-    u_char            *p;
-    ngx_str_t         *key;
-    ngx_uint_t         i;
-    ngx_http_cache_t  *c;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache set header");
+static ngx_int_t
+ngx_http_file_cache_purge_key(ngx_http_file_cache_t *cache, ngx_str_t *key,
+    ngx_uint_t prefix, ngx_str_t *from, ngx_pool_t *pool, ngx_uint_t *n)
+{
+    u_char             *p;
+    ngx_str_t          *prev;
+    ngx_uint_t          i;
+    ngx_str_node_t     *sn;
+    ngx_rbtree_node_t  *node, *sentinel, *first;
 
-    c = r->cache;
+    /* the first key not less than the one to start from */
 
-    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+    node = cache->sh->keys.root;
+    sentinel = cache->sh->keys.sentinel;
+    first = NULL;
 
-    h->version = NGX_HTTP_CACHE_VERSION;
-    h->valid_sec = c->valid_sec;
-    h->updating_sec = c->updating_sec;
-    h->error_sec = c->error_sec;
-    h->last_modified = c->last_modified;
-    h->date = c->date;
-    h->crc32 = c->crc32;
-    h->valid_msec = (u_short) c->valid_msec;
-    h->header_start = (u_short) c->header_start;
-    h->body_start = (u_short) c->body_start;
+    while (node != sentinel) {
+        sn = (ngx_str_node_t *) node;
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h->etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+        if (ngx_memn2cmp(sn->str.data, from->data, sn->str.len, from->len)
+            < 0)
+        {
+            node = node->right;
+            continue;
+        }
+
+        first = node;
+        node = node->left;
     }
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+    prev = NULL;
+
+    for (node = first, i = 0;
+         node;
+         node = ngx_rbtree_next(&cache->sh->keys, node), i++)
+    {
+        sn = (ngx_str_node_t *) node;
+
+        if (sn->str.len < key->len
+            || (!prefix && sn->str.len != key->len)
+            || ngx_memcmp(sn->str.data, key->data, key->len) != 0)
+        {
+            break;
         }
 
-        h->vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+        /*
+         * a batch ends before a new key, variants of the same key
+         * are adjacent and are marked together
+         */
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
-    }
+        if (i >= NGX_HTTP_CACHE_PURGE_BATCH
+            && (sn->str.len != prev->len
+                || ngx_memcmp(sn->str.data, prev->data, prev->len) != 0))
+        {
+            p = ngx_pnalloc(pool, sn->str.len);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
 
-    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
-        return NGX_ERROR;
-    }
+            ngx_memcpy(p, sn->str.data, sn->str.len);
 
-    p = buf + sizeof(ngx_http_file_cache_header_t);
+            from->len = sn->str.len;
+            from->data = p;
 
-    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+            return NGX_AGAIN;
+        }
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        p = ngx_copy(p, key[i].data, key[i].len);
-    }
+        *n += ngx_http_file_cache_purge_node(cache,
+                                  ((ngx_http_file_cache_purge_t *) sn)->fcn);
 
-    *p = LF;
+        prev = &sn->str;
+    }
 
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+ngx_http_file_cache_purge_tag(ngx_http_file_cache_t *cache, ngx_str_t *name,
+    ngx_uint_t *n)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                   i;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_tag_t   *tag;
+    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_link_t  *link, **lp;
 
-    if (!c->secondary) {
-        return NGX_OK;
-    }
+    tag = (ngx_http_file_cache_tag_t *)
+              ngx_str_rbtree_lookup(&cache->sh->tags, name,
+                                    ngx_crc32_short(name->data, name->len));
 
-    if (c->vary.len
-        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
-    {
+    if (tag == NULL) {
         return NGX_OK;
     }
 
     /*
-     * if the variant hash doesn't match one we used as a secondary
-     * cache key, switch back to the original key
+     * entries are unlinked from the tag as they are marked,
+     * so the next batch starts from the head of the tag links
      */
 
-    cache = c->file_cache;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache main key");
+    for (i = 0; i < NGX_HTTP_CACHE_PURGE_BATCH; i++) {
+        q = ngx_queue_head(&tag->links);
+        link = ngx_queue_data(q, ngx_http_file_cache_link_t, queue);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_queue_remove(q);
 
-    c->node->count--;
-    c->node->updating = 0;
-    c->node = NULL;
+        for (lp = &link->purge->links; *lp != link; lp = &(*lp)->next) {
+            /* void */
+        }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        *lp = link->next;
 
-    c->file.name.len = 0;
-    c->update_variant = 1;
+        fcn = link->purge->fcn;
 
-    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+        ngx_slab_free_locked(cache->shpool, link);
 
-    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
-        return NGX_ERROR;
-    }
+        *n += ngx_http_file_cache_purge_node(cache, fcn);
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
-        return NGX_ERROR;
+        if (ngx_queue_empty(&tag->links)) {
+            ngx_rbtree_delete(&cache->sh->tags, &tag->sn.node);
+            ngx_slab_free_locked(cache->shpool, tag);
+            return NGX_OK;
+        }
     }
 
-    return NGX_OK;
+    return NGX_AGAIN;
 }
 
 
-void
-ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+static ngx_uint_t
+ngx_http_file_cache_purge_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    if (fcn->error) {
 
-    c = r->cache;
+        /* a cached error has no file */
 
-    if (c->updated) {
-        return;
+        fcn->error = 0;
+        fcn->valid_sec = 0;
+        fcn->valid_msec = 0;
+
+        return 1;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update");
+    if (!fcn->exists || fcn->purged || fcn->deleting) {
+        return 0;
+    }
 
-    cache = c->file_cache;
+    fcn->purged = 1;
 
-    c->updated = 1;
-    c->updating = 0;
+    if (fcn->hot) {
+        ngx_http_file_cache_hot_delete(cache, fcn->hot);
+    }
 
-    uniq = 0;
+    ngx_http_file_cache_sparse_delete(cache, fcn);
+
+    if (fcn->count == 0) {
+        ngx_http_file_cache_purge_expire(cache, fcn);
+    }
+
+    return 1;
+}
+
+
+static void
+ngx_http_file_cache_purge_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    /* the entry is moved to be expired by the cache manager first */
+
+    if (fcn->protected) {
+        fcn->protected = 0;
+        cache->sh->protected_count--;
+    }
+
+    ngx_queue_remove(&fcn->queue);
+    ngx_queue_insert_tail(&cache->sh->queue, &fcn->queue);
+
+    fcn->expire = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                        *p;
+    time_t                         now;
+    ssize_t                        n;
+    ngx_str_t                     *key;
+    ngx_int_t                      rc;
+    ngx_uint_t                     i;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_header_t  *h;
+
+    if (c->hot) {
+        n = (ssize_t) c->length;
+
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+            return n;
+        }
+    }
+
+    if ((size_t) n < c->header_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" is too small", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    h = (ngx_http_file_cache_header_t *) c->buf->pos;
+
+    if (h->version != NGX_HTTP_CACHE_VERSION
+        && !(c->sparse
+             && h->version == (NGX_HTTP_CACHE_VERSION|NGX_HTTP_CACHE_SPARSE)))
+    {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache file \"%s\" version mismatch", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->crc32 != c->crc32 || (size_t) h->header_start != c->header_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has md5 collision", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    p = c->buf->pos + sizeof(ngx_http_file_cache_header_t)
+        + sizeof(ngx_http_file_cache_key);
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        if (ngx_memcmp(p, key[i].data, key[i].len) != 0) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                          "cache file \"%s\" has md5 collision",
+                          c->file.name.data);
+            return NGX_DECLINED;
+        }
+
+        p += key[i].len;
+    }
+
+    if ((size_t) h->body_start > c->body_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has too long header",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary length",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->vary_len) {
+        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
+
+        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache vary mismatch");
+            return ngx_http_file_cache_reopen(r, c);
+        }
+    }
+
+    c->buf->last += n;
+
+    c->valid_sec = h->valid_sec;
+    c->updating_sec = h->updating_sec;
+    c->error_sec = h->error_sec;
+    c->last_modified = h->last_modified;
+    c->date = h->date;
+    c->valid_msec = h->valid_msec;
+    c->body_start = h->body_start;
+    c->etag.len = h->etag_len;
+    c->etag.data = h->etag;
+
+    if (h->version != NGX_HTTP_CACHE_VERSION) {
+        return ngx_http_file_cache_sparse_test(r, c);
+    }
+
+    r->cached = 1;
+
+    cache = c->file_cache;
+
+    if (c->filling) {
+        return NGX_OK;
+    }
+
+    if (cache->sh->cold) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (!c->node->exists) {
+            c->node->uses = 1;
+            c->node->body_start = c->body_start;
+            c->node->exists = 1;
+            c->node->uniq = c->uniq;
+            c->node->fs_size = c->fs_size;
+
+            cache->sh->size += c->fs_size;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+    now = ngx_time();
+
+    if (c->valid_sec < now) {
+        c->stale_updating = c->valid_sec + c->updating_sec >= now;
+        c->stale_error = c->valid_sec + c->error_sec >= now;
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (c->node->updating) {
+            rc = NGX_HTTP_CACHE_UPDATING;
+
+        } else {
+            c->node->updating = 1;
+            c->updating = 1;
+            c->lock_time = c->node->lock_time;
+            rc = NGX_HTTP_CACHE_STALE;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache expired: %i %T %T",
+                       rc, c->valid_sec, now);
+
+        return rc;
+    }
+
+    if (cache->hot_size
+        && !c->hot
+        && (off_t) n == c->length
+        && c->length <= (off_t) cache->hot_max_object)
+    {
+        ngx_http_file_cache_hot_add(c, (size_t) n);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_hot_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t      *cache;
+    ngx_http_file_cache_hot_t  *hot;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    hot = c->node->hot;
+
+    if (hot == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, hot->len);
+    if (c->buf == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->buf->pos, hot->data, hot->len);
+
+    ngx_queue_remove(&hot->queue);
+    ngx_queue_insert_head(&cache->sh->hot_queue, &hot->queue);
+
+    c->length = hot->len;
+    c->uniq = c->node->uniq;
+    c->fs_size = c->node->fs_size;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory: %O", c->length);
+
+    c->hot = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_hot_add(ngx_http_cache_t *c, size_t len)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_hot_t   *hot;
+    ngx_http_file_cache_node_t  *fcn;
+
+    cache = c->file_cache;
+
+    if (len > cache->hot_size) {
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+
+    /* the file might have been replaced while it was read */
+
+    if (fcn->hot
+        || !fcn->exists
+        || (fcn->uniq && fcn->uniq != c->uniq)
+        || (fcn->segment
+            && (fcn->segment->id != c->segment || fcn->offset != c->offset))
+        || fcn->uses < cache->hot_min_uses)
+    {
+        goto done;
+    }
+
+    while (cache->sh->hot_size + len > cache->hot_size) {
+        q = ngx_queue_last(&cache->sh->hot_queue);
+        hot = ngx_queue_data(q, ngx_http_file_cache_hot_t, queue);
+
+        ngx_http_file_cache_hot_delete(cache, hot);
+    }
+
+    hot = ngx_slab_alloc_locked(cache->shpool,
+                                offsetof(ngx_http_file_cache_hot_t, data)
+                                + len);
+    if (hot == NULL) {
+        goto done;
+    }
+
+    ngx_memcpy(hot->data, c->buf->pos, len);
+
+    hot->node = fcn;
+    hot->len = len;
+
+    ngx_queue_insert_head(&cache->sh->hot_queue, &hot->queue);
+    cache->sh->hot_size += len;
+
+    fcn->hot = hot;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache memory add: %uz", len);
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static void
+ngx_http_file_cache_hot_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_hot_t *hot)
+{
+    ngx_queue_remove(&hot->queue);
+
+    cache->sh->hot_size -= hot->len;
+    hot->node->hot = NULL;
+
+    ngx_slab_free_locked(cache->shpool, hot);
+}
+
+
+static ssize_t
+ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    size_t                     size;
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
+    ssize_t                    n;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+#endif
+
+    size = c->buf->end - c->buf->pos;
+
+    /* a segment holds other objects after this one */
+
+    if (c->segment && (off_t) size > c->length) {
+        size = (size_t) c->length;
+    }
+
+#if (NGX_HAVE_FILE_AIO)
+
+    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
+        n = ngx_file_aio_read(&c->file, c->buf->pos, size, c->offset,
+                              r->pool);
+
+        if (n != NGX_AGAIN) {
+            c->reading = 0;
+            return n;
+        }
+
+        c->reading = 1;
+
+        c->file.aio->data = r;
+        c->file.aio->handler = ngx_http_cache_aio_event_handler;
+
+        ngx_add_timer(&c->file.aio->event, 60000);
+
+        r->main->blocked++;
+        r->aio = 1;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
+#if (NGX_THREADS)
+
+    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+        c->file.thread_task = c->thread_task;
+        c->file.thread_handler = ngx_http_cache_thread_handler;
+        c->file.thread_ctx = r;
+
+        n = ngx_thread_read(&c->file, c->buf->pos, size, c->offset,
+                            r->pool);
+
+        c->thread_task = c->file.thread_task;
+        c->reading = (n == NGX_AGAIN);
+
+        return n;
+    }
+
+#endif
+
+    return ngx_read_file(&c->file, c->buf->pos, size, c->offset);
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+static void
+ngx_http_cache_aio_event_handler(ngx_event_t *ev)
+{
+    ngx_event_aio_t     *aio;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    aio = ev->data;
+    r = aio->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache aio: \"%V?%V\"", &r->uri, &r->args);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "aio operation took too long");
+        ev->timedout = 0;
+        return;
+    }
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    if (r->main->terminated) {
+        /*
+         * trigger connection event handler if the request was
+         * terminated
+         */
+
+        c->write->handler(c->write);
+
+    } else {
+        r->write_event_handler(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+#endif
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+{
+    return ngx_http_cache_thread_post(file->thread_ctx, task);
+}
+
+
+static ngx_int_t
+ngx_http_cache_open_thread_handler(ngx_thread_task_t *task,
+    ngx_open_file_info_t *of)
+{
+    return ngx_http_cache_thread_post(of->thread_ctx, task);
+}
+
+
+static ngx_int_t
+ngx_http_cache_thread_post(ngx_http_request_t *r, ngx_thread_task_t *task)
+{
+    ngx_str_t                  name;
+    ngx_thread_pool_t         *tp;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
+
+    task->event.data = r;
+    task->event.handler = ngx_http_cache_thread_event_handler;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_add_timer(&task->event, 60000);
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_cache_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache thread: \"%V?%V\"", &r->uri, &r->args);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "thread operation took too long");
+        ev->timedout = 0;
+        return;
+    }
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    if (r->main->terminated) {
+        /*
+         * trigger connection event handler if the request was
+         * terminated
+         */
+
+        c->write->handler(c->write);
+
+    } else {
+        r->write_event_handler(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   hit;
+    ngx_http_file_cache_node_t  *fcn;
+
+    hit = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+
+    if (fcn == NULL) {
+        fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (cache->sh->sketch) {
+            ngx_http_file_cache_sketch_add(cache, c->key);
+        }
+    }
+
+    if (fcn) {
+        ngx_queue_remove(&fcn->queue);
+
+        if (c->node == NULL) {
+            fcn->uses++;
+            fcn->count++;
+        }
+
+        if (fcn->error) {
+
+            if (fcn->valid_sec < ngx_time()) {
+                goto renew;
+            }
+
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        if (fcn->purged) {
+
+            /* the file is deleted by the cache manager unless replaced */
+
+            c->exists = 0;
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        if (fcn->exists || fcn->uses >= c->min_uses) {
+
+            if (cache->purge && fcn->exists && fcn->purge == NULL) {
+                (void) ngx_http_file_cache_purge_add(cache, c, fcn);
+            }
+
+            hit = fcn->exists;
+
+            c->exists = fcn->exists;
+            if (fcn->body_start && !c->update_variant) {
+                c->body_start = fcn->body_start;
+            }
+
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        rc = NGX_AGAIN;
+
+        goto done;
+    }
+
+    fcn = ngx_slab_calloc_locked(cache->shpool,
+                                 sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(cache);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        (void) ngx_http_file_cache_forced_expire(cache);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate node%s", cache->shpool->log_ctx);
+            rc = NGX_ERROR;
+            goto failed;
+        }
+    }
+
+    cache->sh->count++;
+
+    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+    fcn->uses = 1;
+    fcn->count = 1;
+
+renew:
+
+    rc = NGX_DECLINED;
+
+    if (fcn->hot) {
+        ngx_http_file_cache_hot_delete(cache, fcn->hot);
+    }
+
+    ngx_http_file_cache_sparse_delete(cache, fcn);
+    ngx_http_file_cache_purge_delete(cache, fcn);
+
+    if (fcn->segment) {
+        cache->sh->size -= fcn->fs_size;
+        ngx_http_file_cache_segment_release(cache, fcn);
+    }
+
+    fcn->valid_msec = 0;
+    fcn->error = 0;
+    fcn->exists = 0;
+    fcn->indexed = 0;
+    fcn->valid_sec = 0;
+    fcn->uniq = 0;
+    fcn->body_start = 0;
+    fcn->fs_size = 0;
+
+done:
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_http_file_cache_enqueue(cache, fcn, hit);
+
+    c->uniq = fcn->uniq;
+    c->error = fcn->error;
+    c->node = fcn;
+
+    if (fcn->segment) {
+        c->segment = fcn->segment->id;
+        c->offset = fcn->offset;
+        c->length = fcn->length;
+        c->fs_size = fcn->fs_size;
+
+    } else {
+        c->segment = 0;
+        c->offset = 0;
+    }
+
+failed:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+
+static void
+ngx_http_file_cache_enqueue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t hit)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *last;
+
+    if (cache->policy == NGX_HTTP_CACHE_LRU || !(hit || fcn->protected)) {
+
+        if (fcn->protected) {
+            fcn->protected = 0;
+            cache->sh->protected_count--;
+        }
+
+        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        return;
+    }
+
+    /*
+     * segmented LRU: entries hit while in the probation segment
+     * are promoted to the protected segment, which is limited
+     * to 80% of entries; the least recently used protected entries
+     * are moved back to probation
+     */
+
+    if (!fcn->protected) {
+        fcn->protected = 1;
+        cache->sh->protected_count++;
+    }
+
+    ngx_queue_insert_head(&cache->sh->protected, &fcn->queue);
+
+    while (cache->sh->protected_count
+           > cache->sh->count - cache->sh->count / 5)
+    {
+        q = ngx_queue_last(&cache->sh->protected);
+        ngx_queue_remove(q);
+
+        last = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        last->protected = 0;
+        cache->sh->protected_count--;
+
+        ngx_queue_insert_head(&cache->sh->queue, q);
+    }
+}
+
+
+static ngx_queue_t *
+ngx_http_file_cache_last(ngx_http_file_cache_t *cache)
+{
+    /* eviction candidates are taken from probation first */
+
+    if (!ngx_queue_empty(&cache->sh->queue)) {
+        return ngx_queue_last(&cache->sh->queue);
+    }
+
+    if (!ngx_queue_empty(&cache->sh->protected)) {
+        return ngx_queue_last(&cache->sh->protected);
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   freq;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
+
+    rc = NGX_OK;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    /*
+     * new entries are admitted unconditionally unless the cache is
+     * close to its limits, since the cache manager keeps it just below
+     */
+
+    if (cache->sh->size < cache->max_size - cache->max_size / 8
+        && cache->sh->count < cache->sh->watermark)
+    {
+        goto done;
+    }
+
+    q = ngx_http_file_cache_last(cache);
+
+    if (q == NULL) {
+        goto done;
+    }
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn == c->node) {
+        goto done;
+    }
+
+    ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    freq = ngx_http_file_cache_sketch_estimate(cache, c->key);
+
+    if (freq <= ngx_http_file_cache_sketch_estimate(cache, key)) {
+        cache->sh->rejected++;
+        rc = NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache admit: %ui %i", freq, rc);
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+
+static void
+ngx_http_file_cache_sketch_add(ngx_http_file_cache_t *cache, u_char *key)
+{
+    u_char      *p, *last;
+    uint32_t     hash;
+    ngx_uint_t   i, width;
+
+    width = cache->sh->sketch_width;
+    p = cache->sh->sketch;
+
+    /* the md5 key provides independent hashes for each row */
+
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_DEPTH; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
+
+        if (p[hash & (width - 1)] < 15) {
+            p[hash & (width - 1)]++;
+        }
+
+        p += width;
+    }
+
+    if (++cache->sh->sketch_additions < 10 * width) {
+        return;
+    }
+
+    /* aging */
+
+    p = cache->sh->sketch;
+    last = p + NGX_HTTP_CACHE_SKETCH_DEPTH * width;
+
+    while (p < last) {
+        *p++ >>= 1;
+    }
+
+    cache->sh->sketch_additions /= 2;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_sketch_estimate(ngx_http_file_cache_t *cache,
+    u_char *key)
+{
+    u_char      *p;
+    uint32_t     hash;
+    ngx_uint_t   i, width, freq;
+
+    width = cache->sh->sketch_width;
+    p = cache->sh->sketch;
+    freq = 15;
+
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_DEPTH; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
+
+        if (p[hash & (width - 1)] < freq) {
+            freq = p[hash & (width - 1)];
+        }
+
+        p += width;
+    }
+
+    return freq;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+{
+    u_char            *p;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (c->file.name.len) {
+        return NGX_OK;
+    }
+
+    c->file.name.len = path->name.len + 1 + path->len
+                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
+    if (c->file.name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
+
+    p = c->file.name.data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cache file: \"%s\"", c->file.name.data);
+
+    return NGX_OK;
+}
+
+
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_strlow(buf, vary, len);
+
+    p = buf;
+    last = buf + len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') { p++; }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache vary: %V", &name);
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    }
+
+    ngx_md5_final(hash, &md5);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    normalize = 0;
+
+    if (name->len == sizeof("Accept-Charset") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
+                           sizeof("Accept-Charset") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Encoding") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
+                           sizeof("Accept-Encoding") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Language") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
+                           sizeof("Accept-Language") - 1) == 0)
+    {
+        normalize = 1;
+    }
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        if (header[i].key.len != name->len) {
+            continue;
+        }
+
+        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
+            continue;
+        }
+
+        if (!normalize) {
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+
+            multiple = 1;
+
+            continue;
+        }
+
+        /* normalize spaces */
+
+        p = header[i].value.data;
+        last = p + header[i].value.len;
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+            start = p;
+
+            while (p < last && *p != ',' && *p != ' ') { p++; }
+
+            len = p - start;
+
+            if (len == 0) {
+                break;
+            }
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, start, len);
+
+            multiple = 1;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache reopen");
+
+    if (c->secondary) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary hash",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->secondary = 1;
+    c->file.name.len = 0;
+    c->body_start = c->buffer_size;
+
+    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    return ngx_http_file_cache_open(r);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+{
+    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+
+    u_char            *p;
+    ngx_str_t         *key;
+    ngx_uint_t         i;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache set header");
+
+    c = r->cache;
+
+    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+
+    h->version = NGX_HTTP_CACHE_VERSION;
+
+    if (c->sparse_fill) {
+        h->version |= NGX_HTTP_CACHE_SPARSE;
+    }
+    h->valid_sec = c->valid_sec;
+    h->updating_sec = c->updating_sec;
+    h->error_sec = c->error_sec;
+    h->last_modified = c->last_modified;
+    h->date = c->date;
+    h->crc32 = c->crc32;
+    h->valid_msec = (u_short) c->valid_msec;
+    h->header_start = (u_short) c->header_start;
+    h->body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h->etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h->vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = buf + sizeof(ngx_http_file_cache_header_t);
+
+    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_copy(p, key[i].data, key[i].len);
+    }
+
+    *p = LF;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_uint_t              waiting;
+    ngx_http_file_cache_t  *cache;
+
+    if (!c->secondary) {
+        return NGX_OK;
+    }
+
+    if (c->vary.len
+        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * if the variant hash doesn't match one we used as a secondary
+     * cache key, switch back to the original key
+     */
+
+    cache = c->file_cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache main key");
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node->updating = 0;
+
+    waiting = c->node->waiting;
+    c->node->waiting = 0;
+
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_wait_notify(waiting);
+
+    c->file.name.len = 0;
+    c->update_variant = 1;
+
+    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf,
+    off_t length)
+{
+    ngx_uint_t                   waiting;
+    ngx_file_info_t              fi;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_fill_t  *fill;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    if (!cache->read_while_write || !c->updating || c->updated
+        || c->sparse_fill)
+    {
+        return;
+    }
+
+    if (c->fill) {
+        if (c->fill->length == tf->offset) {
+            return;
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        c->fill->length = tf->offset;
+
+        /* the lock is held as long as the response is being received */
+
+        if (c->node->lock_time == c->lock_time) {
+            c->node->lock_time = ngx_current_msec + c->lock_age;
+            c->lock_time = c->node->lock_time;
+        }
+
+        waiting = c->node->waiting;
+        c->node->waiting = 0;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_http_file_cache_wait_notify(waiting);
+        return;
+    }
+
+    /*
+     * the response can be read while it is written only if its length
+     * is known, and variants are never shared
+     */
+
+    if (length == -1 || c->vary.len || tf->file.fd == NGX_INVALID_FILE) {
+        return;
+    }
+
+    if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    /*
+     * a fill left by a previous lock holder is replaced,
+     * it is freed by its owner
+     */
+
+    if (c->node->lock_time == c->lock_time) {
+        fill = ngx_slab_alloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_fill_t)
+                                     + tf->file.name.len);
+        if (fill) {
+            fill->length = tf->offset;
+            fill->total = c->body_start + length;
+            fill->uniq = ngx_file_uniq(&fi);
+            fill->len = tf->file.name.len;
+            ngx_memcpy(fill->name, tf->file.name.data, fill->len + 1);
+
+            c->node->fill = fill;
+            c->fill = fill;
+        }
+    }
+
+    waiting = c->node->waiting;
+
+    if (c->fill) {
+        c->node->waiting = 0;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (c->fill) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache fill start: \"%s\" %O",
+                       tf->file.name.data, c->fill->total);
+
+        ngx_http_file_cache_wait_notify(waiting);
+    }
+}
+
+
+void
+ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                           fs_size, offset, length;
+    ngx_int_t                       rc;
+    ngx_uint_t                      waiting;
+    ngx_file_uniq_t                 uniq;
+    ngx_file_info_t                 fi;
+    ngx_http_cache_t               *c;
+    ngx_ext_rename_file_t           ext;
+    ngx_http_file_cache_t          *cache;
+    ngx_http_file_cache_purge_t    *purge;
+    ngx_http_file_cache_segment_t  *segment;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update");
+
+    cache = c->file_cache;
+
+    c->updated = 1;
+    c->updating = 0;
+
+    uniq = 0;
     fs_size = 0;
+    offset = 0;
+    length = 0;
+    segment = NULL;
+
+    if (cache->segment_size) {
+
+        /* the response is appended to the current segment */
+
+        segment = ngx_http_file_cache_segment_write(r, tf, &offset, &length);
+
+        if (segment) {
+            rc = NGX_OK;
+            fs_size = (sizeof(ngx_http_file_cache_record_t) + length
+                       + cache->bsize - 1) / cache->bsize;
+
+        } else {
+            rc = NGX_ERROR;
+        }
+
+        if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed",
+                          tf->file.name.data);
+        }
+
+        goto stored;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache rename: \"%s\" to \"%s\"",
+                   tf->file.name.data, c->file.name.data);
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = r->connection->log;
+
+    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+
+    if (rc == NGX_OK) {
+
+        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+
+            rc = NGX_ERROR;
+
+        } else {
+            uniq = ngx_file_uniq(&fi);
+            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        }
+    }
+
+stored:
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (c->node->hot) {
+        ngx_http_file_cache_hot_delete(cache, c->node->hot);
+    }
+
+    ngx_http_file_cache_fill_done(cache, c);
+    ngx_http_file_cache_sparse_delete(cache, c->node);
+
+    c->node->count--;
+    c->node->error = 0;
+    c->node->uniq = uniq;
+    c->node->body_start = c->body_start;
+
+    cache->sh->size += fs_size - c->node->fs_size;
+    c->node->fs_size = fs_size;
+
+    if (rc == NGX_OK) {
+        c->node->exists = 1;
+        c->node->purged = 0;
+
+        if (segment) {
+            ngx_http_file_cache_segment_attach(cache, c->node, segment,
+                                               offset, length);
+            segment->writing--;
+        }
+
+        if (c->sparse_fill) {
+            ngx_http_file_cache_sparse_mark(cache, c, uniq);
+        }
+
+        if (cache->purge) {
+            purge = ngx_http_file_cache_purge_add(cache, c, c->node);
+
+            if (purge) {
+                ngx_http_file_cache_purge_tags(cache, c, purge);
+            }
+        }
+    }
+
+    c->node->updating = 0;
+
+    waiting = c->node->waiting;
+    c->node->waiting = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_wait_notify(waiting);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_sparse_open(ngx_http_request_t *r, ngx_temp_file_t *tf,
+    u_char *buf)
+{
+    size_t                    body_start;
+    ssize_t                   n;
+    ngx_fd_t                  fd;
+    ngx_err_t                 err;
+    ngx_uint_t                found;
+    ngx_file_info_t           fi;
+    ngx_http_cache_t         *c;
+    ngx_pool_cleanup_t       *cln;
+    ngx_http_file_cache_t    *cache;
+    ngx_pool_cleanup_file_t  *clnf;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    if (c->sparse_new) {
+        goto create;
+    }
+
+    /* the received range is written directly into the cache file */
+
+    found = 0;
+    body_start = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (c->node->exists
+        && c->node->sparse
+        && c->node->sparse->uniq == c->uniq)
+    {
+        found = 1;
+        body_start = c->node->body_start;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (!found) {
+        goto create;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(c->file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOENT) {
+            goto create;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = c->file.name.data;
+    clnf->log = r->pool->log;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_file_uniq(&fi) != c->uniq) {
+        ngx_pool_run_cleanup_file(r->pool, fd);
+        goto create;
+    }
+
+    tf->file.fd = fd;
+    tf->file.name = c->file.name;
+    tf->offset = body_start + c->sparse_start;
+
+    c->body_start = body_start;
+    c->temp_file = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache sparse write: \"%s\" %O",
+                   c->file.name.data, tf->offset);
+
+    return NGX_OK;
+
+create:
+
+    c->sparse_new = 1;
+    c->temp_file = 1;
+
+    if (ngx_create_temp_file(&tf->file, tf->path, tf->pool,
+                             tf->persistent, tf->clean, tf->access)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    n = ngx_write_file(&tf->file, buf, c->body_start, 0);
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    tf->offset = c->body_start + c->sparse_start;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache sparse create: \"%s\" %O",
+                   tf->file.name.data, tf->offset);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_file_cache_sparse_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                        fs_size;
+    ngx_uint_t                   waiting;
+    ngx_file_info_t              fi;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    c = r->cache;
+
+    if (tf->offset != (off_t) c->body_start + c->sparse_end + 1) {
+        ngx_http_file_cache_free(c, tf);
+        return NGX_DECLINED;
+    }
+
+    if (!c->sparse_commit) {
+        ngx_http_file_cache_free(c, tf);
+        return NGX_OK;
+    }
+
+    if (c->sparse_new) {
+        ngx_http_file_cache_update(r, tf);
+        return NGX_OK;
+    }
+
+    if (c->updated) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache sparse update: %O-%O",
+                   c->sparse_start, c->sparse_end);
+
+    cache = c->file_cache;
+
+    c->updated = 1;
+    c->updating = 0;
+
+    fs_size = -1;
+
+    if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+
+    } else {
+        fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    /* the file may have been deleted by the cache manager meanwhile */
+
+    if (fcn->exists && fcn->uniq == c->uniq) {
+
+        if (fs_size != -1) {
+            cache->sh->size += fs_size - fcn->fs_size;
+            fcn->fs_size = fs_size;
+        }
+
+        ngx_http_file_cache_sparse_mark(cache, c, c->uniq);
+    }
+
+    fcn->updating = 0;
+
+    waiting = fcn->waiting;
+    fcn->waiting = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_wait_notify(waiting);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    if (c->segment && ngx_http_file_cache_segment_file(r, c) != NGX_OK) {
+        return;
+    }
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" not found",
+                           file.name.data);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        return;
+    }
+
+    /*
+     * make sure cache file wasn't replaced;
+     * if it was, do nothing
+     */
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    if (c->segment == 0
+        && (c->uniq != ngx_file_uniq(&fi)
+            || c->length != ngx_file_size(&fi)))
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" changed",
+                       file.name.data);
+        goto done;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), c->offset);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      ngx_read_file_n " read only %z of %z from \"%s\"",
+                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
+        goto done;
+    }
+
+    if (h.version != NGX_HTTP_CACHE_VERSION
+        || h.last_modified != c->last_modified
+        || h.crc32 != c->crc32
+        || (size_t) h.header_start != c->header_start
+        || (size_t) h.body_start != c->body_start)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" content changed",
+                       file.name.data);
+        goto done;
+    }
+
+    /*
+     * update cache file header with new data,
+     * notably h.valid_sec and h.date
+     */
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+
+    h.version = NGX_HTTP_CACHE_VERSION;
+    h.valid_sec = c->valid_sec;
+    h.updating_sec = c->updating_sec;
+    h.error_sec = c->error_sec;
+    h.last_modified = c->last_modified;
+    h.date = c->date;
+    h.crc32 = c->crc32;
+    h.valid_msec = (u_short) c->valid_msec;
+    h.header_start = (u_short) c->header_start;
+    h.body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h.etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h.vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    (void) ngx_write_file(&file, (u_char *) &h,
+                          sizeof(ngx_http_file_cache_header_t), c->offset);
+
+    /* the memory copy still has the old header */
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (c->node && c->node->hot) {
+        ngx_http_file_cache_hot_delete(cache, c->node->hot);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+ngx_int_t
+ngx_http_cache_send(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send: %s", c->file.name.data);
+
+    /* we need to allocate all before the header would be sent */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!c->hot) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    if (c->sparse_send && r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "range was not applied to partially cached file \"%s\"",
+                      c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (c->filling) {
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+
+        c->fill_buf = b;
+        c->fill_sent = c->body_start;
+
+        c->wait_event.handler = ngx_http_file_cache_fill_handler;
+        c->wait_event.data = r;
+        c->wait_event.log = r->connection->log;
+
+        r->write_event_handler = ngx_http_file_cache_fill_write_handler;
+
+        return ngx_http_file_cache_fill_send(r);
+    }
+
+    if (c->hot) {
+        b->pos = c->buf->pos + c->body_start;
+        b->last = c->buf->pos + c->length;
+
+        b->memory = (c->length - c->body_start) ? 1 : 0;
+
+    } else {
+        b->file_pos = c->offset + c->body_start;
+        b->file_last = c->offset + c->length;
+
+        b->in_file = (c->length - c->body_start) ? 1 : 0;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+    b->sync = (b->last_buf || b->in_file || b->memory) ? 0 : 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_uint_t                   waiting;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_fill_done(cache, c);
+
+    fcn = c->node;
+    fcn->count--;
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+    }
+
+    waiting = 0;
+
+    if (c->updating) {
+        waiting = fcn->waiting;
+        fcn->waiting = 0;
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+
+        if (fcn->protected) {
+            cache->sh->protected_count--;
+        }
+
+        ngx_http_file_cache_sparse_delete(cache, fcn);
+        ngx_http_file_cache_purge_delete(cache, fcn);
+
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+        c->node = NULL;
+
+    } else if (fcn->purged && fcn->count == 0) {
+        ngx_http_file_cache_purge_expire(cache, fcn);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (c->updating) {
+        ngx_http_file_cache_wait_notify(waiting);
+    }
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->waiting) {
+        ngx_queue_remove(&c->wait_queue);
+
+        if (c->wait_event.posted) {
+            ngx_delete_posted_event(&c->wait_event);
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       wait;
+    ngx_uint_t                   tries;
+    ngx_path_t                  *path;
+    ngx_queue_t                 *q, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    wait = 10;
+    tries = 20;
+    sentinel = NULL;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for ( ;; ) {
+        q = ngx_http_file_cache_last(cache);
+
+        if (q == NULL || q == sentinel) {
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+
+            if (fcn->protected) {
+                cache->sh->evicted_protected++;
+
+            } else {
+                cache->sh->evicted_probation++;
+            }
+
+            ngx_http_file_cache_delete(cache, q, name);
+            wait = 0;
+            break;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_http_file_cache_enqueue(cache, fcn, 0);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+        if (sentinel == NULL) {
+            sentinel = q;
+        }
+
+        if (--tries) {
+            continue;
+        }
+
+        wait = 1;
+        break;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_path_t                  *path;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q, *pq;
+    ngx_http_file_cache_node_t  *fcn, *pfcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        q = ngx_http_file_cache_last(cache);
+
+        if (q == NULL) {
+            wait = 10;
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        if (!ngx_queue_empty(&cache->sh->protected)) {
+            pq = ngx_queue_last(&cache->sh->protected);
+            pfcn = ngx_queue_data(pq, ngx_http_file_cache_node_t, queue);
+
+            if (pfcn->expire < fcn->expire) {
+                q = pq;
+                fcn = pfcn;
+            }
+        }
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, q, name);
+            goto next;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_http_file_cache_enqueue(cache, fcn, 0);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+        if (++cache->files >= cache->manager_files) {
+            wait = 0;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
+    u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_node_t  *fcn;
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn->hot) {
+        ngx_http_file_cache_hot_delete(cache, fcn->hot);
+    }
+
+    ngx_http_file_cache_sparse_delete(cache, fcn);
+    ngx_http_file_cache_purge_delete(cache, fcn);
+
+    if (fcn->segment) {
+
+        /* the space is reclaimed when the segment is compacted */
+
+        cache->sh->size -= fcn->fs_size;
+        ngx_http_file_cache_segment_release(cache, fcn);
+
+    } else if (fcn->exists) {
+        cache->sh->size -= fcn->fs_size;
+
+        path = cache->path;
+
+#if (NGX_THREADS)
+        if (cache->batch) {
+            name = cache->batch->names
+                   + cache->batch->nelts * (cache->batch->len + 1);
+        }
+#endif
+
+        p = name + path->name.len + 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        fcn->count++;
+        fcn->deleting = 1;
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+#if (NGX_THREADS)
+
+        if (cache->batch) {
+
+            /*
+             * the node is taken out of the queue to let the manager
+             * proceed to the next one, files are unlinked later by
+             * the manager threads
+             */
+
+            ngx_queue_remove(q);
+            ngx_queue_init(q);
+
+            cache->batch->nodes[cache->batch->nelts++] = fcn;
+
+            if (cache->batch->nelts == cache->batch->nalloc) {
+                ngx_http_file_cache_delete_batch(cache);
+            }
+
+            return;
+        }
+
+#endif
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+
+        if (fcn->protected) {
+            cache->sh->protected_count--;
+        }
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+    }
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_http_file_cache_batch_t *
+ngx_http_file_cache_batch_create(ngx_http_file_cache_t *cache)
+{
+    u_char                       *p;
+    ngx_uint_t                    i;
+    ngx_path_t                   *path;
+    ngx_http_file_cache_batch_t  *batch;
+
+    batch = ngx_alloc(sizeof(ngx_http_file_cache_batch_t), ngx_cycle->log);
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    path = cache->path;
+
+    batch->len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    batch->nelts = 0;
+    batch->nalloc = ngx_min(ngx_max(cache->manager_files, 1), 1024);
+    batch->next = 0;
+
+    batch->nodes = ngx_alloc(batch->nalloc
+                             * sizeof(ngx_http_file_cache_node_t *),
+                             ngx_cycle->log);
+    if (batch->nodes == NULL) {
+        ngx_free(batch);
+        return NULL;
+    }
+
+    batch->names = ngx_alloc(batch->nalloc * (batch->len + 1),
+                             ngx_cycle->log);
+    if (batch->names == NULL) {
+        ngx_free(batch->nodes);
+        ngx_free(batch);
+        return NULL;
+    }
+
+    for (i = 0; i < batch->nalloc; i++) {
+        p = batch->names + i * (batch->len + 1);
+        ngx_memcpy(p, path->name.data, path->name.len);
+    }
+
+    return batch;
+}
+
+
+static void
+ngx_http_file_cache_delete_batch(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t                    i;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_batch_t  *batch;
+
+    batch = cache->batch;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    batch->next = 0;
+
+    ngx_http_file_cache_threads(ngx_http_file_cache_delete_thread,
+                                (u_char *) batch, 0,
+                                ngx_min(cache->manager_threads, batch->nelts));
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (i = 0; i < batch->nelts; i++) {
+        fcn = batch->nodes[i];
+
+        fcn->count--;
+        fcn->deleting = 0;
+
+        if (fcn->count == 0) {
+
+            if (fcn->protected) {
+                cache->sh->protected_count--;
+            }
+
+            ngx_queue_remove(&fcn->queue);
+            ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+            ngx_slab_free_locked(cache->shpool, fcn);
+            cache->sh->count--;
+        }
+    }
+
+    batch->nelts = 0;
+}
+
+
+static void *
+ngx_http_file_cache_delete_thread(void *data)
+{
+    ngx_http_file_cache_batch_t  *batch = data;
+
+    u_char      *name;
+    ngx_uint_t   i;
+
+    for ( ;; ) {
+        i = ngx_atomic_fetch_add(&batch->next, 1);
+
+        if (i >= batch->nelts) {
+            break;
+        }
+
+        name = batch->names + i * (batch->len + 1);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_threads(void *(*handler)(void *data), u_char *data,
+    size_t size, ngx_uint_t n)
+{
+    ngx_uint_t                      i;
+    ngx_http_file_cache_helpers_t  *hp;
+
+    /*
+     * the helper threads are created once per process and take parts
+     * of each batch; the main thread waits for them in short steps and
+     * reads commands from the master in between, so loader walks give
+     * up as soon as the process is told to quit, and a batch of files
+     * to delete is limited to 1024 files
+     */
+
+    hp = ngx_http_file_cache_helpers_get(n);
+
+    if (hp == NULL
+        || hp->threads == 0
+        || ngx_thread_mutex_lock(&hp->mtx, hp->log) != NGX_OK)
+    {
+        for (i = 0; i < n; i++) {
+            (void) handler(data + i * size);
+        }
+
+        return;
+    }
+
+    hp->handler = handler;
+    hp->data = data;
+    hp->size = size;
+    hp->nelts = n;
+    hp->next = 0;
+    hp->left = n;
+
+    for (i = 0; i < n; i++) {
+        (void) ngx_thread_cond_signal(&hp->cond, hp->log);
+    }
+
+    while (hp->left) {
+
+        if (ngx_thread_cond_timedwait(&hp->done, &hp->mtx, 100, hp->log)
+            == NGX_OK)
+        {
+            continue;
+        }
+
+        (void) ngx_thread_mutex_unlock(&hp->mtx, hp->log);
+
+        ngx_process_channel(hp->log);
+
+        (void) ngx_thread_mutex_lock(&hp->mtx, hp->log);
+    }
+
+    (void) ngx_thread_mutex_unlock(&hp->mtx, hp->log);
+}
+
+
+static ngx_http_file_cache_helpers_t *
+ngx_http_file_cache_helpers_get(ngx_uint_t threads)
+{
+    int                             err;
+    pthread_t                       tid;
+    pthread_attr_t                  attr;
+    ngx_http_file_cache_helpers_t  *hp;
+
+    hp = ngx_http_file_cache_helpers;
+
+    if (hp == NULL) {
+        hp = ngx_calloc(sizeof(ngx_http_file_cache_helpers_t),
+                        ngx_cycle->log);
+        if (hp == NULL) {
+            return NULL;
+        }
+
+        hp->log = ngx_cycle->log;
+
+        if (ngx_thread_mutex_create(&hp->mtx, hp->log) != NGX_OK) {
+            ngx_free(hp);
+            return NULL;
+        }
+
+        if (ngx_thread_cond_create(&hp->cond, hp->log) != NGX_OK) {
+            (void) ngx_thread_mutex_destroy(&hp->mtx, hp->log);
+            ngx_free(hp);
+            return NULL;
+        }
+
+        if (ngx_thread_cond_create(&hp->done, hp->log) != NGX_OK) {
+            (void) ngx_thread_cond_destroy(&hp->cond, hp->log);
+            (void) ngx_thread_mutex_destroy(&hp->mtx, hp->log);
+            ngx_free(hp);
+            return NULL;
+        }
+
+        ngx_http_file_cache_helpers = hp;
+    }
+
+    if (hp->threads >= threads) {
+        return hp;
+    }
+
+    err = pthread_attr_init(&attr);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, hp->log, err,
+                      "pthread_attr_init() failed");
+        return hp;
+    }
+
+    err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, hp->log, err,
+                      "pthread_attr_setdetachstate() failed");
+        (void) pthread_attr_destroy(&attr);
+        return hp;
+    }
+
+    /* the batch is shared, so fewer threads only make it slower */
+
+    while (hp->threads < threads) {
+        err = pthread_create(&tid, &attr, ngx_http_file_cache_helper_cycle,
+                             hp);
+        if (err) {
+            ngx_log_error(NGX_LOG_ALERT, hp->log, err,
+                          "pthread_create() failed");
+            break;
+        }
+
+        hp->threads++;
+    }
+
+    (void) pthread_attr_destroy(&attr);
+
+    return hp;
+}
+
+
+static void *
+ngx_http_file_cache_helper_cycle(void *data)
+{
+    ngx_http_file_cache_helpers_t *hp = data;
+
+    int          err;
+    void      *(*handler)(void *data);
+    u_char      *p;
+    sigset_t     set;
+    ngx_uint_t   i;
+
+    /* signals are left to the main thread */
+
+    sigfillset(&set);
+
+    sigdelset(&set, SIGILL);
+    sigdelset(&set, SIGFPE);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+
+    err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, hp->log, err, "pthread_sigmask() failed");
+        return NULL;
+    }
+
+    if (ngx_thread_mutex_lock(&hp->mtx, hp->log) != NGX_OK) {
+        return NULL;
+    }
+
+    for ( ;; ) {
+
+        while (hp->next >= hp->nelts) {
+            if (ngx_thread_cond_wait(&hp->cond, &hp->mtx, hp->log) != NGX_OK) {
+                (void) ngx_thread_mutex_unlock(&hp->mtx, hp->log);
+                return NULL;
+            }
+        }
+
+        i = hp->next++;
+        handler = hp->handler;
+        p = hp->data + i * hp->size;
+
+        (void) ngx_thread_mutex_unlock(&hp->mtx, hp->log);
+
+        (void) handler(p);
+
+        if (ngx_thread_mutex_lock(&hp->mtx, hp->log) != NGX_OK) {
+            return NULL;
+        }
+
+        if (--hp->left == 0) {
+            (void) ngx_thread_cond_signal(&hp->done, hp->log);
+        }
+    }
+}
+
+#endif
+
+
+static ngx_msec_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t       size, free;
+    time_t      wait;
+    ngx_msec_t  elapsed, next;
+    ngx_uint_t  count, watermark;
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+#if (NGX_THREADS)
+    if (cache->manager_threads > 1 && cache->batch == NULL) {
+        cache->batch = ngx_http_file_cache_batch_create(cache);
+    }
+#endif
+
+    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+
+    if (next == 0) {
+        next = cache->manager_sleep;
+        goto done;
+    }
+
+    for ( ;; ) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        size = cache->sh->size;
+        count = cache->sh->count;
+        watermark = cache->sh->watermark;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O c:%ui w:%i",
+                       size, count, (ngx_int_t) watermark);
+
+        if (size < cache->max_size && count < watermark) {
+
+            if (!cache->min_free) {
+                break;
+            }
+
+            free = ngx_fs_available(cache->path->name.data);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache free: %O", free);
+
+            if (free > cache->min_free) {
+                break;
+            }
+        }
+
+        wait = ngx_http_file_cache_forced_expire(cache);
+
+        if (wait > 0) {
+            next = (ngx_msec_t) wait * 1000;
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+
+        if (++cache->files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            next = cache->manager_sleep;
+            break;
+        }
+    }
+
+done:
+
+#if (NGX_THREADS)
+    if (cache->batch && cache->batch->nelts) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_http_file_cache_delete_batch(cache);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+#endif
+
+    if (cache->segment_size
+        && !cache->sh->cold
+        && ngx_http_file_cache_segment_manage(cache) == NGX_AGAIN
+        && next > cache->manager_sleep)
+    {
+        next = cache->manager_sleep;
+    }
+
+    if (cache->index.len) {
+
+        if (!cache->sh->cold && ngx_time() >= cache->index_next) {
+            ngx_http_file_cache_index_write(cache);
+
+            ngx_time_update();
+            cache->index_next = ngx_time() + cache->index_interval;
+        }
+
+        /* the first snapshot is written as soon as the loader finishes */
+
+        wait = cache->sh->cold ? 1 : cache->index_next - ngx_time();
+
+        if ((ngx_msec_t) wait * 1000 < next) {
+            next = (ngx_msec_t) wait * 1000;
+        }
+    }
+
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache manager: %ui e:%M n:%M",
+                   cache->files, elapsed, next);
+
+    return next;
+}
+
+
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    ngx_int_t                    rc;
+    ngx_uint_t                   i, n;
+    ngx_http_file_cache_walk_t  *walk;
+
+    if (!cache->sh->cold || cache->sh->loading) {
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
+
+    n = cache->loader_threads;
+
+    walk = ngx_calloc(n * sizeof(ngx_http_file_cache_walk_t), ngx_cycle->log);
+    if (walk == NULL) {
+        cache->sh->loading = 0;
+        return;
+    }
+
+    if (cache->index.len) {
+        ngx_http_file_cache_index_load(cache);
+    }
+
+    cache->loaded = 0;
+    cache->reported = ngx_current_msec;
+
+    for (i = 0; i < n; i++) {
+        walk[i].cache = cache;
+        walk[i].thread = i;
+        walk[i].last = ngx_current_msec;
+
+        walk[i].tree.init_handler = NULL;
+        walk[i].tree.file_handler = ngx_http_file_cache_manage_file;
+        walk[i].tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+        walk[i].tree.post_tree_handler = ngx_http_file_cache_noop;
+        walk[i].tree.spec_handler = ngx_http_file_cache_delete_file;
+        walk[i].tree.data = &walk[i];
+        walk[i].tree.alloc = 0;
+        walk[i].tree.log = ngx_cycle->log;
+    }
+
+    if (cache->segment_size) {
+        walk[0].rc = ngx_http_file_cache_segment_load(&walk[0]);
+
+    } else
+#if (NGX_THREADS)
+    if (n > 1) {
+        ngx_http_file_cache_threads(ngx_http_file_cache_loader_walk,
+                                    (u_char *) walk,
+                                    sizeof(ngx_http_file_cache_walk_t), n);
+    } else
+#endif
+    {
+        (void) ngx_http_file_cache_loader_walk(walk);
+    }
+
+    rc = NGX_OK;
+
+    for (i = 0; i < n; i++) {
+        if (walk[i].rc == NGX_ABORT) {
+            rc = NGX_ABORT;
+        }
+    }
+
+    ngx_free(walk);
+
+    if (rc == NGX_ABORT) {
+        cache->sh->loading = 0;
+        return;
+    }
+
+    if (cache->index_dirs) {
+        ngx_http_file_cache_index_sweep(cache);
+
+        ngx_free(cache->index_dirs);
+        cache->index_dirs = NULL;
+    }
+
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+}
+
+
+static void *
+ngx_http_file_cache_loader_walk(void *data)
+{
+    ngx_http_file_cache_walk_t  *walk = data;
+
+    walk->rc = ngx_walk_tree(&walk->tree, &walk->cache->path->name);
+
+    return NULL;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_loader_owner(ngx_http_file_cache_walk_t *walk,
+    ngx_str_t *path)
+{
+    u_char                 *p, *last;
+    ngx_int_t               n;
+    ngx_http_file_cache_t  *cache;
+
+    /*
+     * entries of the cache directory are shared between loader threads
+     * by their last hex digit, everything below belongs to the thread
+     * which walks the entry
+     */
+
+    cache = walk->cache;
+
+    p = path->data + cache->path->name.len + 1;
+    last = path->data + path->len;
+
+    if (ngx_strlchr(p, last, '/') != NULL) {
+        return walk->thread;
+    }
+
+    n = ngx_hextoi(last - 1, 1);
+
+    if (n == NGX_ERROR) {
+        return 0;
+    }
+
+    return n % cache->loader_threads;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_walk_t  *walk;
+
+    walk = ctx->data;
+    cache = walk->cache;
+
+    if (cache->loader_threads > 1
+        && ngx_http_file_cache_loader_owner(walk, path) != walk->thread)
+    {
+        return NGX_OK;
+    }
+
+    if (cache->index.len
+        && ((path->len == cache->index.len
+             && ngx_strcmp(path->data, cache->index.data) == 0)
+            || (path->len == cache->index_temp.len
+                && ngx_strcmp(path->data, cache->index_temp.data) == 0)))
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
+
+    ngx_http_file_cache_loader_progress(walk);
+
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_progress(ngx_http_file_cache_walk_t *walk)
+{
+    ngx_msec_t              elapsed, now;
+    ngx_atomic_uint_t       files, reported;
+    ngx_http_file_cache_t  *cache;
+
+    cache = walk->cache;
+
+    files = ngx_atomic_fetch_add(&cache->loaded, 1) + 1;
+
+    if (++walk->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(walk);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - walk->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(walk);
+        }
+    }
+
+    now = ngx_current_msec;
+    reported = cache->reported;
+
+    if (now - (ngx_msec_t) reported >= 10000
+        && ngx_atomic_cmp_set(&cache->reported, reported, now))
+    {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "http file cache: %V loading, %uA files",
+                      &cache->path->name, files);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_int_t                    n;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_walk_t  *walk;
+
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    walk = ctx->data;
+    cache = walk->cache;
+
+    if (cache->loader_threads > 1
+        && ngx_http_file_cache_loader_owner(walk, path) != walk->thread)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (cache->index_dirs
+        && path->len == cache->path->name.len + cache->path->len)
+    {
+        n = ngx_http_file_cache_index_dir(cache,
+                                          path->data + cache->path->name.len);
+        if (n == NGX_ERROR) {
+            return NGX_OK;
+        }
+
+        /*
+         * files are added to and removed from the leaf directories only,
+         * so a directory not modified since the snapshot has been written
+         * is already described by the index
+         */
+
+        if (ctx->mtime < cache->index_time) {
+            return NGX_DECLINED;
+        }
+
+        cache->index_dirs[n] = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_walk_t *walk)
+{
+    ngx_msleep(walk->cache->loader_sleep);
+
+    ngx_time_update();
+
+    walk->last = ngx_current_msec;
+    walk->files = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p, *buf;
+    ngx_int_t               n, rc;
+    ngx_str_t               key;
+    ngx_uint_t              i;
+    ngx_file_t              file;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
+     */
+
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
+    }
+
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ((ngx_http_file_cache_walk_t *) ctx->data)->cache;
+
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
+    }
+
+    buf = NULL;
+
+    if (cache->purge) {
+        ngx_memzero(&file, sizeof(ngx_file_t));
+
+        file.name = *name;
+        file.log = ctx->log;
+
+        file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+        if (file.fd != NGX_INVALID_FILE) {
+            buf = ngx_http_file_cache_loader_key(cache, &file, &c, &key);
+
+            if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_ALERT, ctx->log, ngx_errno,
+                              ngx_close_file_n " \"%s\" failed", name->data);
+            }
+        }
+    }
+
+    rc = ngx_http_file_cache_add(cache, &c, NULL);
+
+    if (buf) {
+        ngx_free(buf);
+    }
+
+    return rc;
+}
+
+
+static u_char *
+ngx_http_file_cache_loader_key(ngx_http_file_cache_t *cache, ngx_file_t *file,
+    ngx_http_cache_t *c, ngx_str_t *key)
+{
+    u_char                        *buf, *p, *last, *start;
+    size_t                         len;
+    ssize_t                        n;
+    ngx_http_file_cache_header_t   h;
+
+    /*
+     * the key and the tags of an entry are read from its header
+     * for the entry to be purged before it is requested
+     */
+
+    n = ngx_read_file(file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), c->offset);
+
+    if (n != (ssize_t) sizeof(ngx_http_file_cache_header_t)
+        || (h.version != NGX_HTTP_CACHE_VERSION
+            && h.version != (NGX_HTTP_CACHE_VERSION|NGX_HTTP_CACHE_SPARSE))
+        || h.header_start < sizeof(ngx_http_file_cache_header_t)
+                            + sizeof(ngx_http_file_cache_key) + 1
+        || h.body_start < h.header_start
+        || (off_t) h.body_start > c->length)
+    {
+        return NULL;
+    }
+
+    len = cache->tags.len ? h.body_start : h.header_start;
+
+    buf = ngx_alloc(len, file->log);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    n = ngx_read_file(file, buf, len, c->offset);
+
+    if (n != (ssize_t) len) {
+        ngx_free(buf);
+        return NULL;
+    }
+
+    key->data = buf + sizeof(ngx_http_file_cache_header_t)
+                + sizeof(ngx_http_file_cache_key);
+    key->len = buf + h.header_start - 1 - key->data;
+
+    c->keys.elts = key;
+    c->keys.nelts = 1;
+
+    if (cache->tags.len == 0) {
+        return buf;
+    }
+
+    p = buf + h.header_start;
+    last = buf + h.body_start;
+
+    while (p < last) {
+
+        if ((size_t) (last - p) > cache->tags.len
+            && p[cache->tags.len] == ':'
+            && ngx_strncasecmp(p, cache->tags.data, cache->tags.len) == 0)
+        {
+            p += cache->tags.len + 1;
+
+            while (p < last && *p == ' ') { p++; }
+
+            start = p;
+
+            while (p < last && *p != CR && *p != LF) { p++; }
+
+            c->tags.len = p - start;
+            c->tags.data = start;
+
+            break;
+        }
+
+        p = ngx_strlchr(p, last, LF);
+
+        if (p == NULL) {
+            break;
+        }
+
+        p++;
+    }
+
+    return buf;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c,
+    ngx_http_file_cache_segment_t *seg)
+{
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_purge_t  *purge;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+    if (fcn == NULL) {
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
+
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        cache->sh->count++;
+
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
+
+        cache->sh->size += c->fs_size;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
+    } else {
+        ngx_queue_remove(&fcn->queue);
 
-    ext.access = NGX_FILE_OWNER_ACCESS;
-    ext.path_access = NGX_FILE_OWNER_ACCESS;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
+        if (fcn->indexed) {
+            fcn->indexed = 0;
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+            if (fcn->exists && fcn->count == 0) {
+                cache->sh->size += c->fs_size - fcn->fs_size;
+
+                fcn->uniq = 0;
+                fcn->body_start = 0;
+                fcn->fs_size = c->fs_size;
+            }
+        }
+
+        if (seg
+            && (fcn->segment == NULL
+                || fcn->segment->id < cache->sh->segment_start))
+        {
+            /* a later record of the key replaces an earlier one */
+
+            cache->sh->size += c->fs_size - fcn->fs_size;
+
+            fcn->exists = 1;
+            fcn->uniq = 0;
+            fcn->body_start = 0;
+            fcn->fs_size = c->fs_size;
+
+        } else {
+            seg = NULL;
+        }
+    }
+
+    if (seg) {
+        ngx_http_file_cache_segment_attach(cache, fcn, seg, c->offset,
+                                           c->length);
+    }
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_http_file_cache_enqueue(cache, fcn, 0);
+
+    if (c->keys.nelts && (fcn->purge == NULL || seg)) {
+        purge = ngx_http_file_cache_purge_add(cache, c, fcn);
+
+        if (purge && c->tags.len) {
+            ngx_http_file_cache_purge_tags(cache, c, purge);
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
+
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+{
+    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
+
+
+static void
+ngx_http_file_cache_index_write(ngx_http_file_cache_t *cache)
+{
+    u_char                              *p, key[NGX_HTTP_CACHE_KEY_LEN];
+    size_t                               size;
+    uint32_t                             crc;
+    uint64_t                             count;
+    ngx_uint_t                           i, n;
+    ngx_file_t                           file;
+    ngx_rbtree_node_t                   *node;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_index_entry_t   *entries, *e;
+    ngx_http_file_cache_index_header_t   h;
+
+    entries = ngx_alloc(NGX_HTTP_CACHE_INDEX_BATCH
+                        * sizeof(ngx_http_file_cache_index_entry_t),
+                        ngx_cycle->log);
+    if (entries == NULL) {
+        return;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->index_temp;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY,
+                            NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        ngx_free(entries);
+        return;
+    }
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_index_header_t));
+
+    h.magic = NGX_HTTP_CACHE_INDEX_MAGIC;
+    h.version = NGX_HTTP_CACHE_INDEX_VERSION;
+    h.entry_size = sizeof(ngx_http_file_cache_index_entry_t);
+    h.bsize = cache->bsize;
+    h.time = ngx_time();
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        h.levels[i] = (u_char) cache->path->level[i];
+    }
+
+    ngx_memzero(key, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_crc32_init(crc);
+    count = 0;
+
+    /*
+     * the tree is walked in batches to keep the zone unlocked most
+     * of the time, each batch starts from the key the previous one
+     * stopped at
+     */
+
+    for ( ;; ) {
+
+        n = 0;
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        node = ngx_http_file_cache_index_next(cache, key);
+
+        for (i = 0; node && i < NGX_HTTP_CACHE_INDEX_BATCH; i++) {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            if (fcn->exists && !fcn->deleting && !fcn->purged) {
+                e = &entries[n++];
+
+                ngx_memzero(e, sizeof(ngx_http_file_cache_index_entry_t));
+
+                p = ngx_cpymem(e->key, &node->key, sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(p, fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+                e->uniq = fcn->uniq;
+                e->fs_size = fcn->fs_size;
+                e->body_start = fcn->body_start;
+            }
+
+            node = ngx_rbtree_next(&cache->sh->rbtree, node);
+        }
+
+        if (node) {
+            p = ngx_cpymem(key, &node->key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(p, ((ngx_http_file_cache_node_t *) node)->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (n) {
+            size = n * sizeof(ngx_http_file_cache_index_entry_t);
+
+            ngx_crc32_update(&crc, (u_char *) entries, size);
+
+            if (ngx_write_file(&file, (u_char *) entries, size,
+                               sizeof(ngx_http_file_cache_index_header_t)
+                               + count
+                                 * sizeof(ngx_http_file_cache_index_entry_t))
+                == NGX_ERROR)
+            {
+                goto failed;
+            }
+
+            count += n;
+        }
+
+        if (node == NULL) {
+            break;
+        }
+    }
+
+    ngx_crc32_final(crc);
+
+    h.count = count;
+    h.crc32 = crc;
+
+    if (ngx_write_file(&file, (u_char *) &h, sizeof(h), 0) == NGX_ERROR) {
+        goto failed;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    ngx_free(entries);
+
+    if (ngx_rename_file(cache->index_temp.data, cache->index.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      cache->index_temp.data, cache->index.data);
+        goto delete;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index: \"%s\" %uL entries",
+                   cache->index.data, count);
+
+    return;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    ngx_free(entries);
+
+delete:
+
+    if (ngx_delete_file(cache->index_temp.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed",
+                      cache->index_temp.data);
+    }
+}
+
+
+static void
+ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache)
+{
+    off_t                                offset, end;
+    size_t                               size;
+    ssize_t                              n;
+    uint32_t                             crc;
+    uint64_t                             count;
+    ngx_err_t                            err;
+    ngx_int_t                            rc;
+    ngx_uint_t                           i, bits;
+    ngx_file_t                           file;
+    ngx_file_info_t                      fi;
+    ngx_http_file_cache_index_entry_t   *entries;
+    ngx_http_file_cache_index_header_t   h;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->index;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_open_file_n " \"%s\" failed", file.name.data);
+        }
+
+        return;
+    }
+
+    entries = NULL;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    end = ngx_file_size(&fi);
+
+    n = ngx_read_file(&file, (u_char *) &h, sizeof(h), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(h)
+        || h.magic != NGX_HTTP_CACHE_INDEX_MAGIC
+        || h.version != NGX_HTTP_CACHE_INDEX_VERSION
+        || h.entry_size != sizeof(ngx_http_file_cache_index_entry_t)
+        || (off_t) (sizeof(h) + h.count * h.entry_size) != end)
+    {
+        goto invalid;
+    }
+
+    if (h.bsize != cache->bsize) {
+        goto mismatch;
+    }
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        if (h.levels[i] != cache->path->level[i]) {
+            goto mismatch;
+        }
+    }
+
+    entries = ngx_alloc(NGX_HTTP_CACHE_INDEX_BATCH
+                        * sizeof(ngx_http_file_cache_index_entry_t),
+                        ngx_cycle->log);
+    if (entries == NULL) {
+        goto done;
+    }
+
+    /* the whole file is verified before anything is added to the zone */
+
+    ngx_crc32_init(crc);
+
+    for (offset = sizeof(h); offset < end; offset += n) {
+
+        size = ngx_min(end - offset,
+                       (off_t) (NGX_HTTP_CACHE_INDEX_BATCH
+                                * sizeof(ngx_http_file_cache_index_entry_t)));
+
+        n = ngx_read_file(&file, (u_char *) entries, size, offset);
+
+        if (n == NGX_ERROR) {
+            goto done;
+        }
+
+        if ((size_t) n != size) {
+            goto invalid;
+        }
+
+        ngx_crc32_update(&crc, (u_char *) entries, size);
+    }
+
+    ngx_crc32_final(crc);
+
+    if (crc != h.crc32) {
+        goto invalid;
+    }
+
+    /*
+     * one byte for each leaf directory, set when it is walked;
+     * bytes rather than bits as loader threads may walk neighbours
+     */
+
+    bits = 0;
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        bits += 4 * cache->path->level[i];
+    }
+
+    cache->index_dirs = ngx_calloc((size_t) 1 << bits, ngx_cycle->log);
+    if (cache->index_dirs == NULL) {
+        goto done;
+    }
+
+    if (bits == 0) {
+        cache->index_dirs[0] = 1;
+    }
+
+    count = 0;
+    rc = NGX_OK;
+
+    for (offset = sizeof(h); offset < end && rc == NGX_OK; offset += n) {
+
+        size = ngx_min(end - offset,
+                       (off_t) (NGX_HTTP_CACHE_INDEX_BATCH
+                                * sizeof(ngx_http_file_cache_index_entry_t)));
+
+        n = ngx_read_file(&file, (u_char *) entries, size, offset);
+
+        if (n == NGX_ERROR || (size_t) n != size) {
+            rc = NGX_ERROR;
+            break;
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        for (i = 0; i < size / sizeof(ngx_http_file_cache_index_entry_t); i++)
+        {
+            rc = ngx_http_file_cache_index_add(cache, &entries[i]);
+
+            if (rc != NGX_OK) {
+                break;
+            }
+
+            count++;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (ngx_quit || ngx_terminate) {
+            rc = NGX_ERROR;
+        }
+    }
+
+    if (rc == NGX_OK) {
+        cache->index_time = h.time;
+    }
+
+    /*
+     * if the index was not added completely, all directories are walked
+     * and the entries added are either confirmed or swept afterwards
+     */
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V index %uL entries%s",
+                  &cache->path->name, count,
+                  rc == NGX_OK ? "" : ", incomplete");
+
+    goto done;
+
+mismatch:
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "cache index \"%s\" does not match cache parameters, "
+                  "ignored", file.name.data);
+    goto done;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0,
+                  "cache index \"%s\" is corrupt, ignored", file.name.data);
+
+done:
+
+    if (entries) {
+        ngx_free(entries);
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_index_add(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_index_entry_t *e)
+{
+    ngx_http_file_cache_node_t  *fcn;
 
-    if (rc == NGX_OK) {
+    fcn = ngx_http_file_cache_lookup(cache, e->key);
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+    if (fcn) {
+        return NGX_OK;
+    }
 
-            rc = NGX_ERROR;
+    fcn = ngx_slab_calloc_locked(cache->shpool,
+                                 sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(cache);
 
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        if (cache->fail_time != ngx_time()) {
+            cache->fail_time = ngx_time();
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate node%s", cache->shpool->log_ctx);
         }
+
+        return NGX_ERROR;
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    cache->sh->count++;
 
-    c->node->count--;
-    c->node->error = 0;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
+    ngx_memcpy((u_char *) &fcn->node.key, e->key, sizeof(ngx_rbtree_key_t));
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+    ngx_memcpy(fcn->key, &e->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
-    }
+    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-    c->node->updating = 0;
+    fcn->uses = 1;
+    fcn->exists = 1;
+    fcn->indexed = 1;
+    fcn->uniq = e->uniq;
+    fcn->body_start = e->body_start;
+    fcn->fs_size = e->fs_size;
+    fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    cache->sh->size += e->fs_size;
+
+    ngx_http_file_cache_enqueue(cache, fcn, 0);
+
+    return NGX_OK;
 }
 
 
-void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
+static void
+ngx_http_file_cache_index_sweep(ngx_http_file_cache_t *cache)
 {
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
+    u_char                      *p, key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_uint_t                   i, n, bits, mask, swept;
+    ngx_rbtree_node_t           *node, *next;
+    ngx_http_file_cache_node_t  *fcn;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
+    /*
+     * entries of the walked directories which were not confirmed
+     * by the walk refer to the files deleted after the snapshot
+     */
 
-    c = r->cache;
+    bits = 0;
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        bits += 4 * cache->path->level[i];
+    }
 
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+    mask = ((ngx_uint_t) 1 << bits) - 1;
 
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
+    ngx_memzero(key, NGX_HTTP_CACHE_KEY_LEN);
 
-        /* cache file may have been deleted */
+    swept = 0;
 
-        if (err == NGX_ENOENT) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache \"%s\" not found",
-                           file.name.data);
-            return;
-        }
+    for ( ;; ) {
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                      ngx_open_file_n " \"%s\" failed", file.name.data);
-        return;
-    }
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-    /*
-     * make sure cache file wasn't replaced;
-     * if it was, do nothing
-     */
+        node = ngx_http_file_cache_index_next(cache, key);
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_fd_info_n " \"%s\" failed", file.name.data);
-        goto done;
-    }
+        for (i = 0; node && i < NGX_HTTP_CACHE_INDEX_BATCH; i++) {
+            fcn = (ngx_http_file_cache_node_t *) node;
+            next = ngx_rbtree_next(&cache->sh->rbtree, node);
 
-    if (c->uniq != ngx_file_uniq(&fi)
-        || c->length != ngx_file_size(&fi))
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" changed",
-                       file.name.data);
-        goto done;
-    }
+            if (fcn->indexed) {
+                fcn->indexed = 0;
 
-    n = ngx_read_file(&file, (u_char *) &h,
-                      sizeof(ngx_http_file_cache_header_t), 0);
+                p = ngx_cpymem(key, &node->key, sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(p, fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    if (n == NGX_ERROR) {
-        goto done;
-    }
+                n = ((key[NGX_HTTP_CACHE_KEY_LEN - 3] << 16)
+                     | (key[NGX_HTTP_CACHE_KEY_LEN - 2] << 8)
+                     | key[NGX_HTTP_CACHE_KEY_LEN - 1])
+                    & mask;
 
-    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      ngx_read_file_n " read only %z of %z from \"%s\"",
-                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
-        goto done;
-    }
+                if (fcn->exists
+                    && fcn->count == 0
+                    && cache->index_dirs[n])
+                {
+                    if (fcn->protected) {
+                        cache->sh->protected_count--;
+                    }
 
-    if (h.version != NGX_HTTP_CACHE_VERSION
-        || h.last_modified != c->last_modified
-        || h.crc32 != c->crc32
-        || (size_t) h.header_start != c->header_start
-        || (size_t) h.body_start != c->body_start)
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" content changed",
-                       file.name.data);
-        goto done;
-    }
+                    if (fcn->hot) {
+                        ngx_http_file_cache_hot_delete(cache, fcn->hot);
+                    }
 
-    /*
-     * update cache file header with new data,
-     * notably h.valid_sec and h.date
-     */
+                    ngx_http_file_cache_sparse_delete(cache, fcn);
+                    ngx_http_file_cache_purge_delete(cache, fcn);
 
-    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+                    cache->sh->size -= fcn->fs_size;
 
-    h.version = NGX_HTTP_CACHE_VERSION;
-    h.valid_sec = c->valid_sec;
-    h.updating_sec = c->updating_sec;
-    h.error_sec = c->error_sec;
-    h.last_modified = c->last_modified;
-    h.date = c->date;
-    h.crc32 = c->crc32;
-    h.valid_msec = (u_short) c->valid_msec;
-    h.header_start = (u_short) c->header_start;
-    h.body_start = (u_short) c->body_start;
+                    ngx_queue_remove(&fcn->queue);
+                    ngx_rbtree_delete(&cache->sh->rbtree, node);
+                    ngx_slab_free_locked(cache->shpool, fcn);
+                    cache->sh->count--;
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h.etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
-    }
+                    swept++;
+                }
+            }
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+            node = next;
         }
 
-        h.vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
-
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
-    }
-
-    (void) ngx_write_file(&file, (u_char *) &h,
-                          sizeof(ngx_http_file_cache_header_t), 0);
+        if (node) {
+            p = ngx_cpymem(key, &node->key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(p, ((ngx_http_file_cache_node_t *) node)->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
 
-done:
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_file_n " \"%s\" failed", file.name.data);
+        if (node == NULL) {
+            break;
+        }
     }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index swept: %ui", swept);
 }
 
 
-ngx_int_t
-ngx_http_cache_send(ngx_http_request_t *r)
+static ngx_rbtree_node_t *
+ngx_http_file_cache_index_next(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel, *found;
+    ngx_http_file_cache_node_t  *fcn;
 
-    c = r->cache;
+    /* the first node with a key not less than the given one */
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache send: %s", c->file.name.data);
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    /* we need to allocate all before the header would be sent */
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+    found = NULL;
 
-    b = ngx_calloc_buf(r->pool);
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+    while (node != sentinel) {
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        if (node_key != node->key) {
+            rc = (node_key < node->key) ? -1 : 1;
+
+        } else {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
+
+        if (rc <= 0) {
+            found = node;
+
+            if (rc == 0) {
+                break;
+            }
+
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
     }
 
-    rc = ngx_http_send_header(r);
+    return found;
+}
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
+
+static ngx_int_t
+ngx_http_file_cache_index_dir(ngx_http_file_cache_t *cache, u_char *p)
+{
+    u_char      *level[NGX_MAX_PATH_LEVEL];
+    ngx_int_t    n, rc;
+    ngx_uint_t   i, len;
+
+    /*
+     * a leaf directory "/c/ab" holds files with names ending in "abc",
+     * the directory is numbered by these trailing hex digits
+     */
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL && cache->path->level[i]; i++) {
+        level[i] = p + 1;
+        p += cache->path->level[i] + 1;
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    rc = 0;
 
-    b->in_file = (c->length - c->body_start) ? 1 : 0;
-    b->last_buf = (r == r->main) ? 1 : 0;
-    b->last_in_chain = 1;
-    b->sync = (b->last_buf || b->in_file) ? 0 : 1;
+    while (i--) {
+        len = cache->path->level[i];
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+        n = ngx_hextoi(level[i], len);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
-    out.buf = b;
-    out.next = NULL;
+        rc = (rc << 4 * len) | n;
+    }
 
-    return ngx_http_output_filter(r, &out);
+    return rc;
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static ngx_int_t
+ngx_http_file_cache_segment_init(ngx_http_file_cache_t *cache, ngx_log_t *log)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    u_char                         *name, *p;
+    size_t                          len;
+    uint32_t                        id;
+    ngx_int_t                       n, rc;
+    ngx_err_t                       err;
+    ngx_dir_t                       dir;
+    ngx_queue_t                    *q;
+    ngx_file_info_t                 fi;
+    ngx_http_file_cache_segment_t  *seg, *s;
+
+    cache->sh->segment_id = 1;
+    cache->sh->segment_start = 1;
+
+    if (cache->segment_size == 0) {
+        return NGX_OK;
+    }
 
-    if (c->updated || c->node == NULL) {
-        return;
+    if (ngx_open_dir(&cache->path->name, &dir) == NGX_ERROR) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOENT) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, log, err,
+                      ngx_open_dir_n " \"%V\" failed", &cache->path->name);
+        return NGX_ERROR;
     }
 
-    cache = c->file_cache;
+    name = ngx_alloc(cache->path->name.len + NGX_HTTP_CACHE_SEGMENT_NAME_LEN
+                     + 1, log);
+    if (name == NULL) {
+        rc = NGX_ERROR;
+        goto done;
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    /* segments left by the previous run are loaded by the cache loader */
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    id = 1;
+    rc = NGX_OK;
 
-    fcn = c->node;
-    fcn->count--;
+    for ( ;; ) {
+        ngx_set_errno(0);
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
-    }
+        if (ngx_read_dir(&dir) == NGX_ERROR) {
+            err = ngx_errno;
 
-    if (c->error) {
-        fcn->error = c->error;
+            if (err != NGX_ENOMOREFILES) {
+                ngx_log_error(NGX_LOG_CRIT, log, err,
+                              ngx_read_dir_n " \"%V\" failed",
+                              &cache->path->name);
+                rc = NGX_ERROR;
+            }
+
+            break;
+        }
+
+        len = ngx_de_namelen(&dir);
+        p = ngx_de_name(&dir);
+
+        if (len != NGX_HTTP_CACHE_SEGMENT_NAME_LEN - 1
+            || ngx_strncmp(p, "segment.", sizeof("segment.") - 1) != 0)
+        {
+            continue;
+        }
+
+        n = ngx_hextoi(p + sizeof("segment.") - 1, 8);
+
+        if (n == NGX_ERROR || n == 0) {
+            continue;
+        }
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
+        (void) ngx_http_file_cache_segment_name(cache, name, (uint32_t) n);
+
+        if (ngx_file_info(name, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_file_info_n " \"%s\" failed", name);
+            continue;
         }
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
-    }
+        seg = ngx_slab_calloc(cache->shpool,
+                              sizeof(ngx_http_file_cache_segment_t));
+        if (seg == NULL) {
+            rc = NGX_ERROR;
+            break;
+        }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        seg->id = (uint32_t) n;
+        seg->size = ngx_file_size(&fi);
 
-    c->updated = 1;
-    c->updating = 0;
+        /* the segments are kept sorted by id */
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
+        for (q = ngx_queue_last(&cache->sh->segments);
+             q != ngx_queue_sentinel(&cache->sh->segments);
+             q = ngx_queue_prev(q))
+        {
+            s = ngx_queue_data(q, ngx_http_file_cache_segment_t, queue);
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
+            if (s->id < seg->id) {
+                break;
             }
         }
-    }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
+        ngx_queue_insert_after(q, &seg->queue);
+
+        if (seg->id >= id) {
+            id = seg->id + 1;
+        }
     }
-}
 
+    cache->sh->segment_id = id;
+    cache->sh->segment_start = id;
 
-static void
-ngx_http_file_cache_cleanup(void *data)
-{
-    ngx_http_cache_t  *c = data;
+    ngx_free(name);
 
-    if (c->updated) {
-        return;
+done:
+
+    if (ngx_close_dir(&dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_close_dir_n " \"%V\" failed", &cache->path->name);
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+    return rc;
+}
 
-    if (c->updating && !c->background) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
-    }
 
-    ngx_http_file_cache_free(c, NULL);
+static u_char *
+ngx_http_file_cache_segment_name(ngx_http_file_cache_t *cache, u_char *name,
+    uint32_t id)
+{
+    return ngx_sprintf(name, "%V/segment.%08xD%Z", &cache->path->name, id);
 }
 
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+static ngx_int_t
+ngx_http_file_cache_segment_file(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    ngx_http_file_cache_t  *cache;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    cache = c->file_cache;
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    c->file.name.len = cache->path->name.len + NGX_HTTP_CACHE_SEGMENT_NAME_LEN;
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
+    if (c->file.name.data == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    (void) ngx_http_file_cache_segment_name(cache, c->file.name.data,
+                                            c->segment);
 
-    wait = 10;
-    tries = 20;
-    sentinel = NULL;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cache segment: \"%s\" %O", c->file.name.data, c->offset);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    return NGX_OK;
+}
 
-    for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            break;
-        }
 
-        q = ngx_queue_last(&cache->sh->queue);
+static ngx_http_file_cache_segment_t *
+ngx_http_file_cache_segment_reserve(ngx_http_file_cache_t *cache, off_t size,
+    off_t *offset)
+{
+    ngx_http_file_cache_segment_t  *seg;
 
-        if (q == sentinel) {
-            break;
+    seg = cache->sh->segment;
+
+    if (seg == NULL
+        || (seg->size && seg->size + size > cache->segment_size))
+    {
+        seg = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_segment_t));
+        if (seg == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate segment%s",
+                          cache->shpool->log_ctx);
+            return NULL;
         }
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        seg->id = cache->sh->segment_id++;
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+        ngx_queue_insert_tail(&cache->sh->segments, &seg->queue);
+        cache->sh->segment = seg;
+    }
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
-            break;
-        }
+    *offset = seg->size;
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+    seg->size += size;
+    seg->writing++;
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+    return seg;
+}
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+static void
+ngx_http_file_cache_segment_attach(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_http_file_cache_segment_t *seg,
+    off_t offset, off_t length)
+{
+    ngx_http_file_cache_segment_release(cache, fcn);
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    fcn->segment = seg;
+    fcn->offset = offset;
+    fcn->length = length;
 
-        if (sentinel == NULL) {
-            sentinel = q;
-        }
+    seg->live += sizeof(ngx_http_file_cache_record_t) + length;
+}
 
-        if (--tries) {
-            continue;
-        }
 
-        wait = 1;
-        break;
+static void
+ngx_http_file_cache_segment_release(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    if (fcn->segment == NULL) {
+        return;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    ngx_free(name);
+    fcn->segment->live -= sizeof(ngx_http_file_cache_record_t) + fcn->length;
 
-    return wait;
+    fcn->segment = NULL;
+    fcn->offset = 0;
+    fcn->length = 0;
 }
 
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+static ngx_http_file_cache_segment_t *
+ngx_http_file_cache_segment_write(ngx_http_request_t *r, ngx_temp_file_t *tf,
+    off_t *offset, off_t *length)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    off_t                           start, size;
+    u_char                         *buf;
+    ngx_int_t                       rc;
+    ngx_file_t                      file, src;
+    ngx_file_info_t                 fi;
+    ngx_http_cache_t               *c;
+    ngx_http_file_cache_t          *cache;
+    ngx_http_file_cache_segment_t  *seg;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
-
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    c = r->cache;
+    cache = c->file_cache;
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+        return NULL;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    size = ngx_file_size(&fi);
 
-    now = ngx_time();
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    file.log = r->connection->log;
+    file.name.len = cache->path->name.len + NGX_HTTP_CACHE_SEGMENT_NAME_LEN;
 
-    for ( ;; ) {
+    file.name.data = ngx_pnalloc(r->pool, file.name.len + 1);
+    if (file.name.data == NULL) {
+        return NULL;
+    }
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+    buf = ngx_alloc(NGX_HTTP_CACHE_SEGMENT_BUFFER, r->connection->log);
+    if (buf == NULL) {
+        return NULL;
+    }
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        q = ngx_queue_last(&cache->sh->queue);
+    seg = ngx_http_file_cache_segment_reserve(cache,
+                                  sizeof(ngx_http_file_cache_record_t) + size,
+                                  &start);
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        wait = fcn->expire - now;
+    if (seg == NULL) {
+        ngx_free(buf);
+        return NULL;
+    }
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
+    (void) ngx_http_file_cache_segment_name(cache, file.name.data, seg->id);
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache segment write: \"%s\" %O:%O",
+                   file.name.data, start, size);
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
-        }
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR,
+                            NGX_FILE_CREATE_OR_OPEN, NGX_FILE_OWNER_ACCESS);
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        goto failed;
+    }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+    src = tf->file;
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+    rc = ngx_http_file_cache_segment_record(&file, start, c->key, &src, 0,
+                                            size, buf);
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    if (rc != NGX_OK) {
+        goto failed;
+    }
 
-next:
+    ngx_free(buf);
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
-            break;
-        }
+    *offset = start + sizeof(ngx_http_file_cache_record_t);
+    *length = size;
 
-        ngx_time_update();
+    return seg;
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+failed:
 
-        if (elapsed >= cache->manager_threshold) {
-            wait = 0;
-            break;
-        }
-    }
+    ngx_free(buf);
 
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    seg->writing--;
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    ngx_free(name);
-
-    return wait;
+    return NULL;
 }
 
 
-static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+static ngx_int_t
+ngx_http_file_cache_segment_record(ngx_file_t *file, off_t offset,
+    u_char *key, ngx_file_t *src, off_t from, off_t length, u_char *buf)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+    off_t                          to;
+    size_t                         size;
+    ssize_t                        n;
+    ngx_http_file_cache_record_t   rec;
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    /*
+     * the record is marked complete after the object is written,
+     * so an interrupted write is skipped by the loader
+     */
+
+    ngx_memzero(&rec, sizeof(ngx_http_file_cache_record_t));
+
+    rec.magic = NGX_HTTP_CACHE_RECORD_PENDING;
+    rec.length = length;
+    ngx_memcpy(rec.key, key, NGX_HTTP_CACHE_KEY_LEN);
+
+    if (ngx_write_file(file, (u_char *) &rec,
+                       sizeof(ngx_http_file_cache_record_t), offset)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+    to = offset + sizeof(ngx_http_file_cache_record_t);
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    while (length) {
+        size = (size_t) ngx_min(length, NGX_HTTP_CACHE_SEGMENT_BUFFER);
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        n = ngx_read_file(src, buf, size, from);
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_CRIT, src->log, 0,
+                          "file \"%s\" is truncated at %O",
+                          src->name.data, from);
+            return NGX_ERROR;
+        }
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
+        if (ngx_write_file(file, buf, n, to) == NGX_ERROR) {
+            return NGX_ERROR;
         }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
+        from += n;
+        to += n;
+        length -= n;
     }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+    rec.magic = NGX_HTTP_CACHE_RECORD_COMPLETE;
+
+    if (ngx_write_file(file, (u_char *) &rec.magic, sizeof(uint32_t), offset)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
     }
+
+    return NGX_OK;
 }
 
 
-static ngx_msec_t
-ngx_http_file_cache_manager(void *data)
+static ngx_int_t
+ngx_http_file_cache_segment_load(ngx_http_file_cache_walk_t *walk)
 {
-    ngx_http_file_cache_t  *cache = data;
-
-    off_t       size, free;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+    off_t                           offset, next, size;
+    u_char                         *buf;
+    ssize_t                         n;
+    uint32_t                        id;
+    ngx_int_t                       rc;
+    ngx_str_t                       key;
+    ngx_file_t                      file;
+    ngx_queue_t                    *q;
+    ngx_http_cache_t                c;
+    ngx_http_file_cache_t          *cache;
+    ngx_http_file_cache_record_t    rec;
+    ngx_http_file_cache_segment_t  *seg;
+
+    cache = walk->cache;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+    file.log = ngx_cycle->log;
+    file.name.len = cache->path->name.len + NGX_HTTP_CACHE_SEGMENT_NAME_LEN;
 
-    if (next == 0) {
-        next = cache->manager_sleep;
-        goto done;
+    file.name.data = ngx_alloc(file.name.len + 1, ngx_cycle->log);
+    if (file.name.data == NULL) {
+        return NGX_ERROR;
     }
 
+    rc = NGX_OK;
+    id = 0;
+
     for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+        /* segments are read in order, so later records replace earlier */
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        seg = NULL;
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-        if (size < cache->max_size && count < watermark) {
+        for (q = ngx_queue_head(&cache->sh->segments);
+             q != ngx_queue_sentinel(&cache->sh->segments);
+             q = ngx_queue_next(q))
+        {
+            seg = ngx_queue_data(q, ngx_http_file_cache_segment_t, queue);
 
-            if (!cache->min_free) {
+            if (seg->id > id) {
                 break;
             }
 
-            free = ngx_fs_available(cache->path->name.data);
-
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                           "http file cache free: %O", free);
-
-            if (free > cache->min_free) {
-                break;
-            }
+            seg = NULL;
         }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        if (wait > 0) {
-            next = (ngx_msec_t) wait * 1000;
+        if (seg == NULL || seg->id >= cache->sh->segment_start) {
             break;
         }
 
-        if (ngx_quit || ngx_terminate) {
-            break;
-        }
+        id = seg->id;
+        size = seg->size;
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
-            break;
-        }
+        (void) ngx_http_file_cache_segment_name(cache, file.name.data, id);
 
-        ngx_time_update();
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache segment load: \"%s\" %O",
+                       file.name.data, size);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY,
+                                NGX_FILE_OPEN, 0);
 
-        if (elapsed >= cache->manager_threshold) {
-            next = cache->manager_sleep;
-            break;
+        if (file.fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", file.name.data);
+            continue;
         }
-    }
 
-done:
+        for (offset = 0;
+             offset + (off_t) sizeof(ngx_http_file_cache_record_t) <= size;
+             offset = next)
+        {
+            n = ngx_read_file(&file, (u_char *) &rec,
+                              sizeof(ngx_http_file_cache_record_t), offset);
 
-    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+            if (n == NGX_ERROR) {
+                break;
+            }
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
+            next = offset + sizeof(ngx_http_file_cache_record_t);
+
+            if ((size_t) n != sizeof(ngx_http_file_cache_record_t)
+                || (rec.magic != NGX_HTTP_CACHE_RECORD_PENDING
+                    && rec.magic != NGX_HTTP_CACHE_RECORD_COMPLETE)
+                || rec.length < 0
+                || rec.length > size - next)
+            {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0,
+                              "cache segment \"%s\" is corrupted at %O",
+                              file.name.data, offset);
+                break;
+            }
 
-    return next;
-}
+            if (rec.magic == NGX_HTTP_CACHE_RECORD_COMPLETE) {
+                ngx_memzero(&c, sizeof(ngx_http_cache_t));
 
+                ngx_memcpy(c.key, rec.key, NGX_HTTP_CACHE_KEY_LEN);
 
-static void
-ngx_http_file_cache_loader(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+                c.offset = next;
+                c.length = rec.length;
+                c.fs_size = (sizeof(ngx_http_file_cache_record_t) + rec.length
+                             + cache->bsize - 1) / cache->bsize;
 
-    ngx_tree_ctx_t  tree;
+                buf = NULL;
 
-    if (!cache->sh->cold || cache->sh->loading) {
-        return;
-    }
+                if (cache->purge) {
+                    buf = ngx_http_file_cache_loader_key(cache, &file, &c,
+                                                         &key);
+                }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
-    }
+                (void) ngx_http_file_cache_add(cache, &c, seg);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+                if (buf) {
+                    ngx_free(buf);
+                }
+            }
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+            next += rec.length;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+            ngx_http_file_cache_loader_progress(walk);
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
-        return;
+            if (ngx_quit || ngx_terminate) {
+                rc = NGX_ABORT;
+                break;
+            }
+        }
+
+        if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", file.name.data);
+        }
+
+        if (rc == NGX_ABORT) {
+            break;
+        }
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    ngx_free(file.name.data);
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
+    return rc;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+ngx_http_file_cache_segment_manage(ngx_http_file_cache_t *cache)
 {
-    return NGX_OK;
-}
+    u_char                         *name;
+    uint32_t                        id;
+    ngx_int_t                       rc;
+    ngx_queue_t                    *q;
+    ngx_http_file_cache_segment_t  *seg, *compact;
+
+    name = ngx_alloc(cache->path->name.len + NGX_HTTP_CACHE_SEGMENT_NAME_LEN
+                     + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return NGX_OK;
+    }
 
+    for ( ;; ) {
+        id = 0;
+        compact = NULL;
 
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-    cache = ctx->data;
+        for (q = ngx_queue_head(&cache->sh->segments);
+             q != ngx_queue_sentinel(&cache->sh->segments);
+             q = ngx_queue_next(q))
+        {
+            seg = ngx_queue_data(q, ngx_http_file_cache_segment_t, queue);
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
-    }
+            if (seg == cache->sh->segment || seg->writing) {
+                continue;
+            }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+            if (seg->live == 0) {
+                id = seg->id;
 
-    } else {
-        ngx_time_update();
+                ngx_queue_remove(&seg->queue);
+                ngx_slab_free_locked(cache->shpool, seg);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+                break;
+            }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+            if (seg->failed) {
+                continue;
+            }
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
+            /*
+             * a segment which is mostly dead is compacted by moving
+             * the live objects into the current segment
+             */
+
+            if (seg->compact
+                || (compact == NULL && seg->live < seg->size / 2))
+            {
+                compact = seg;
+            }
         }
-    }
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
-}
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
+        if (id == 0) {
+            break;
+        }
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
-    }
+        (void) ngx_http_file_cache_segment_name(cache, name, id);
 
-    return NGX_OK;
-}
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache segment delete: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+    }
 
+    rc = NGX_OK;
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
-{
-    ngx_msleep(cache->loader_sleep);
+    if (compact) {
+        rc = ngx_http_file_cache_segment_compact(cache, compact, name);
+    }
 
-    ngx_time_update();
+    ngx_free(name);
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    return rc;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+ngx_http_file_cache_segment_compact(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_segment_t *seg, u_char *name)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
-
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
-    }
+    off_t                           offset, next, size, start;
+    u_char                         *buf;
+    ssize_t                         n;
+    uint32_t                        id;
+    ngx_int_t                       rc;
+    ngx_msec_t                      elapsed;
+    ngx_file_t                      file, target;
+    ngx_http_file_cache_node_t     *fcn;
+    ngx_http_file_cache_record_t    rec;
+    ngx_http_file_cache_segment_t  *dst;
 
     /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
+     * segments are freed by the cache manager only,
+     * so the segment stays valid while it is compacted
      */
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
-    {
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    ngx_memzero(&target, sizeof(ngx_file_t));
+
+    file.name.len = cache->path->name.len + NGX_HTTP_CACHE_SEGMENT_NAME_LEN;
+    file.name.data = name;
+    file.log = ngx_cycle->log;
+
+    target.name.len = file.name.len;
+    target.fd = NGX_INVALID_FILE;
+    target.log = ngx_cycle->log;
+
+    buf = ngx_alloc(NGX_HTTP_CACHE_SEGMENT_BUFFER + target.name.len + 1,
+                    ngx_cycle->log);
+    if (buf == NULL) {
         return NGX_OK;
     }
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
+    target.name.data = buf + NGX_HTTP_CACHE_SEGMENT_BUFFER;
+
+    (void) ngx_http_file_cache_segment_name(cache, name, seg->id);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache segment compact: \"%s\" %O",
+                   name, seg->compact);
+
+    file.fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+        goto failed;
     }
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    offset = seg->compact;
+    size = seg->size;
+    id = 0;
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    rc = NGX_OK;
+
+    while (offset + (off_t) sizeof(ngx_http_file_cache_record_t) <= size) {
+
+        n = ngx_read_file(&file, (u_char *) &rec,
+                          sizeof(ngx_http_file_cache_record_t), offset);
+
+        if (n == NGX_ERROR) {
+            goto failed;
+        }
+
+        next = offset + sizeof(ngx_http_file_cache_record_t);
+
+        if ((size_t) n != sizeof(ngx_http_file_cache_record_t)
+            || (rec.magic != NGX_HTTP_CACHE_RECORD_PENDING
+                && rec.magic != NGX_HTTP_CACHE_RECORD_COMPLETE)
+            || rec.length < 0
+            || rec.length > size - next)
+        {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0,
+                          "cache segment \"%s\" is corrupted at %O",
+                          name, offset);
+            goto failed;
+        }
+
+        dst = NULL;
+
+        if (rec.magic == NGX_HTTP_CACHE_RECORD_COMPLETE) {
+
+            ngx_shmtx_lock(&cache->shpool->mutex);
+
+            fcn = ngx_http_file_cache_lookup(cache, rec.key);
+
+            if (fcn && fcn->segment == seg && fcn->offset == next) {
+                dst = ngx_http_file_cache_segment_reserve(cache,
+                                  sizeof(ngx_http_file_cache_record_t)
+                                  + rec.length, &start);
+                if (dst == NULL) {
+                    ngx_shmtx_unlock(&cache->shpool->mutex);
+                    goto failed;
+                }
+            }
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+        }
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+        if (dst) {
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+            if (dst->id != id) {
+                if (target.fd != NGX_INVALID_FILE
+                    && ngx_close_file(target.fd) == NGX_FILE_ERROR)
+                {
+                    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                                  ngx_close_file_n " \"%s\" failed",
+                                  target.name.data);
+                }
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
-        }
+                id = dst->id;
 
-        p += 2;
+                (void) ngx_http_file_cache_segment_name(cache,
+                                                        target.name.data, id);
 
-        c.key[i] = (u_char) n;
-    }
+                target.fd = ngx_open_file(target.name.data, NGX_FILE_RDWR,
+                                          NGX_FILE_CREATE_OR_OPEN,
+                                          NGX_FILE_OWNER_ACCESS);
 
-    return ngx_http_file_cache_add(cache, &c);
-}
+                if (target.fd == NGX_INVALID_FILE) {
+                    ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                                  ngx_open_file_n " \"%s\" failed",
+                                  target.name.data);
+                }
+            }
 
+            rc = NGX_ERROR;
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
-{
-    ngx_http_file_cache_node_t  *fcn;
+            if (target.fd != NGX_INVALID_FILE) {
+                rc = ngx_http_file_cache_segment_record(&target, start,
+                                                        rec.key, &file, next,
+                                                        rec.length, buf);
+            }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+            ngx_shmtx_lock(&cache->shpool->mutex);
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+            dst->writing--;
 
-    if (fcn == NULL) {
+            /* the node may have been replaced or deleted meanwhile */
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+            fcn = ngx_http_file_cache_lookup(cache, rec.key);
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
+            if (rc == NGX_OK
+                && fcn && fcn->segment == seg && fcn->offset == next)
+            {
+                ngx_http_file_cache_segment_attach(cache, fcn, dst,
+                                  start + sizeof(ngx_http_file_cache_record_t),
+                                  rec.length);
             }
 
             ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
-        }
 
-        cache->sh->count++;
+            if (rc != NGX_OK) {
+                goto failed;
+            }
+        }
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        offset = next + rec.length;
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        if (++cache->files >= cache->manager_files) {
+            rc = NGX_AGAIN;
+            break;
+        }
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+        ngx_time_update();
 
-        cache->sh->size += c->fs_size;
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
+        if (elapsed >= cache->manager_threshold) {
+            rc = NGX_AGAIN;
+            break;
+        }
     }
 
-    fcn->expire = ngx_time() + cache->inactive;
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    seg->compact = offset;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    if (offset + (off_t) sizeof(ngx_http_file_cache_record_t) > size
+        && seg->live)
+    {
+        /* objects not found in the keys zone, should not happen */
+        seg->failed = 1;
+    }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    return NGX_OK;
-}
+    goto done;
 
+failed:
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    seg->failed = 1;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
-    }
+    rc = NGX_OK;
 
-    return NGX_OK;
-}
+done:
 
+    if (file.fd != NGX_INVALID_FILE
+        && ngx_close_file(file.fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
 
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
-{
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    if (target.fd != NGX_INVALID_FILE
+        && ngx_close_file(target.fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", target.name.data);
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+    ngx_free(buf);
+
+    return rc;
 }
 
 
@@ -2380,15 +7060,17 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char  *confp = conf;
 
-    off_t                   max_size, min_free;
+    off_t                   max_size, min_free, segment_size;
     u_char                 *last, *p;
-    time_t                  inactive;
-    ssize_t                 size;
+    time_t                  inactive, index_interval;
+    ssize_t                 size, hot_size, hot_max_object, sparse;
     ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files, manager_files;
+    ngx_int_t               loader_files, manager_files, hot_min_uses,
+                            loader_threads, manager_threads;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    ngx_uint_t              i, n, use_temp_path, use_index, policy,
+                            read_while_write, purge;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
 
@@ -2403,22 +7085,36 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     use_temp_path = 1;
+    use_index = 0;
+    read_while_write = 0;
+    purge = 0;
+    policy = NGX_HTTP_CACHE_LRU;
 
     inactive = 600;
+    index_interval = 300;
 
     loader_files = 100;
     loader_sleep = 50;
     loader_threshold = 200;
+    loader_threads = 1;
 
     manager_files = 100;
     manager_sleep = 50;
     manager_threshold = 200;
+    manager_threads = 1;
 
     name.len = 0;
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
     min_free = 0;
 
+    hot_size = 0;
+    hot_max_object = 64 * 1024;
+    hot_min_uses = 2;
+
+    sparse = 0;
+    segment_size = 0;
+
     value = cf->args->elts;
 
     cache->path->name = value[1];
@@ -2489,6 +7185,111 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "read_while_write=", 17) == 0) {
+
+            if (ngx_strcmp(&value[i].data[17], "on") == 0) {
+                read_while_write = 1;
+
+            } else if (ngx_strcmp(&value[i].data[17], "off") == 0) {
+                read_while_write = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid read_while_write value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "purge=", 6) == 0) {
+
+            if (ngx_strcmp(&value[i].data[6], "on") == 0) {
+                purge = 1;
+
+            } else if (ngx_strcmp(&value[i].data[6], "off") == 0) {
+                purge = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid purge value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "tags=", 5) == 0) {
+
+            cache->tags.len = value[i].len - 5;
+            cache->tags.data = value[i].data + 5;
+
+            if (cache->tags.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid tags value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            if (ngx_strcmp(&value[i].data[6], "on") == 0) {
+                use_index = 1;
+
+            } else if (ngx_strcmp(&value[i].data[6], "off") == 0) {
+                use_index = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index_interval=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            index_interval = ngx_parse_time(&s, 1);
+            if (index_interval == (time_t) NGX_ERROR || index_interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                              "invalid index_interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "policy=", 7) == 0) {
+
+            if (ngx_strcmp(&value[i].data[7], "lru") == 0) {
+                policy = NGX_HTTP_CACHE_LRU;
+
+            } else if (ngx_strcmp(&value[i].data[7], "tinylfu") == 0) {
+                policy = NGX_HTTP_CACHE_TINYLFU;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid policy value \"%V\", "
+                                   "it must be \"lru\" or \"tinylfu\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
 
             name.data = value[i].data + 10;
@@ -2576,6 +7377,78 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "memory=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            hot_size = ngx_parse_size(&s);
+            if (hot_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_max_object=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            hot_max_object = ngx_parse_size(&s);
+            if (hot_max_object == NGX_ERROR || hot_max_object == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_max_object value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sparse=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            sparse = ngx_parse_size(&s);
+            if (sparse == NGX_ERROR || sparse == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sparse value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "segments=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            segment_size = ngx_parse_offset(&s);
+            if (segment_size == NGX_ERROR || segment_size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid segments value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_min_uses=", 16) == 0) {
+
+            hot_min_uses = ngx_atoi(value[i].data + 16, value[i].len - 16);
+            if (hot_min_uses == NGX_ERROR || hot_min_uses == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_min_uses value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "loader_files=", 13) == 0) {
 
             loader_files = ngx_atoi(value[i].data + 13, value[i].len - 13);
@@ -2618,6 +7491,27 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "loader_threads=", 15) == 0) {
+
+            loader_threads = ngx_atoi(value[i].data + 15, value[i].len - 15);
+            if (loader_threads == NGX_ERROR || loader_threads == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid loader_threads value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_THREADS)
+            if (loader_threads > 1) {
+                ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                                   "loader_threads require thread support, "
+                                   "ignored");
+                loader_threads = 1;
+            }
+#endif
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "manager_files=", 14) == 0) {
 
             manager_files = ngx_atoi(value[i].data + 14, value[i].len - 14);
@@ -2660,6 +7554,27 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "manager_threads=", 16) == 0) {
+
+            manager_threads = ngx_atoi(value[i].data + 16, value[i].len - 16);
+            if (manager_threads == NGX_ERROR || manager_threads == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid manager_threads value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_THREADS)
+            if (manager_threads > 1) {
+                ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                                   "manager_threads require thread support, "
+                                   "ignored");
+                manager_threads = 1;
+            }
+#endif
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -2672,6 +7587,23 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (use_index && (purge || cache->tags.len)) {
+
+        /* the snapshot does not keep keys to be purged */
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"index\" parameter is incompatible with "
+                           "\"%s\" parameter", purge ? "purge" : "tags");
+        return NGX_CONF_ERROR;
+    }
+
+    if (segment_size && (sparse || use_index)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"segments\" parameter is incompatible with "
+                           "\"%s\" parameter", sparse ? "sparse" : "index");
+        return NGX_CONF_ERROR;
+    }
+
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
     cache->path->data = cache;
@@ -2680,15 +7612,20 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->loader_files = loader_files;
     cache->loader_sleep = loader_sleep;
     cache->loader_threshold = loader_threshold;
+    cache->loader_threads = loader_threads;
     cache->manager_files = manager_files;
     cache->manager_sleep = manager_sleep;
     cache->manager_threshold = manager_threshold;
+    cache->manager_threads = manager_threads;
 
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
-    cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
+    /* the memory tier is allocated from the keys zone */
+
+    cache->shm_zone = ngx_shared_memory_add(cf, &name, size + hot_size,
+                                            cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
     }
@@ -2704,11 +7641,48 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->data = cache;
 
     cache->use_temp_path = use_temp_path;
+    cache->read_while_write = read_while_write;
+    cache->policy = policy;
+
+    /* tags are looked up in the purge index */
+
+    cache->purge = (purge || cache->tags.len) ? 1 : 0;
+
+    if (use_index) {
+        n = cache->path->name.len;
+
+        cache->index.len = n + sizeof("/index") - 1;
+        cache->index.data = ngx_pnalloc(cf->pool, n + sizeof("/index"));
+        if (cache->index.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->index.data, "%V/index%Z", &cache->path->name);
+
+        cache->index_temp.len = n + sizeof("/index.tmp") - 1;
+        cache->index_temp.data = ngx_pnalloc(cf->pool,
+                                             n + sizeof("/index.tmp"));
+        if (cache->index_temp.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->index_temp.data, "%V/index.tmp%Z",
+                    &cache->path->name);
+
+        cache->index_interval = index_interval;
+    }
 
     cache->inactive = inactive;
     cache->max_size = max_size;
     cache->min_free = min_free;
 
+    cache->hot_size = hot_size;
+    cache->hot_max_object = hot_max_object;
+    cache->hot_min_uses = hot_min_uses;
+
+    cache->sparse = sparse;
+    cache->segment_size = segment_size;
+
     caches = (ngx_array_t *) (confp + cmd->offset);
 
     ce = ngx_array_push(caches);
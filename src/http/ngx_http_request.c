@@ -36,6 +36,10 @@ static ngx_int_t ngx_http_read_early_body(ngx_http_request_t *r);
 static ngx_int_t ngx_http_find_virtual_server(ngx_connection_t *c,
     ngx_http_virtual_names_t *virtual_names, ngx_str_t *host,
     ngx_http_request_t *r, ngx_http_core_srv_conf_t **cscfp);
+#if (NGX_PCRE)
+static ngx_int_t ngx_http_find_server_regex(ngx_connection_t *c,
+    ngx_http_virtual_names_t *virtual_names, ngx_str_t *host, ngx_uint_t *ip);
+#endif
 
 static void ngx_http_request_handler(ngx_event_t *ev);
 static void ngx_http_terminate_request(ngx_http_request_t *r, ngx_int_t rc);
@@ -978,6 +982,9 @@ ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
     sscf = ngx_http_get_module_srv_conf(cscf->ctx, ngx_http_ssl_module);
 
     c->ssl->buffer_size = sscf->buffer_size;
+    c->ssl->record_size = sscf->record_size;
+    c->ssl->record_threshold = sscf->record_threshold;
+    c->ssl->record_idle = sscf->record_idle;
 
     if (sscf->ssl.ctx) {
         if (SSL_set_SSL_CTX(ssl_conn, sscf->ssl.ctx) == NULL) {
@@ -2583,41 +2590,29 @@ ngx_http_find_virtual_server(ngx_connection_t *c,
 
         sn = virtual_names->regex;
 
-#if (NGX_HTTP_SSL && defined SSL_CTRL_SET_TLSEXT_HOSTNAME)
-
-        if (r == NULL) {
-            ngx_http_connection_t  *hc;
+        for (i = 0; /* void */ ; i++) {
 
-            for (i = 0; i < virtual_names->nregex; i++) {
+            n = ngx_http_find_server_regex(c, virtual_names, host, &i);
 
-                n = ngx_regex_exec(sn[i].regex->regex, host, NULL, 0);
-
-                if (n == NGX_REGEX_NO_MATCHED) {
-                    continue;
-                }
+            if (n != NGX_OK) {
+                return n;
+            }
 
-                if (n >= 0) {
-                    hc = c->data;
-                    hc->ssl_servername_regex = sn[i].regex;
+#if (NGX_HTTP_SSL && defined SSL_CTRL_SET_TLSEXT_HOSTNAME)
 
-                    *cscfp = sn[i].server;
-                    return NGX_OK;
-                }
+            if (r == NULL) {
+                ngx_http_connection_t  *hc;
 
-                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                              ngx_regex_exec_n " failed: %i "
-                              "on \"%V\" using \"%V\"",
-                              n, host, &sn[i].regex->name);
+                hc = c->data;
+                hc->ssl_servername_regex = sn[i].regex;
 
-                return NGX_ERROR;
+                *cscfp = sn[i].server;
+                return NGX_OK;
             }
 
-            return NGX_DECLINED;
-        }
-
 #endif /* NGX_HTTP_SSL && defined SSL_CTRL_SET_TLSEXT_HOSTNAME */
 
-        for (i = 0; i < virtual_names->nregex; i++) {
+            /* captures are set by the regex of the server */
 
             n = ngx_http_regex_exec(r, sn[i].regex, host);
 
@@ -2640,6 +2635,76 @@ ngx_http_find_virtual_server(ngx_connection_t *c,
 }
 
 
+#if (NGX_PCRE)
+
+static ngx_int_t
+ngx_http_find_server_regex(ngx_connection_t *c,
+    ngx_http_virtual_names_t *virtual_names, ngx_str_t *host, ngx_uint_t *ip)
+{
+    ngx_int_t                 n;
+    ngx_uint_t                i, s;
+    ngx_http_server_name_t   *sn;
+    ngx_http_server_regex_t  *set;
+
+    sn = virtual_names->regex;
+    set = virtual_names->sets;
+
+    for (s = 0; s < virtual_names->nsets; s++) {
+
+        if (set[s].last <= *ip) {
+            continue;
+        }
+
+        if (set[s].regex && set[s].first >= *ip) {
+
+            n = ngx_regex_exec(set[s].regex, host, virtual_names->captures,
+                               virtual_names->ncaptures);
+
+            if (n == NGX_REGEX_NO_MATCHED) {
+                continue;
+            }
+
+            if (n < 2) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                              ngx_regex_exec_n " failed: %i "
+                              "on \"%V\" using server names regexes",
+                              n, host);
+                return NGX_ERROR;
+            }
+
+            /* the group of the regex which matched is the last one set */
+
+            *ip = set[s].first + n - 2;
+            return NGX_OK;
+        }
+
+        for (i = ngx_max(*ip, set[s].first); i < set[s].last; i++) {
+
+            n = ngx_regex_exec(sn[i].regex->regex, host, NULL, 0);
+
+            if (n == NGX_REGEX_NO_MATCHED) {
+                continue;
+            }
+
+            if (n < 0) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                              ngx_regex_exec_n " failed: %i "
+                              "on \"%V\" using \"%V\"",
+                              n, host, &sn[i].regex->name);
+                return NGX_ERROR;
+            }
+
+            *ip = i;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+#endif
+
+
 static void
 ngx_http_request_handler(ngx_event_t *ev)
 {
@@ -21,12 +21,27 @@ static ngx_int_t ngx_http_upstream_cache_background_update(
     ngx_http_request_t *r, ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_purge(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_tags(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_sparse(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_sparse_send(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_sparse_headers(ngx_http_request_t *r);
 static ngx_int_t ngx_http_upstream_cache_status(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_tier(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_counter(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_range(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 #endif
 
 static void ngx_http_upstream_init_request(ngx_http_request_t *r);
@@ -166,6 +181,10 @@ static ngx_int_t ngx_http_upstream_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_response_time_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_upstream_ssl_ktls_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+#endif
 static ngx_int_t ngx_http_upstream_response_length_variable(
     ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_header_variable(ngx_http_request_t *r,
@@ -443,12 +462,39 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_response_length_variable, 2,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+#if (NGX_HTTP_SSL)
+
+    { ngx_string("upstream_ssl_ktls"), NULL,
+      ngx_http_upstream_ssl_ktls_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+#endif
+
 #if (NGX_HTTP_CACHE)
 
     { ngx_string("upstream_cache_status"), NULL,
       ngx_http_upstream_cache_status, 0,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("upstream_cache_tier"), NULL,
+      ngx_http_upstream_cache_tier, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_rejected"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, rejected),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_evicted_probation"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, evicted_probation),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_cache_evicted_protected"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, evicted_protected),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
     { ngx_string("upstream_cache_last_modified"), NULL,
       ngx_http_upstream_cache_last_modified, 0,
       NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
@@ -457,6 +503,10 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_cache_etag, 0,
       NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
 
+    { ngx_string("upstream_cache_range"), NULL,
+      ngx_http_upstream_cache_range, 0,
+      NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
+
 #endif
 
     { ngx_string("upstream_http_"), NULL, ngx_http_upstream_header_variable,
@@ -876,7 +926,9 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     if (c == NULL) {
 
-        if (!(r->method & u->conf->cache_methods)) {
+        if (!(r->method & u->conf->cache_methods)
+            && u->conf->cache_purge == NULL)
+        {
             return NGX_DECLINED;
         }
 
@@ -921,6 +973,23 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->min_uses = u->conf->cache_min_uses;
         c->file_cache = cache;
 
+        switch (ngx_http_test_predicates(r, u->conf->cache_purge)) {
+
+        case NGX_ERROR:
+            return NGX_ERROR;
+
+        case NGX_DECLINED:
+            return ngx_http_upstream_cache_purge(r, u);
+
+        default: /* NGX_OK */
+            break;
+        }
+
+        if (!(r->method & u->conf->cache_methods)) {
+            r->cache = NULL;
+            return NGX_DECLINED;
+        }
+
         switch (ngx_http_test_predicates(r, u->conf->cache_bypass)) {
 
         case NGX_ERROR:
@@ -1134,6 +1203,10 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return NGX_DONE;
         }
 
+        if (c->sparse_send) {
+            ngx_http_upstream_cache_sparse_headers(r);
+        }
+
         return ngx_http_cache_send(r);
     }
 
@@ -1229,6 +1302,230 @@ ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+
+static ngx_int_t
+ngx_http_upstream_cache_purge(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t  rc;
+
+    rc = ngx_http_file_cache_purge(r);
+
+    switch (rc) {
+
+    case NGX_OK:
+        return NGX_HTTP_NO_CONTENT;
+
+    case NGX_DECLINED:
+        return NGX_HTTP_NOT_FOUND;
+
+    default:
+        return rc;
+    }
+}
+
+
+static void
+ngx_http_upstream_cache_tags(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_str_t        *name;
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    name = &r->cache->file_cache->tags;
+
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].hash == 0) {
+            continue;
+        }
+
+        if (h[i].key.len == name->len
+            && ngx_strncasecmp(h[i].key.data, name->data, name->len) == 0)
+        {
+            r->cache->tags = h[i].value;
+            return;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_sparse(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    off_t              start, end, length, last;
+    u_char            *p, *dash, *slash, *e;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT) {
+        return NGX_DECLINED;
+    }
+
+    if (r->headers_out.content_range == NULL) {
+        goto invalid;
+    }
+
+    /* "bytes start-end/length" */
+
+    p = r->headers_out.content_range->value.data;
+    e = p + r->headers_out.content_range->value.len;
+
+    if (e - p < 6 || ngx_strncasecmp(p, (u_char *) "bytes ", 6) != 0) {
+        goto invalid;
+    }
+
+    p += 6;
+
+    dash = ngx_strlchr(p, e, '-');
+    slash = ngx_strlchr(p, e, '/');
+
+    if (dash == NULL || slash == NULL || dash > slash) {
+        goto invalid;
+    }
+
+    start = ngx_atoof(p, dash - p);
+    end = ngx_atoof(dash + 1, slash - dash - 1);
+    length = ngx_atoof(slash + 1, e - slash - 1);
+
+    if (start == NGX_ERROR || end == NGX_ERROR || length == NGX_ERROR
+        || end < start || end >= length)
+    {
+        goto invalid;
+    }
+
+    last = (c->sparse_end == -1 || c->sparse_end >= length)
+           ? length - 1 : c->sparse_end;
+
+    if (start != c->sparse_start
+        || end != last
+        || (u->headers_in.content_length_n != -1
+            && u->headers_in.content_length_n != end - start + 1))
+    {
+        goto invalid;
+    }
+
+    if (!c->sparse_new) {
+
+        /* the rest of the file must belong to the same response */
+
+        if (length != c->sparse_length
+            || u->headers_in.last_modified_time != c->last_modified
+            || (u->headers_in.etag == NULL) != (c->etag.len == 0)
+            || (u->headers_in.etag
+                && (u->headers_in.etag->value.len != c->etag.len
+                    || ngx_strncmp(u->headers_in.etag->value.data,
+                                   c->etag.data, c->etag.len)
+                       != 0)))
+        {
+            c->sparse_new = 1;
+        }
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream cache sparse: %O-%O/%O n:%d",
+                   start, end, length, c->sparse_new);
+
+    c->sparse_start = start;
+    c->sparse_end = end;
+    c->sparse_length = length;
+
+    c->sparse_fill = 1;
+    c->sparse_commit = u->cacheable;
+
+    u->cacheable = 1;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "upstream sent unexpected range");
+
+    return NGX_HTTP_BAD_GATEWAY;
+}
+
+
+static void
+ngx_http_upstream_cache_sparse_send(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_int_t          rc;
+    ngx_temp_file_t   *tf;
+    ngx_http_cache_t  *c;
+    ngx_event_pipe_t  *p;
+
+    p = u->pipe;
+    tf = p->temp_file;
+    c = r->cache;
+
+    if (p->upstream_error) {
+        ngx_http_file_cache_free(c, tf);
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    if (ngx_http_file_cache_sparse_update(r, tf) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstream prematurely closed connection");
+
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    /* the client range is sent from the file just written */
+
+    c->file.fd = tf->file.fd;
+    c->file.log = r->connection->log;
+    c->length = c->body_start + c->sparse_length;
+    c->sparse_send = 1;
+    c->hot = 0;
+
+    ngx_http_upstream_cache_sparse_headers(r);
+
+    rc = ngx_http_cache_send(r);
+
+    ngx_http_upstream_finalize_request(r, u, rc);
+}
+
+
+static void
+ngx_http_upstream_cache_sparse_headers(ngx_http_request_t *r)
+{
+    /* the range filter cuts the client range out of the whole response */
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.status_line.len = 0;
+    r->headers_out.content_length_n = r->cache->sparse_length;
+
+    if (r->headers_out.content_length) {
+        r->headers_out.content_length->hash = 0;
+        r->headers_out.content_length = NULL;
+    }
+
+    if (r->headers_out.content_range) {
+        r->headers_out.content_range->hash = 0;
+        r->headers_out.content_range = NULL;
+    }
+
+    r->allow_ranges = 1;
+    r->single_range = 1;
+}
+
 #endif
 
 
@@ -1737,6 +2034,10 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
+    if (c->ssl) {
+        (void) ngx_ssl_get_ktls(c, r->pool, &u->state->ssl_ktls);
+    }
+
 #endif
 
     ngx_http_upstream_send_request(r, u, 1);
@@ -1895,6 +2196,8 @@ ngx_http_upstream_ssl_handshake(ngx_http_request_t *r, ngx_http_upstream_t *u,
             u->output.sendfile = 0;
         }
 
+        (void) ngx_ssl_get_ktls(c, r->pool, &u->state->ssl_ktls);
+
         c->write->handler = ngx_http_upstream_handler;
         c->read->handler = ngx_http_upstream_handler;
 
@@ -3281,14 +3584,35 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
-    rc = ngx_http_send_header(r);
+#if (NGX_HTTP_CACHE)
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
-        ngx_http_upstream_finalize_request(r, u, rc);
-        return;
+    if (r->cache && r->cache->sparse_range) {
+        rc = ngx_http_upstream_cache_sparse(r, u);
+
+        if (rc != NGX_OK && rc != NGX_DECLINED) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
     }
 
-    u->header_sent = 1;
+    if (r->cache && r->cache->sparse_fill) {
+
+        /* the header is sent when the range is received completely */
+
+        rc = NGX_OK;
+
+    } else
+#endif
+    {
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+
+        u->header_sent = 1;
+    }
 
     if (u->upgrade) {
 
@@ -3436,7 +3760,9 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         if (valid == 0) {
             valid = ngx_http_file_cache_valid(u->conf->cache_valid,
-                                              u->headers_in.status_n);
+                                              r->cache->sparse_fill
+                                              ? NGX_HTTP_OK
+                                              : u->headers_in.status_n);
             if (valid) {
                 r->cache->valid_sec = now + valid;
             }
@@ -3468,6 +3794,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
                 return;
             }
 
+            if (r->cache->file_cache->tags.len) {
+                ngx_http_upstream_cache_tags(r, u);
+            }
+
         } else {
             u->cacheable = 0;
         }
@@ -3476,6 +3806,16 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http cacheable: %d", u->cacheable);
 
+    if (r->cache && r->cache->sparse_fill && !u->cacheable) {
+
+        /* the range is still buffered to a file to be sent to the client */
+
+        r->cache->sparse_commit = 0;
+        r->cache->body_start = (u_short) (u->buffer.pos - u->buffer.start);
+
+        u->cacheable = 1;
+    }
+
     if (u->cacheable == 0 && r->cache) {
         ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
     }
@@ -3566,6 +3906,23 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
         p->buf_to_file->temporary = 1;
     }
 
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && r->cache->sparse_fill) {
+
+        if (ngx_http_file_cache_sparse_open(r, p->temp_file, u->buffer.start)
+            != NGX_OK)
+        {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        p->buf_to_file = NULL;
+        p->downstream_error = 1;
+    }
+
+#endif
+
     if (ngx_event_flags & NGX_USE_IOCP_EVENT) {
         /* the posted aio operation may corrupt a shadow buffer */
         p->single_buf = 1;
@@ -4443,7 +4800,14 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 
 #if (NGX_HTTP_CACHE)
 
-        if (u->cacheable) {
+        if (u->cacheable && r->cache->sparse_fill) {
+
+            if (p->upstream_done || p->upstream_eof || p->upstream_error) {
+                ngx_http_upstream_cache_sparse_send(r, u);
+                return;
+            }
+
+        } else if (u->cacheable) {
 
             if (p->upstream_done) {
                 ngx_http_file_cache_update(r, p->temp_file);
@@ -4465,6 +4829,10 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 
             } else if (p->upstream_error) {
                 ngx_http_file_cache_free(r->cache, p->temp_file);
+
+            } else {
+                ngx_http_file_cache_fill(r, p->temp_file,
+                                         u->headers_in.content_length_n);
             }
         }
 
@@ -6058,6 +6426,79 @@ ngx_http_upstream_status_variable(ngx_http_request_t *r,
 }
 
 
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_ssl_ktls_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                     *p;
+    size_t                      len;
+    ngx_uint_t                  i;
+    ngx_http_upstream_state_t  *state;
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    if (r->upstream_states == NULL || r->upstream_states->nelts == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    len = 0;
+    state = r->upstream_states->elts;
+
+    for (i = 0; i < r->upstream_states->nelts; i++) {
+        len += state[i].ssl_ktls.len + 1 + 3;
+    }
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    i = 0;
+
+    for ( ;; ) {
+        if (state[i].ssl_ktls.len) {
+            p = ngx_copy(p, state[i].ssl_ktls.data, state[i].ssl_ktls.len);
+
+        } else {
+            *p++ = '-';
+        }
+
+        if (++i == r->upstream_states->nelts) {
+            break;
+        }
+
+        if (state[i].peer) {
+            *p++ = ',';
+            *p++ = ' ';
+
+        } else {
+            *p++ = ' ';
+            *p++ = ':';
+            *p++ = ' ';
+
+            if (++i == r->upstream_states->nelts) {
+                break;
+            }
+
+            continue;
+        }
+    }
+
+    v->len = p - v->data;
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_upstream_response_time_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -6294,6 +6735,78 @@ ngx_http_upstream_cache_status(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_cache_tier(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_uint_t  status;
+
+    if (r->upstream == NULL || r->cache == NULL || !r->cached) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    status = r->upstream->cache_status;
+
+    if (status != NGX_HTTP_CACHE_HIT
+        && status != NGX_HTTP_CACHE_STALE
+        && status != NGX_HTTP_CACHE_UPDATING
+        && status != NGX_HTTP_CACHE_REVALIDATED)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    if (r->cache->filling) {
+        v->len = sizeof("FILL") - 1;
+        v->data = (u_char *) "FILL";
+
+    } else if (r->cache->hot) {
+        v->len = sizeof("MEMORY") - 1;
+        v->data = (u_char *) "MEMORY";
+
+    } else {
+        v->len = sizeof("DISK") - 1;
+        v->data = (u_char *) "DISK";
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_counter(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char      *p;
+    ngx_uint_t   n;
+
+    if (r->cache == NULL || r->cache->file_cache == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    n = *(ngx_uint_t *) ((char *) r->cache->file_cache->sh + data);
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", n) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -6346,6 +6859,49 @@ ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+
+static ngx_int_t
+ngx_http_upstream_cache_range(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char            *p;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (r->upstream == NULL
+        || c == NULL
+        || !c->sparse
+        || !r->upstream->buffering
+        || r->upstream->cache_status != NGX_HTTP_CACHE_MISS)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, sizeof("bytes=-") - 1 + 2 * NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (c->sparse_end == -1) {
+        v->len = ngx_sprintf(p, "bytes=%O-", c->sparse_start) - p;
+
+    } else {
+        v->len = ngx_sprintf(p, "bytes=%O-%O", c->sparse_start, c->sparse_end)
+                 - p;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    c->sparse_range = 1;
+
+    return NGX_OK;
+}
+
 #endif
 
 
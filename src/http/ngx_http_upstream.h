@@ -71,6 +71,7 @@ typedef struct {
     off_t                            bytes_sent;
 
     ngx_str_t                       *peer;
+    ngx_str_t                        ssl_ktls;
 
     NGX_COMPAT_BEGIN(2)
     NGX_COMPAT_END
@@ -20,6 +20,10 @@
 
 #define NGX_HTTP_UPSTREAM_FAILED     1
 
+#if (NGX_HTTP_UPSTREAM_HC)
+#define NGX_HTTP_UPSTREAM_UNHEALTHY  4
+#endif
+
 #if (NGX_HTTP_UPSTREAM_STICKY)
 #define NGX_HTTP_UPSTREAM_DRAINING   8
 #endif
@@ -31,6 +35,23 @@ typedef struct ngx_http_upstream_rr_peer_s   ngx_http_upstream_rr_peer_t;
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
 
+#if (NGX_HTTP_SSL)
+
+#define NGX_HTTP_UPSTREAM_SSL_SESSIONS  4
+
+
+/* a serialized session in the upstream zone */
+
+typedef struct {
+    u_char                         *data;
+    int                             len;
+    int                             size;
+    uint32_t                        crc32;
+    ngx_uint_t                      uses;
+} ngx_http_upstream_rr_session_t;
+
+#endif
+
 typedef struct {
     ngx_event_t                     event;         /* must be first */
     ngx_uint_t                      worker;
@@ -71,6 +92,9 @@ struct ngx_http_upstream_rr_peer_s {
 #if (NGX_HTTP_SSL || NGX_COMPAT)
     void                           *ssl_session;
     int                             ssl_session_len;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    void                           *ssl_sessions;
+#endif
 #endif
 
 #if (NGX_HTTP_UPSTREAM_SID || NGX_COMPAT)
@@ -100,6 +124,18 @@ struct ngx_http_upstream_rr_peer_s {
     ngx_uint_t                      inflight_reqs;
 #endif
 
+#if (NGX_HTTP_UPSTREAM_PEAK_EWMA || NGX_COMPAT)
+    ngx_uint_t                      ewma;
+    ngx_msec_t                      ewma_stamp;
+#endif
+
+#if (NGX_HTTP_UPSTREAM_HC || NGX_COMPAT)
+    ngx_uint_t                      hc_fails;
+    ngx_uint_t                      hc_passes;
+    ngx_uint_t                      hc_checking;
+    ngx_msec_t                      hc_checked;
+#endif
+
     NGX_COMPAT_BEGIN(7)
     NGX_COMPAT_END
 };
@@ -188,8 +224,19 @@ ngx_http_upstream_rr_peer_free_locked(ngx_http_upstream_rr_peers_t *peers,
     }
 
 #if (NGX_HTTP_SSL)
-    if (peer->ssl_session) {
-        ngx_slab_free_locked(peers->shpool, peer->ssl_session);
+    if (peer->ssl_sessions) {
+        ngx_uint_t                       i;
+        ngx_http_upstream_rr_session_t  *sessions;
+
+        sessions = peer->ssl_sessions;
+
+        for (i = 0; i < NGX_HTTP_UPSTREAM_SSL_SESSIONS; i++) {
+            if (sessions[i].data) {
+                ngx_slab_free_locked(peers->shpool, sessions[i].data);
+            }
+        }
+
+        ngx_slab_free_locked(peers->shpool, peer->ssl_sessions);
     }
 #endif
 
@@ -272,6 +272,19 @@ ngx_http_v2_init(ngx_event_t *rev)
         return;
     }
 
+    if (h2scf->hpack_table_size) {
+        h2c->hpack_enc = ngx_pcalloc(c->pool, sizeof(ngx_http_v2_hpack_enc_t));
+        if (h2c->hpack_enc == NULL) {
+            ngx_http_close_connection(c);
+            return;
+        }
+
+        h2c->hpack_enc->max_size = h2scf->hpack_table_size;
+        h2c->hpack_enc->size = ngx_min(h2scf->hpack_table_size,
+                                       NGX_HTTP_V2_TABLE_SIZE);
+        h2c->hpack_enc->free = h2c->hpack_enc->size;
+    }
+
     if (ngx_http_v2_send_settings(h2c) == NGX_ERROR) {
         ngx_http_close_connection(c);
         return;
@@ -2260,6 +2273,10 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
 
         case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
 
+            if (h2c->hpack_enc) {
+                ngx_http_v2_table_encoder_size(h2c, value);
+            }
+
             h2c->table_update = 1;
             break;
 
@@ -26,6 +26,9 @@
 
 #define NGX_HTTP_V2_FRAME_HEADER_SIZE    9
 
+#define NGX_HTTP_V2_TABLE_SIZE           4096
+#define NGX_HTTP_V2_MAX_TABLE_SIZE       65536
+
 /* frame types */
 #define NGX_HTTP_V2_DATA_FRAME           0x0
 #define NGX_HTTP_V2_HEADERS_FRAME        0x1
@@ -67,6 +70,7 @@ typedef struct {
     ngx_uint_t                       concurrent_streams;
     size_t                           preread_size;
     ngx_uint_t                       streams_index_mask;
+    size_t                           hpack_table_size;
 } ngx_http_v2_srv_conf_t;
 
 
@@ -122,6 +126,37 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+#define NGX_HTTP_V2_HPACK_SEEN           64
+
+
+typedef struct {
+    ngx_str_t                        name;
+    ngx_str_t                        value;
+    ngx_uint_t                       key;
+    ngx_uint_t                       hash;
+    size_t                           literal;
+} ngx_http_v2_hpack_entry_t;
+
+
+typedef struct {
+    ngx_http_v2_hpack_entry_t       *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    ngx_uint_t                       allocated;
+
+    size_t                           size;
+    size_t                           free;
+    size_t                           max_size;
+    u_char                          *storage;
+    u_char                          *pos;
+
+    off_t                            saved;
+
+    ngx_uint_t                       seen[NGX_HTTP_V2_HPACK_SEEN];
+} ngx_http_v2_hpack_enc_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -147,6 +182,7 @@ struct ngx_http_v2_connection_s {
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_enc_t         *hpack_enc;
 
     ngx_pool_t                      *pool;
 
@@ -313,6 +349,11 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+void ngx_http_v2_table_encoder_size(ngx_http_v2_connection_t *h2c,
+    size_t size);
+u_char *ngx_http_v2_table_encode(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp);
+
 
 #define ngx_http_v2_prefix(bits)  ((1 << (bits)) - 1)
 
@@ -416,6 +457,7 @@ ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
 u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
     u_char *tmp, ngx_uint_t lower);
+u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix, ngx_uint_t value);
 
 
 extern ngx_module_t  ngx_http_v2_module;
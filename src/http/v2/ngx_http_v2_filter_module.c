@@ -24,6 +24,14 @@
     (ngx_http_v2_integer_octets(sizeof(h) - 1) + sizeof(h) - 1)
 
 
+/*
+ * With the dynamic table maintained by the encoder, names of the predefined
+ * fields may need 2 octets, and a table size update up to 4 octets.
+ */
+
+#define NGX_HTTP_V2_TABLE_EXTRA_OCTETS    16
+
+
 #define NGX_HTTP_V2_NO_TRAILERS           (ngx_http_v2_out_frame_t *) -1
 
 
@@ -31,6 +39,11 @@ static ngx_int_t ngx_http_v2_header_filter(ngx_http_request_t *r);
 static ngx_int_t ngx_http_v2_early_hints_filter(ngx_http_request_t *r);
 static ngx_int_t ngx_http_v2_init_stream(ngx_http_request_t *r);
 
+static u_char *ngx_http_v2_write_table_update(ngx_http_v2_connection_t *h2c,
+    u_char *pos);
+static ngx_inline u_char *ngx_http_v2_write_indexed_name(
+    ngx_http_v2_connection_t *h2c, u_char *pos, ngx_uint_t index);
+
 static ngx_http_v2_out_frame_t *ngx_http_v2_create_headers_frame(
     ngx_http_request_t *r, u_char *pos, u_char *end, ngx_uint_t fin,
     ngx_uint_t flush);
@@ -108,7 +121,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
     u_char                     status, *pos, *start, *p, *tmp;
     size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
+    ngx_str_t                  host, location, name, value;
     ngx_uint_t                 i, port, fin;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
@@ -219,6 +232,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
     len = h2c->table_update ? 1 : 0;
 
+    len += h2c->hpack_enc ? NGX_HTTP_V2_TABLE_EXTRA_OCTETS : 0;
+
     len += status ? 1 : 1 + ngx_http_v2_literal_size("418");
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
@@ -423,10 +438,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+        pos = ngx_http_v2_write_table_update(h2c, pos);
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -437,7 +449,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         *pos++ = status;
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
+        pos = ngx_http_v2_write_indexed_name(h2c, pos,
+                                             NGX_HTTP_V2_STATUS_INDEX);
         *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
         pos = ngx_sprintf(pos, "%03ui", r->headers_out.status);
     }
@@ -459,9 +472,25 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                            "http2 output header: \"server: nginx\"");
         }
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
+        if (h2c->hpack_enc) {
+            ngx_str_set(&name, "server");
+
+            if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
+                ngx_str_set(&value, NGINX_VER);
+
+            } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
+                ngx_str_set(&value, NGINX_VER_BUILD);
+
+            } else {
+                ngx_str_set(&value, "nginx");
+            }
+
+            pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_SERVER_INDEX,
+                                           &name, &value, tmp);
+
+        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
 
-        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
             if (nginx_ver[0] == '\0') {
                 p = ngx_http_v2_write_value(nginx_ver, (u_char *) NGINX_VER,
                                             sizeof(NGINX_VER) - 1, tmp);
@@ -471,6 +500,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
             pos = ngx_cpymem(pos, nginx_ver, nginx_ver_len);
 
         } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
+
             if (nginx_ver_build[0] == '\0') {
                 p = ngx_http_v2_write_value(nginx_ver_build,
                                             (u_char *) NGINX_VER_BUILD,
@@ -481,6 +512,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
             pos = ngx_cpymem(pos, nginx_ver_build, nginx_ver_build_len);
 
         } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
             pos = ngx_cpymem(pos, nginx, sizeof(nginx));
         }
     }
@@ -490,14 +522,12 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"date: %V\"",
                        &ngx_cached_http_time);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
+        pos = ngx_http_v2_write_indexed_name(h2c, pos, NGX_HTTP_V2_DATE_INDEX);
         pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
                                       ngx_cached_http_time.len, tmp);
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
-
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
         {
@@ -527,8 +557,21 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        if (h2c->hpack_enc) {
+            ngx_str_set(&name, "content-type");
+
+            pos = ngx_http_v2_table_encode(h2c, pos,
+                                           NGX_HTTP_V2_CONTENT_TYPE_INDEX,
+                                           &name, &r->headers_out.content_type,
+                                           tmp);
+
+        } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
+            pos = ngx_http_v2_write_value(pos,
+                                          r->headers_out.content_type.data,
+                                          r->headers_out.content_type.len,
+                                          tmp);
+        }
     }
 
     if (r->headers_out.content_length == NULL
@@ -538,7 +581,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        pos = ngx_http_v2_write_indexed_name(h2c, pos,
+                                             NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
 
         p = pos;
         pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
@@ -548,7 +592,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
+        pos = ngx_http_v2_write_indexed_name(h2c, pos,
+                                             NGX_HTTP_V2_LAST_MODIFIED_INDEX);
 
         ngx_http_time(pos, r->headers_out.last_modified_time);
         len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
@@ -569,7 +614,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
+        pos = ngx_http_v2_write_indexed_name(h2c, pos,
+                                             NGX_HTTP_V2_LOCATION_INDEX);
         pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
                                       r->headers_out.location->value.len, tmp);
     }
@@ -579,8 +625,17 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        if (h2c->hpack_enc) {
+            ngx_str_set(&name, "vary");
+            ngx_str_set(&value, "Accept-Encoding");
+
+            pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_VARY_INDEX,
+                                           &name, &value, tmp);
+
+        } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
+            pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        }
     }
 #endif
 
@@ -613,6 +668,12 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
 #endif
 
+        if (h2c->hpack_enc) {
+            pos = ngx_http_v2_table_encode(h2c, pos, 0, &header[i].key,
+                                           &header[i].value, tmp);
+            continue;
+        }
+
         *pos++ = 0;
 
         pos = ngx_http_v2_write_name(pos, header[i].key.data,
@@ -627,6 +688,12 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
     frame = ngx_http_v2_create_headers_frame(r, start, pos, fin, 0);
     if (frame == NULL) {
+
+        if (h2c->hpack_enc) {
+            /* the dynamic table is out of sync with the client */
+            h2c->connection->error = 1;
+        }
+
         return NGX_ERROR;
     }
 
@@ -726,6 +793,7 @@ ngx_http_v2_early_hints_filter(ngx_http_request_t *r)
     h2c = stream->connection;
 
     len += h2c->table_update ? 1 : 0;
+    len += h2c->hpack_enc ? NGX_HTTP_V2_TABLE_EXTRA_OCTETS : 0;
     len += 1 + ngx_http_v2_literal_size("418");
 
     tmp = ngx_palloc(r->pool, tmp_len);
@@ -738,17 +806,14 @@ ngx_http_v2_early_hints_filter(ngx_http_request_t *r)
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+        pos = ngx_http_v2_write_table_update(h2c, pos);
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 output header: \":status: %03ui\"",
                    (ngx_uint_t) NGX_HTTP_EARLY_HINTS);
 
-    *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
+    pos = ngx_http_v2_write_indexed_name(h2c, pos, NGX_HTTP_V2_STATUS_INDEX);
     *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
     pos = ngx_sprintf(pos, "%03ui", (ngx_uint_t) NGX_HTTP_EARLY_HINTS);
 
@@ -781,6 +846,12 @@ ngx_http_v2_early_hints_filter(ngx_http_request_t *r)
         }
 #endif
 
+        if (h2c->hpack_enc) {
+            pos = ngx_http_v2_table_encode(h2c, pos, 0, &header[i].key,
+                                           &header[i].value, tmp);
+            continue;
+        }
+
         *pos++ = 0;
 
         pos = ngx_http_v2_write_name(pos, header[i].key.data,
@@ -792,6 +863,12 @@ ngx_http_v2_early_hints_filter(ngx_http_request_t *r)
 
     frame = ngx_http_v2_create_headers_frame(r, start, pos, 0, 1);
     if (frame == NULL) {
+
+        if (h2c->hpack_enc) {
+            /* the dynamic table is out of sync with the client */
+            h2c->connection->error = 1;
+        }
+
         return NGX_ERROR;
     }
 
@@ -807,6 +884,39 @@ ngx_http_v2_early_hints_filter(ngx_http_request_t *r)
 }
 
 
+static u_char *
+ngx_http_v2_write_table_update(ngx_http_v2_connection_t *h2c, u_char *pos)
+{
+    size_t  size;
+
+    size = h2c->hpack_enc ? h2c->hpack_enc->size : 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table size update: %uz", size);
+
+    h2c->table_update = 0;
+
+    *pos = 32;
+    return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), size);
+}
+
+
+static ngx_inline u_char *
+ngx_http_v2_write_indexed_name(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index)
+{
+    if (h2c->hpack_enc == NULL) {
+        *pos++ = ngx_http_v2_inc_indexed(index);
+        return pos;
+    }
+
+    /* literal without indexing, as the client table is tracked */
+
+    *pos = 0;
+    return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4), index);
+}
+
+
 static ngx_int_t
 ngx_http_v2_init_stream(ngx_http_request_t *r)
 {
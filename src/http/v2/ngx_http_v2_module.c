@@ -15,6 +15,8 @@ static ngx_int_t ngx_http_v2_add_variables(ngx_conf_t *cf);
 
 static ngx_int_t ngx_http_v2_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_v2_hpack_saved_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 
 static ngx_int_t ngx_http_v2_module_init(ngx_cycle_t *cycle);
 
@@ -34,6 +36,8 @@ static char *ngx_http_v2_preread_size(ngx_conf_t *cf, void *post, void *data);
 static char *ngx_http_v2_streams_index_mask(ngx_conf_t *cf, void *post,
     void *data);
 static char *ngx_http_v2_chunk_size(ngx_conf_t *cf, void *post, void *data);
+static char *ngx_http_v2_hpack_table_size(ngx_conf_t *cf, void *post,
+    void *data);
 static char *ngx_http_v2_obsolete(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
@@ -69,6 +73,8 @@ static ngx_conf_post_t  ngx_http_v2_streams_index_mask_post =
     { ngx_http_v2_streams_index_mask };
 static ngx_conf_post_t  ngx_http_v2_chunk_size_post =
     { ngx_http_v2_chunk_size };
+static ngx_conf_post_t  ngx_http_v2_hpack_table_size_post =
+    { ngx_http_v2_hpack_table_size };
 
 
 static ngx_command_t  ngx_http_v2_commands[] = {
@@ -143,6 +149,13 @@ static ngx_command_t  ngx_http_v2_commands[] = {
       offsetof(ngx_http_v2_srv_conf_t, streams_index_mask),
       &ngx_http_v2_streams_index_mask_post },
 
+    { ngx_string("http2_hpack_table_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, hpack_table_size),
+      &ngx_http_v2_hpack_table_size_post },
+
     { ngx_string("http2_recv_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_http_v2_obsolete,
@@ -218,6 +231,9 @@ static ngx_http_variable_t  ngx_http_v2_vars[] = {
     { ngx_string("http2"), NULL,
       ngx_http_v2_variable, 0, 0, 0 },
 
+    { ngx_string("http2_hpack_saved"), NULL,
+      ngx_http_v2_hpack_saved_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
       ngx_http_null_variable
 };
 
@@ -275,6 +291,35 @@ ngx_http_v2_variable(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_v2_hpack_saved_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                    *p;
+    ngx_http_v2_connection_t  *h2c;
+
+    if (r->stream == NULL || r->stream->connection->hpack_enc == NULL) {
+        *v = ngx_http_variable_null_value;
+        return NGX_OK;
+    }
+
+    h2c = r->stream->connection;
+
+    p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%O", h2c->hpack_enc->saved) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_v2_module_init(ngx_cycle_t *cycle)
 {
@@ -329,6 +374,8 @@ ngx_http_v2_create_srv_conf(ngx_conf_t *cf)
 
     h2scf->streams_index_mask = NGX_CONF_UNSET_UINT;
 
+    h2scf->hpack_table_size = NGX_CONF_UNSET_SIZE;
+
     return h2scf;
 }
 
@@ -351,6 +398,9 @@ ngx_http_v2_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_uint_value(conf->streams_index_mask,
                               prev->streams_index_mask, 32 - 1);
 
+    ngx_conf_merge_size_value(conf->hpack_table_size,
+                              prev->hpack_table_size, 0);
+
     return NGX_CONF_OK;
 }
 
@@ -477,6 +527,31 @@ ngx_http_v2_chunk_size(ngx_conf_t *cf, void *post, void *data)
 }
 
 
+static char *
+ngx_http_v2_hpack_table_size(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *sp = data;
+
+    if (*sp > NGX_HTTP_V2_MAX_TABLE_SIZE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the maximum http2 hpack table size is %d",
+                           NGX_HTTP_V2_MAX_TABLE_SIZE);
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (*sp && *sp < 64) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the http2 hpack table size cannot be less "
+                           "than 64");
+
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_http_v2_obsolete(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
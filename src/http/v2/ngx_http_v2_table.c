@@ -10,11 +10,12 @@
 #include <ngx_http.h>
 
 
-#define NGX_HTTP_V2_TABLE_SIZE  4096
-
-
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
+static u_char *ngx_http_v2_table_copy(ngx_http_v2_hpack_enc_t *hpack,
+    u_char *src, size_t len, ngx_uint_t lower);
+static ngx_int_t ngx_http_v2_table_compare(ngx_http_v2_hpack_enc_t *hpack,
+    u_char *p, u_char *s, size_t len, ngx_uint_t lower);
 
 
 static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
@@ -361,3 +362,249 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+void
+ngx_http_v2_table_encoder_size(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    size_t                      used;
+    ngx_http_v2_hpack_enc_t    *hpack;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    hpack = h2c->hpack_enc;
+
+    if (size > hpack->max_size) {
+        size = hpack->max_size;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 new encoder hpack table size: %uz was:%uz",
+                   size, hpack->size);
+
+    used = hpack->size - hpack->free;
+
+    while (used > size) {
+        entry = &hpack->entries[hpack->deleted++ % hpack->allocated];
+        used -= 32 + entry->name.len + entry->value.len;
+    }
+
+    hpack->size = size;
+    hpack->free = size - used;
+}
+
+
+u_char *
+ngx_http_v2_table_encode(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp)
+{
+    u_char                     *start;
+    size_t                      size;
+    ngx_uint_t                  i, n, key, hash, *seen;
+    ngx_http_v2_hpack_enc_t    *hpack;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    hpack = h2c->hpack_enc;
+
+    key = 0;
+
+    for (i = 0; i < name->len; i++) {
+        key = ngx_hash(key, ngx_tolower(name->data[i]));
+    }
+
+    hash = key;
+
+    for (i = 0; i < value->len; i++) {
+        hash = ngx_hash(hash, value->data[i]);
+    }
+
+    if (index == 0) {
+        for (i = 0; i < NGX_HTTP_V2_STATIC_TABLE_ENTRIES; i++) {
+            if (ngx_http_v2_static_table[i].name.len == name->len
+                && ngx_strncasecmp(ngx_http_v2_static_table[i].name.data,
+                                   name->data, name->len)
+                   == 0)
+            {
+                index = i + 1;
+                break;
+            }
+        }
+    }
+
+    for (n = hpack->added; n != hpack->deleted; n--) {
+        entry = &hpack->entries[(n - 1) % hpack->allocated];
+
+        if (entry->key != key
+            || entry->name.len != name->len
+            || ngx_http_v2_table_compare(hpack, entry->name.data, name->data,
+                                         name->len, 1)
+               != NGX_OK)
+        {
+            continue;
+        }
+
+        if (entry->hash == hash
+            && entry->value.len == value->len
+            && ngx_http_v2_table_compare(hpack, entry->value.data,
+                                         value->data, value->len, 0)
+               == NGX_OK)
+        {
+            start = pos;
+
+            *pos = 128;
+            pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7),
+                                        NGX_HTTP_V2_STATIC_TABLE_ENTRIES
+                                        + hpack->added - n + 1);
+
+            hpack->saved += entry->literal - (pos - start);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                           "http2 table hit: \"%V: %V\" saved:%O",
+                           name, value, hpack->saved);
+
+            return pos;
+        }
+
+        if (index == 0) {
+            index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + hpack->added - n + 1;
+        }
+    }
+
+    /*
+     * Only headers seen at least twice on the connection are indexed,
+     * so unique values such as request ids do not evict repetitive ones.
+     */
+
+    size = 32 + name->len + value->len;
+
+    if (size > hpack->size / 2
+        || (name->len == sizeof("set-cookie") - 1
+            && ngx_strncasecmp(name->data, (u_char *) "set-cookie",
+                               sizeof("set-cookie") - 1)
+               == 0))
+    {
+        goto literal;
+    }
+
+    seen = &hpack->seen[hash % NGX_HTTP_V2_HPACK_SEEN];
+
+    if (*seen != hash) {
+        *seen = hash;
+        goto literal;
+    }
+
+    if (hpack->storage == NULL) {
+        hpack->allocated = hpack->max_size / 32;
+
+        hpack->entries = ngx_palloc(h2c->connection->pool,
+                                    sizeof(ngx_http_v2_hpack_entry_t)
+                                    * hpack->allocated);
+        if (hpack->entries == NULL) {
+            goto literal;
+        }
+
+        hpack->storage = ngx_palloc(h2c->connection->pool, hpack->max_size);
+        if (hpack->storage == NULL) {
+            goto literal;
+        }
+
+        hpack->pos = hpack->storage;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table encoder add: \"%V: %V\" free:%uz",
+                   name, value, hpack->free);
+
+    while (size > hpack->free) {
+        entry = &hpack->entries[hpack->deleted++ % hpack->allocated];
+        hpack->free += 32 + entry->name.len + entry->value.len;
+    }
+
+    hpack->free -= size;
+
+    start = pos;
+
+    *pos = 64;
+    pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(6), index);
+
+    if (index == 0) {
+        pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+    }
+
+    pos = ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+
+    entry = &hpack->entries[hpack->added++ % hpack->allocated];
+
+    entry->name.len = name->len;
+    entry->name.data = ngx_http_v2_table_copy(hpack, name->data, name->len, 1);
+    entry->value.len = value->len;
+    entry->value.data = ngx_http_v2_table_copy(hpack, value->data, value->len,
+                                               0);
+    entry->key = key;
+    entry->hash = hash;
+    entry->literal = pos - start;
+
+    return pos;
+
+literal:
+
+    *pos = 0;
+    pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4), index);
+
+    if (index == 0) {
+        pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+}
+
+
+static u_char *
+ngx_http_v2_table_copy(ngx_http_v2_hpack_enc_t *hpack, u_char *src,
+    size_t len, ngx_uint_t lower)
+{
+    u_char  *p, *start, *end, ch;
+
+    start = hpack->pos;
+    end = hpack->storage + hpack->max_size;
+
+    for (p = start; len--; /* void */) {
+        ch = *src++;
+        *p++ = lower ? ngx_tolower(ch) : ch;
+
+        if (p == end) {
+            p = hpack->storage;
+        }
+    }
+
+    hpack->pos = p;
+
+    return start;
+}
+
+
+static ngx_int_t
+ngx_http_v2_table_compare(ngx_http_v2_hpack_enc_t *hpack, u_char *p,
+    u_char *s, size_t len, ngx_uint_t lower)
+{
+    u_char  *end, ch;
+
+    end = hpack->storage + hpack->max_size;
+
+    while (len--) {
+        ch = *s++;
+
+        if (lower) {
+            ch = ngx_tolower(ch);
+        }
+
+        if (*p++ != ch) {
+            return NGX_DECLINED;
+        }
+
+        if (p == end) {
+            p = hpack->storage;
+        }
+    }
+
+    return NGX_OK;
+}
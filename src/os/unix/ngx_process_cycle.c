@@ -23,6 +23,7 @@ static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker);
 static void ngx_worker_process_exit(ngx_cycle_t *cycle);
 static void ngx_channel_handler(ngx_event_t *ev);
+static void ngx_channel_command(ngx_channel_t *ch, ngx_log_t *log);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_handler(ngx_event_t *ev);
 static void ngx_cache_loader_process_handler(ngx_event_t *ev);
@@ -40,6 +41,7 @@ sig_atomic_t  ngx_terminate;
 sig_atomic_t  ngx_quit;
 sig_atomic_t  ngx_debug_quit;
 ngx_uint_t    ngx_exiting;
+ngx_event_t  *ngx_wakeup_event;
 sig_atomic_t  ngx_reconfigure;
 sig_atomic_t  ngx_reopen;
 
@@ -1039,48 +1041,132 @@ ngx_channel_handler(ngx_event_t *ev)
             return;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
-                       "channel command: %ui", ch.command);
+        ngx_channel_command(&ch, ev->log);
+    }
+}
 
-        switch (ch.command) {
 
-        case NGX_CMD_QUIT:
-            ngx_quit = 1;
-            break;
+void
+ngx_process_channel(ngx_log_t *log)
+{
+    ngx_int_t      n;
+    ngx_channel_t  ch;
 
-        case NGX_CMD_TERMINATE:
-            ngx_terminate = 1;
-            break;
+    /*
+     * a process which cannot return to its event loop for a while
+     * still receives quit and terminate commands from the master
+     */
 
-        case NGX_CMD_REOPEN:
-            ngx_reopen = 1;
-            break;
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_HELPER)
+    {
+        return;
+    }
 
-        case NGX_CMD_OPEN_CHANNEL:
+    for ( ;; ) {
+        n = ngx_read_channel(ngx_channel, &ch, sizeof(ngx_channel_t), log);
 
-            ngx_log_debug3(NGX_LOG_DEBUG_CORE, ev->log, 0,
-                           "get channel s:%i pid:%P fd:%d",
-                           ch.slot, ch.pid, ch.fd);
+        if (n == NGX_ERROR || n == NGX_AGAIN) {
+            return;
+        }
 
-            ngx_processes[ch.slot].pid = ch.pid;
-            ngx_processes[ch.slot].channel[0] = ch.fd;
-            break;
+        ngx_channel_command(&ch, log);
+    }
+}
 
-        case NGX_CMD_CLOSE_CHANNEL:
 
-            ngx_log_debug4(NGX_LOG_DEBUG_CORE, ev->log, 0,
-                           "close channel s:%i pid:%P our:%P fd:%d",
-                           ch.slot, ch.pid, ngx_processes[ch.slot].pid,
-                           ngx_processes[ch.slot].channel[0]);
+static void
+ngx_channel_command(ngx_channel_t *ch, ngx_log_t *log)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "channel command: %ui", ch->command);
 
-            if (close(ngx_processes[ch.slot].channel[0]) == -1) {
-                ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
-                              "close() channel failed");
-            }
+    switch (ch->command) {
 
-            ngx_processes[ch.slot].channel[0] = -1;
-            break;
+    case NGX_CMD_QUIT:
+        ngx_quit = 1;
+        break;
+
+    case NGX_CMD_TERMINATE:
+        ngx_terminate = 1;
+        break;
+
+    case NGX_CMD_REOPEN:
+        ngx_reopen = 1;
+        break;
+
+    case NGX_CMD_OPEN_CHANNEL:
+
+        ngx_log_debug3(NGX_LOG_DEBUG_CORE, log, 0,
+                       "get channel s:%i pid:%P fd:%d",
+                       ch->slot, ch->pid, ch->fd);
+
+        ngx_processes[ch->slot].pid = ch->pid;
+        ngx_processes[ch->slot].channel[0] = ch->fd;
+
+        if (ch->slot >= ngx_last_process) {
+            ngx_last_process = ch->slot + 1;
+        }
+
+        break;
+
+    case NGX_CMD_CLOSE_CHANNEL:
+
+        ngx_log_debug4(NGX_LOG_DEBUG_CORE, log, 0,
+                       "close channel s:%i pid:%P our:%P fd:%d",
+                       ch->slot, ch->pid, ngx_processes[ch->slot].pid,
+                       ngx_processes[ch->slot].channel[0]);
+
+        if (close(ngx_processes[ch->slot].channel[0]) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "close() channel failed");
+        }
+
+        ngx_processes[ch->slot].channel[0] = -1;
+        break;
+
+    case NGX_CMD_WAKEUP:
+
+        if (ngx_wakeup_event) {
+            ngx_post_event(ngx_wakeup_event, &ngx_posted_events);
+        }
+
+        break;
+    }
+}
+
+
+void
+ngx_wakeup_processes(ngx_log_t *log)
+{
+    ngx_int_t      i;
+    ngx_channel_t  ch;
+
+    /*
+     * other processes are told that a shared state has changed,
+     * the message is lost if a channel is full
+     */
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_WAKEUP;
+    ch.pid = ngx_pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = -1;
+
+    for (i = 0; i < ngx_last_process; i++) {
+
+        /* slots of detached processes are not passed to workers */
+
+        if (i == ngx_process_slot
+            || ngx_processes[i].pid <= 0
+            || ngx_processes[i].channel[0] == -1)
+        {
+            continue;
         }
+
+        (void) ngx_write_channel(ngx_processes[i].channel[0],
+                                 &ch, sizeof(ngx_channel_t), log);
     }
 }
 
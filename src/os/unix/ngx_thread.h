@@ -32,6 +32,8 @@ ngx_int_t ngx_thread_cond_destroy(ngx_thread_cond_t *cond, ngx_log_t *log);
 ngx_int_t ngx_thread_cond_signal(ngx_thread_cond_t *cond, ngx_log_t *log);
 ngx_int_t ngx_thread_cond_wait(ngx_thread_cond_t *cond, ngx_thread_mutex_t *mtx,
     ngx_log_t *log);
+ngx_int_t ngx_thread_cond_timedwait(ngx_thread_cond_t *cond,
+    ngx_thread_mutex_t *mtx, ngx_uint_t timeout, ngx_log_t *log);
 
 
 #if (NGX_LINUX)
@@ -74,3 +74,37 @@ ngx_thread_cond_wait(ngx_thread_cond_t *cond, ngx_thread_mutex_t *mtx,
 
     return NGX_ERROR;
 }
+
+
+ngx_int_t
+ngx_thread_cond_timedwait(ngx_thread_cond_t *cond, ngx_thread_mutex_t *mtx,
+    ngx_uint_t timeout, ngx_log_t *log)
+{
+    ngx_err_t        err;
+    struct timeval   tv;
+    struct timespec  ts;
+
+    ngx_gettimeofday(&tv);
+
+    ts.tv_sec = tv.tv_sec + timeout / 1000;
+    ts.tv_nsec = (tv.tv_usec + (timeout % 1000) * 1000) * 1000;
+
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    err = pthread_cond_timedwait(cond, mtx, &ts);
+
+    if (err == 0) {
+        return NGX_OK;
+    }
+
+    if (err == NGX_ETIMEDOUT) {
+        return NGX_AGAIN;
+    }
+
+    ngx_log_error(NGX_LOG_ALERT, log, err, "pthread_cond_timedwait() failed");
+
+    return NGX_ERROR;
+}
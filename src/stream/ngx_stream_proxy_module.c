@@ -54,6 +54,7 @@ typedef struct {
     ngx_stream_complex_value_t      *ssl_certificate_key;
     ngx_ssl_cache_t                 *ssl_certificate_cache;
     ngx_array_t                     *ssl_passwords;
+    ngx_flag_t                       ssl_ktls;
     ngx_array_t                     *ssl_conf_commands;
 
     ngx_ssl_t                       *ssl;
@@ -395,6 +396,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       0,
       NULL },
 
+    { ngx_string("proxy_ssl_ktls"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, ssl_ktls),
+      NULL },
+
     { ngx_string("proxy_ssl_conf_command"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE2,
       ngx_conf_set_keyval_slot,
@@ -1369,6 +1377,7 @@ ngx_stream_proxy_ssl_handshake(ngx_connection_t *pc)
     ngx_stream_proxy_srv_conf_t  *pscf;
 
     s = pc->data;
+    u = s->upstream;
 
     pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
 
@@ -1384,8 +1393,6 @@ ngx_stream_proxy_ssl_handshake(ngx_connection_t *pc)
                 goto failed;
             }
 
-            u = s->upstream;
-
             if (ngx_ssl_check_host(pc, &u->ssl_name) != NGX_OK) {
                 ngx_log_error(NGX_LOG_ERR, pc->log, 0,
                               "upstream SSL certificate does not match \"%V\"",
@@ -1398,6 +1405,8 @@ ngx_stream_proxy_ssl_handshake(ngx_connection_t *pc)
             ngx_del_timer(pc->write);
         }
 
+        (void) ngx_ssl_get_ktls(pc, s->connection->pool, &u->state->ssl_ktls);
+
         ngx_stream_proxy_init_upstream(s);
 
         return;
@@ -2446,6 +2455,7 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->ssl_certificate_key = NGX_CONF_UNSET_PTR;
     conf->ssl_certificate_cache = NGX_CONF_UNSET_PTR;
     conf->ssl_passwords = NGX_CONF_UNSET_PTR;
+    conf->ssl_ktls = NGX_CONF_UNSET;
     conf->ssl_conf_commands = NGX_CONF_UNSET_PTR;
 #endif
 
@@ -2544,6 +2554,8 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+    ngx_conf_merge_value(conf->ssl_ktls, prev->ssl_ktls, 0);
+
     ngx_conf_merge_ptr_value(conf->ssl_conf_commands,
                               prev->ssl_conf_commands, NULL);
 
@@ -2575,6 +2587,7 @@ ngx_stream_proxy_merge_ssl(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *conf,
         && conf->ssl_trusted_certificate.data == NULL
         && conf->ssl_crl.data == NULL
         && conf->ssl_session_reuse == NGX_CONF_UNSET
+        && conf->ssl_ktls == NGX_CONF_UNSET
         && conf->ssl_conf_commands == NGX_CONF_UNSET_PTR)
     {
         if (prev->ssl) {
@@ -2736,6 +2749,10 @@ ngx_stream_proxy_set_ssl(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *pscf)
         return NGX_ERROR;
     }
 
+    if (ngx_ssl_ktls(cf, pscf->ssl, pscf->ssl_ktls) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     if (ngx_ssl_conf_commands(cf, pscf->ssl, pscf->ssl_conf_commands)
         != NGX_OK)
     {
@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_stream.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 typedef ngx_int_t (*ngx_ssl_variable_handler_pt)(ngx_connection_t *c,
     ngx_pool_t *pool, ngx_str_t *s);
@@ -55,6 +59,10 @@ static char *ngx_stream_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_stream_ssl_ocsp_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_stream_ssl_stapling_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_ssl_key_offload(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static char *ngx_stream_ssl_alpn(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
@@ -294,6 +302,20 @@ static ngx_command_t  ngx_stream_ssl_commands[] = {
       offsetof(ngx_stream_ssl_srv_conf_t, stapling_verify),
       NULL },
 
+    { ngx_string("ssl_stapling_cache"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE12,
+      ngx_stream_ssl_stapling_cache,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ssl_key_offload"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE123,
+      ngx_stream_ssl_key_offload,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("ssl_conf_command"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE2,
       ngx_conf_set_keyval_slot,
@@ -376,6 +398,27 @@ static ngx_stream_variable_t  ngx_stream_ssl_vars[] = {
     { ngx_string("ssl_session_reused"), NULL, ngx_stream_ssl_variable,
       (uintptr_t) ngx_ssl_get_session_reused, NGX_STREAM_VAR_CHANGEABLE, 0 },
 
+    { ngx_string("ssl_ktls"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_ktls, NGX_STREAM_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("ssl_key_offload_batch"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_key_offload_batch, NGX_STREAM_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("ssl_key_offload_time"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_key_offload_time, NGX_STREAM_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("ssl_session_cache_hits"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_cache_hits,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ssl_session_cache_misses"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_cache_misses,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ssl_session_cache_evictions"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_cache_evictions,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
     { ngx_string("ssl_server_name"), NULL, ngx_stream_ssl_variable,
       (uintptr_t) ngx_ssl_get_server_name, NGX_STREAM_VAR_CHANGEABLE, 0 },
 
@@ -898,6 +941,7 @@ ngx_stream_ssl_create_srv_conf(ngx_conf_t *cf)
      *
      *     sscf->protocols = 0;
      *     sscf->certificate_values = NULL;
+     *     sscf->certificate_lazy = 0;
      *     sscf->dhparam = { 0, NULL };
      *     sscf->ecdh_curve = { 0, NULL };
      *     sscf->client_certificate = { 0, NULL };
@@ -929,8 +973,10 @@ ngx_stream_ssl_create_srv_conf(ngx_conf_t *cf)
     sscf->session_ticket_keys = NGX_CONF_UNSET_PTR;
     sscf->ocsp = NGX_CONF_UNSET_UINT;
     sscf->ocsp_cache_zone = NGX_CONF_UNSET_PTR;
+    sscf->stapling_cache_zone = NGX_CONF_UNSET_PTR;
     sscf->stapling = NGX_CONF_UNSET;
     sscf->stapling_verify = NGX_CONF_UNSET;
+    sscf->key_offload = NGX_CONF_UNSET_PTR;
 
     return sscf;
 }
@@ -968,8 +1014,11 @@ ngx_stream_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_ptr_value(conf->certificate_keys, prev->certificate_keys,
                          NULL);
 
-    ngx_conf_merge_ptr_value(conf->certificate_cache, prev->certificate_cache,
-                         NULL);
+    if (conf->certificate_cache == NGX_CONF_UNSET_PTR) {
+        ngx_conf_merge_ptr_value(conf->certificate_cache,
+                                 prev->certificate_cache, NULL);
+        conf->certificate_lazy = prev->certificate_lazy;
+    }
 
     ngx_conf_merge_ptr_value(conf->ech_files, prev->ech_files, NULL);
 
@@ -995,6 +1044,8 @@ ngx_stream_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_str_value(conf->ocsp_responder, prev->ocsp_responder, "");
     ngx_conf_merge_ptr_value(conf->ocsp_cache_zone,
                          prev->ocsp_cache_zone, NULL);
+    ngx_conf_merge_ptr_value(conf->stapling_cache_zone,
+                         prev->stapling_cache_zone, NULL);
 
     ngx_conf_merge_value(conf->stapling, prev->stapling, 0);
     ngx_conf_merge_value(conf->stapling_verify, prev->stapling_verify, 0);
@@ -1002,6 +1053,12 @@ ngx_stream_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_str_value(conf->stapling_responder,
                          prev->stapling_responder, "");
 
+    if (conf->key_offload == NGX_CONF_UNSET_PTR) {
+        ngx_conf_merge_ptr_value(conf->key_offload, prev->key_offload, NULL);
+        conf->key_offload_batch = prev->key_offload_batch;
+        conf->key_offload_delay = prev->key_offload_delay;
+    }
+
     conf->ssl.log = cf->log;
 
     if (conf->certificates) {
@@ -1067,6 +1124,33 @@ ngx_stream_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     if (conf->certificate_values) {
 
+        if (conf->certificate_lazy) {
+
+            /* lazy certificates are not in the context at this point */
+
+            if (conf->certificate_compression) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "\"ssl_certificate_compression\" is "
+                              "incompatible with "
+                              "\"ssl_certificate_cache ... lazy\"");
+                return NGX_CONF_ERROR;
+            }
+
+            if (conf->key_offload) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "\"ssl_key_offload\" is incompatible with "
+                              "\"ssl_certificate_cache ... lazy\"");
+                return NGX_CONF_ERROR;
+            }
+
+            if (conf->stapling) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "\"ssl_stapling\" is incompatible with "
+                              "\"ssl_certificate_cache ... lazy\"");
+                return NGX_CONF_ERROR;
+            }
+        }
+
 #ifdef SSL_R_CERT_CB_ERROR
 
         /* install callback to lookup certificates */
@@ -1098,6 +1182,14 @@ ngx_stream_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
         {
             return NGX_CONF_ERROR;
         }
+
+        if (ngx_ssl_key_offload(cf, &conf->ssl, conf->key_offload,
+                                conf->key_offload_batch,
+                                conf->key_offload_delay)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
     }
 
     if (conf->verify) {
@@ -1210,6 +1302,14 @@ ngx_stream_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
         {
             return NGX_CONF_ERROR;
         }
+
+        if (conf->stapling_cache_zone
+            && ngx_ssl_stapling_cache(cf, &conf->ssl,
+                                      conf->stapling_cache_zone)
+               != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
     }
 
     if (ngx_ssl_conf_commands(cf, &conf->ssl, conf->conf_commands) != NGX_OK) {
@@ -1237,6 +1337,13 @@ ngx_stream_ssl_compile_certificates(ngx_conf_t *cf,
     key = conf->certificate_keys->elts;
     nelts = conf->certificates->nelts;
 
+    if (conf->certificate_lazy) {
+
+        /* load certificates on first use via the certificate cache */
+
+        goto found;
+    }
+
     for (i = 0; i < nelts; i++) {
 
         if (ngx_stream_script_variables_count(&cert[i])) {
@@ -1316,7 +1423,7 @@ ngx_stream_ssl_certificate_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     time_t       inactive, valid;
     ngx_str_t   *value, s;
     ngx_int_t    max;
-    ngx_uint_t   i;
+    ngx_uint_t   i, lazy;
 
     if (sscf->certificate_cache != NGX_CONF_UNSET_PTR) {
         return "is duplicate";
@@ -1327,6 +1434,7 @@ ngx_stream_ssl_certificate_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max = 0;
     inactive = 10;
     valid = 60;
+    lazy = 0;
 
     for (i = 1; i < cf->args->nelts; i++) {
 
@@ -1366,6 +1474,13 @@ ngx_stream_ssl_certificate_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "lazy") == 0) {
+
+            lazy = 1;
+
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "off") == 0) {
 
             sscf->certificate_cache = NULL;
@@ -1397,6 +1512,8 @@ ngx_stream_ssl_certificate_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    sscf->certificate_lazy = lazy;
+
     return NGX_CONF_OK;
 }
 
@@ -1615,6 +1732,207 @@ invalid:
 }
 
 
+static char *
+ngx_stream_ssl_stapling_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_ssl_srv_conf_t *sscf = conf;
+
+    size_t       len;
+    ngx_int_t    n;
+    ngx_str_t   *value, name, size, file;
+    ngx_uint_t   i, j;
+
+    if (sscf->stapling_cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        sscf->stapling_cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (value[1].len <= sizeof("shared:") - 1
+        || ngx_strncmp(value[1].data, "shared:", sizeof("shared:") - 1) != 0)
+    {
+        goto invalid;
+    }
+
+    len = 0;
+
+    for (j = sizeof("shared:") - 1; j < value[1].len; j++) {
+        if (value[1].data[j] == ':') {
+            break;
+        }
+
+        len++;
+    }
+
+    if (len == 0 || j == value[1].len) {
+        goto invalid;
+    }
+
+    name.len = len;
+    name.data = value[1].data + sizeof("shared:") - 1;
+
+    size.len = value[1].len - j - 1;
+    size.data = name.data + len + 1;
+
+    n = ngx_parse_size(&size);
+
+    if (n == NGX_ERROR) {
+        goto invalid;
+    }
+
+    if (n < (ngx_int_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "stapling cache \"%V\" is too small", &value[1]);
+
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_null(&file);
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "file=", 5) == 0
+            && value[i].len > 5)
+        {
+            file.len = value[i].len - 5;
+            file.data = value[i].data + 5;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    sscf->stapling_cache_zone = ngx_ssl_stapling_cache_zone(cf, &name, n,
+                                                            &file, cmd);
+    if (sscf->stapling_cache_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid stapling cache \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_stream_ssl_key_offload(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_ssl_srv_conf_t *sscf = conf;
+
+    ngx_str_t   *value;
+#if (NGX_THREADS)
+    ngx_int_t    n;
+    ngx_str_t    name, s;
+    ngx_uint_t   i;
+#endif
+
+    if (sscf->key_offload != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (cf->args->nelts > 2) {
+            return "has invalid parameters with \"off\"";
+        }
+
+        sscf->key_offload = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "threads", 7) == 0
+        && (value[1].len == 7 || value[1].data[7] == '='))
+    {
+#if (NGX_THREADS)
+        if (value[1].len >= 8) {
+            name.len = value[1].len - 8;
+            name.data = value[1].data + 8;
+
+            sscf->key_offload = ngx_thread_pool_add(cf, &name);
+
+        } else {
+            sscf->key_offload = ngx_thread_pool_add(cf, NULL);
+        }
+
+        if (sscf->key_offload == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        sscf->key_offload_batch = 1;
+        sscf->key_offload_delay = 0;
+
+        for (i = 2; i < cf->args->nelts; i++) {
+
+            if (ngx_strncmp(value[i].data, "batch=", 6) == 0) {
+
+                n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+                if (n == NGX_ERROR || n == 0) {
+                    goto invalid;
+                }
+
+                sscf->key_offload_batch = n;
+
+                continue;
+            }
+
+            if (ngx_strncmp(value[i].data, "batch_delay=", 12) == 0) {
+
+                s.len = value[i].len - 12;
+                s.data = value[i].data + 12;
+
+                n = ngx_parse_time(&s, 0);
+
+                if (n == NGX_ERROR) {
+                    goto invalid;
+                }
+
+                sscf->key_offload_delay = (ngx_msec_t) n;
+
+                continue;
+            }
+
+            goto invalid;
+        }
+
+        return NGX_CONF_OK;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ssl_key_offload threads\" "
+                           "is unsupported on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+    return "invalid value";
+
+#if (NGX_THREADS)
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+
 static char *
 ngx_stream_ssl_alpn(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -17,6 +17,10 @@ static ngx_int_t ngx_stream_upstream_response_time_variable(
     ngx_stream_session_t *s, ngx_stream_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_stream_upstream_bytes_variable(ngx_stream_session_t *s,
     ngx_stream_variable_value_t *v, uintptr_t data);
+#if (NGX_STREAM_SSL)
+static ngx_int_t ngx_stream_upstream_ssl_ktls_variable(
+    ngx_stream_session_t *s, ngx_stream_variable_value_t *v, uintptr_t data);
+#endif
 
 static char *ngx_stream_upstream(ngx_conf_t *cf, ngx_command_t *cmd,
     void *dummy);
@@ -123,6 +127,14 @@ static ngx_stream_variable_t  ngx_stream_upstream_vars[] = {
       ngx_stream_upstream_bytes_variable, 1,
       NGX_STREAM_VAR_NOCACHEABLE, 0 },
 
+#if (NGX_STREAM_SSL)
+
+    { ngx_string("upstream_ssl_ktls"), NULL,
+      ngx_stream_upstream_ssl_ktls_variable, 0,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+#endif
+
       ngx_stream_null_variable
 };
 
@@ -256,6 +268,67 @@ ngx_stream_upstream_bytes_variable(ngx_stream_session_t *s,
 }
 
 
+#if (NGX_STREAM_SSL)
+
+static ngx_int_t
+ngx_stream_upstream_ssl_ktls_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    u_char                       *p;
+    size_t                        len;
+    ngx_uint_t                    i;
+    ngx_stream_upstream_state_t  *state;
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    if (s->upstream_states == NULL || s->upstream_states->nelts == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    len = 0;
+    state = s->upstream_states->elts;
+
+    for (i = 0; i < s->upstream_states->nelts; i++) {
+        len += state[i].ssl_ktls.len + 1 + 2;
+    }
+
+    p = ngx_pnalloc(s->connection->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    i = 0;
+
+    for ( ;; ) {
+
+        if (state[i].ssl_ktls.len) {
+            p = ngx_copy(p, state[i].ssl_ktls.data, state[i].ssl_ktls.len);
+
+        } else {
+            *p++ = '-';
+        }
+
+        if (++i == s->upstream_states->nelts) {
+            break;
+        }
+
+        *p++ = ',';
+        *p++ = ' ';
+    }
+
+    v->len = p - v->data;
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_stream_upstream_response_time_variable(ngx_stream_session_t *s,
     ngx_stream_variable_value_t *v, uintptr_t data)
@@ -101,6 +101,7 @@ typedef struct {
     off_t                              bytes_received;
 
     ngx_str_t                         *peer;
+    ngx_str_t                          ssl_ktls;
 
     NGX_COMPAT_BEGIN(2)
     NGX_COMPAT_END
@@ -22,12 +22,21 @@ typedef struct {
 } ngx_stream_upstream_chash_points_t;
 
 
+typedef struct {
+    ngx_uint_t                            size;
+    ngx_uint_t                            number;
+    ngx_stream_upstream_rr_peer_t       **peer;
+    uint32_t                             *lookup;
+} ngx_stream_upstream_maglev_t;
+
+
 typedef struct {
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_uint_t                            config;
 #endif
     ngx_stream_complex_value_t            key;
     ngx_stream_upstream_chash_points_t   *points;
+    ngx_stream_upstream_maglev_t         *maglev;
 } ngx_stream_upstream_hash_srv_conf_t;
 
 
@@ -63,11 +72,25 @@ static ngx_int_t ngx_stream_upstream_init_chash_peer(ngx_stream_session_t *s,
 static ngx_int_t ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_update_maglev(ngx_pool_t *pool,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_init_maglev_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_get_maglev_peer(
+    ngx_peer_connection_t *pc, void *data);
+
 static void *ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
 
+static ngx_uint_t  ngx_stream_upstream_maglev_sizes[] = {
+    65521, 131071, 262139, 524287, 1048573, 0
+};
+
+
 static ngx_command_t  ngx_stream_upstream_hash_commands[] = {
 
     { ngx_string("hash"),
@@ -687,6 +710,340 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 }
 
 
+static ngx_int_t
+ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_maglev_peer;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (us->shm_zone) {
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_stream_upstream_update_maglev(cf->pool, us);
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_update_maglev(ngx_pool_t *pool,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    u_char                               *p;
+    size_t                                size;
+    uint32_t                             *lookup, *next, *offset, *skip, c;
+    ngx_int_t                             max_weight, *credit;
+    ngx_uint_t                            i, n, m, filled;
+    ngx_stream_upstream_rr_peer_t        *peer, **peers_list;
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_maglev_t         *maglev;
+    ngx_stream_upstream_hash_srv_conf_t  *hcf;
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+
+    peers = us->peer.data;
+    n = peers->number;
+
+    /*
+     * the lookup table size is a prime number, at least 100 times
+     * larger than the number of peers to keep the imbalance low;
+     * the size only changes on large steps, as it changes the mapping
+     */
+
+    for (i = 0; ngx_stream_upstream_maglev_sizes[i + 1]; i++) {
+        if (ngx_stream_upstream_maglev_sizes[i] >= n * 100) {
+            break;
+        }
+    }
+
+    m = ngx_stream_upstream_maglev_sizes[i];
+
+    /* scratch arrays go first, so that errors keep the current table */
+
+    credit = NULL;
+
+    if (n) {
+        size = n * (3 * sizeof(uint32_t) + sizeof(ngx_int_t));
+
+        credit = ngx_alloc(size, ngx_cycle->log);
+        if (credit == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    maglev = hcf->maglev;
+
+    /* the table memory is reused if the size did not change */
+
+    if (maglev == NULL || maglev->size != m || maglev->number != n) {
+        size = sizeof(ngx_stream_upstream_maglev_t)
+               + n * sizeof(ngx_stream_upstream_rr_peer_t *)
+               + m * sizeof(uint32_t);
+
+        p = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
+        if (p == NULL) {
+            if (credit) {
+                ngx_free(credit);
+            }
+
+            return NGX_ERROR;
+        }
+
+        if (maglev) {
+            ngx_free(maglev);
+        }
+
+        maglev = (ngx_stream_upstream_maglev_t *) p;
+        p += sizeof(ngx_stream_upstream_maglev_t);
+
+        maglev->size = m;
+        maglev->number = n;
+
+        maglev->peer = (ngx_stream_upstream_rr_peer_t **) p;
+        p += n * sizeof(ngx_stream_upstream_rr_peer_t *);
+
+        maglev->lookup = (uint32_t *) p;
+
+        hcf->maglev = maglev;
+    }
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    next = (uint32_t *) (credit + n);
+    offset = next + n;
+    skip = offset + n;
+
+    peers_list = maglev->peer;
+    lookup = maglev->lookup;
+
+    /*
+     * each peer gets its own permutation of the table slots, defined
+     * by the peer address, so that changes in the list of peers only
+     * affect a small part of the table
+     */
+
+    max_weight = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        peers_list[i] = peer;
+
+        offset[i] = ngx_crc32_long(peer->name.data, peer->name.len) % m;
+        skip[i] = ngx_murmur_hash2(peer->name.data, peer->name.len) % (m - 1)
+                  + 1;
+        next[i] = 0;
+        credit[i] = 0;
+
+        if (peer->weight > max_weight) {
+            max_weight = peer->weight;
+        }
+    }
+
+    ngx_memset(lookup, 0xff, m * sizeof(uint32_t));
+
+    /*
+     * peers take turns to claim the next free slot in their permutation,
+     * the turns are distributed proportionally to the peer weights
+     */
+
+    filled = 0;
+
+    for ( ;; ) {
+        for (i = 0; i < n; i++) {
+
+            credit[i] += peers_list[i]->weight;
+
+            if (credit[i] < max_weight) {
+                continue;
+            }
+
+            credit[i] -= max_weight;
+
+            do {
+                c = (offset[i] + (uint64_t) next[i] * skip[i]) % m;
+                next[i]++;
+            } while (lookup[c] != (uint32_t) -1);
+
+            lookup[c] = i;
+
+            if (++filled == m) {
+                goto done;
+            }
+        }
+    }
+
+done:
+
+    ngx_free(credit);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_maglev_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_hash_peer_data_t  *hp;
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    ngx_stream_upstream_hash_srv_conf_t   *hcf;
+#endif
+
+    if (ngx_stream_upstream_init_hash_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.get = ngx_stream_upstream_get_maglev_peer;
+
+    hp = s->upstream->peer.data;
+
+    hp->hash = ngx_crc32_long(hp->key.data, hp->key.len);
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+
+    ngx_stream_upstream_rr_peers_rlock(hp->rrp.peers);
+
+    if (hp->rrp.peers->config
+        && (hcf->maglev == NULL || hcf->config != *hp->rrp.peers->config))
+    {
+        if (ngx_stream_upstream_update_maglev(NULL, us) != NGX_OK) {
+            ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+            return NGX_ERROR;
+        }
+
+        hcf->config = *hp->rrp.peers->config;
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_get_maglev_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_upstream_hash_peer_data_t *hp = data;
+
+    time_t                          now;
+    uintptr_t                       m;
+    ngx_uint_t                      n, p;
+    ngx_stream_upstream_rr_peer_t  *peer;
+    ngx_stream_upstream_maglev_t   *maglev;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get maglev hash peer, try: %ui", pc->tries);
+
+    ngx_stream_upstream_rr_peers_rlock(hp->rrp.peers);
+
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+        ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    pc->connection = NULL;
+
+    if (hp->rrp.peers->number == 0) {
+        pc->name = hp->rrp.peers->name;
+        ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+        return NGX_BUSY;
+    }
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (hp->rrp.peers->config && hp->rrp.config != *hp->rrp.peers->config) {
+        pc->name = hp->rrp.peers->name;
+        ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+        return NGX_BUSY;
+    }
+#endif
+
+    now = ngx_time();
+
+    maglev = hp->conf->maglev;
+
+    for ( ;; ) {
+
+        /* next slots of the table are used on retries */
+
+        p = maglev->lookup[hp->hash % maglev->size];
+        peer = maglev->peer[p];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "maglev hash peer:%uD, peer:%ui", hp->hash, p);
+
+        n = p / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+        if (hp->rrp.tried[n] & m) {
+            goto next;
+        }
+
+        ngx_stream_upstream_rr_peer_lock(hp->rrp.peers, peer);
+
+        if (peer->down) {
+            ngx_stream_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            ngx_stream_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            ngx_stream_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        break;
+
+    next:
+
+        hp->hash++;
+
+        if (++hp->tries > 20) {
+            ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    hp->rrp.current = peer;
+    ngx_stream_upstream_rr_peer_ref(hp->rrp.peers, peer);
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    ngx_stream_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -698,6 +1055,7 @@ ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->maglev = NULL;
 
     return conf;
 }
@@ -745,6 +1103,9 @@ ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
         uscf->peer.init_upstream = ngx_stream_upstream_init_chash;
 
+    } else if (ngx_strcmp(value[2].data, "maglev") == 0) {
+        uscf->peer.init_upstream = ngx_stream_upstream_init_maglev;
+
     } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
@@ -0,0 +1,656 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_msec_t                          interval;
+    ngx_msec_t                          timeout;
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+    in_port_t                           port;
+
+    ngx_uint_t                          workers;
+    ngx_event_t                        *event;
+    ngx_stream_upstream_srv_conf_t     *upstream;
+} ngx_stream_upstream_hc_srv_conf_t;
+
+
+typedef struct {
+    ngx_pool_t                         *pool;
+    ngx_log_t                          *log;
+    ngx_peer_connection_t               peer;
+    ngx_stream_upstream_hc_srv_conf_t  *conf;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_rr_peer_t      *rr_peer;
+} ngx_stream_upstream_hc_ctx_t;
+
+
+static ngx_int_t ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle);
+static void ngx_stream_upstream_hc_timer(ngx_event_t *ev);
+static void ngx_stream_upstream_hc_start(
+    ngx_stream_upstream_hc_srv_conf_t *hcf,
+    ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_rr_peer_t *peer, ngx_log_t *log);
+static void ngx_stream_upstream_hc_write_handler(ngx_event_t *wev);
+static void ngx_stream_upstream_hc_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_upstream_hc_test_connect(ngx_connection_t *c);
+static void ngx_stream_upstream_hc_done(ngx_stream_upstream_hc_ctx_t *ctx,
+    ngx_uint_t passed);
+static u_char *ngx_stream_upstream_hc_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+
+static void *ngx_stream_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_hc_init_main_conf(ngx_conf_t *cf,
+    void *conf);
+static char *ngx_stream_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_stream_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_stream_upstream_hc,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    ngx_stream_upstream_hc_init_main_conf, /* init main configuration */
+
+    ngx_stream_upstream_hc_create_conf,    /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_hc_module_ctx,    /* module context */
+    ngx_stream_upstream_hc_commands,       /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_stream_upstream_hc_init_process,   /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                          i;
+    ngx_event_t                        *event;
+    ngx_core_conf_t                    *ccf;
+    ngx_stream_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_stream_upstream_main_conf_t    *umcf;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        uscf = uscfp[i];
+
+        if (uscf->srv_conf == NULL || uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        hcf = ngx_stream_conf_upstream_srv_conf(uscf,
+                                                ngx_stream_upstream_hc_module);
+
+        if (hcf->interval == NGX_CONF_UNSET_MSEC) {
+            continue;
+        }
+
+        /*
+         * each peer is checked by a single worker process,
+         * selected by the hash of the peer address
+         */
+
+        hcf->workers = (ngx_process == NGX_PROCESS_SINGLE)
+                       ? 1 : (ngx_uint_t) ccf->worker_processes;
+
+        event = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+        if (event == NULL) {
+            return NGX_ERROR;
+        }
+
+        event->data = hcf;
+        event->handler = ngx_stream_upstream_hc_timer;
+        event->log = cycle->log;
+        event->cancelable = 1;
+
+        hcf->event = event;
+
+        ngx_add_timer(event, ngx_random() % 1000 + 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_upstream_hc_timer(ngx_event_t *ev)
+{
+    ngx_msec_t                          now;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = ev->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "stream upstream health check \"%V\"", &hcf->upstream->host);
+
+    now = ngx_current_msec;
+
+    for (peers = hcf->upstream->peer.data; peers; peers = peers->next) {
+
+        ngx_stream_upstream_rr_peers_rlock(peers);
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (ngx_crc32_short(peer->name.data, peer->name.len)
+                % hcf->workers != ngx_worker)
+            {
+                continue;
+            }
+
+            ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+            /* a check left by an exited worker process is restarted */
+
+            if (peer->hc_checking
+                && now - peer->hc_checked < hcf->timeout + hcf->interval)
+            {
+                ngx_stream_upstream_rr_peer_unlock(peers, peer);
+                continue;
+            }
+
+            peer->hc_checking = 1;
+            peer->hc_checked = now;
+
+            ngx_stream_upstream_rr_peer_ref(peers, peer);
+
+            ngx_stream_upstream_rr_peer_unlock(peers, peer);
+
+            ngx_stream_upstream_hc_start(hcf, peers, peer, ev->log);
+        }
+
+        ngx_stream_upstream_rr_peers_unlock(peers);
+    }
+
+    ngx_add_timer(ev, hcf->interval);
+}
+
+
+static void
+ngx_stream_upstream_hc_start(ngx_stream_upstream_hc_srv_conf_t *hcf,
+    ngx_stream_upstream_rr_peers_t *peers, ngx_stream_upstream_rr_peer_t *peer,
+    ngx_log_t *log)
+{
+    ngx_int_t                      rc;
+    ngx_pool_t                    *pool;
+    ngx_connection_t              *c;
+    ngx_stream_upstream_hc_ctx_t  *ctx;
+
+    pool = ngx_create_pool(1024, log);
+    if (pool == NULL) {
+        goto failed;
+    }
+
+    ctx = ngx_pcalloc(pool, sizeof(ngx_stream_upstream_hc_ctx_t));
+    if (ctx == NULL) {
+        ngx_destroy_pool(pool);
+        goto failed;
+    }
+
+    ctx->log = ngx_palloc(pool, sizeof(ngx_log_t));
+    if (ctx->log == NULL) {
+        ngx_destroy_pool(pool);
+        goto failed;
+    }
+
+    *ctx->log = *log;
+
+    ctx->log->handler = ngx_stream_upstream_hc_log_error;
+    ctx->log->data = ctx;
+    ctx->log->action = "checking upstream health";
+
+    pool->log = ctx->log;
+
+    ctx->pool = pool;
+    ctx->conf = hcf;
+    ctx->peers = peers;
+    ctx->rr_peer = peer;
+
+    ctx->peer.sockaddr = ngx_palloc(pool, peer->socklen);
+    if (ctx->peer.sockaddr == NULL) {
+        goto error;
+    }
+
+    ngx_memcpy(ctx->peer.sockaddr, peer->sockaddr, peer->socklen);
+
+    if (hcf->port) {
+        ngx_inet_set_port(ctx->peer.sockaddr, hcf->port);
+    }
+
+    ctx->peer.socklen = peer->socklen;
+    ctx->peer.name = &peer->name;
+    ctx->peer.get = ngx_event_get_peer;
+    ctx->peer.log = ctx->log;
+    ctx->peer.log_error = NGX_ERROR_INFO;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ctx->log, 0,
+                   "stream upstream health check peer \"%V\"", &peer->name);
+
+    rc = ngx_event_connect_peer(&ctx->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_stream_upstream_hc_done(ctx, 0);
+        return;
+    }
+
+    c = ctx->peer.connection;
+
+    c->data = ctx;
+    c->pool = pool;
+
+    c->read->handler = ngx_stream_upstream_hc_dummy_handler;
+    c->write->handler = ngx_stream_upstream_hc_write_handler;
+
+    ngx_add_timer(c->write, hcf->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_stream_upstream_hc_write_handler(c->write);
+    }
+
+    return;
+
+error:
+
+    ngx_stream_upstream_hc_done(ctx, 0);
+    return;
+
+failed:
+
+    ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+    peer->hc_checking = 0;
+
+    if (ngx_stream_upstream_rr_peer_unref(peers, peer) == NGX_OK) {
+        ngx_stream_upstream_rr_peer_unlock(peers, peer);
+    }
+}
+
+
+static void
+ngx_stream_upstream_hc_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t              *c;
+    ngx_stream_upstream_hc_ctx_t  *ctx;
+
+    c = wev->data;
+    ctx = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, wev->log, 0,
+                   "stream upstream health check write handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, wev->log, NGX_ETIMEDOUT,
+                      "upstream health check timed out");
+        ngx_stream_upstream_hc_done(ctx, 0);
+        return;
+    }
+
+    if (ngx_stream_upstream_hc_test_connect(c) != NGX_OK) {
+        ngx_stream_upstream_hc_done(ctx, 0);
+        return;
+    }
+
+    ngx_stream_upstream_hc_done(ctx, 1);
+}
+
+
+static void
+ngx_stream_upstream_hc_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "stream upstream health check dummy handler");
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_upstream_hc_done(ngx_stream_upstream_hc_ctx_t *ctx,
+    ngx_uint_t passed)
+{
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, ctx->log, 0,
+                   "stream upstream health check peer \"%V\" %s",
+                   ctx->peer.name, passed ? "passed" : "failed");
+
+    if (ctx->peer.connection) {
+        ngx_close_connection(ctx->peer.connection);
+        ctx->peer.connection = NULL;
+    }
+
+    hcf = ctx->conf;
+    peers = ctx->peers;
+    peer = ctx->rr_peer;
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+    ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+    if (passed) {
+        peer->hc_fails = 0;
+        peer->hc_passes++;
+
+        if ((peer->down & NGX_STREAM_UPSTREAM_UNHEALTHY)
+            && peer->hc_passes >= hcf->passes)
+        {
+            peer->down &= ~NGX_STREAM_UPSTREAM_UNHEALTHY;
+
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "peer \"%V\" in upstream \"%V\" is healthy",
+                          &peer->name, &hcf->upstream->host);
+        }
+
+    } else {
+        peer->hc_passes = 0;
+        peer->hc_fails++;
+
+        if (!(peer->down & NGX_STREAM_UPSTREAM_UNHEALTHY)
+            && peer->hc_fails >= hcf->fails)
+        {
+            peer->down |= NGX_STREAM_UPSTREAM_UNHEALTHY;
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "peer \"%V\" in upstream \"%V\" is unhealthy",
+                          &peer->name, &hcf->upstream->host);
+        }
+    }
+
+    peer->hc_checking = 0;
+
+    if (ngx_stream_upstream_rr_peer_unref(peers, peer) == NGX_OK) {
+        ngx_stream_upstream_rr_peer_unlock(peers, peer);
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    ngx_destroy_pool(ctx->pool);
+}
+
+
+static u_char *
+ngx_stream_upstream_hc_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                        *p;
+    ngx_stream_upstream_hc_ctx_t  *ctx;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    ctx = log->data;
+
+    p = ngx_snprintf(buf, len, ", upstream: \"%V\", peer: %V",
+                     &ctx->conf->upstream->host, ctx->peer.name);
+
+    return p;
+}
+
+
+static void *
+ngx_stream_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->port = 0;
+     *     conf->event = NULL;
+     */
+
+    conf->interval = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_hc_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_uint_t                          i;
+    ngx_stream_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_stream_upstream_main_conf_t    *umcf;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    umcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                ngx_stream_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        uscf = uscfp[i];
+
+        if (uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_stream_conf_upstream_srv_conf(uscf,
+                                                ngx_stream_upstream_hc_module);
+
+        if (hcf->interval != NGX_CONF_UNSET_MSEC && uscf->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires upstream \"%V\" "
+                          "in %s:%ui to be in shared memory",
+                          &uscf->host, uscf->file_name, uscf->line);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_hc_srv_conf_t  *hcf = conf;
+
+    ngx_int_t                        n;
+    ngx_str_t                       *value, s;
+    ngx_uint_t                       i;
+    ngx_stream_upstream_srv_conf_t  *uscf;
+
+    if (hcf->interval != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    hcf->upstream = uscf;
+
+    hcf->interval = 5000;
+    hcf->timeout = 5000;
+    hcf->fails = 1;
+    hcf->passes = 1;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR || hcf->timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "port=", 5) == 0) {
+
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+
+            if (n < 1 || n > 65535) {
+                goto invalid;
+            }
+
+            hcf->port = (in_port_t) n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
@@ -30,6 +30,32 @@ static ngx_int_t ngx_stream_upstream_empty_set_session(
 static void ngx_stream_upstream_empty_save_session(ngx_peer_connection_t *pc,
     void *data);
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+
+#define NGX_STREAM_UPSTREAM_SSL_SESSION_CACHE  256
+
+
+/* sessions already decoded by the worker process */
+
+typedef struct {
+    ngx_stream_upstream_rr_peer_t   *peer;
+    uint32_t                         crc32;
+    int                              len;
+    ngx_ssl_session_t               *session;
+} ngx_stream_upstream_rr_session_cache_t;
+
+
+static ngx_int_t ngx_stream_upstream_set_zone_peer_session(
+    ngx_peer_connection_t *pc, ngx_stream_upstream_rr_peer_data_t *rrp);
+static void ngx_stream_upstream_save_zone_peer_session(
+    ngx_peer_connection_t *pc, ngx_stream_upstream_rr_peer_data_t *rrp);
+
+
+static ngx_stream_upstream_rr_session_cache_t
+    ngx_stream_upstream_rr_session_cache[NGX_STREAM_UPSTREAM_SSL_SESSION_CACHE];
+
+#endif
+
 #endif
 
 
@@ -939,160 +965,295 @@ ngx_stream_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
 {
     ngx_stream_upstream_rr_peer_data_t  *rrp = data;
 
-    ngx_int_t                        rc;
-    ngx_ssl_session_t               *ssl_session;
-    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_int_t                       rc;
+    ngx_ssl_session_t              *ssl_session;
+    ngx_stream_upstream_rr_peer_t  *peer;
+
 #if (NGX_STREAM_UPSTREAM_ZONE)
-    int                              len;
-    const u_char                    *p;
-    ngx_stream_upstream_rr_peers_t  *peers;
+    if (rrp->peers->shpool) {
+        return ngx_stream_upstream_set_zone_peer_session(pc, rrp);
+    }
 #endif
 
     peer = rrp->current;
 
+    ssl_session = peer->ssl_session;
+
+    rc = ngx_ssl_set_session(pc->connection, ssl_session);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "set session: %p", ssl_session);
+
+    return rc;
+}
+
+
+static void
+ngx_stream_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_stream_upstream_rr_peer_data_t  *rrp = data;
+
+    ngx_ssl_session_t              *old_ssl_session, *ssl_session;
+    ngx_stream_upstream_rr_peer_t  *peer;
+
 #if (NGX_STREAM_UPSTREAM_ZONE)
-    peers = rrp->peers;
+    if (rrp->peers->shpool) {
+        ngx_stream_upstream_save_zone_peer_session(pc, rrp);
+        return;
+    }
+#endif
 
-    if (peers->shpool) {
-        ngx_stream_upstream_rr_peers_rlock(peers);
-        ngx_stream_upstream_rr_peer_lock(peers, peer);
+    ssl_session = ngx_ssl_get_session(pc->connection);
 
-        if (peer->ssl_session == NULL) {
-            ngx_stream_upstream_rr_peer_unlock(peers, peer);
-            ngx_stream_upstream_rr_peers_unlock(peers);
-            return NGX_OK;
-        }
+    if (ssl_session == NULL) {
+        return;
+    }
 
-        len = peer->ssl_session_len;
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "save session: %p", ssl_session);
 
-        ngx_memcpy(ngx_ssl_session_buffer, peer->ssl_session, len);
+    peer = rrp->current;
+
+    old_ssl_session = peer->ssl_session;
+    peer->ssl_session = ssl_session;
+
+    if (old_ssl_session) {
 
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "old session: %p", old_ssl_session);
+
+        ngx_ssl_free_session(old_ssl_session);
+    }
+}
+
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+
+static ngx_int_t
+ngx_stream_upstream_set_zone_peer_session(ngx_peer_connection_t *pc,
+    ngx_stream_upstream_rr_peer_data_t *rrp)
+{
+    int                                      len;
+    uint32_t                                 crc32;
+    ngx_int_t                                rc;
+    ngx_uint_t                               i;
+    const u_char                            *p;
+    ngx_ssl_session_t                       *ssl_session;
+    ngx_stream_upstream_rr_peer_t           *peer;
+    ngx_stream_upstream_rr_peers_t          *peers;
+    ngx_stream_upstream_rr_session_t        *sessions, *s;
+    ngx_stream_upstream_rr_session_cache_t  *cache;
+
+    peers = rrp->peers;
+    peer = rrp->current;
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+    ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+    sessions = peer->ssl_sessions;
+
+    if (sessions == NULL) {
         ngx_stream_upstream_rr_peer_unlock(peers, peer);
         ngx_stream_upstream_rr_peers_unlock(peers);
+        return NGX_OK;
+    }
 
-        p = ngx_ssl_session_buffer;
-        ssl_session = d2i_SSL_SESSION(NULL, &p, len);
+    /*
+     * prefer sessions not used yet, so concurrent connections
+     * get different tickets
+     */
 
-        rc = ngx_ssl_set_session(pc->connection, ssl_session);
+    s = NULL;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
-                       "set session: %p", ssl_session);
+    for (i = 0; i < NGX_STREAM_UPSTREAM_SSL_SESSIONS; i++) {
+        if (sessions[i].len == 0) {
+            continue;
+        }
 
-        ngx_ssl_free_session(ssl_session);
+        if (s == NULL || sessions[i].uses < s->uses) {
+            s = &sessions[i];
+        }
+    }
 
-        return rc;
+    if (s == NULL) {
+        ngx_stream_upstream_rr_peer_unlock(peers, peer);
+        ngx_stream_upstream_rr_peers_unlock(peers);
+        return NGX_OK;
     }
+
+    s->uses++;
+
+    len = s->len;
+    crc32 = s->crc32;
+
+    cache = &ngx_stream_upstream_rr_session_cache[
+                   (((uintptr_t) peer >> 4) ^ crc32)
+                   % NGX_STREAM_UPSTREAM_SSL_SESSION_CACHE];
+
+    /*
+     * OpenSSL marks a session as not resumable if a connection
+     * using it is closed uncleanly, such sessions are decoded again
+     */
+
+    if (cache->session
+        && cache->peer == peer
+        && cache->crc32 == crc32
+        && cache->len == len
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+        && SSL_SESSION_is_resumable(cache->session)
 #endif
+       )
+    {
+        ngx_stream_upstream_rr_peer_unlock(peers, peer);
+        ngx_stream_upstream_rr_peers_unlock(peers);
 
-    ssl_session = peer->ssl_session;
+        ssl_session = cache->session;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "set cached session: %p", ssl_session);
+
+        return ngx_ssl_set_session(pc->connection, ssl_session);
+    }
+
+    ngx_memcpy(ngx_ssl_session_buffer, s->data, len);
+
+    ngx_stream_upstream_rr_peer_unlock(peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    p = ngx_ssl_session_buffer;
+    ssl_session = d2i_SSL_SESSION(NULL, &p, len);
 
     rc = ngx_ssl_set_session(pc->connection, ssl_session);
 
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                    "set session: %p", ssl_session);
 
+    if (ssl_session == NULL) {
+        return rc;
+    }
+
+    if (cache->session) {
+        ngx_ssl_free_session(cache->session);
+    }
+
+    cache->peer = peer;
+    cache->crc32 = crc32;
+    cache->len = len;
+    cache->session = ssl_session;
+
     return rc;
 }
 
 
 static void
-ngx_stream_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
-    void *data)
+ngx_stream_upstream_save_zone_peer_session(ngx_peer_connection_t *pc,
+    ngx_stream_upstream_rr_peer_data_t *rrp)
 {
-    ngx_stream_upstream_rr_peer_data_t  *rrp = data;
+    int                                len;
+    u_char                            *p;
+    uint32_t                           crc32;
+    ngx_uint_t                         i;
+    ngx_ssl_session_t                 *ssl_session;
+    ngx_stream_upstream_rr_peer_t     *peer;
+    ngx_stream_upstream_rr_peers_t    *peers;
+    ngx_stream_upstream_rr_session_t  *sessions, *s;
 
-    ngx_ssl_session_t               *old_ssl_session, *ssl_session;
-    ngx_stream_upstream_rr_peer_t   *peer;
-#if (NGX_STREAM_UPSTREAM_ZONE)
-    int                              len;
-    u_char                          *p;
-    ngx_stream_upstream_rr_peers_t  *peers;
-#endif
+    ssl_session = ngx_ssl_get0_session(pc->connection);
 
-#if (NGX_STREAM_UPSTREAM_ZONE)
-    peers = rrp->peers;
+    if (ssl_session == NULL) {
+        return;
+    }
 
-    if (peers->shpool) {
+    len = i2d_SSL_SESSION(ssl_session, NULL);
 
-        ssl_session = ngx_ssl_get0_session(pc->connection);
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "save session: %p:%d", ssl_session, len);
 
-        if (ssl_session == NULL) {
-            return;
-        }
+    /* do not cache too big session */
 
-        len = i2d_SSL_SESSION(ssl_session, NULL);
+    if (len > NGX_SSL_MAX_SESSION_SIZE) {
+        return;
+    }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
-                       "save session: %p:%d", ssl_session, len);
+    p = ngx_ssl_session_buffer;
+    (void) i2d_SSL_SESSION(ssl_session, &p);
 
-        /* do not cache too big session */
+    crc32 = ngx_crc32_long(ngx_ssl_session_buffer, len);
 
-        if (len > NGX_SSL_MAX_SESSION_SIZE) {
-            return;
-        }
+    peers = rrp->peers;
+    peer = rrp->current;
 
-        p = ngx_ssl_session_buffer;
-        (void) i2d_SSL_SESSION(ssl_session, &p);
+    ngx_stream_upstream_rr_peers_rlock(peers);
+    ngx_stream_upstream_rr_peer_lock(peers, peer);
 
-        peer = rrp->current;
+    sessions = peer->ssl_sessions;
 
-        ngx_stream_upstream_rr_peers_rlock(peers);
-        ngx_stream_upstream_rr_peer_lock(peers, peer);
+    if (sessions == NULL) {
+        ngx_shmtx_lock(&peers->shpool->mutex);
 
-        if (len > peer->ssl_session_len) {
-            ngx_shmtx_lock(&peers->shpool->mutex);
+        sessions = ngx_slab_calloc_locked(peers->shpool,
+                                    NGX_STREAM_UPSTREAM_SSL_SESSIONS
+                                    * sizeof(ngx_stream_upstream_rr_session_t));
 
-            if (peer->ssl_session) {
-                ngx_slab_free_locked(peers->shpool, peer->ssl_session);
-            }
+        ngx_shmtx_unlock(&peers->shpool->mutex);
 
-            peer->ssl_session = ngx_slab_alloc_locked(peers->shpool, len);
+        if (sessions == NULL) {
+            goto done;
+        }
 
-            ngx_shmtx_unlock(&peers->shpool->mutex);
+        peer->ssl_sessions = sessions;
+    }
 
-            if (peer->ssl_session == NULL) {
-                peer->ssl_session_len = 0;
+    /* replace an empty slot, or the most used session */
 
-                ngx_stream_upstream_rr_peer_unlock(peers, peer);
-                ngx_stream_upstream_rr_peers_unlock(peers);
-                return;
-            }
+    s = &sessions[0];
+
+    for (i = 0; i < NGX_STREAM_UPSTREAM_SSL_SESSIONS; i++) {
 
-            peer->ssl_session_len = len;
+        if (sessions[i].len == len && sessions[i].crc32 == crc32) {
+            goto done;
         }
 
-        ngx_memcpy(peer->ssl_session, ngx_ssl_session_buffer, len);
+        if (s->len && (sessions[i].len == 0 || sessions[i].uses > s->uses)) {
+            s = &sessions[i];
+        }
+    }
 
-        ngx_stream_upstream_rr_peer_unlock(peers, peer);
-        ngx_stream_upstream_rr_peers_unlock(peers);
+    if (len > s->size) {
+        ngx_shmtx_lock(&peers->shpool->mutex);
 
-        return;
-    }
-#endif
+        if (s->data) {
+            ngx_slab_free_locked(peers->shpool, s->data);
+        }
 
-    ssl_session = ngx_ssl_get_session(pc->connection);
+        s->data = ngx_slab_alloc_locked(peers->shpool, len);
 
-    if (ssl_session == NULL) {
-        return;
-    }
+        ngx_shmtx_unlock(&peers->shpool->mutex);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
-                   "save session: %p", ssl_session);
+        if (s->data == NULL) {
+            s->len = 0;
+            s->size = 0;
+            goto done;
+        }
 
-    peer = rrp->current;
+        s->size = len;
+    }
 
-    old_ssl_session = peer->ssl_session;
-    peer->ssl_session = ssl_session;
+    ngx_memcpy(s->data, ngx_ssl_session_buffer, len);
 
-    if (old_ssl_session) {
+    s->len = len;
+    s->crc32 = crc32;
+    s->uses = 0;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
-                       "old session: %p", old_ssl_session);
+done:
 
-        ngx_ssl_free_session(old_ssl_session);
-    }
+    ngx_stream_upstream_rr_peer_unlock(peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(peers);
 }
 
+#endif
+
 
 static ngx_int_t
 ngx_stream_upstream_empty_set_session(ngx_peer_connection_t *pc, void *data)
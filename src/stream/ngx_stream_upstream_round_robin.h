@@ -16,6 +16,10 @@
 
 #define NGX_STREAM_UPSTREAM_FAILED      1
 
+#if (NGX_STREAM_UPSTREAM_HC)
+#define NGX_STREAM_UPSTREAM_UNHEALTHY   4
+#endif
+
 
 typedef struct ngx_stream_upstream_rr_peers_s  ngx_stream_upstream_rr_peers_t;
 typedef struct ngx_stream_upstream_rr_peer_s   ngx_stream_upstream_rr_peer_t;
@@ -23,6 +27,23 @@ typedef struct ngx_stream_upstream_rr_peer_s   ngx_stream_upstream_rr_peer_t;
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
 
+#if (NGX_STREAM_SSL)
+
+#define NGX_STREAM_UPSTREAM_SSL_SESSIONS  4
+
+
+/* a serialized session in the upstream zone */
+
+typedef struct {
+    u_char                          *data;
+    int                              len;
+    int                              size;
+    uint32_t                         crc32;
+    ngx_uint_t                       uses;
+} ngx_stream_upstream_rr_session_t;
+
+#endif
+
 typedef struct {
     ngx_event_t                      event;         /* must be first */
     ngx_uint_t                       worker;
@@ -62,6 +83,9 @@ struct ngx_stream_upstream_rr_peer_s {
 
     void                            *ssl_session;
     int                              ssl_session_len;
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    void                            *ssl_sessions;
+#endif
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
     unsigned                         zombie:1;
@@ -83,6 +107,18 @@ struct ngx_stream_upstream_rr_peer_s {
     ngx_uint_t                       inflight_reqs;
 #endif
 
+#if (NGX_STREAM_UPSTREAM_PEAK_EWMA || NGX_COMPAT)
+    ngx_uint_t                       ewma;
+    ngx_msec_t                       ewma_stamp;
+#endif
+
+#if (NGX_STREAM_UPSTREAM_HC || NGX_COMPAT)
+    ngx_uint_t                       hc_fails;
+    ngx_uint_t                       hc_passes;
+    ngx_uint_t                       hc_checking;
+    ngx_msec_t                       hc_checked;
+#endif
+
     NGX_COMPAT_BEGIN(7)
     NGX_COMPAT_END
 };
@@ -168,8 +204,19 @@ ngx_stream_upstream_rr_peer_free_locked(ngx_stream_upstream_rr_peers_t *peers,
     }
 
 #if (NGX_STREAM_SSL)
-    if (peer->ssl_session) {
-        ngx_slab_free_locked(peers->shpool, peer->ssl_session);
+    if (peer->ssl_sessions) {
+        ngx_uint_t                         i;
+        ngx_stream_upstream_rr_session_t  *sessions;
+
+        sessions = peer->ssl_sessions;
+
+        for (i = 0; i < NGX_STREAM_UPSTREAM_SSL_SESSIONS; i++) {
+            if (sessions[i].data) {
+                ngx_slab_free_locked(peers->shpool, sessions[i].data);
+            }
+        }
+
+        ngx_slab_free_locked(peers->shpool, peer->ssl_sessions);
     }
 #endif
 
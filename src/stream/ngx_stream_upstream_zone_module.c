@@ -10,6 +10,19 @@
 #include <ngx_stream.h>
 
 
+/*
+ * peers marked unhealthy by health checks are still counted in tries,
+ * as health checks do not adjust peers->tries
+ */
+
+#if (NGX_STREAM_UPSTREAM_HC)
+#define ngx_stream_upstream_zone_tries(peer)                                  \
+    (((peer)->down & ~NGX_STREAM_UPSTREAM_UNHEALTHY) == 0)
+#else
+#define ngx_stream_upstream_zone_tries(peer)  ((peer)->down == 0)
+#endif
+
+
 static char *ngx_stream_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_stream_upstream_init_zone(ngx_shm_zone_t *shm_zone,
@@ -384,6 +397,9 @@ ngx_stream_upstream_zone_copy_peer(ngx_stream_upstream_rr_peers_t *peers,
         dst->name.data = NULL;
         dst->server.data = NULL;
         dst->host = NULL;
+#if (NGX_STREAM_SSL)
+        dst->ssl_sessions = NULL;
+#endif
     }
 
     dst->sockaddr = ngx_slab_calloc_locked(pool, sizeof(ngx_sockaddr_t));
@@ -576,7 +592,7 @@ ngx_stream_upstream_zone_preresolve(ngx_stream_upstream_rr_peer_t *resolve,
                 peerp = &peer->next;
 
                 peers->number++;
-                peers->tries += (peer->down == 0);
+                peers->tries += ngx_stream_upstream_zone_tries(peer);
                 peers->total_weight += peer->weight;
                 peers->weighted = (peers->total_weight != peers->number);
             }
@@ -614,7 +630,7 @@ ngx_stream_upstream_zone_remove_peer_locked(
 {
     peers->total_weight -= peer->weight;
     peers->number--;
-    peers->tries -= (peer->down == 0);
+    peers->tries -= ngx_stream_upstream_zone_tries(peer);
     (*peers->config)++;
     peers->weighted = (peers->total_weight != peers->number);
 
@@ -968,7 +984,7 @@ again:
         peerp = &peer->next;
 
         peers->number++;
-        peers->tries += (peer->down == 0);
+        peers->tries += ngx_stream_upstream_zone_tries(peer);
         peers->total_weight += peer->weight;
         peers->weighted = (peers->total_weight != peers->number);
         (*peers->config)++;